@@ -0,0 +1,594 @@
+#define _GNU_SOURCE
+
+/*
+ * Throughput benchmark for the tokenizer, shunting yard and evaluator stages.
+ *
+ *   cc -std=gnu11 -O2 bench.c calc.c -o bench -lm
+ *   ./bench --seed 42 --count 20000 --size 12 --depth 4 --float-ratio 0.3 > run.json
+ *
+ * Expressions are generated from the seed alone, so two builds given the same arguments see identical
+ * input. One JSON object is written per run: per-stage token counts, best and mean time over the
+ * iterations, throughput and allocator calls made through calc_core_use_allocator.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "calc.h"
+#include "calc_core.h"
+
+#define GENERATE_ATTEMPTS 32
+
+typedef enum
+{
+	DOMAIN_ANY,
+	DOMAIN_NON_ZERO,
+	DOMAIN_NON_NEGATIVE,
+	DOMAIN_POSITIVE
+} value_domain;
+
+static const char* default_operators = "+,-,*,/";
+static const char* functions[] = { "sqrt", "log2", "sin", "cos", "tan" };
+static const value_domain function_domains[] = { DOMAIN_NON_NEGATIVE, DOMAIN_POSITIVE, DOMAIN_ANY, DOMAIN_ANY,
+												  DOMAIN_ANY };
+
+typedef struct
+{
+	uint64_t seed;
+	size_t count;
+	size_t size;
+	size_t depth;
+	size_t iterations;
+	double float_ratio;
+	double function_density;
+	const char* operators;
+} bench_options;
+
+typedef struct
+{
+	char* storage;
+	char** items;
+	size_t count;
+} operator_set;
+
+typedef struct
+{
+	char* data;
+	size_t length;
+	size_t capacity;
+} text_buffer;
+
+typedef struct
+{
+	uint64_t allocations;
+	uint64_t reallocations;
+	uint64_t releases;
+} allocation_counts;
+
+typedef struct
+{
+	uint64_t tokens;
+	uint64_t best_ns;
+	uint64_t total_ns;
+	allocation_counts allocations;
+} stage_result;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t* state)
+{
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545f4914f6cdd1dull;
+}
+
+static double random_unit(uint64_t* state)
+{
+	return (double)(next_random(state) >> 11) / 9007199254740992.0;
+}
+
+static size_t random_below(uint64_t* state, size_t bound)
+{
+	return (size_t)(next_random(state) % bound);
+}
+
+static bool append_text(text_buffer* b, const char* text)
+{
+	size_t length = strlen(text);
+	if (b->length + length + 1 > b->capacity)
+	{
+		size_t capacity = b->capacity ? b->capacity * 2 : 128;
+		while (capacity < b->length + length + 1)
+		{
+			capacity *= 2;
+		}
+		char* data = realloc(b->data, capacity);
+		if (!data)
+		{
+			return false;
+		}
+		b->data = data;
+		b->capacity = capacity;
+	}
+	memcpy(b->data + b->length, text, length + 1);
+	b->length += length;
+	return true;
+}
+
+static bool generate_expression(text_buffer* b, const bench_options* options, const operator_set* ops, uint64_t* rng,
+								size_t operands, size_t depth);
+
+/* Runs text through the measured token pipeline and reports whether it evaluates to a value inside domain. */
+static bool evaluates_within(const char* text, value_domain domain)
+{
+	int err_code = 0;
+	token_stream input;
+	token_stream output;
+	bool evaluated = false;
+	double value = 0.0;
+	if (!initialize_token_stream(&input, 16))
+	{
+		return false;
+	}
+	if (tokenize_stream(text, &input, &err_code) && shunt_token_stream(&input, &output, &err_code))
+	{
+		queue program;
+		token result;
+		if (initialize_queue(&program, output.length) && token_stream_to_queue(&output, &program, &err_code) &&
+			calculate_expression(&program, &result, &err_code))
+		{
+			value = strtod(result.value, NULL);
+			evaluated = true;
+			free_token(&result);
+		}
+		delete_queue(&program);
+		delete_token_stream(&output);
+	}
+	delete_token_stream(&input);
+	switch (domain)
+	{
+	case DOMAIN_NON_ZERO:
+		return evaluated && value != 0.0;
+	case DOMAIN_NON_NEGATIVE:
+		return evaluated && value >= 0.0;
+	case DOMAIN_POSITIVE:
+		return evaluated && value > 0.0;
+	default:
+		return evaluated;
+	}
+}
+
+/*
+ * Function arguments and divisors are drawn again from the same random stream until they fall inside the
+ * domain, so the generated set stays a function of the seed; after GENERATE_ATTEMPTS misses the text is 1.
+ */
+static bool generate_within(text_buffer* b, const bench_options* options, const operator_set* ops, uint64_t* rng,
+							size_t operands, size_t depth, value_domain domain)
+{
+	size_t start = b->length;
+	for (size_t attempt = 0; attempt < GENERATE_ATTEMPTS; attempt++)
+	{
+		b->length = start;
+		if (!generate_expression(b, options, ops, rng, operands, depth))
+		{
+			return false;
+		}
+		if (evaluates_within(b->data + start, domain))
+		{
+			return true;
+		}
+	}
+	b->length = start;
+	return append_text(b, "1");
+}
+
+static bool generate_operand(text_buffer* b, const bench_options* options, const operator_set* ops, uint64_t* rng,
+							 size_t depth)
+{
+	char number[32];
+	if (random_unit(rng) < 0.1 && !append_text(b, "-"))
+	{
+		return false;
+	}
+	if (depth > 0 && random_unit(rng) < options->function_density)
+	{
+		size_t f = random_below(rng, sizeof(functions) / sizeof(functions[0]));
+		return append_text(b, functions[f]) && append_text(b, "(") &&
+			   generate_within(b, options, ops, rng, 1 + random_below(rng, 3), depth - 1, function_domains[f]) &&
+			   append_text(b, ")");
+	}
+	if (depth > 0 && random_unit(rng) < 0.25)
+	{
+		return append_text(b, "(") && generate_expression(b, options, ops, rng, 2 + random_below(rng, 3), depth - 1) &&
+			   append_text(b, ")");
+	}
+	if (random_unit(rng) < options->float_ratio)
+	{
+		snprintf(number, sizeof(number), "%zu.%02zu", random_below(rng, 100), random_below(rng, 100));
+	}
+	else
+	{
+		snprintf(number, sizeof(number), "%zu", 1 + random_below(rng, 99));
+	}
+	return append_text(b, number);
+}
+
+static bool generate_expression(text_buffer* b, const bench_options* options, const operator_set* ops, uint64_t* rng,
+								size_t operands, size_t depth)
+{
+	for (size_t i = 0; i < operands; i++)
+	{
+		const char* op = i > 0 ? ops->items[random_below(rng, ops->count)] : NULL;
+		if (op && (!append_text(b, " ") || !append_text(b, op) || !append_text(b, " ")))
+		{
+			return false;
+		}
+		bool divisor = op && (strcmp(op, "/") == 0 || strcmp(op, "%") == 0);
+		if (divisor ? !generate_within(b, options, ops, rng, 1, depth, DOMAIN_NON_ZERO)
+					: !generate_operand(b, options, ops, rng, depth))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool parse_operator_set(const char* text, operator_set* ops)
+{
+	ops->items = NULL;
+	ops->count = 0;
+	char* copy = strdup(text);
+	if (!copy)
+	{
+		return false;
+	}
+	ops->storage = copy;
+	char* save = NULL;
+	for (char* item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save))
+	{
+		if (binary_opcode(item) == CALC_OP_NONE)
+		{
+			fprintf(stderr, "Error: unsupported operator %s\n", item);
+			free(copy);
+			free(ops->items);
+			return false;
+		}
+		char** items = realloc(ops->items, (ops->count + 1) * sizeof(char*));
+		if (!items)
+		{
+			free(copy);
+			free(ops->items);
+			return false;
+		}
+		ops->items = items;
+		ops->items[ops->count++] = item;
+	}
+	if (ops->count == 0)
+	{
+		free(copy);
+		free(ops->items);
+		return false;
+	}
+	return true;
+}
+
+static void* counting_allocate(void* user_data, size_t size)
+{
+	((allocation_counts*)user_data)->allocations++;
+	return malloc(size);
+}
+
+static void* counting_reallocate(void* user_data, void* ptr, size_t size)
+{
+	((allocation_counts*)user_data)->reallocations++;
+	return realloc(ptr, size);
+}
+
+static void counting_release(void* user_data, void* ptr)
+{
+	((allocation_counts*)user_data)->releases++;
+	free(ptr);
+}
+
+static void record_stage(stage_result* stage, uint64_t elapsed, uint64_t tokens, const allocation_counts* counts,
+						 size_t iteration)
+{
+	if (iteration == 0 || elapsed < stage->best_ns)
+	{
+		stage->best_ns = elapsed;
+	}
+	stage->total_ns += elapsed;
+	stage->tokens = tokens;
+	stage->allocations = *counts;
+}
+
+static void print_stage(const char* name, const stage_result* stage, size_t expressions, size_t iterations, bool last)
+{
+	double seconds = (double)stage->best_ns / 1e9;
+	printf("\"%s\":{\"tokens\":%llu,\"best_seconds\":%.9f,\"mean_seconds\":%.9f,\"tokens_per_sec\":%.0f,"
+		   "\"expressions_per_sec\":%.0f,\"mallocs\":%llu,\"reallocs\":%llu,\"frees\":%llu}%s",
+		   name, (unsigned long long)stage->tokens, seconds, (double)stage->total_ns / 1e9 / (double)iterations,
+		   seconds > 0 ? (double)stage->tokens / seconds : 0.0, seconds > 0 ? (double)expressions / seconds : 0.0,
+		   (unsigned long long)stage->allocations.allocations, (unsigned long long)stage->allocations.reallocations,
+		   (unsigned long long)stage->allocations.releases,
+		   last ? "" : ",");
+}
+
+static int run_bench(const bench_options* options, const operator_set* ops)
+{
+	uint64_t rng = options->seed ? options->seed : 1;
+	char** expressions = calloc(options->count, sizeof(char*));
+	token_stream* tokenized = calloc(options->count, sizeof(token_stream));
+	token_stream* rpn = calloc(options->count, sizeof(token_stream));
+	queue* shunted = calloc(options->count, sizeof(queue));
+	if (!expressions || !tokenized || !rpn || !shunted)
+	{
+		fprintf(stderr, "Error: Cannot allocate benchmark state\n");
+		free(expressions);
+		free(tokenized);
+		free(rpn);
+		free(shunted);
+		return 5;
+	}
+
+	size_t input_bytes = 0;
+	for (size_t i = 0; i < options->count; i++)
+	{
+		text_buffer b = { NULL, 0, 0 };
+		if (!generate_expression(&b, options, ops, &rng, options->size, options->depth))
+		{
+			fprintf(stderr, "Error: Cannot allocate benchmark expression\n");
+			free(b.data);
+			for (size_t j = 0; j < i; j++)
+			{
+				free(expressions[j]);
+			}
+			free(expressions);
+			free(tokenized);
+			free(rpn);
+			free(shunted);
+			return 5;
+		}
+		expressions[i] = b.data;
+		input_bytes += b.length;
+	}
+
+	allocation_counts counts;
+	calc_allocator allocator = { counting_allocate, counting_reallocate, counting_release, &counts };
+	const calc_allocator* previous = calc_core_use_allocator(&allocator);
+
+	stage_result tokenize = { 0 };
+	stage_result shunt = { 0 };
+	stage_result evaluate = { 0 };
+	stage_result end_to_end = { 0 };
+	size_t failed = 0;
+
+	for (size_t it = 0; it < options->iterations; it++)
+	{
+		uint64_t tokens = 0;
+		memset(&counts, 0, sizeof(counts));
+		uint64_t start = now_ns();
+		for (size_t i = 0; i < options->count; i++)
+		{
+			int err_code = 0;
+			if (initialize_token_stream(&tokenized[i], 100) && !tokenize_stream(expressions[i], &tokenized[i], &err_code))
+			{
+				tokenized[i].length = 0;
+			}
+			tokens += tokenized[i].length;
+		}
+		record_stage(&tokenize, now_ns() - start, tokens, &counts, it);
+
+		tokens = 0;
+		memset(&counts, 0, sizeof(counts));
+		start = now_ns();
+		for (size_t i = 0; i < options->count; i++)
+		{
+			int err_code = 0;
+			tokens += tokenized[i].length;
+			if (!shunt_token_stream(&tokenized[i], &rpn[i], &err_code))
+			{
+				rpn[i].length = 0;
+			}
+		}
+		record_stage(&shunt, now_ns() - start, tokens, &counts, it);
+		for (size_t i = 0; i < options->count; i++)
+		{
+			int err_code = 0;
+			delete_token_stream(&tokenized[i]);
+			shunted[i].data = NULL;
+			shunted[i].front = shunted[i].rear = 0;
+			if (rpn[i].length && initialize_queue(&shunted[i], rpn[i].length) &&
+				!token_stream_to_queue(&rpn[i], &shunted[i], &err_code))
+			{
+				delete_queue(&shunted[i]);
+			}
+			delete_token_stream(&rpn[i]);
+		}
+
+		tokens = 0;
+		failed = 0;
+		memset(&counts, 0, sizeof(counts));
+		start = now_ns();
+		for (size_t i = 0; i < options->count; i++)
+		{
+			int err_code = 0;
+			token result;
+			tokens += queue_size(&shunted[i]);
+			if (shunted[i].data && calculate_expression(&shunted[i], &result, &err_code))
+			{
+				free_token(&result);
+			}
+			else
+			{
+				failed++;
+			}
+		}
+		record_stage(&evaluate, now_ns() - start, tokens, &counts, it);
+		for (size_t i = 0; i < options->count; i++)
+		{
+			delete_queue(&shunted[i]);
+		}
+
+		tokens = 0;
+		memset(&counts, 0, sizeof(counts));
+		start = now_ns();
+		for (size_t i = 0; i < options->count; i++)
+		{
+			int err_code = 0;
+			token_stream input;
+			token_stream output;
+			if (!initialize_token_stream(&input, 100))
+			{
+				continue;
+			}
+			if (tokenize_stream(expressions[i], &input, &err_code) && shunt_token_stream(&input, &output, &err_code))
+			{
+				tokens += input.length;
+				queue program;
+				token result;
+				if (initialize_queue(&program, output.length) && token_stream_to_queue(&output, &program, &err_code) &&
+					calculate_expression(&program, &result, &err_code))
+				{
+					free_token(&result);
+				}
+				delete_queue(&program);
+				delete_token_stream(&output);
+			}
+			delete_token_stream(&input);
+		}
+		record_stage(&end_to_end, now_ns() - start, tokens, &counts, it);
+	}
+
+	calc_core_use_allocator(previous);
+
+	printf("{\"seed\":%llu,\"count\":%zu,\"size\":%zu,\"depth\":%zu,\"iterations\":%zu,\"float_ratio\":%.3f,"
+		   "\"function_density\":%.3f,\"operators\":\"%s\",\"input_bytes\":%zu,\"failed\":%zu,",
+		   (unsigned long long)options->seed, options->count, options->size, options->depth, options->iterations,
+		   options->float_ratio, options->function_density, options->operators, input_bytes, failed);
+	print_stage("tokenize", &tokenize, options->count, options->iterations, false);
+	print_stage("shunting_yard", &shunt, options->count, options->iterations, false);
+	print_stage("evaluate", &evaluate, options->count, options->iterations, false);
+	print_stage("end_to_end", &end_to_end, options->count, options->iterations, true);
+	printf("}\n");
+
+	for (size_t i = 0; i < options->count; i++)
+	{
+		free(expressions[i]);
+	}
+	free(expressions);
+	free(tokenized);
+	free(rpn);
+	free(shunted);
+	return 0;
+}
+
+static bool parse_count(const char* str, size_t* result)
+{
+	char* endp = NULL;
+	unsigned long long value = strtoull(str, &endp, 10);
+	if (endp == str || *endp != '\0' || *str == '-')
+	{
+		return false;
+	}
+	*result = (size_t)value;
+	return true;
+}
+
+static bool parse_ratio(const char* str, double* result)
+{
+	char* endp = NULL;
+	double value = strtod(str, &endp);
+	if (endp == str || *endp != '\0' || value < 0.0 || value > 1.0)
+	{
+		return false;
+	}
+	*result = value;
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	bench_options options = { 1, 10000, 8, 3, 5, 0.2, 0.1, default_operators };
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (i + 1 >= argc)
+		{
+			fprintf(stderr,
+					"Usage: %s [--seed n] [--count n] [--size operands] [--depth n] [--iterations n] "
+					"[--float-ratio r] [--function-density r] [--operators list]\n",
+					argv[0]);
+			return 1;
+		}
+		size_t seed = 0;
+		bool ok = true;
+		if (strcmp(argv[i], "--seed") == 0)
+		{
+			ok = parse_count(argv[i + 1], &seed);
+			options.seed = seed;
+		}
+		else if (strcmp(argv[i], "--count") == 0)
+		{
+			ok = parse_count(argv[i + 1], &options.count) && options.count > 0;
+		}
+		else if (strcmp(argv[i], "--size") == 0)
+		{
+			ok = parse_count(argv[i + 1], &options.size) && options.size > 0;
+		}
+		else if (strcmp(argv[i], "--depth") == 0)
+		{
+			ok = parse_count(argv[i + 1], &options.depth);
+		}
+		else if (strcmp(argv[i], "--iterations") == 0)
+		{
+			ok = parse_count(argv[i + 1], &options.iterations) && options.iterations > 0;
+		}
+		else if (strcmp(argv[i], "--float-ratio") == 0)
+		{
+			ok = parse_ratio(argv[i + 1], &options.float_ratio);
+		}
+		else if (strcmp(argv[i], "--function-density") == 0)
+		{
+			ok = parse_ratio(argv[i + 1], &options.function_density);
+		}
+		else if (strcmp(argv[i], "--operators") == 0)
+		{
+			options.operators = argv[i + 1];
+		}
+		else
+		{
+			fprintf(stderr, "Error: unknown argument %s\n", argv[i]);
+			return 1;
+		}
+		if (!ok)
+		{
+			fprintf(stderr, "Error: invalid value %s for %s\n", argv[i + 1], argv[i]);
+			return 1;
+		}
+		i++;
+	}
+
+	operator_set ops;
+	if (!parse_operator_set(options.operators, &ops))
+	{
+		fprintf(stderr, "Error: invalid operator list %s\n", options.operators);
+		return 1;
+	}
+	int err_code = run_bench(&options, &ops);
+	free(ops.storage);
+	free(ops.items);
+	return err_code;
+}
@@ -0,0 +1,6025 @@
+#include "calc.h"
+#include "calc_core.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static _Thread_local const calc_allocator* active_allocator = NULL;
+static _Thread_local calc_core_stats* active_stats = NULL;
+static _Thread_local calc_core_budget* active_budget = NULL;
+static _Thread_local const calc_widths* active_widths = NULL;
+
+const calc_allocator* calc_core_use_allocator(const calc_allocator* allocator)
+{
+	const calc_allocator* previous = active_allocator;
+	active_allocator = allocator;
+	return previous;
+}
+
+calc_core_stats* calc_core_use_stats(calc_core_stats* stats)
+{
+	calc_core_stats* previous = active_stats;
+	active_stats = stats;
+	return previous;
+}
+
+calc_core_budget* calc_core_use_budget(calc_core_budget* budget)
+{
+	calc_core_budget* previous = active_budget;
+	active_budget = budget;
+	return previous;
+}
+
+const calc_widths* calc_core_use_widths(const calc_widths* widths)
+{
+	const calc_widths* previous = active_widths;
+	active_widths = widths;
+	return previous;
+}
+
+void calc_core_reset_cost(void)
+{
+	if (active_budget)
+	{
+		active_budget->cost = 0;
+	}
+}
+
+static bool charge_cost(uint64_t cost, int* err_code)
+{
+	if (!active_budget || !active_budget->limits.max_cost)
+	{
+		return true;
+	}
+	active_budget->cost += cost;
+	if (active_budget->cost <= active_budget->limits.max_cost)
+	{
+		return true;
+	}
+	if (err_code)
+	{
+		*err_code = CALC_ERROR_COST_LIMIT;
+	}
+	return false;
+}
+
+static void* calc_malloc(size_t size)
+{
+	if (active_stats)
+	{
+		active_stats->allocations++;
+	}
+	if (active_allocator)
+	{
+		return active_allocator->allocate(active_allocator->user_data, size);
+	}
+	return malloc(size);
+}
+
+static void* calc_realloc(void* ptr, size_t size)
+{
+	if (active_stats)
+	{
+		active_stats->reallocations++;
+	}
+	if (active_allocator)
+	{
+		return active_allocator->reallocate(active_allocator->user_data, ptr, size);
+	}
+	return realloc(ptr, size);
+}
+
+static void calc_free(void* ptr)
+{
+	if (!ptr)
+	{
+		return;
+	}
+	if (active_stats)
+	{
+		active_stats->releases++;
+	}
+	if (active_allocator)
+	{
+		active_allocator->release(active_allocator->user_data, ptr);
+		return;
+	}
+	free(ptr);
+}
+
+static bool fail_operation(int* err_code, int code)
+{
+	if (err_code)
+	{
+		*err_code = code;
+	}
+	return false;
+}
+
+token make_token(token_type type, const char* text)
+{
+	token t;
+	t.type = type;
+	t.priority = -1;
+	if (text)
+	{
+		if (active_stats)
+		{
+			active_stats->token_allocations++;
+		}
+		t.value = calc_malloc(strlen(text) + 1);
+		if (t.value)
+		{
+			strcpy(t.value, text);
+		}
+	}
+	else
+	{
+		t.value = NULL;
+	}
+
+	if (type == TOKEN_FUNCTION || type == TOKEN_UNARY_OPERATOR || (type == TOKEN_OPERATOR && t.value))
+	{
+		t.priority = token_stream_priority(type, type == TOKEN_OPERATOR ? binary_opcode(t.value) : CALC_OP_NONE);
+	}
+	return t;
+}
+
+void free_token(token* t)
+{
+	if (!t)
+	{
+		return;
+	}
+	if (t->value)
+	{
+		calc_free(t->value);
+		t->value = NULL;
+	}
+	t->type = TOKEN_NULL;
+	t->priority = 0;
+}
+
+token copy_token(const token* t)
+{
+	return make_token(t->type, t->value);
+}
+
+bool is_digit_char(char c)
+{
+	return (c >= '0' && c <= '9');
+}
+
+bool is_letter_char(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+/*
+ * Function registry: a fixed table of entries plus a trie over [a-zA-Z0-9], so a lookup costs one step per
+ * name character. Built-ins are registered on first use; the five unary built-ins keep their own opcodes,
+ * everything else is CALC_OP_CALL with the table index as operand.
+ */
+#define CALC_MAX_FUNCTIONS 256
+#define FUNCTION_TRIE_FANOUT 62
+
+typedef struct
+{
+	char name[CALC_FUNCTION_MAX_NAME + 1];
+	uint8_t arity;
+	uint8_t opcode;
+	calc_status (*scalar)(const double* args, double* result);
+	calc_status (*vector)(const double* const* args, double* results, size_t count);
+} function_entry;
+
+typedef struct
+{
+	uint16_t child[FUNCTION_TRIE_FANOUT];
+	uint16_t function;
+} function_trie_node;
+
+static function_entry function_table[CALC_MAX_FUNCTIONS];
+static size_t function_count = 0;
+static function_trie_node* function_trie = NULL;
+static size_t function_trie_length = 0;
+static size_t function_trie_capacity = 0;
+static _Atomic int function_registry_state = 0;
+
+static calc_status builtin_sqrt(const double* x, double* r)
+{
+	*r = sqrt(x[0]);
+	return x[0] < 0 ? CALC_ERROR_MATH : CALC_OK;
+}
+
+static calc_status builtin_log2(const double* x, double* r)
+{
+	*r = log2(x[0]);
+	return x[0] <= 0 ? CALC_ERROR_MATH : CALC_OK;
+}
+
+static calc_status builtin_sin(const double* x, double* r)
+{
+	*r = sin(x[0]);
+	return CALC_OK;
+}
+
+static calc_status builtin_cos(const double* x, double* r)
+{
+	*r = cos(x[0]);
+	return CALC_OK;
+}
+
+static calc_status builtin_tan(const double* x, double* r)
+{
+	*r = tan(x[0]);
+	return CALC_OK;
+}
+
+static calc_status builtin_min(const double* x, double* r)
+{
+	*r = fmin(x[0], x[1]);
+	return CALC_OK;
+}
+
+static calc_status builtin_max(const double* x, double* r)
+{
+	*r = fmax(x[0], x[1]);
+	return CALC_OK;
+}
+
+static calc_status builtin_pow(const double* x, double* r)
+{
+	*r = pow(x[0], x[1]);
+	return CALC_OK;
+}
+
+static calc_status builtin_atan2(const double* x, double* r)
+{
+	*r = atan2(x[0], x[1]);
+	return CALC_OK;
+}
+
+static calc_status builtin_hypot(const double* x, double* r)
+{
+	*r = hypot(x[0], x[1]);
+	return CALC_OK;
+}
+
+static const struct
+{
+	calc_function function;
+	calc_opcode opcode;
+} builtin_functions[] = {
+	{ { "sqrt", 1, builtin_sqrt, NULL }, CALC_OP_SQRT },
+	{ { "log2", 1, builtin_log2, NULL }, CALC_OP_LOG2 },
+	{ { "sin", 1, builtin_sin, NULL }, CALC_OP_SIN },
+	{ { "cos", 1, builtin_cos, NULL }, CALC_OP_COS },
+	{ { "tan", 1, builtin_tan, NULL }, CALC_OP_TAN },
+	{ { "min", 2, builtin_min, NULL }, CALC_OP_CALL },
+	{ { "max", 2, builtin_max, NULL }, CALC_OP_CALL },
+	{ { "pow", 2, builtin_pow, NULL }, CALC_OP_CALL },
+	{ { "atan2", 2, builtin_atan2, NULL }, CALC_OP_CALL },
+	{ { "hypot", 2, builtin_hypot, NULL }, CALC_OP_CALL },
+};
+
+#define BUILTIN_FUNCTION_COUNT (sizeof(builtin_functions) / sizeof(builtin_functions[0]))
+
+static int function_trie_slot(char c)
+{
+	if (c >= 'a' && c <= 'z')
+	{
+		return c - 'a';
+	}
+	if (c >= 'A' && c <= 'Z')
+	{
+		return 26 + (c - 'A');
+	}
+	if (c >= '0' && c <= '9')
+	{
+		return 52 + (c - '0');
+	}
+	return -1;
+}
+
+static bool grow_function_trie(void)
+{
+	if (function_trie_length < function_trie_capacity)
+	{
+		return true;
+	}
+	size_t capacity = function_trie_capacity ? function_trie_capacity * 2 : 64;
+	if (capacity > UINT16_MAX)
+	{
+		return false;
+	}
+	function_trie_node* nodes = realloc(function_trie, capacity * sizeof(function_trie_node));
+	if (!nodes)
+	{
+		return false;
+	}
+	function_trie = nodes;
+	function_trie_capacity = capacity;
+	return true;
+}
+
+static calc_status add_function(const calc_function* function, calc_opcode opcode)
+{
+	size_t length = function && function->name ? strlen(function->name) : 0;
+	if (!length || length > CALC_FUNCTION_MAX_NAME || !is_letter_char(function->name[0]) || !function->scalar ||
+		function->arity < 1 || function->arity > CALC_FUNCTION_MAX_ARITY)
+	{
+		return CALC_ERROR_INVALID_ARGUMENT;
+	}
+	if (function_count == CALC_MAX_FUNCTIONS)
+	{
+		return CALC_ERROR_NO_MEMORY;
+	}
+	if (!function_trie_length)
+	{
+		if (!grow_function_trie())
+		{
+			return CALC_ERROR_NO_MEMORY;
+		}
+		memset(&function_trie[function_trie_length++], 0, sizeof(function_trie_node));
+	}
+
+	size_t node = 0;
+	for (size_t i = 0; i < length; i++)
+	{
+		int slot = function_trie_slot(function->name[i]);
+		if (slot < 0)
+		{
+			return CALC_ERROR_INVALID_ARGUMENT;
+		}
+		if (!function_trie[node].child[slot])
+		{
+			if (!grow_function_trie())
+			{
+				return CALC_ERROR_NO_MEMORY;
+			}
+			memset(&function_trie[function_trie_length], 0, sizeof(function_trie_node));
+			function_trie[node].child[slot] = (uint16_t)function_trie_length++;
+		}
+		node = function_trie[node].child[slot];
+	}
+	if (function_trie[node].function)
+	{
+		return CALC_ERROR_INVALID_ARGUMENT;
+	}
+
+	function_entry* entry = &function_table[function_count];
+	memcpy(entry->name, function->name, length + 1);
+	entry->arity = (uint8_t)function->arity;
+	entry->opcode = (uint8_t)opcode;
+	entry->scalar = function->scalar;
+	entry->vector = function->vector;
+	function_trie[node].function = (uint16_t)++function_count;
+	return CALC_OK;
+}
+
+static void ensure_function_registry(void)
+{
+	if (atomic_load_explicit(&function_registry_state, memory_order_acquire) == 2)
+	{
+		return;
+	}
+	int expected = 0;
+	if (atomic_compare_exchange_strong(&function_registry_state, &expected, 1))
+	{
+		for (size_t i = 0; i < BUILTIN_FUNCTION_COUNT; i++)
+		{
+			add_function(&builtin_functions[i].function, builtin_functions[i].opcode);
+		}
+		atomic_store_explicit(&function_registry_state, 2, memory_order_release);
+		return;
+	}
+	while (atomic_load_explicit(&function_registry_state, memory_order_acquire) != 2)
+	{
+	}
+}
+
+/* Index of the function spelled by name[0..length), or -1. */
+static int find_function(const char* name, size_t length)
+{
+	ensure_function_registry();
+	size_t node = 0;
+	for (size_t i = 0; i < length && function_trie_length; i++)
+	{
+		int slot = function_trie_slot(name[i]);
+		if (slot < 0 || !function_trie[node].child[slot])
+		{
+			return -1;
+		}
+		node = function_trie[node].child[slot];
+	}
+	return node && function_trie[node].function ? (int)function_trie[node].function - 1 : -1;
+}
+
+static const function_entry* registered_function(uint32_t index)
+{
+	ensure_function_registry();
+	return index < function_count ? &function_table[index] : NULL;
+}
+
+calc_status calc_register_function(const calc_function* function)
+{
+	ensure_function_registry();
+	return add_function(function, CALC_OP_CALL);
+}
+
+/* Drops the functions and trie nodes added after the registry held count functions and trie_length nodes. */
+static void truncate_function_registry(size_t count, size_t trie_length)
+{
+	function_count = count;
+	function_trie_length = trie_length;
+	for (size_t node = 0; node < trie_length; node++)
+	{
+		for (size_t slot = 0; slot < FUNCTION_TRIE_FANOUT; slot++)
+		{
+			if (function_trie[node].child[slot] >= trie_length)
+			{
+				function_trie[node].child[slot] = 0;
+			}
+		}
+		if (function_trie[node].function > count)
+		{
+			function_trie[node].function = 0;
+		}
+	}
+}
+
+calc_status calc_load_functions(const char* path)
+{
+	if (!path)
+	{
+		return CALC_ERROR_INVALID_ARGUMENT;
+	}
+	void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!handle)
+	{
+		return CALC_ERROR_INVALID_ARGUMENT;
+	}
+	calc_plugin_entry entry;
+	*(void**)&entry = dlsym(handle, CALC_PLUGIN_SYMBOL);
+	if (!entry)
+	{
+		dlclose(handle);
+		return CALC_ERROR_UNSUPPORTED;
+	}
+
+	/* Either every entry is registered and the handle stays open, as entries point into the plug-in, or none. */
+	ensure_function_registry();
+	size_t previous_count = function_count;
+	size_t previous_trie_length = function_trie_length;
+	size_t count = 0;
+	const calc_function* functions = entry(&count);
+	for (size_t i = 0; i < count; i++)
+	{
+		calc_status status = add_function(&functions[i], CALC_OP_CALL);
+		if (status != CALC_OK)
+		{
+			truncate_function_registry(previous_count, previous_trie_length);
+			dlclose(handle);
+			return status;
+		}
+	}
+	return CALC_OK;
+}
+
+calc_status calc_apply_function(const char* name, const double* const* args, double* results, size_t count)
+{
+	int index = name ? find_function(name, strlen(name)) : -1;
+	if (index < 0 || (count && (!args || !results)))
+	{
+		return CALC_ERROR_INVALID_ARGUMENT;
+	}
+	const function_entry* f = &function_table[index];
+	if (f->vector)
+	{
+		return f->vector(args, results, count);
+	}
+	for (size_t i = 0; i < count; i++)
+	{
+		double values[CALC_FUNCTION_MAX_ARITY];
+		for (size_t k = 0; k < f->arity; k++)
+		{
+			values[k] = args[k][i];
+		}
+		calc_status status = f->scalar(values, &results[i]);
+		if (status != CALC_OK)
+		{
+			return status;
+		}
+	}
+	return CALC_OK;
+}
+
+bool is_valid_function(const char* func_name)
+{
+	return find_function(func_name, strlen(func_name)) >= 0;
+}
+
+bool initialize_stack(stack* s, size_t capacity)
+{
+	s->data = calc_malloc(sizeof(token) * capacity);
+	if (!s->data)
+	{
+		return false;
+	}
+	if (active_stats)
+	{
+		active_stats->stack_allocations++;
+		if (capacity > active_stats->peak_stack_capacity)
+		{
+			active_stats->peak_stack_capacity = capacity;
+		}
+	}
+	s->capacity = capacity;
+	s->top = 0;
+	return true;
+}
+
+void delete_stack(stack* s)
+{
+	if (!s || !s->data)
+	{
+		return;
+	}
+	for (size_t i = 0; i < s->top; i++)
+	{
+		free_token(&s->data[i]);
+	}
+	calc_free(s->data);
+	s->data = NULL;
+	s->top = 0;
+	s->capacity = 0;
+}
+
+bool push_stack(stack* s, token input)
+{
+	if (s->top >= s->capacity)
+	{
+		size_t newcap = s->capacity == 0 ? 8 : s->capacity * 2;
+		token* tmp = calc_realloc(s->data, sizeof(token) * newcap);
+		if (!tmp)
+		{
+			return false;
+		}
+		s->data = tmp;
+		s->capacity = newcap;
+		if (active_stats)
+		{
+			active_stats->stack_reallocations++;
+			if (newcap > active_stats->peak_stack_capacity)
+			{
+				active_stats->peak_stack_capacity = newcap;
+			}
+		}
+	}
+	s->data[s->top++] = input;
+	return true;
+}
+
+token pop_stack(stack* s)
+{
+	if (s->top == 0)
+	{
+		return make_token(TOKEN_NULL, NULL);
+	}
+	s->top--;
+	return s->data[s->top];
+}
+
+token peek_stack(stack* s)
+{
+	if (s->top == 0)
+	{
+		return make_token(TOKEN_NULL, NULL);
+	}
+	return s->data[s->top - 1];
+}
+
+bool is_empty_stack(stack* s)
+{
+	return s->top == 0;
+}
+
+void clear_stack(stack* s)
+{
+	while (s->top > 0)
+	{
+		s->top--;
+		free_token(&s->data[s->top]);
+	}
+}
+
+static size_t queue_slot(const queue* q, size_t position)
+{
+	return position & (q->capacity - 1);
+}
+
+bool initialize_queue(queue* q, size_t capacity)
+{
+	size_t rounded = 8;
+	while (rounded < capacity)
+	{
+		rounded *= 2;
+	}
+	q->data = calc_malloc(sizeof(token) * rounded);
+	if (!q->data)
+	{
+		return false;
+	}
+	if (active_stats)
+	{
+		active_stats->queue_allocations++;
+		if (rounded > active_stats->peak_queue_capacity)
+		{
+			active_stats->peak_queue_capacity = rounded;
+		}
+	}
+	q->capacity = rounded;
+	q->front = 0;
+	q->rear = 0;
+	return true;
+}
+
+void delete_queue(queue* q)
+{
+	if (!q || !q->data)
+	{
+		return;
+	}
+	for (size_t i = q->front; i != q->rear; i++)
+	{
+		free_token(&q->data[queue_slot(q, i)]);
+	}
+	calc_free(q->data);
+	q->data = NULL;
+	q->front = q->rear = q->capacity = 0;
+}
+
+bool reserve_queue(queue* q, size_t count)
+{
+	size_t live = queue_size(q);
+	if (live + count <= q->capacity)
+	{
+		return true;
+	}
+	size_t newcap = q->capacity == 0 ? 8 : q->capacity * 2;
+	while (newcap < live + count)
+	{
+		newcap *= 2;
+	}
+	token* tmp = calc_realloc(q->data, sizeof(token) * newcap);
+	if (!tmp)
+	{
+		return false;
+	}
+	size_t head = q->capacity ? queue_slot(q, q->front) : 0;
+	size_t wrapped = head + live > q->capacity ? head + live - q->capacity : 0;
+	memcpy(tmp + q->capacity, tmp, wrapped * sizeof(token));
+	q->data = tmp;
+	q->front = head;
+	q->rear = head + live;
+	q->capacity = newcap;
+	if (active_stats)
+	{
+		active_stats->queue_reallocations++;
+		if (newcap > active_stats->peak_queue_capacity)
+		{
+			active_stats->peak_queue_capacity = newcap;
+		}
+	}
+	return true;
+}
+
+bool push_queue(queue* q, token input)
+{
+	if (q->rear - q->front == q->capacity && !reserve_queue(q, 1))
+	{
+		return false;
+	}
+	q->data[queue_slot(q, q->rear++)] = input;
+	return true;
+}
+
+bool push_queue_bulk(queue* q, const token* items, size_t count)
+{
+	if (!count)
+	{
+		return true;
+	}
+	if (!reserve_queue(q, count))
+	{
+		return false;
+	}
+	size_t slot = queue_slot(q, q->rear);
+	size_t first = q->capacity - slot < count ? q->capacity - slot : count;
+	memcpy(q->data + slot, items, first * sizeof(token));
+	memcpy(q->data, items + first, (count - first) * sizeof(token));
+	q->rear += count;
+	return true;
+}
+
+token pop_queue(queue* q)
+{
+	if (q->front == q->rear)
+	{
+		return make_token(TOKEN_NULL, NULL);
+	}
+	return q->data[queue_slot(q, q->front++)];
+}
+
+size_t pop_queue_bulk(queue* q, token* items, size_t max)
+{
+	size_t count = queue_size(q) < max ? queue_size(q) : max;
+	if (!count)
+	{
+		return 0;
+	}
+	size_t slot = queue_slot(q, q->front);
+	size_t first = q->capacity - slot < count ? q->capacity - slot : count;
+	memcpy(items, q->data + slot, first * sizeof(token));
+	memcpy(items + first, q->data, (count - first) * sizeof(token));
+	q->front += count;
+	return count;
+}
+
+token* queue_at(const queue* q, size_t index)
+{
+	return &q->data[queue_slot(q, q->front + index)];
+}
+
+size_t queue_size(const queue* q)
+{
+	return q->rear - q->front;
+}
+
+bool is_empty_queue(queue* q)
+{
+	return q->front == q->rear;
+}
+
+static queue make_empty_queue(void)
+{
+	queue empty;
+	empty.data = NULL;
+	empty.front = empty.rear = empty.capacity = 0;
+	return empty;
+}
+
+static bool parse_string_to_int(const char* str, int32_t* result, int* err_code)
+{
+	char* endp = NULL;
+	long value = strtol(str, &endp, 10);
+	if (endp == str || *endp != '\0' || value < INT_MIN || value > INT_MAX)
+	{
+		if (err_code)
+		{
+			*err_code = 1;
+		}
+		return false;
+	}
+	*result = (int32_t)value;
+	return true;
+}
+
+static bool parse_string_to_int64(const char* str, int64_t* result, int* err_code)
+{
+	char* endp = NULL;
+	errno = 0;
+	long long value = strtoll(str, &endp, 10);
+	if (endp == str || *endp != '\0' || errno == ERANGE)
+	{
+		if (err_code)
+		{
+			*err_code = 1;
+		}
+		return false;
+	}
+	*result = (int64_t)value;
+	return true;
+}
+
+bool is_right_assoc(const token* t)
+{
+	if (!t || !t->value)
+	{
+		return false;
+	}
+	if (t->type == TOKEN_UNARY_OPERATOR)
+	{
+		return true;
+	}
+	return false;
+}
+
+bool is_operator_token(const token* t)
+{
+	return t && (t->type == TOKEN_OPERATOR || t->type == TOKEN_UNARY_OPERATOR);
+}
+
+bool initialize_token_stream(token_stream* s, size_t capacity)
+{
+	s->kinds = NULL;
+	s->opcodes = NULL;
+	s->values = NULL;
+	s->length = 0;
+	s->capacity = 0;
+	s->literals = NULL;
+	s->literals_length = 0;
+	s->literals_capacity = 0;
+	return reserve_token_stream(s, capacity ? capacity : 16);
+}
+
+void delete_token_stream(token_stream* s)
+{
+	if (!s)
+	{
+		return;
+	}
+	calc_free(s->values);
+	calc_free(s->literals);
+	s->kinds = NULL;
+	s->opcodes = NULL;
+	s->values = NULL;
+	s->length = s->capacity = 0;
+	s->literals = NULL;
+	s->literals_length = s->literals_capacity = 0;
+}
+
+bool reserve_token_stream(token_stream* s, size_t capacity)
+{
+	if (capacity <= s->capacity)
+	{
+		return true;
+	}
+	unsigned char* block = calc_malloc(capacity * (sizeof(uint32_t) + 2));
+	if (!block)
+	{
+		return false;
+	}
+	uint32_t* values = (uint32_t*)block;
+	uint8_t* kinds = (uint8_t*)(values + capacity);
+	uint8_t* opcodes = kinds + capacity;
+	if (s->length)
+	{
+		memcpy(values, s->values, s->length * sizeof(uint32_t));
+		memcpy(kinds, s->kinds, s->length);
+		memcpy(opcodes, s->opcodes, s->length);
+	}
+	calc_free(s->values);
+	s->values = values;
+	s->kinds = kinds;
+	s->opcodes = opcodes;
+	s->capacity = capacity;
+	return true;
+}
+
+bool push_token_stream(token_stream* s, token_type kind, calc_opcode opcode, uint32_t value)
+{
+	if (s->length == s->capacity && !reserve_token_stream(s, s->capacity ? s->capacity * 2 : 16))
+	{
+		return false;
+	}
+	s->kinds[s->length] = (uint8_t)kind;
+	s->opcodes[s->length] = (uint8_t)opcode;
+	s->values[s->length] = value;
+	s->length++;
+	return true;
+}
+
+bool push_token_literal(token_stream* s, token_type kind, const char* text, size_t length)
+{
+	size_t needed = s->literals_length + length + 1;
+	if (needed > UINT32_MAX)
+	{
+		return false;
+	}
+	if (needed > s->literals_capacity)
+	{
+		size_t capacity = s->literals_capacity ? s->literals_capacity * 2 : 64;
+		while (capacity < needed)
+		{
+			capacity *= 2;
+		}
+		char* literals = calc_realloc(s->literals, capacity);
+		if (!literals)
+		{
+			return false;
+		}
+		s->literals = literals;
+		s->literals_capacity = capacity;
+	}
+	uint32_t offset = (uint32_t)s->literals_length;
+	memcpy(s->literals + offset, text, length);
+	s->literals[offset + length] = '\0';
+	if (!push_token_stream(s, kind, CALC_OP_NONE, offset))
+	{
+		return false;
+	}
+	s->literals_length = needed;
+	return true;
+}
+
+const char* token_stream_literal(const token_stream* s, size_t index)
+{
+	return s->literals + s->values[index];
+}
+
+int token_stream_priority(token_type kind, calc_opcode opcode)
+{
+	if (kind == TOKEN_FUNCTION)
+	{
+		return 0;
+	}
+	if (kind == TOKEN_UNARY_OPERATOR)
+	{
+		return 1;
+	}
+	if (kind != TOKEN_OPERATOR)
+	{
+		return -1;
+	}
+	switch (opcode)
+	{
+	case CALC_OP_POW:
+		return 2;
+	case CALC_OP_MUL:
+	case CALC_OP_DIV:
+	case CALC_OP_MOD:
+		return 3;
+	case CALC_OP_ADD:
+	case CALC_OP_SUB:
+		return 4;
+	case CALC_OP_SHL:
+	case CALC_OP_SHR:
+		return 5;
+	case CALC_OP_LT:
+	case CALC_OP_LE:
+	case CALC_OP_GT:
+	case CALC_OP_GE:
+		return 6;
+	case CALC_OP_EQ:
+	case CALC_OP_NE:
+		return 7;
+	case CALC_OP_AND:
+		return 8;
+	case CALC_OP_XOR:
+		return 9;
+	case CALC_OP_OR:
+		return 10;
+	case CALC_OP_LAND:
+		return 11;
+	case CALC_OP_LOR:
+		return 12;
+	default:
+		return 100;
+	}
+}
+
+static const char* token_stream_text(const token_stream* s, size_t index)
+{
+	token_type kind = (token_type)s->kinds[index];
+	calc_opcode opcode = (calc_opcode)s->opcodes[index];
+	switch (kind)
+	{
+	case TOKEN_NUMBER:
+	case TOKEN_FLOAT_NUMBER:
+	case TOKEN_VARIABLE:
+		return token_stream_literal(s, index);
+	case TOKEN_LPAREN:
+		return "(";
+	case TOKEN_RPAREN:
+		return ")";
+	case TOKEN_UNARY_OPERATOR:
+		return opcode == CALC_OP_NOT ? "~" : opcode == CALC_OP_NEG ? "-" : "+";
+	case TOKEN_FUNCTION:
+		return function_table[s->values[index]].name;
+	case TOKEN_COMMA:
+		return ",";
+	case TOKEN_OPERATOR:
+		switch (opcode)
+		{
+		case CALC_OP_ADD:
+			return "+";
+		case CALC_OP_SUB:
+			return "-";
+		case CALC_OP_MUL:
+			return "*";
+		case CALC_OP_DIV:
+			return "/";
+		case CALC_OP_MOD:
+			return "%";
+		case CALC_OP_POW:
+			return "**";
+		case CALC_OP_SHL:
+			return "<<";
+		case CALC_OP_SHR:
+			return ">>";
+		case CALC_OP_AND:
+			return "&";
+		case CALC_OP_XOR:
+			return "^";
+		case CALC_OP_OR:
+			return "|";
+		case CALC_OP_LT:
+			return "<";
+		case CALC_OP_LE:
+			return "<=";
+		case CALC_OP_GT:
+			return ">";
+		case CALC_OP_GE:
+			return ">=";
+		case CALC_OP_EQ:
+			return "==";
+		case CALC_OP_NE:
+			return "!=";
+		case CALC_OP_LAND:
+			return "&&";
+		case CALC_OP_LOR:
+			return "||";
+		case CALC_OP_SELECT:
+			return "?:";
+		default:
+			return "~";
+		}
+	case TOKEN_QUESTION:
+		return "?";
+	case TOKEN_COLON:
+		return ":";
+	default:
+		return NULL;
+	}
+}
+
+static bool is_operand_kind(uint8_t kind)
+{
+	return kind == TOKEN_NUMBER || kind == TOKEN_FLOAT_NUMBER || kind == TOKEN_VARIABLE;
+}
+
+static calc_opcode two_char_opcode(char first, char second)
+{
+	switch (first)
+	{
+	case '*':
+		return second == '*' ? CALC_OP_POW : CALC_OP_NONE;
+	case '<':
+		return second == '<' ? CALC_OP_SHL : second == '=' ? CALC_OP_LE : CALC_OP_NONE;
+	case '>':
+		return second == '>' ? CALC_OP_SHR : second == '=' ? CALC_OP_GE : CALC_OP_NONE;
+	case '=':
+		return second == '=' ? CALC_OP_EQ : CALC_OP_NONE;
+	case '!':
+		return second == '=' ? CALC_OP_NE : CALC_OP_NONE;
+	case '&':
+		return second == '&' ? CALC_OP_LAND : CALC_OP_NONE;
+	case '|':
+		return second == '|' ? CALC_OP_LOR : CALC_OP_NONE;
+	default:
+		return CALC_OP_NONE;
+	}
+}
+
+bool tokenize_stream(const char* math_expression, token_stream* tokens, int* err_code)
+{
+	size_t length = strlen(math_expression);
+	size_t index = 0;
+	size_t nesting = 0;
+	size_t first = tokens->length;
+	token_type prev = TOKEN_NULL;
+	const calc_limits* limits = active_budget ? &active_budget->limits : NULL;
+
+	if (limits && limits->max_input_bytes && length > limits->max_input_bytes)
+	{
+		return fail_operation(err_code, CALC_ERROR_INPUT_LIMIT);
+	}
+
+	while (index < length)
+	{
+		char ch = math_expression[index];
+		if (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r')
+		{
+			index++;
+			continue;
+		}
+
+		if (limits)
+		{
+			if (limits->max_tokens && tokens->length - first >= limits->max_tokens)
+			{
+				return fail_operation(err_code, CALC_ERROR_TOKEN_LIMIT);
+			}
+			if (limits->max_nesting && ch == '(' && nesting >= limits->max_nesting)
+			{
+				return fail_operation(err_code, CALC_ERROR_NESTING_LIMIT);
+			}
+		}
+
+		bool pushed;
+		if (is_digit_char(ch))
+		{
+			size_t end = index;
+			bool has_dot = false;
+			while (end < length && (is_digit_char(math_expression[end]) || math_expression[end] == '.'))
+			{
+				if (math_expression[end] == '.')
+				{
+					if (has_dot)
+					{
+						return fail_operation(err_code, 2);
+					}
+					has_dot = true;
+				}
+				end++;
+			}
+			prev = has_dot ? TOKEN_FLOAT_NUMBER : TOKEN_NUMBER;
+			pushed = push_token_literal(tokens, prev, math_expression + index, end - index);
+			index = end;
+		}
+		else if (is_letter_char(ch))
+		{
+			size_t end = index;
+			while (end < length && (is_letter_char(math_expression[end]) || is_digit_char(math_expression[end])))
+			{
+				end++;
+			}
+			int function = find_function(math_expression + index, end - index);
+			if (function >= 0)
+			{
+				prev = TOKEN_FUNCTION;
+				pushed = push_token_stream(tokens, TOKEN_FUNCTION, (calc_opcode)function_table[function].opcode,
+										   (uint32_t)function);
+			}
+			else
+			{
+				prev = TOKEN_VARIABLE;
+				pushed = push_token_literal(tokens, TOKEN_VARIABLE, math_expression + index, end - index);
+			}
+			index = end;
+		}
+		else if (ch == '(' || ch == ')')
+		{
+			if (ch == '(')
+			{
+				nesting++;
+			}
+			else if (nesting)
+			{
+				nesting--;
+			}
+			prev = ch == '(' ? TOKEN_LPAREN : TOKEN_RPAREN;
+			pushed = push_token_stream(tokens, prev, CALC_OP_NONE, 0);
+			index++;
+		}
+		else if (ch == ',')
+		{
+			prev = TOKEN_COMMA;
+			pushed = push_token_stream(tokens, TOKEN_COMMA, CALC_OP_NONE, 0);
+			index++;
+		}
+		else if (ch == '?' || ch == ':')
+		{
+			prev = ch == '?' ? TOKEN_QUESTION : TOKEN_COLON;
+			pushed = push_token_stream(tokens, prev, CALC_OP_NONE, 0);
+			index++;
+		}
+		else if (index + 1 < length && two_char_opcode(ch, math_expression[index + 1]) != CALC_OP_NONE)
+		{
+			prev = TOKEN_OPERATOR;
+			pushed = push_token_stream(tokens, TOKEN_OPERATOR, two_char_opcode(ch, math_expression[index + 1]), 0);
+			index += 2;
+		}
+		else if (ch == '+' || ch == '-' || ch == '*' || ch == '/' || ch == '%' || ch == '&' || ch == '^' || ch == '|' ||
+				 ch == '~' || ch == '<' || ch == '>')
+		{
+			char text[2] = { ch, '\0' };
+			bool unary = (ch == '+' || ch == '-' || ch == '~') &&
+						 (prev == TOKEN_NULL || prev == TOKEN_OPERATOR || prev == TOKEN_UNARY_OPERATOR ||
+						  prev == TOKEN_LPAREN || prev == TOKEN_COMMA || prev == TOKEN_QUESTION || prev == TOKEN_COLON);
+			prev = unary ? TOKEN_UNARY_OPERATOR : TOKEN_OPERATOR;
+			pushed = push_token_stream(tokens, prev, unary ? unary_opcode(text) : binary_opcode(text), 0);
+			index++;
+		}
+		else
+		{
+			return fail_operation(err_code, 1);
+		}
+
+		if (!pushed)
+		{
+			return fail_operation(err_code, 5);
+		}
+	}
+	return true;
+}
+
+bool shunt_token_stream(const token_stream* input, token_stream* output, int* err_code)
+{
+	if (!initialize_token_stream(output, input->length * 2))
+	{
+		return fail_operation(err_code, 5);
+	}
+	if (input->literals_length)
+	{
+		output->literals = calc_malloc(input->literals_length);
+		if (!output->literals)
+		{
+			delete_token_stream(output);
+			return fail_operation(err_code, 5);
+		}
+		memcpy(output->literals, input->literals, input->literals_length);
+		output->literals_length = output->literals_capacity = input->literals_length;
+	}
+
+	/*
+	 * arguments[k] counts the commas seen inside the parenthesis at operators[k]; for &&, ||, ? and : it is
+	 * the output index of the branch marker that the operator patches once its right operand is complete.
+	 */
+	uint32_t* operators = calc_malloc((input->length ? input->length : 1) * 2 * sizeof(uint32_t));
+	if (!operators)
+	{
+		delete_token_stream(output);
+		return fail_operation(err_code, 5);
+	}
+	uint32_t* arguments = operators + (input->length ? input->length : 1);
+	size_t top = 0;
+	int error = 0;
+
+	/* Markers and SELECT at most double the input, so emits below cannot fail. */
+#define EMIT(i) push_token_stream(output, (token_type)input->kinds[i], (calc_opcode)input->opcodes[i], input->values[i])
+#define MARK(op) push_token_stream(output, TOKEN_BRANCH, op, 0)
+#define PATCH(m) (output->values[m] = (uint32_t)(output->length - 1 - (m)))
+#define POP_OPERATOR()                                                                                                 \
+	do                                                                                                                 \
+	{                                                                                                                  \
+		uint32_t j_ = operators[--top];                                                                                \
+		if (input->kinds[j_] == TOKEN_COLON)                                                                           \
+		{                                                                                                              \
+			PATCH(arguments[top]);                                                                                     \
+			push_token_stream(output, TOKEN_OPERATOR, CALC_OP_SELECT, 0);                                              \
+		}                                                                                                              \
+		else                                                                                                           \
+		{                                                                                                              \
+			if (input->opcodes[j_] == CALC_OP_LAND || input->opcodes[j_] == CALC_OP_LOR)                               \
+			{                                                                                                          \
+				PATCH(arguments[top]);                                                                                 \
+			}                                                                                                          \
+			EMIT(j_);                                                                                                  \
+		}                                                                                                              \
+	} while (0)
+
+	for (size_t i = 0; i < input->length && !error; i++)
+	{
+		uint8_t kind = input->kinds[i];
+		if (is_operand_kind(kind))
+		{
+			EMIT(i);
+			if (top && input->kinds[operators[top - 1]] == TOKEN_FUNCTION)
+			{
+				top--;
+				error = function_table[input->values[operators[top]]].arity == 1 ? 0 : 2;
+				EMIT(operators[top]);
+			}
+		}
+		else if (kind == TOKEN_OPERATOR)
+		{
+			calc_opcode op = (calc_opcode)input->opcodes[i];
+			int priority = token_stream_priority(TOKEN_OPERATOR, op);
+			while (top)
+			{
+				uint32_t j = operators[top - 1];
+				if (input->kinds[j] == TOKEN_UNARY_OPERATOR ||
+					(input->kinds[j] == TOKEN_OPERATOR &&
+					 token_stream_priority(TOKEN_OPERATOR, (calc_opcode)input->opcodes[j]) <= priority))
+				{
+					POP_OPERATOR();
+				}
+				else
+				{
+					break;
+				}
+			}
+			if (op == CALC_OP_LAND || op == CALC_OP_LOR)
+			{
+				MARK(op == CALC_OP_LAND ? CALC_OP_AND_THEN : CALC_OP_OR_ELSE);
+				arguments[top] = (uint32_t)(output->length - 1);
+			}
+			operators[top++] = (uint32_t)i;
+		}
+		else if (kind == TOKEN_QUESTION)
+		{
+			while (top && (input->kinds[operators[top - 1]] == TOKEN_OPERATOR ||
+						   input->kinds[operators[top - 1]] == TOKEN_UNARY_OPERATOR))
+			{
+				POP_OPERATOR();
+			}
+			MARK(CALC_OP_THEN);
+			arguments[top] = (uint32_t)(output->length - 1);
+			operators[top++] = (uint32_t)i;
+		}
+		else if (kind == TOKEN_COLON)
+		{
+			while (top && input->kinds[operators[top - 1]] != TOKEN_QUESTION &&
+				   input->kinds[operators[top - 1]] != TOKEN_LPAREN)
+			{
+				POP_OPERATOR();
+			}
+			if (!top || input->kinds[operators[top - 1]] != TOKEN_QUESTION)
+			{
+				error = 2;
+				break;
+			}
+			uint32_t then = arguments[top - 1];
+			output->values[then] = (uint32_t)(output->length - then);
+			MARK(CALC_OP_ELSE);
+			arguments[top - 1] = (uint32_t)(output->length - 1);
+			operators[top - 1] = (uint32_t)i;
+		}
+		else if (kind == TOKEN_LPAREN || kind == TOKEN_FUNCTION || kind == TOKEN_UNARY_OPERATOR)
+		{
+			arguments[top] = 0;
+			operators[top++] = (uint32_t)i;
+		}
+		else if (kind == TOKEN_RPAREN || kind == TOKEN_COMMA)
+		{
+			while (top && input->kinds[operators[top - 1]] != TOKEN_LPAREN &&
+				   input->kinds[operators[top - 1]] != TOKEN_QUESTION)
+			{
+				POP_OPERATOR();
+			}
+			if (!top || input->kinds[operators[top - 1]] == TOKEN_QUESTION)
+			{
+				error = 2;
+				break;
+			}
+			if (kind == TOKEN_COMMA)
+			{
+				arguments[top - 1]++;
+				continue;
+			}
+			uint32_t commas = arguments[--top];
+			if (top && input->kinds[operators[top - 1]] == TOKEN_FUNCTION)
+			{
+				top--;
+				error = function_table[input->values[operators[top]]].arity == commas + 1 ? 0 : 2;
+				EMIT(operators[top]);
+			}
+			else if (commas)
+			{
+				error = 2;
+			}
+		}
+		else
+		{
+			error = 1;
+		}
+	}
+
+	while (top && !error)
+	{
+		if (input->kinds[operators[top - 1]] == TOKEN_LPAREN || input->kinds[operators[top - 1]] == TOKEN_QUESTION)
+		{
+			error = 2;
+			break;
+		}
+		POP_OPERATOR();
+	}
+#undef POP_OPERATOR
+#undef PATCH
+#undef MARK
+#undef EMIT
+	calc_free(operators);
+
+	bool has_operand = false;
+	for (size_t i = 0; i < output->length && !has_operand; i++)
+	{
+		has_operand = is_operand_kind(output->kinds[i]);
+	}
+	if (!error && !has_operand)
+	{
+		error = 2;
+	}
+	if (error)
+	{
+		delete_token_stream(output);
+		return fail_operation(err_code, error);
+	}
+	return true;
+}
+
+/* Branch markers keep their skip count in the queue as text: "&&3", "||3", "?3" or ":3"; -p prints them so. */
+static const char* const branch_symbols[] = { "&&", "||", "?", ":" };
+
+static calc_opcode branch_opcode(const char* text, uint32_t* skip)
+{
+	for (size_t k = 0; k < sizeof(branch_symbols) / sizeof(branch_symbols[0]); k++)
+	{
+		size_t length = strlen(branch_symbols[k]);
+		if (strncmp(text, branch_symbols[k], length) == 0 && is_digit_char(text[length]))
+		{
+			unsigned long value = strtoul(text + length, NULL, 10);
+			*skip = value > UINT32_MAX ? UINT32_MAX : (uint32_t)value;
+			return (calc_opcode)(CALC_OP_AND_THEN + k);
+		}
+	}
+	return CALC_OP_NONE;
+}
+
+bool token_stream_to_queue(const token_stream* tokens, queue* res_queue, int* err_code)
+{
+	token batch[QUEUE_BATCH];
+	size_t count = 0;
+	for (size_t i = 0; i < tokens->length; i++)
+	{
+		const char* text = token_stream_text(tokens, i);
+		char branch[16];
+		if (tokens->kinds[i] == TOKEN_BRANCH)
+		{
+			snprintf(branch, sizeof(branch), "%s%" PRIu32, branch_symbols[tokens->opcodes[i] - CALC_OP_AND_THEN],
+					 tokens->values[i]);
+			text = branch;
+		}
+		batch[count] = make_token((token_type)tokens->kinds[i], text);
+		bool failed = !batch[count++].value;
+		if (failed || count == QUEUE_BATCH || i + 1 == tokens->length)
+		{
+			if (failed || !push_queue_bulk(res_queue, batch, count))
+			{
+				while (count)
+				{
+					free_token(&batch[--count]);
+				}
+				return fail_operation(err_code, 5);
+			}
+			count = 0;
+		}
+	}
+	return true;
+}
+
+bool queue_to_token_stream(const queue* q, token_stream* tokens, int* err_code)
+{
+	for (size_t i = 0; i < queue_size(q); i++)
+	{
+		const token* t = queue_at(q, i);
+		bool pushed;
+		if (is_operand_kind((uint8_t)t->type))
+		{
+			pushed = push_token_literal(tokens, t->type, t->value, strlen(t->value));
+		}
+		else
+		{
+			calc_opcode op = CALC_OP_NONE;
+			int function = -1;
+			uint32_t skip = 0;
+			if (t->type == TOKEN_OPERATOR)
+			{
+				op = binary_opcode(t->value);
+			}
+			else if (t->type == TOKEN_UNARY_OPERATOR)
+			{
+				op = unary_opcode(t->value);
+			}
+			else if (t->type == TOKEN_BRANCH)
+			{
+				op = branch_opcode(t->value, &skip);
+				if (op == CALC_OP_NONE)
+				{
+					return fail_operation(err_code, 1);
+				}
+			}
+			else if (t->type == TOKEN_FUNCTION)
+			{
+				function = find_function(t->value, strlen(t->value));
+				if (function < 0)
+				{
+					return fail_operation(err_code, 1);
+				}
+				op = (calc_opcode)function_table[function].opcode;
+			}
+			pushed = push_token_stream(tokens, t->type, op, function < 0 ? skip : (uint32_t)function);
+		}
+		if (!pushed)
+		{
+			return fail_operation(err_code, 5);
+		}
+	}
+	return true;
+}
+
+bool tokenizator(const char* math_expression, queue* res_queue, int* err_code)
+{
+	token_stream tokens;
+	if (!initialize_token_stream(&tokens, 16))
+	{
+		return fail_operation(err_code, 5);
+	}
+	bool ok = tokenize_stream(math_expression, &tokens, err_code) && token_stream_to_queue(&tokens, res_queue, err_code);
+	delete_token_stream(&tokens);
+	return ok;
+}
+
+calc_opcode binary_opcode(const char* op)
+{
+	if (strcmp(op, "+") == 0)
+	{
+		return CALC_OP_ADD;
+	}
+	if (strcmp(op, "-") == 0)
+	{
+		return CALC_OP_SUB;
+	}
+	if (strcmp(op, "*") == 0)
+	{
+		return CALC_OP_MUL;
+	}
+	if (strcmp(op, "**") == 0)
+	{
+		return CALC_OP_POW;
+	}
+	if (strcmp(op, "/") == 0)
+	{
+		return CALC_OP_DIV;
+	}
+	if (strcmp(op, "%") == 0)
+	{
+		return CALC_OP_MOD;
+	}
+	if (strcmp(op, "<<") == 0)
+	{
+		return CALC_OP_SHL;
+	}
+	if (strcmp(op, ">>") == 0)
+	{
+		return CALC_OP_SHR;
+	}
+	if (strcmp(op, "&") == 0)
+	{
+		return CALC_OP_AND;
+	}
+	if (strcmp(op, "^") == 0)
+	{
+		return CALC_OP_XOR;
+	}
+	if (strcmp(op, "|") == 0)
+	{
+		return CALC_OP_OR;
+	}
+	if (strcmp(op, "<") == 0)
+	{
+		return CALC_OP_LT;
+	}
+	if (strcmp(op, "<=") == 0)
+	{
+		return CALC_OP_LE;
+	}
+	if (strcmp(op, ">") == 0)
+	{
+		return CALC_OP_GT;
+	}
+	if (strcmp(op, ">=") == 0)
+	{
+		return CALC_OP_GE;
+	}
+	if (strcmp(op, "==") == 0)
+	{
+		return CALC_OP_EQ;
+	}
+	if (strcmp(op, "!=") == 0)
+	{
+		return CALC_OP_NE;
+	}
+	if (strcmp(op, "&&") == 0)
+	{
+		return CALC_OP_LAND;
+	}
+	if (strcmp(op, "||") == 0)
+	{
+		return CALC_OP_LOR;
+	}
+	if (strcmp(op, "?:") == 0)
+	{
+		return CALC_OP_SELECT;
+	}
+	return CALC_OP_NONE;
+}
+
+calc_opcode unary_opcode(const char* op)
+{
+	if (strcmp(op, "~") == 0)
+	{
+		return CALC_OP_NOT;
+	}
+	if (strcmp(op, "+") == 0)
+	{
+		return CALC_OP_POS;
+	}
+	if (strcmp(op, "-") == 0)
+	{
+		return CALC_OP_NEG;
+	}
+	return CALC_OP_NONE;
+}
+
+calc_opcode function_opcode(const char* func_name)
+{
+	int index = find_function(func_name, strlen(func_name));
+	return index < 0 ? CALC_OP_NONE : (calc_opcode)function_table[index].opcode;
+}
+
+bool float_supported(calc_opcode op)
+{
+	return op == CALC_OP_ADD || op == CALC_OP_SUB || op == CALC_OP_MUL || op == CALC_OP_DIV || op == CALC_OP_POW ||
+		   op == CALC_OP_POS || op == CALC_OP_NEG;
+}
+
+/*
+ * Width-specialized kernels share one definition. Integer arithmetic wraps through the unsigned type of
+ * the same width; the 32-bit instantiations keep the original names.
+ */
+#define CALC_DEFINE_INTEGER_KERNELS(suffix, type, utype, bits, min)                                                    \
+	bool safe_pow##suffix(type a, type b, type* res)                                                                   \
+	{                                                                                                                  \
+		if (b < 0)                                                                                                     \
+		{                                                                                                              \
+			return false;                                                                                              \
+		}                                                                                                              \
+		utype base = (utype)a;                                                                                         \
+		utype r = 1;                                                                                                   \
+		for (utype e = (utype)b; e; e >>= 1)                                                                           \
+		{                                                                                                              \
+			if (e & 1u)                                                                                                \
+			{                                                                                                          \
+				r *= base;                                                                                             \
+			}                                                                                                          \
+			base *= base;                                                                                              \
+		}                                                                                                              \
+		*res = (type)r;                                                                                                \
+		return true;                                                                                                   \
+	}                                                                                                                  \
+                                                                                                                       \
+	bool integer_binary_operation##suffix(calc_opcode op, type a, type b, type* res, int* err_code)                    \
+	{                                                                                                                  \
+		switch (op)                                                                                                    \
+		{                                                                                                              \
+		case CALC_OP_ADD:                                                                                              \
+			*res = (type)((utype)a + (utype)b);                                                                        \
+			return true;                                                                                               \
+		case CALC_OP_SUB:                                                                                              \
+			*res = (type)((utype)a - (utype)b);                                                                        \
+			return true;                                                                                               \
+		case CALC_OP_MUL:                                                                                              \
+			*res = (type)((utype)a * (utype)b);                                                                        \
+			return true;                                                                                               \
+		case CALC_OP_POW:                                                                                              \
+			if (b > 0 && !charge_cost((uint64_t)(64 - __builtin_clzll((unsigned long long)b)), err_code))              \
+			{                                                                                                          \
+				return false;                                                                                          \
+			}                                                                                                          \
+			return safe_pow##suffix(a, b, res) || fail_operation(err_code, 3);                                         \
+		case CALC_OP_DIV:                                                                                              \
+			if (b == 0 || (a == min && b == -1))                                                                       \
+			{                                                                                                          \
+				return fail_operation(err_code, 3);                                                                    \
+			}                                                                                                          \
+			*res = a / b;                                                                                              \
+			return true;                                                                                               \
+		case CALC_OP_MOD:                                                                                              \
+			if (b == 0)                                                                                                \
+			{                                                                                                          \
+				return fail_operation(err_code, 3);                                                                    \
+			}                                                                                                          \
+			*res = b == -1 ? 0 : a % b;                                                                                \
+			return true;                                                                                               \
+		case CALC_OP_SHL:                                                                                              \
+			if (b < 0 || b >= bits)                                                                                    \
+			{                                                                                                          \
+				return fail_operation(err_code, 3);                                                                    \
+			}                                                                                                          \
+			*res = (type)((utype)a << b);                                                                              \
+			return true;                                                                                               \
+		case CALC_OP_SHR:                                                                                              \
+			if (b < 0 || b >= bits)                                                                                    \
+			{                                                                                                          \
+				return fail_operation(err_code, 3);                                                                    \
+			}                                                                                                          \
+			*res = (type)(a >> b);                                                                                     \
+			return true;                                                                                               \
+		case CALC_OP_AND:                                                                                              \
+			*res = a & b;                                                                                              \
+			return true;                                                                                               \
+		case CALC_OP_XOR:                                                                                              \
+			*res = a ^ b;                                                                                              \
+			return true;                                                                                               \
+		case CALC_OP_OR:                                                                                               \
+			*res = a | b;                                                                                              \
+			return true;                                                                                               \
+		default:                                                                                                       \
+			return fail_operation(err_code, 1);                                                                        \
+		}                                                                                                              \
+	}                                                                                                                  \
+                                                                                                                       \
+	bool integer_unary_operation##suffix(calc_opcode op, type a, type* res, int* err_code)                             \
+	{                                                                                                                  \
+		switch (op)                                                                                                    \
+		{                                                                                                              \
+		case CALC_OP_NOT:                                                                                              \
+			*res = ~a;                                                                                                 \
+			return true;                                                                                               \
+		case CALC_OP_POS:                                                                                              \
+			*res = +a;                                                                                                 \
+			return true;                                                                                               \
+		case CALC_OP_NEG:                                                                                              \
+			*res = (type)(0u - (utype)a);                                                                              \
+			return true;                                                                                               \
+		default:                                                                                                       \
+			return fail_operation(err_code, 1);                                                                        \
+		}                                                                                                              \
+	}
+
+#define CALC_DEFINE_FLOAT_KERNELS(suffix, type, pow_fn, sqrt_fn, log2_fn, sin_fn, cos_fn, tan_fn)                      \
+	bool float_binary_operation##suffix(calc_opcode op, type a, type b, type* res, int* err_code)                      \
+	{                                                                                                                  \
+		switch (op)                                                                                                    \
+		{                                                                                                              \
+		case CALC_OP_ADD:                                                                                              \
+			*res = a + b;                                                                                              \
+			return true;                                                                                               \
+		case CALC_OP_SUB:                                                                                              \
+			*res = a - b;                                                                                              \
+			return true;                                                                                               \
+		case CALC_OP_MUL:                                                                                              \
+			*res = a * b;                                                                                              \
+			return true;                                                                                               \
+		case CALC_OP_DIV:                                                                                              \
+			if (b == 0)                                                                                                \
+			{                                                                                                          \
+				return fail_operation(err_code, 3);                                                                    \
+			}                                                                                                          \
+			*res = a / b;                                                                                              \
+			return true;                                                                                               \
+		case CALC_OP_POW:                                                                                              \
+			*res = pow_fn(a, b);                                                                                       \
+			return true;                                                                                               \
+		default:                                                                                                       \
+			return fail_operation(err_code, 1);                                                                        \
+		}                                                                                                              \
+	}                                                                                                                  \
+                                                                                                                       \
+	bool float_unary_operation##suffix(calc_opcode op, type a, type* res, int* err_code)                               \
+	{                                                                                                                  \
+		switch (op)                                                                                                    \
+		{                                                                                                              \
+		case CALC_OP_POS:                                                                                              \
+			*res = +a;                                                                                                 \
+			return true;                                                                                               \
+		case CALC_OP_NEG:                                                                                              \
+			*res = -a;                                                                                                 \
+			return true;                                                                                               \
+		default:                                                                                                       \
+			return fail_operation(err_code, 1);                                                                        \
+		}                                                                                                              \
+	}                                                                                                                  \
+                                                                                                                       \
+	bool function_operation##suffix(calc_opcode op, type arg, type* res, int* err_code)                                \
+	{                                                                                                                  \
+		switch (op)                                                                                                    \
+		{                                                                                                              \
+		case CALC_OP_SQRT:                                                                                             \
+			if (arg < 0)                                                                                               \
+			{                                                                                                          \
+				return fail_operation(err_code, 3);                                                                    \
+			}                                                                                                          \
+			*res = sqrt_fn(arg);                                                                                       \
+			return true;                                                                                               \
+		case CALC_OP_LOG2:                                                                                             \
+			if (arg <= 0)                                                                                              \
+			{                                                                                                          \
+				return fail_operation(err_code, 3);                                                                    \
+			}                                                                                                          \
+			*res = log2_fn(arg);                                                                                       \
+			return true;                                                                                               \
+		case CALC_OP_SIN:                                                                                              \
+			*res = sin_fn(arg);                                                                                        \
+			return true;                                                                                               \
+		case CALC_OP_COS:                                                                                              \
+			*res = cos_fn(arg);                                                                                        \
+			return true;                                                                                               \
+		case CALC_OP_TAN:                                                                                              \
+			*res = tan_fn(arg);                                                                                        \
+			return true;                                                                                               \
+		default:                                                                                                       \
+			return fail_operation(err_code, 1);                                                                        \
+		}                                                                                                              \
+	}
+
+CALC_DEFINE_INTEGER_KERNELS(, int32_t, uint32_t, 32, INT32_MIN)
+CALC_DEFINE_INTEGER_KERNELS(_64, int64_t, uint64_t, 64, INT64_MIN)
+CALC_DEFINE_FLOAT_KERNELS(, float, powf, sqrtf, log2f, sinf, cosf, tanf)
+CALC_DEFINE_FLOAT_KERNELS(_64, double, pow, sqrt, log2, sin, cos, tan)
+
+bool binary_operators_operations(int32_t a, int32_t b, const char* op, int32_t* res, int* err_code)
+{
+	if (!op || !res)
+	{
+		return fail_operation(err_code, 5);
+	}
+	return integer_binary_operation(binary_opcode(op), a, b, res, err_code);
+}
+
+bool unary_operators_operations(int32_t a, const char* operation, int32_t* res, int* err_code)
+{
+	return integer_unary_operation(unary_opcode(operation), a, res, err_code);
+}
+
+bool binary_operators_operations_float(float a, float b, const char* op, float* res, int* err_code)
+{
+	if (!op || !res)
+	{
+		return fail_operation(err_code, 5);
+	}
+	return float_binary_operation(binary_opcode(op), a, b, res, err_code);
+}
+
+bool unary_operators_operations_float(float a, const char* operation, float* res, int* err_code)
+{
+	return float_unary_operation(unary_opcode(operation), a, res, err_code);
+}
+
+bool function_operations(const char* func_name, float arg, float* res, int* err_code)
+{
+	if (!func_name || !res)
+	{
+		return fail_operation(err_code, 5);
+	}
+	return function_operation(function_opcode(func_name), arg, res, err_code);
+}
+
+bool make_rpn_token(const char* text, token* result, int* err_code)
+{
+	uint32_t skip = 0;
+	if (is_digit_char(text[0]))
+	{
+		bool has_dot = false;
+		for (const char* p = text; *p; p++)
+		{
+			if (*p == '.')
+			{
+				if (has_dot)
+				{
+					return fail_operation(err_code, 2);
+				}
+				has_dot = true;
+			}
+			else if (!is_digit_char(*p))
+			{
+				return fail_operation(err_code, 1);
+			}
+		}
+		*result = make_token(has_dot ? TOKEN_FLOAT_NUMBER : TOKEN_NUMBER, text);
+	}
+	else if (strcmp(text, "u+") == 0 || strcmp(text, "u-") == 0)
+	{
+		*result = make_token(TOKEN_UNARY_OPERATOR, text + 1);
+	}
+	else if (strcmp(text, "~") == 0)
+	{
+		*result = make_token(TOKEN_UNARY_OPERATOR, text);
+	}
+	else if (binary_opcode(text) != CALC_OP_NONE)
+	{
+		*result = make_token(TOKEN_OPERATOR, text);
+	}
+	else if (branch_opcode(text, &skip) != CALC_OP_NONE)
+	{
+		*result = make_token(TOKEN_BRANCH, text);
+	}
+	else if (is_letter_char(text[0]))
+	{
+		for (const char* p = text; *p; p++)
+		{
+			if (!is_letter_char(*p) && !is_digit_char(*p))
+			{
+				return fail_operation(err_code, 1);
+			}
+		}
+		*result = make_token(is_valid_function(text) ? TOKEN_FUNCTION : TOKEN_VARIABLE, text);
+	}
+	else
+	{
+		return fail_operation(err_code, 1);
+	}
+	return result->value != NULL || fail_operation(err_code, 5);
+}
+
+queue shunting_yard_algorithm(queue input, int* err_code)
+{
+	token_stream tokens;
+	token_stream rpn;
+	if (!initialize_token_stream(&tokens, queue_size(&input)))
+	{
+		fail_operation(err_code, 5);
+		return make_empty_queue();
+	}
+	bool ok = queue_to_token_stream(&input, &tokens, err_code) && shunt_token_stream(&tokens, &rpn, err_code);
+	delete_token_stream(&tokens);
+	if (!ok)
+	{
+		return make_empty_queue();
+	}
+
+	queue output;
+	if (!initialize_queue(&output, rpn.length))
+	{
+		delete_token_stream(&rpn);
+		fail_operation(err_code, 5);
+		return make_empty_queue();
+	}
+	ok = token_stream_to_queue(&rpn, &output, err_code);
+	delete_token_stream(&rpn);
+	if (!ok)
+	{
+		delete_queue(&output);
+		return make_empty_queue();
+	}
+	return output;
+}
+
+/*
+ * Arbitrary-precision integers for the token evaluator. Magnitudes are little-endian base 10^9 limbs, so
+ * decimal text converts in linear time; bitwise operators go through a two's complement base 2^32 copy.
+ * Up to BIGNUM_INLINE_LIMBS limbs live inside the struct.
+ */
+#define BIGNUM_BASE 1000000000u
+#define BIGNUM_DIGITS 9
+#define BIGNUM_INLINE_LIMBS 4
+#define BIGNUM_KARATSUBA_THRESHOLD 40
+#define BIGNUM_BURNIKEL_THRESHOLD 80
+#define BIGNUM_MAX_BITS ((uint64_t)1 << 26)
+
+typedef struct
+{
+	uint32_t* heap;
+	uint32_t inline_limbs[BIGNUM_INLINE_LIMBS];
+	size_t length;
+	size_t capacity;
+	bool negative;
+} bignum;
+
+static void bignum_init(bignum* b)
+{
+	b->heap = NULL;
+	b->length = 0;
+	b->capacity = BIGNUM_INLINE_LIMBS;
+	b->negative = false;
+}
+
+static void bignum_free(bignum* b)
+{
+	calc_free(b->heap);
+	bignum_init(b);
+}
+
+static uint32_t* bignum_limbs(bignum* b)
+{
+	return b->heap ? b->heap : b->inline_limbs;
+}
+
+static const uint32_t* bignum_const_limbs(const bignum* b)
+{
+	return b->heap ? b->heap : b->inline_limbs;
+}
+
+static bool bignum_reserve(bignum* b, size_t capacity)
+{
+	if (capacity <= b->capacity)
+	{
+		return true;
+	}
+	uint32_t* heap = calc_malloc(capacity * sizeof(uint32_t));
+	if (!heap)
+	{
+		return false;
+	}
+	memcpy(heap, bignum_limbs(b), b->length * sizeof(uint32_t));
+	calc_free(b->heap);
+	b->heap = heap;
+	b->capacity = capacity;
+	return true;
+}
+
+static size_t mag_trim(const uint32_t* a, size_t n)
+{
+	while (n && a[n - 1] == 0)
+	{
+		n--;
+	}
+	return n;
+}
+
+static void bignum_trim(bignum* b)
+{
+	b->length = mag_trim(bignum_limbs(b), b->length);
+	if (!b->length)
+	{
+		b->negative = false;
+	}
+}
+
+static bool bignum_set_uint64(bignum* b, uint64_t value)
+{
+	b->length = 0;
+	b->negative = false;
+	uint32_t* limbs = bignum_limbs(b);
+	while (value)
+	{
+		limbs[b->length++] = (uint32_t)(value % BIGNUM_BASE);
+		value /= BIGNUM_BASE;
+	}
+	return true;
+}
+
+static bool bignum_parse(const char* text, bignum* b, int* err_code)
+{
+	bool negative = *text == '-';
+	const char* digits = text + negative;
+	size_t n = strlen(digits);
+	if (n == 0)
+	{
+		return fail_operation(err_code, 1);
+	}
+	for (size_t i = 0; i < n; i++)
+	{
+		if (!is_digit_char(digits[i]))
+		{
+			return fail_operation(err_code, 1);
+		}
+	}
+	if (!bignum_reserve(b, (n + BIGNUM_DIGITS - 1) / BIGNUM_DIGITS))
+	{
+		return fail_operation(err_code, 5);
+	}
+	uint32_t* limbs = bignum_limbs(b);
+	b->length = 0;
+	for (size_t end = n; end > 0;)
+	{
+		size_t start = end > BIGNUM_DIGITS ? end - BIGNUM_DIGITS : 0;
+		uint32_t limb = 0;
+		for (size_t i = start; i < end; i++)
+		{
+			limb = limb * 10 + (uint32_t)(digits[i] - '0');
+		}
+		limbs[b->length++] = limb;
+		end = start;
+	}
+	b->negative = negative;
+	bignum_trim(b);
+	return true;
+}
+
+static char* bignum_format(const bignum* b)
+{
+	const uint32_t* limbs = bignum_const_limbs(b);
+	char* text = calc_malloc(b->length * BIGNUM_DIGITS + 3);
+	if (!text)
+	{
+		return NULL;
+	}
+	if (!b->length)
+	{
+		strcpy(text, "0");
+		return text;
+	}
+	char* p = text;
+	if (b->negative)
+	{
+		*p++ = '-';
+	}
+	p += sprintf(p, "%" PRIu32, limbs[b->length - 1]);
+	for (size_t i = b->length - 1; i-- > 0;)
+	{
+		p += sprintf(p, "%09" PRIu32, limbs[i]);
+	}
+	return text;
+}
+
+static int mag_compare(const uint32_t* a, size_t an, const uint32_t* b, size_t bn)
+{
+	an = mag_trim(a, an);
+	bn = mag_trim(b, bn);
+	if (an != bn)
+	{
+		return an < bn ? -1 : 1;
+	}
+	for (size_t i = an; i-- > 0;)
+	{
+		if (a[i] != b[i])
+		{
+			return a[i] < b[i] ? -1 : 1;
+		}
+	}
+	return 0;
+}
+
+/* r = a + b for any an, bn; r holds max(an, bn) + 1 limbs and may alias a. Returns the limbs written. */
+static size_t mag_add(uint32_t* r, const uint32_t* a, size_t an, const uint32_t* b, size_t bn)
+{
+	size_t n = an > bn ? an : bn;
+	uint32_t carry = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		uint32_t sum = (i < an ? a[i] : 0) + (i < bn ? b[i] : 0) + carry;
+		carry = sum >= BIGNUM_BASE;
+		r[i] = carry ? sum - BIGNUM_BASE : sum;
+	}
+	r[n] = carry;
+	return n + 1;
+}
+
+/* r = a - b with a >= b; r holds an limbs and may alias a. */
+static void mag_sub(uint32_t* r, const uint32_t* a, size_t an, const uint32_t* b, size_t bn)
+{
+	uint32_t borrow = 0;
+	for (size_t i = 0; i < an; i++)
+	{
+		uint32_t sub = (i < bn ? b[i] : 0) + borrow;
+		borrow = a[i] < sub;
+		r[i] = borrow ? a[i] + BIGNUM_BASE - sub : a[i] - sub;
+	}
+}
+
+/* Adds a into r starting at limb 0, propagating the carry within rn limbs. */
+static void mag_add_into(uint32_t* r, size_t rn, const uint32_t* a, size_t an)
+{
+	uint32_t carry = 0;
+	size_t i = 0;
+	for (; i < an; i++)
+	{
+		uint32_t sum = r[i] + a[i] + carry;
+		carry = sum >= BIGNUM_BASE;
+		r[i] = carry ? sum - BIGNUM_BASE : sum;
+	}
+	for (; carry && i < rn; i++)
+	{
+		uint32_t sum = r[i] + carry;
+		carry = sum >= BIGNUM_BASE;
+		r[i] = carry ? sum - BIGNUM_BASE : sum;
+	}
+}
+
+static void mag_mul_schoolbook(uint32_t* r, const uint32_t* a, size_t an, const uint32_t* b, size_t bn)
+{
+	memset(r, 0, (an + bn) * sizeof(uint32_t));
+	for (size_t i = 0; i < an; i++)
+	{
+		uint64_t carry = 0;
+		uint64_t ai = a[i];
+		if (!ai)
+		{
+			continue;
+		}
+		for (size_t j = 0; j < bn; j++)
+		{
+			uint64_t t = r[i + j] + ai * b[j] + carry;
+			r[i + j] = (uint32_t)(t % BIGNUM_BASE);
+			carry = t / BIGNUM_BASE;
+		}
+		r[i + bn] = (uint32_t)carry;
+	}
+}
+
+static void mag_square_schoolbook(uint32_t* r, const uint32_t* a, size_t an)
+{
+	memset(r, 0, 2 * an * sizeof(uint32_t));
+	for (size_t i = 0; i < an; i++)
+	{
+		uint64_t carry = 0;
+		uint64_t ai = a[i];
+		for (size_t j = i + 1; j < an; j++)
+		{
+			uint64_t t = r[i + j] + ai * a[j] + carry;
+			r[i + j] = (uint32_t)(t % BIGNUM_BASE);
+			carry = t / BIGNUM_BASE;
+		}
+		r[i + an] = (uint32_t)carry;
+	}
+	uint32_t carry = 0;
+	for (size_t i = 0; i < 2 * an; i++)
+	{
+		uint32_t doubled = r[i] * 2 + carry;
+		carry = doubled >= BIGNUM_BASE;
+		r[i] = carry ? doubled - BIGNUM_BASE : doubled;
+	}
+	uint64_t diagonal = 0;
+	for (size_t i = 0; i < an; i++)
+	{
+		uint64_t t = r[2 * i] + (uint64_t)a[i] * a[i] + diagonal;
+		r[2 * i] = (uint32_t)(t % BIGNUM_BASE);
+		t = r[2 * i + 1] + t / BIGNUM_BASE;
+		r[2 * i + 1] = (uint32_t)(t % BIGNUM_BASE);
+		diagonal = t / BIGNUM_BASE;
+	}
+}
+
+/*
+ * r = a * b into an + bn limbs. Karatsuba above the threshold; a == b takes the squaring route, whose
+ * recursive products are squares as well.
+ */
+static bool mag_mul(uint32_t* r, const uint32_t* a, size_t an, const uint32_t* b, size_t bn)
+{
+	if (an < bn)
+	{
+		const uint32_t* t = a;
+		a = b;
+		b = t;
+		size_t tn = an;
+		an = bn;
+		bn = tn;
+	}
+	bool square = a == b && an == bn;
+	if (bn < BIGNUM_KARATSUBA_THRESHOLD)
+	{
+		if (square)
+		{
+			mag_square_schoolbook(r, a, an);
+		}
+		else
+		{
+			mag_mul_schoolbook(r, a, an, b, bn);
+		}
+		return true;
+	}
+
+	if (2 * bn <= an)
+	{
+		uint32_t* part = calc_malloc(2 * bn * sizeof(uint32_t));
+		if (!part)
+		{
+			return false;
+		}
+		memset(r, 0, (an + bn) * sizeof(uint32_t));
+		for (size_t offset = 0; offset < an; offset += bn)
+		{
+			size_t length = an - offset < bn ? an - offset : bn;
+			if (!mag_mul(part, a + offset, length, b, bn))
+			{
+				calc_free(part);
+				return false;
+			}
+			mag_add_into(r + offset, an + bn - offset, part, length + bn);
+		}
+		calc_free(part);
+		return true;
+	}
+
+	size_t m = an / 2;
+	size_t hn = an - m + 1;
+	size_t gn = (bn > m ? (bn - m > m ? bn - m : m) : m) + 1;
+	uint32_t* scratch = calc_malloc((hn + gn + hn + gn) * sizeof(uint32_t));
+	if (!scratch)
+	{
+		return false;
+	}
+	uint32_t* sa = scratch;
+	uint32_t* sb = sa + hn;
+	uint32_t* z1 = sb + gn;
+
+	if (!mag_mul(r, a, m, b, m) || !mag_mul(r + 2 * m, a + m, an - m, b + m, bn - m))
+	{
+		calc_free(scratch);
+		return false;
+	}
+	size_t sa_length = mag_add(sa, a, m, a + m, an - m);
+	size_t sb_length = square ? sa_length : mag_add(sb, b, m, b + m, bn - m);
+	if (!mag_mul(z1, sa, sa_length, square ? sa : sb, sb_length))
+	{
+		calc_free(scratch);
+		return false;
+	}
+	size_t z1_length = sa_length + sb_length;
+	mag_sub(z1, z1, z1_length, r, 2 * m);
+	mag_sub(z1, z1, z1_length, r + 2 * m, an + bn - 2 * m);
+	mag_add_into(r + m, an + bn - m, z1, mag_trim(z1, z1_length));
+	calc_free(scratch);
+	return true;
+}
+
+static uint32_t mag_divide_small(uint32_t* q, const uint32_t* a, size_t an, uint32_t d)
+{
+	uint64_t rem = 0;
+	for (size_t i = an; i-- > 0;)
+	{
+		uint64_t cur = rem * BIGNUM_BASE + a[i];
+		q[i] = (uint32_t)(cur / d);
+		rem = cur % d;
+	}
+	return (uint32_t)rem;
+}
+
+static void mag_multiply_small(uint32_t* r, const uint32_t* a, size_t an, uint32_t m)
+{
+	uint64_t carry = 0;
+	for (size_t i = 0; i < an; i++)
+	{
+		uint64_t t = (uint64_t)a[i] * m + carry;
+		r[i] = (uint32_t)(t % BIGNUM_BASE);
+		carry = t / BIGNUM_BASE;
+	}
+	r[an] = (uint32_t)carry;
+}
+
+/* q = a / b and rem = a % b on magnitudes (Knuth algorithm D); q holds an - bn + 1 limbs, rem holds bn. */
+static bool mag_divide(uint32_t* q, uint32_t* rem, const uint32_t* a, size_t an, const uint32_t* b, size_t bn)
+{
+	if (bn == 1)
+	{
+		rem[0] = mag_divide_small(q, a, an, b[0]);
+		return true;
+	}
+	uint32_t* u = calc_malloc((an + bn + 2) * sizeof(uint32_t));
+	if (!u)
+	{
+		return false;
+	}
+	uint32_t* v = u + an + 1;
+	uint32_t d = BIGNUM_BASE / (b[bn - 1] + 1);
+	mag_multiply_small(u, a, an, d);
+	mag_multiply_small(v, b, bn, d);
+
+	for (size_t j = an - bn + 1; j-- > 0;)
+	{
+		uint64_t numerator = (uint64_t)u[j + bn] * BIGNUM_BASE + u[j + bn - 1];
+		uint64_t qhat = numerator / v[bn - 1];
+		uint64_t rhat = numerator % v[bn - 1];
+		while (qhat >= BIGNUM_BASE || qhat * v[bn - 2] > rhat * BIGNUM_BASE + u[j + bn - 2])
+		{
+			qhat--;
+			rhat += v[bn - 1];
+			if (rhat >= BIGNUM_BASE)
+			{
+				break;
+			}
+		}
+
+		int64_t borrow = 0;
+		uint64_t carry = 0;
+		for (size_t i = 0; i < bn; i++)
+		{
+			uint64_t p = qhat * v[i] + carry;
+			carry = p / BIGNUM_BASE;
+			int64_t t = (int64_t)u[i + j] - (int64_t)(p % BIGNUM_BASE) - borrow;
+			borrow = t < 0;
+			u[i + j] = (uint32_t)(t < 0 ? t + BIGNUM_BASE : t);
+		}
+		int64_t t = (int64_t)u[j + bn] - (int64_t)carry - borrow;
+		if (t < 0)
+		{
+			u[j + bn] = (uint32_t)(t + BIGNUM_BASE);
+			qhat--;
+			uint32_t add_carry = 0;
+			for (size_t i = 0; i < bn; i++)
+			{
+				uint32_t sum = u[i + j] + v[i] + add_carry;
+				add_carry = sum >= BIGNUM_BASE;
+				u[i + j] = add_carry ? sum - BIGNUM_BASE : sum;
+			}
+			u[j + bn] = (u[j + bn] + add_carry) % BIGNUM_BASE;
+		}
+		else
+		{
+			u[j + bn] = (uint32_t)t;
+		}
+		q[j] = (uint32_t)qhat;
+	}
+	mag_divide_small(rem, u, bn, d);
+	calc_free(u);
+	return true;
+}
+
+/* The bignum operations below write into a result the caller has initialised and owns either way. */
+static bool bignum_add(bignum* r, const bignum* a, const bignum* b, bool subtract)
+{
+	bool b_negative = b->negative != subtract;
+	if (!bignum_reserve(r, (a->length > b->length ? a->length : b->length) + 1))
+	{
+		return false;
+	}
+	const uint32_t* x = bignum_const_limbs(a);
+	const uint32_t* y = bignum_const_limbs(b);
+	if (a->negative == b_negative)
+	{
+		r->length = mag_add(bignum_limbs(r), x, a->length, y, b->length);
+		r->negative = a->negative;
+	}
+	else if (mag_compare(x, a->length, y, b->length) >= 0)
+	{
+		mag_sub(bignum_limbs(r), x, a->length, y, b->length);
+		r->length = a->length;
+		r->negative = a->negative;
+	}
+	else
+	{
+		mag_sub(bignum_limbs(r), y, b->length, x, a->length);
+		r->length = b->length;
+		r->negative = b_negative;
+	}
+	bignum_trim(r);
+	return true;
+}
+
+static bool bignum_add_small(bignum* r, const bignum* a, int64_t value)
+{
+	bignum b;
+	bignum_init(&b);
+	bignum_set_uint64(&b, value < 0 ? -(uint64_t)value : (uint64_t)value);
+	b.negative = value < 0;
+	return bignum_add(r, a, &b, false);
+}
+
+static bool bignum_multiply(bignum* r, const bignum* a, const bignum* b)
+{
+	if (!a->length || !b->length)
+	{
+		return bignum_set_uint64(r, 0);
+	}
+	if (!bignum_reserve(r, a->length + b->length) ||
+		!mag_mul(bignum_limbs(r), bignum_const_limbs(a), a->length, bignum_const_limbs(b), b->length))
+	{
+		return false;
+	}
+	r->length = a->length + b->length;
+	r->negative = a->negative != b->negative;
+	bignum_trim(r);
+	return true;
+}
+
+static bool bignum_divide_schoolbook(bignum* q, bignum* rem, const bignum* a, const bignum* b)
+{
+	const uint32_t* x = bignum_const_limbs(a);
+	const uint32_t* y = bignum_const_limbs(b);
+	if (mag_compare(x, a->length, y, b->length) < 0)
+	{
+		if (!bignum_reserve(rem, a->length))
+		{
+			return false;
+		}
+		memcpy(bignum_limbs(rem), x, a->length * sizeof(uint32_t));
+		rem->length = a->length;
+		rem->negative = a->negative;
+		return bignum_set_uint64(q, 0);
+	}
+	if (!bignum_reserve(q, a->length - b->length + 1) || !bignum_reserve(rem, b->length) ||
+		!mag_divide(bignum_limbs(q), bignum_limbs(rem), x, a->length, y, b->length))
+	{
+		return false;
+	}
+	q->length = a->length - b->length + 1;
+	q->negative = a->negative != b->negative;
+	rem->length = b->length;
+	rem->negative = a->negative;
+	bignum_trim(q);
+	bignum_trim(rem);
+	return true;
+}
+
+/* r = limbs [from, to) of |a|. */
+static bool bignum_slice(bignum* r, const bignum* a, size_t from, size_t to)
+{
+	to = to < a->length ? to : a->length;
+	from = from < to ? from : to;
+	if (!bignum_reserve(r, to - from))
+	{
+		return false;
+	}
+	memcpy(bignum_limbs(r), bignum_const_limbs(a) + from, (to - from) * sizeof(uint32_t));
+	r->length = to - from;
+	r->negative = false;
+	bignum_trim(r);
+	return true;
+}
+
+/* r = a * BASE^k + low for non-negative a and low < BASE^k. */
+static bool bignum_join(bignum* r, const bignum* a, size_t k, const bignum* low)
+{
+	size_t length = a->length ? a->length + k : low->length;
+	if (!bignum_reserve(r, length))
+	{
+		return false;
+	}
+	uint32_t* limbs = bignum_limbs(r);
+	memset(limbs, 0, length * sizeof(uint32_t));
+	memcpy(limbs, bignum_const_limbs(low), low->length * sizeof(uint32_t));
+	if (a->length)
+	{
+		memcpy(limbs + k, bignum_const_limbs(a), a->length * sizeof(uint32_t));
+	}
+	r->length = length;
+	r->negative = false;
+	bignum_trim(r);
+	return true;
+}
+
+static bool bignum_divide_2n1n(bignum* q, bignum* r, const bignum* a, const bignum* b, size_t n);
+
+/* Burnikel-Ziegler step: divides [a12, a3] (3n limbs) by b = [b1, b2] (2n limbs, normalised), a12 < b * BASE^n. */
+static bool bignum_divide_3n2n(bignum* q, bignum* r, const bignum* a12, const bignum* a3, const bignum* b,
+							   const bignum* b1, const bignum* b2, size_t n)
+{
+	bignum top, rest, joined, product, t;
+	bignum_init(&top);
+	bignum_init(&rest);
+	bignum_init(&joined);
+	bignum_init(&product);
+	bignum_init(&t);
+	bool ok = bignum_slice(&top, a12, n, SIZE_MAX);
+	if (ok && mag_compare(bignum_const_limbs(&top), top.length, bignum_const_limbs(b1), b1->length) == 0)
+	{
+		/* The quotient digit saturates at BASE^n - 1 and the remainder is a12 - b1 * BASE^n + b1. */
+		ok = bignum_reserve(q, n) && bignum_slice(&rest, a12, 0, n) && bignum_add(&t, &rest, b1, false);
+		if (ok)
+		{
+			for (size_t i = 0; i < n; i++)
+			{
+				bignum_limbs(q)[i] = BIGNUM_BASE - 1;
+			}
+			q->length = n;
+			q->negative = false;
+		}
+	}
+	else
+	{
+		ok = ok && bignum_divide_2n1n(q, &t, a12, b1, n);
+	}
+	ok = ok && bignum_join(&joined, &t, n, a3) && bignum_multiply(&product, q, b2);
+	bignum_free(&t);
+	bignum_init(&t);
+	ok = ok && bignum_add(r, &joined, &product, true);
+	while (ok && r->negative)
+	{
+		ok = bignum_add_small(&t, q, -1);
+		bignum_free(q);
+		*q = t;
+		bignum_init(&t);
+		ok = ok && bignum_add(&t, r, b, false);
+		bignum_free(r);
+		*r = t;
+		bignum_init(&t);
+	}
+	bignum_free(&top);
+	bignum_free(&rest);
+	bignum_free(&joined);
+	bignum_free(&product);
+	return ok;
+}
+
+/* Divides a < b * BASE^n by the normalised n-limb b, splitting into two 3n/2n steps of half size. */
+static bool bignum_divide_2n1n(bignum* q, bignum* r, const bignum* a, const bignum* b, size_t n)
+{
+	if (n <= BIGNUM_BURNIKEL_THRESHOLD)
+	{
+		return bignum_divide_schoolbook(q, r, a, b);
+	}
+	bignum none, padded_a, padded_b, padded_r;
+	bignum_init(&none);
+	if (n & 1)
+	{
+		bignum_init(&padded_a);
+		bignum_init(&padded_b);
+		bignum_init(&padded_r);
+		bool ok = bignum_join(&padded_a, a, 1, &none) && bignum_join(&padded_b, b, 1, &none) &&
+				  bignum_divide_2n1n(q, &padded_r, &padded_a, &padded_b, n + 1) && bignum_slice(r, &padded_r, 1, SIZE_MAX);
+		bignum_free(&padded_a);
+		bignum_free(&padded_b);
+		bignum_free(&padded_r);
+		return ok;
+	}
+
+	size_t half = n / 2;
+	bignum part[8];
+	for (size_t i = 0; i < 8; i++)
+	{
+		bignum_init(&part[i]);
+	}
+	bignum* b1 = &part[0];
+	bignum* b2 = &part[1];
+	bignum* a12 = &part[2];
+	bignum* a3 = &part[3];
+	bignum* a4 = &part[4];
+	bignum* q1 = &part[5];
+	bignum* r1 = &part[6];
+	bignum* q2 = &part[7];
+	bool ok = bignum_slice(b1, b, half, SIZE_MAX) && bignum_slice(b2, b, 0, half) &&
+			  bignum_slice(a12, a, n, SIZE_MAX) && bignum_slice(a3, a, half, n) && bignum_slice(a4, a, 0, half) &&
+			  bignum_divide_3n2n(q1, r1, a12, a3, b, b1, b2, half) &&
+			  bignum_divide_3n2n(q2, r, r1, a4, b, b1, b2, half) && bignum_join(q, q1, half, q2);
+	for (size_t i = 0; i < 8; i++)
+	{
+		bignum_free(&part[i]);
+	}
+	return ok;
+}
+
+/* Long division by n-limb digits of the dividend, each step a recursive 2n/n division. */
+static bool bignum_divide_recursive(bignum* q, bignum* rem, const bignum* a, const bignum* b)
+{
+	size_t n = b->length;
+	uint32_t d = BIGNUM_BASE / (bignum_const_limbs(b)[n - 1] + 1);
+	bignum x, y, chunk, joined, digit;
+	bignum_init(&x);
+	bignum_init(&y);
+	bignum_init(&chunk);
+	bignum_init(&joined);
+	bignum_init(&digit);
+	bool ok = bignum_reserve(&x, a->length + 1) && bignum_reserve(&y, n + 1);
+	if (ok)
+	{
+		mag_multiply_small(bignum_limbs(&x), bignum_const_limbs(a), a->length, d);
+		mag_multiply_small(bignum_limbs(&y), bignum_const_limbs(b), n, d);
+		x.length = a->length + 1;
+		y.length = n + 1;
+		bignum_trim(&x);
+		bignum_trim(&y);
+	}
+
+	size_t chunks = (a->length + 1 + n - 1) / n;
+	ok = ok && bignum_reserve(q, chunks * n);
+	if (ok)
+	{
+		memset(bignum_limbs(q), 0, chunks * n * sizeof(uint32_t));
+		q->length = chunks * n;
+		bignum_set_uint64(rem, 0);
+	}
+	for (size_t i = chunks; ok && i-- > 0;)
+	{
+		ok = bignum_slice(&chunk, &x, i * n, (i + 1) * n) && bignum_join(&joined, rem, n, &chunk);
+		bignum_free(rem);
+		bignum_free(&digit);
+		ok = ok && bignum_divide_2n1n(&digit, rem, &joined, &y, n);
+		if (ok)
+		{
+			memcpy(bignum_limbs(q) + i * n, bignum_const_limbs(&digit), digit.length * sizeof(uint32_t));
+		}
+	}
+	if (ok)
+	{
+		mag_divide_small(bignum_limbs(rem), bignum_const_limbs(rem), rem->length, d);
+		q->negative = a->negative != b->negative;
+		rem->negative = a->negative;
+		bignum_trim(q);
+		bignum_trim(rem);
+	}
+	bignum_free(&x);
+	bignum_free(&y);
+	bignum_free(&chunk);
+	bignum_free(&joined);
+	bignum_free(&digit);
+	return ok;
+}
+
+/* Truncating division as in C: the quotient rounds toward zero and the remainder takes the dividend's sign. */
+static bool bignum_divide(bignum* q, bignum* rem, const bignum* a, const bignum* b)
+{
+	if (b->length > BIGNUM_BURNIKEL_THRESHOLD && a->length > b->length + BIGNUM_BURNIKEL_THRESHOLD)
+	{
+		return bignum_divide_recursive(q, rem, a, b);
+	}
+	return bignum_divide_schoolbook(q, rem, a, b);
+}
+
+static uint64_t bignum_bits(const bignum* a)
+{
+	const uint32_t* limbs = bignum_const_limbs(a);
+	return a->length ? (uint64_t)(a->length - 1) * 30 + (uint64_t)(32 - __builtin_clz(limbs[a->length - 1])) : 0;
+}
+
+/*
+ * Multiplications and divisions are charged one cost unit per pair of limbs they combine, before the work is
+ * done, so that a cost limit stops an oversized computation at its first expensive step.
+ */
+static bool charge_limb_products(size_t an, size_t bn, int* err_code)
+{
+	return charge_cost((uint64_t)an * (uint64_t)bn, err_code);
+}
+
+static bool charge_division(const bignum* a, const bignum* b, int* err_code)
+{
+	return charge_limb_products(a->length >= b->length ? a->length - b->length + 1 : 1, b->length, err_code);
+}
+
+/* Left-to-right binary exponentiation: one squaring per exponent bit and one multiply per set bit. */
+static bool bignum_power(bignum* r, const bignum* a, uint64_t e, int* err_code)
+{
+	bignum_set_uint64(r, 1);
+	if (!e)
+	{
+		return true;
+	}
+	if (bignum_bits(a) > 1 && e > BIGNUM_MAX_BITS / (bignum_bits(a) - 1))
+	{
+		return fail_operation(err_code, 3);
+	}
+	for (int bit = 63 - __builtin_clzll(e); bit >= 0; bit--)
+	{
+		if (!charge_limb_products(r->length, r->length, err_code) ||
+			(((e >> bit) & 1) && !charge_limb_products(2 * r->length, a->length, err_code)))
+		{
+			return false;
+		}
+		bignum t;
+		bignum_init(&t);
+		bool ok = bignum_multiply(&t, r, r);
+		bignum_free(r);
+		*r = t;
+		if (ok && ((e >> bit) & 1))
+		{
+			bignum_init(&t);
+			ok = bignum_multiply(&t, r, a);
+			bignum_free(r);
+			*r = t;
+		}
+		if (!ok)
+		{
+			return fail_operation(err_code, 5);
+		}
+	}
+	return true;
+}
+
+/* Two's complement image of a in base 2^32 words, sign-extended to width words. */
+static void bignum_to_binary(const bignum* a, uint32_t* words, size_t width)
+{
+	memset(words, 0, width * sizeof(uint32_t));
+	const uint32_t* limbs = bignum_const_limbs(a);
+	for (size_t i = a->length; i-- > 0;)
+	{
+		uint64_t carry = limbs[i];
+		for (size_t w = 0; w < width; w++)
+		{
+			uint64_t t = (uint64_t)words[w] * BIGNUM_BASE + carry;
+			words[w] = (uint32_t)t;
+			carry = t >> 32;
+		}
+	}
+	if (a->negative)
+	{
+		uint64_t carry = 1;
+		for (size_t w = 0; w < width; w++)
+		{
+			uint64_t t = (uint64_t)(uint32_t)~words[w] + carry;
+			words[w] = (uint32_t)t;
+			carry = t >> 32;
+		}
+	}
+}
+
+static bool bignum_from_binary(bignum* r, uint32_t* words, size_t width)
+{
+	bool negative = words[width - 1] >> 31;
+	if (negative)
+	{
+		uint64_t carry = 1;
+		for (size_t w = 0; w < width; w++)
+		{
+			uint64_t t = (uint64_t)(uint32_t)~words[w] + carry;
+			words[w] = (uint32_t)t;
+			carry = t >> 32;
+		}
+	}
+	size_t limbs = width * 32 / 29 + 2;
+	if (!bignum_reserve(r, limbs))
+	{
+		return false;
+	}
+	uint32_t* out = bignum_limbs(r);
+	memset(out, 0, limbs * sizeof(uint32_t));
+	for (size_t w = width; w-- > 0;)
+	{
+		uint64_t carry = words[w];
+		for (size_t i = 0; i < limbs; i++)
+		{
+			uint64_t t = ((uint64_t)out[i] << 32) + carry;
+			out[i] = (uint32_t)(t % BIGNUM_BASE);
+			carry = t / BIGNUM_BASE;
+		}
+	}
+	r->length = limbs;
+	r->negative = negative;
+	bignum_trim(r);
+	return true;
+}
+
+static bool bignum_bitwise(bignum* r, const bignum* a, const bignum* b, calc_opcode op)
+{
+	size_t width = ((a->length > b->length ? a->length : b->length) * 30 + 31) / 32 + 1;
+	uint32_t* x = calc_malloc(2 * width * sizeof(uint32_t));
+	if (!x)
+	{
+		return false;
+	}
+	uint32_t* y = x + width;
+	bignum_to_binary(a, x, width);
+	bignum_to_binary(b, y, width);
+	for (size_t w = 0; w < width; w++)
+	{
+		x[w] = op == CALC_OP_AND ? x[w] & y[w] : op == CALC_OP_OR ? x[w] | y[w] : x[w] ^ y[w];
+	}
+	bool ok = bignum_from_binary(r, x, width);
+	calc_free(x);
+	return ok;
+}
+
+/* Exponents and shift counts: non-negative values that fit in 64 bits. */
+static bool bignum_to_count(const bignum* a, uint64_t* value)
+{
+	if (a->negative || a->length > 3)
+	{
+		return false;
+	}
+	const uint32_t* limbs = bignum_const_limbs(a);
+	unsigned __int128 v = 0;
+	for (size_t i = a->length; i-- > 0;)
+	{
+		v = v * BIGNUM_BASE + limbs[i];
+	}
+	*value = (uint64_t)v;
+	return v <= UINT64_MAX;
+}
+
+static bool bignum_shift(calc_opcode op, const bignum* a, uint64_t n, bignum* r, int* err_code)
+{
+	if (op == CALC_OP_SHR && n >= bignum_bits(a))
+	{
+		bignum_set_uint64(r, a->negative ? 1 : 0);
+		r->negative = a->negative;
+		return true;
+	}
+	if (op == CALC_OP_SHL && !a->length)
+	{
+		return bignum_set_uint64(r, 0);
+	}
+	if (op == CALC_OP_SHL && (n > BIGNUM_MAX_BITS || bignum_bits(a) + n > BIGNUM_MAX_BITS))
+	{
+		return fail_operation(err_code, 3);
+	}
+	bignum two, scale, rem, q;
+	bignum_init(&two);
+	bignum_init(&scale);
+	bignum_init(&rem);
+	bignum_init(&q);
+	bignum_set_uint64(&two, 2);
+	bool ok = bignum_power(&scale, &two, n, err_code);
+	if (ok && op == CALC_OP_SHL)
+	{
+		ok = charge_limb_products(a->length, scale.length, err_code) &&
+			 (bignum_multiply(r, a, &scale) || fail_operation(err_code, 5));
+	}
+	else if (ok)
+	{
+		ok = charge_division(a, &scale, err_code) &&
+			 ((bignum_divide(&q, &rem, a, &scale) &&
+			   bignum_add_small(r, &q, rem.length && a->negative ? -1 : 0)) ||
+			  fail_operation(err_code, 5));
+	}
+	bignum_free(&scale);
+	bignum_free(&rem);
+	bignum_free(&q);
+	return ok;
+}
+
+static bool bignum_binary_operation(calc_opcode op, const bignum* a, const bignum* b, bignum* r, int* err_code)
+{
+	uint64_t n = 0;
+	bool ok;
+	switch (op)
+	{
+	case CALC_OP_ADD:
+	case CALC_OP_SUB:
+		ok = bignum_add(r, a, b, op == CALC_OP_SUB);
+		break;
+	case CALC_OP_MUL:
+		if (bignum_bits(a) + bignum_bits(b) > BIGNUM_MAX_BITS + 60)
+		{
+			return fail_operation(err_code, 3);
+		}
+		if (!charge_limb_products(a->length, b->length, err_code))
+		{
+			return false;
+		}
+		ok = bignum_multiply(r, a, b);
+		break;
+	case CALC_OP_DIV:
+	case CALC_OP_MOD:
+	{
+		if (!b->length)
+		{
+			return fail_operation(err_code, 3);
+		}
+		if (!charge_division(a, b, err_code))
+		{
+			return false;
+		}
+		bignum other;
+		bignum_init(&other);
+		ok = op == CALC_OP_DIV ? bignum_divide(r, &other, a, b) : bignum_divide(&other, r, a, b);
+		bignum_free(&other);
+		break;
+	}
+	case CALC_OP_POW:
+		if (!bignum_to_count(b, &n))
+		{
+			return fail_operation(err_code, 3);
+		}
+		return (!n || charge_cost((uint64_t)(64 - __builtin_clzll(n)), err_code)) && bignum_power(r, a, n, err_code);
+	case CALC_OP_SHL:
+	case CALC_OP_SHR:
+		if (!bignum_to_count(b, &n))
+		{
+			return fail_operation(err_code, 3);
+		}
+		return bignum_shift(op, a, n, r, err_code);
+	case CALC_OP_AND:
+	case CALC_OP_OR:
+	case CALC_OP_XOR:
+		ok = bignum_bitwise(r, a, b, op);
+		break;
+	default:
+		return fail_operation(err_code, 1);
+	}
+	return ok || fail_operation(err_code, 5);
+}
+
+static bool bignum_unary_operation(calc_opcode op, const bignum* a, bignum* r, int* err_code)
+{
+	bignum negated;
+	bignum_init(&negated);
+	bool ok;
+	switch (op)
+	{
+	case CALC_OP_POS:
+		ok = bignum_add_small(r, a, 0);
+		break;
+	case CALC_OP_NEG:
+		ok = bignum_add_small(&negated, a, 0);
+		negated.negative = negated.length && !negated.negative;
+		*r = negated;
+		return ok || fail_operation(err_code, 5);
+	case CALC_OP_NOT:
+		ok = bignum_add_small(&negated, a, 1);
+		negated.negative = negated.length && !negated.negative;
+		*r = negated;
+		return ok || fail_operation(err_code, 5);
+	default:
+		return fail_operation(err_code, 1);
+	}
+	return ok || fail_operation(err_code, 5);
+}
+
+/* Operands of at most 18 digits are evaluated in int64_t; false hands overflow and error cases to the bignum path. */
+static bool small_integer_text(const char* text, int64_t* value)
+{
+	if (strlen(text + (*text == '-')) > 18)
+	{
+		return false;
+	}
+	*value = strtoll(text, NULL, 10);
+	return true;
+}
+
+static bool small_integer_binary(calc_opcode op, int64_t a, int64_t b, int64_t* r)
+{
+	switch (op)
+	{
+	case CALC_OP_ADD:
+		return !__builtin_add_overflow(a, b, r);
+	case CALC_OP_SUB:
+		return !__builtin_sub_overflow(a, b, r);
+	case CALC_OP_MUL:
+		return !__builtin_mul_overflow(a, b, r);
+	case CALC_OP_DIV:
+		*r = b ? a / b : 0;
+		return b != 0;
+	case CALC_OP_MOD:
+		*r = b ? a % b : 0;
+		return b != 0;
+	case CALC_OP_POW:
+		*r = 1;
+		for (int64_t base = a; b > 0; b >>= 1)
+		{
+			if (((b & 1) && __builtin_mul_overflow(*r, base, r)) || (b > 1 && __builtin_mul_overflow(base, base, &base)))
+			{
+				return false;
+			}
+		}
+		return b == 0;
+	case CALC_OP_SHL:
+		return b >= 0 && b < 63 && !__builtin_mul_overflow(a, (int64_t)1 << b, r);
+	case CALC_OP_SHR:
+		*r = a >> (b > 63 ? 63 : b);
+		return b >= 0;
+	case CALC_OP_AND:
+		*r = a & b;
+		return true;
+	case CALC_OP_OR:
+		*r = a | b;
+		return true;
+	case CALC_OP_XOR:
+		*r = a ^ b;
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool small_integer_unary(calc_opcode op, int64_t a, int64_t* r)
+{
+	*r = op == CALC_OP_NEG ? -a : op == CALC_OP_NOT ? ~a : a;
+	return op == CALC_OP_POS || op == CALC_OP_NEG || op == CALC_OP_NOT;
+}
+
+static bool small_integer_token(int64_t value, token* result)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%" PRId64, value);
+	*result = make_token(TOKEN_NUMBER, buf);
+	return true;
+}
+
+static bool bignum_token(const bignum* value, token* result, int* err_code)
+{
+	char* text = bignum_format(value);
+	if (!text)
+	{
+		return fail_operation(err_code, 5);
+	}
+	*result = make_token(TOKEN_NUMBER, text);
+	calc_free(text);
+	return result->value != NULL || fail_operation(err_code, 5);
+}
+
+static bool big_integer_binary_tokens(calc_opcode op, const token* left, const token* right, token* result,
+									  int* err_code)
+{
+	int64_t a, b, r;
+	if (small_integer_text(left->value, &a) && small_integer_text(right->value, &b) &&
+		small_integer_binary(op, a, b, &r))
+	{
+		return small_integer_token(r, result);
+	}
+	bignum x, y, z;
+	bignum_init(&x);
+	bignum_init(&y);
+	bignum_init(&z);
+	bool ok = bignum_parse(right->value, &y, err_code) && bignum_parse(left->value, &x, err_code) &&
+			  bignum_binary_operation(op, &x, &y, &z, err_code) && bignum_token(&z, result, err_code);
+	bignum_free(&x);
+	bignum_free(&y);
+	bignum_free(&z);
+	return ok;
+}
+
+static bool big_integer_unary_tokens(calc_opcode op, const token* operand, token* result, int* err_code)
+{
+	int64_t a, r;
+	if (small_integer_text(operand->value, &a) && small_integer_unary(op, a, &r))
+	{
+		return small_integer_token(r, result);
+	}
+	bignum x, z;
+	bignum_init(&x);
+	bignum_init(&z);
+	bool ok = bignum_parse(operand->value, &x, err_code) && bignum_unary_operation(op, &x, &z, err_code) &&
+			  bignum_token(&z, result, err_code);
+	bignum_free(&x);
+	bignum_free(&z);
+	return ok;
+}
+
+static bool wide_integers(void)
+{
+	return active_widths && active_widths->int_bits == 64;
+}
+
+static bool big_integers(void)
+{
+	return active_widths && active_widths->int_bits == CALC_CORE_BIG_INTEGERS;
+}
+
+static bool wide_floats(void)
+{
+	return active_widths && active_widths->float_bits == 64;
+}
+
+#define CALC_DEFINE_TOKEN_INTEGER_KERNELS(suffix, itype, parse, format)                                                \
+	static bool integer_binary_tokens##suffix(calc_opcode op, const token* left, const token* right,                   \
+											  token* result, int* err_code)                                            \
+	{                                                                                                                  \
+		itype a, b, r;                                                                                                 \
+		if (!parse(right->value, &b, err_code) || !parse(left->value, &a, err_code) ||                                 \
+			!integer_binary_operation##suffix(op, a, b, &r, err_code))                                                 \
+		{                                                                                                              \
+			return false;                                                                                              \
+		}                                                                                                              \
+		char buf[32];                                                                                                  \
+		snprintf(buf, sizeof(buf), format, r);                                                                         \
+		*result = make_token(TOKEN_NUMBER, buf);                                                                       \
+		return true;                                                                                                   \
+	}                                                                                                                  \
+                                                                                                                       \
+	static bool integer_unary_tokens##suffix(calc_opcode op, const token* operand, token* result, int* err_code)       \
+	{                                                                                                                  \
+		itype a, r;                                                                                                    \
+		if (!parse(operand->value, &a, err_code) || !integer_unary_operation##suffix(op, a, &r, err_code))             \
+		{                                                                                                              \
+			return false;                                                                                              \
+		}                                                                                                              \
+		char buf[32];                                                                                                  \
+		snprintf(buf, sizeof(buf), format, r);                                                                         \
+		*result = make_token(TOKEN_NUMBER, buf);                                                                       \
+		return true;                                                                                                   \
+	}
+
+#define CALC_DEFINE_TOKEN_FLOAT_KERNELS(suffix, ftype, parse, format)                                                  \
+	static ftype token_float##suffix(const token* t)                                                                   \
+	{                                                                                                                  \
+		if (t->type == TOKEN_FLOAT_NUMBER || big_integers())                                                           \
+		{                                                                                                              \
+			return parse(t->value, NULL);                                                                              \
+		}                                                                                                              \
+		return (ftype)strtoll(t->value, NULL, 10);                                                                     \
+	}                                                                                                                  \
+                                                                                                                       \
+	static bool float_tokens_result##suffix(ftype value, token* result)                                                \
+	{                                                                                                                  \
+		char buf[64];                                                                                                  \
+		snprintf(buf, sizeof(buf), format, value);                                                                     \
+		*result = make_token(TOKEN_FLOAT_NUMBER, buf);                                                                 \
+		return true;                                                                                                   \
+	}                                                                                                                  \
+                                                                                                                       \
+	static bool float_binary_tokens##suffix(calc_opcode op, const token* left, const token* right,                     \
+											token* result, int* err_code)                                              \
+	{                                                                                                                  \
+		ftype r;                                                                                                       \
+		return float_binary_operation##suffix(op, token_float##suffix(left), token_float##suffix(right), &r,           \
+											  err_code) &&                                                             \
+			   float_tokens_result##suffix(r, result);                                                                 \
+	}                                                                                                                  \
+                                                                                                                       \
+	static bool float_unary_tokens##suffix(calc_opcode op, const token* operand, token* result, int* err_code)         \
+	{                                                                                                                  \
+		ftype r;                                                                                                       \
+		return float_unary_operation##suffix(op, token_float##suffix(operand), &r, err_code) &&                        \
+			   float_tokens_result##suffix(r, result);                                                                 \
+	}                                                                                                                  \
+                                                                                                                       \
+	static bool function_tokens##suffix(calc_opcode op, const token* arg, token* result, int* err_code)                \
+	{                                                                                                                  \
+		ftype r;                                                                                                       \
+		return function_operation##suffix(op, token_float##suffix(arg), &r, err_code) &&                               \
+			   float_tokens_result##suffix(r, result);                                                                 \
+	}
+
+CALC_DEFINE_TOKEN_INTEGER_KERNELS(, int32_t, parse_string_to_int, "%" PRId32)
+CALC_DEFINE_TOKEN_INTEGER_KERNELS(_64, int64_t, parse_string_to_int64, "%" PRId64)
+CALC_DEFINE_TOKEN_FLOAT_KERNELS(, float, strtof, "%e")
+CALC_DEFINE_TOKEN_FLOAT_KERNELS(_64, double, strtod, "%.17e")
+
+/* Registry calls take their arguments at the active float width and widen them to double. */
+static bool call_function_tokens(const function_entry* f, const token* args, token* result, int* err_code)
+{
+	double values[CALC_FUNCTION_MAX_ARITY];
+	for (size_t k = 0; k < f->arity; k++)
+	{
+		values[k] = wide_floats() ? token_float_64(&args[k]) : (double)token_float(&args[k]);
+	}
+	double r;
+	calc_status status = f->scalar(values, &r);
+	if (status != CALC_OK)
+	{
+		return fail_operation(err_code, (int)status);
+	}
+	return wide_floats() ? float_tokens_result_64(r, result) : float_tokens_result((float)r, result);
+}
+
+static bool token_truth(const token* t)
+{
+	if (t->type == TOKEN_FLOAT_NUMBER)
+	{
+		return wide_floats() ? token_float_64(t) != 0 : token_float(t) != 0;
+	}
+	for (const char* p = t->value; *p; p++)
+	{
+		if (*p >= '1' && *p <= '9')
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Orders two decimal integer texts of any length. */
+static int compare_integer_text(const char* a, const char* b)
+{
+	bool negative_a = *a == '-';
+	bool negative_b = *b == '-';
+	a += negative_a;
+	b += negative_b;
+	while (*a == '0')
+	{
+		a++;
+	}
+	while (*b == '0')
+	{
+		b++;
+	}
+	size_t length_a = strlen(a);
+	size_t length_b = strlen(b);
+	int sign_a = length_a ? (negative_a ? -1 : 1) : 0;
+	int sign_b = length_b ? (negative_b ? -1 : 1) : 0;
+	if (sign_a != sign_b)
+	{
+		return sign_a < sign_b ? -1 : 1;
+	}
+	int order = length_a != length_b ? (length_a < length_b ? -1 : 1) : strcmp(a, b);
+	order = (order > 0) - (order < 0);
+	return sign_a < 0 ? -order : order;
+}
+
+/* Outcome of a comparison given the operand order; unordered (NaN) operands compare unequal only. */
+static bool ordered_truth(calc_opcode op, int order, bool unordered)
+{
+	if (unordered)
+	{
+		return op == CALC_OP_NE;
+	}
+	switch (op)
+	{
+	case CALC_OP_LT:
+		return order < 0;
+	case CALC_OP_LE:
+		return order <= 0;
+	case CALC_OP_GT:
+		return order > 0;
+	case CALC_OP_GE:
+		return order >= 0;
+	case CALC_OP_EQ:
+		return order == 0;
+	default:
+		return order != 0;
+	}
+}
+
+static bool compare_tokens(calc_opcode op, const token* left, const token* right, bool* truth, int* err_code)
+{
+	int order;
+	bool unordered = false;
+	if (left->type == TOKEN_FLOAT_NUMBER || right->type == TOKEN_FLOAT_NUMBER)
+	{
+		double x = wide_floats() ? token_float_64(left) : (double)token_float(left);
+		double y = wide_floats() ? token_float_64(right) : (double)token_float(right);
+		unordered = isnan(x) || isnan(y);
+		order = (x > y) - (x < y);
+	}
+	else if (big_integers())
+	{
+		order = compare_integer_text(left->value, right->value);
+	}
+	else if (wide_integers())
+	{
+		int64_t a, b;
+		if (!parse_string_to_int64(right->value, &b, err_code) || !parse_string_to_int64(left->value, &a, err_code))
+		{
+			return false;
+		}
+		order = (a > b) - (a < b);
+	}
+	else
+	{
+		int32_t a, b;
+		if (!parse_string_to_int(right->value, &b, err_code) || !parse_string_to_int(left->value, &a, err_code))
+		{
+			return false;
+		}
+		order = (a > b) - (a < b);
+	}
+	*truth = ordered_truth(op, order, unordered);
+	return true;
+}
+
+static bool is_condition_opcode(calc_opcode op)
+{
+	return op >= CALC_OP_LT && op <= CALC_OP_SELECT;
+}
+
+/* Strict forms of the conditional operators; a selected operand moves into the result. */
+static bool condition_tokens(calc_opcode op, token* args, token* result, int* err_code)
+{
+	bool truth;
+	if (op == CALC_OP_SELECT)
+	{
+		size_t chosen = 2 - (size_t)token_truth(&args[0]);
+		*result = args[chosen];
+		args[chosen].value = NULL;
+		return true;
+	}
+	if (op == CALC_OP_LAND || op == CALC_OP_LOR)
+	{
+		bool a = token_truth(&args[0]);
+		bool b = token_truth(&args[1]);
+		truth = op == CALC_OP_LAND ? (a & b) : (a | b);
+	}
+	else if (!compare_tokens(op, &args[0], &args[1], &truth, err_code))
+	{
+		return false;
+	}
+	*result = make_token(TOKEN_NUMBER, truth ? "1" : "0");
+	return true;
+}
+
+bool calculate_branch(stack* st, token cur, size_t* skip, int* err_code)
+{
+	uint32_t count = 0;
+	calc_opcode op = branch_opcode(cur.value, &count);
+	free_token(&cur);
+	if (op == CALC_OP_NONE)
+	{
+		return fail_operation(err_code, 1);
+	}
+	if (op != CALC_OP_ELSE && is_empty_stack(st))
+	{
+		return fail_operation(err_code, 2);
+	}
+	if (op != CALC_OP_ELSE)
+	{
+		token condition = peek_stack(st);
+		if (token_truth(&condition) != (op == CALC_OP_OR_ELSE))
+		{
+			return true;
+		}
+	}
+	token placeholder = make_token(TOKEN_NUMBER, "0");
+	if (!placeholder.value || !push_stack(st, placeholder))
+	{
+		free_token(&placeholder);
+		return fail_operation(err_code, 5);
+	}
+	*skip = count;
+	return true;
+}
+
+bool calculate_token(stack* st, token cur, int* err_code)
+{
+	if (cur.type == TOKEN_NUMBER || cur.type == TOKEN_FLOAT_NUMBER)
+	{
+		if (active_budget && active_budget->limits.max_stack && st->top >= active_budget->limits.max_stack)
+		{
+			free_token(&cur);
+			return fail_operation(err_code, CALC_ERROR_STACK_LIMIT);
+		}
+		if (!push_stack(st, cur))
+		{
+			free_token(&cur);
+			return fail_operation(err_code, 5);
+		}
+		return true;
+	}
+
+	if (!charge_cost(1, err_code))
+	{
+		free_token(&cur);
+		return false;
+	}
+
+	int function = cur.type == TOKEN_FUNCTION ? find_function(cur.value, strlen(cur.value)) : -1;
+	calc_opcode condition = cur.type == TOKEN_OPERATOR ? binary_opcode(cur.value) : CALC_OP_NONE;
+	size_t arity = cur.type == TOKEN_OPERATOR ? (condition == CALC_OP_SELECT ? 3 : 2)
+				   : function >= 0            ? function_table[function].arity
+											  : 1;
+	if (cur.type != TOKEN_OPERATOR && cur.type != TOKEN_UNARY_OPERATOR && function < 0)
+	{
+		free_token(&cur);
+		return fail_operation(err_code, 1);
+	}
+	if (st->top < arity)
+	{
+		free_token(&cur);
+		return fail_operation(err_code, 2);
+	}
+
+	token result;
+	bool ok;
+	if (is_condition_opcode(condition) || (function >= 0 && function_table[function].opcode == CALC_OP_CALL))
+	{
+		free_token(&cur);
+		token args[CALC_FUNCTION_MAX_ARITY];
+		for (size_t k = arity; k-- > 0;)
+		{
+			args[k] = pop_stack(st);
+		}
+		ok = function >= 0 ? call_function_tokens(&function_table[function], args, &result, err_code)
+						   : condition_tokens(condition, args, &result, err_code);
+		for (size_t k = 0; k < arity; k++)
+		{
+			free_token(&args[k]);
+		}
+		if (ok)
+		{
+			push_stack(st, result);
+		}
+		return ok;
+	}
+
+	token right = pop_stack(st);
+	token left = arity == 2 ? pop_stack(st) : make_token(TOKEN_NULL, NULL);
+	bool use_float = right.type == TOKEN_FLOAT_NUMBER || left.type == TOKEN_FLOAT_NUMBER;
+
+	if (cur.type == TOKEN_OPERATOR)
+	{
+		calc_opcode op = binary_opcode(cur.value);
+		if (use_float && !float_supported(op))
+		{
+			ok = fail_operation(err_code, 1);
+		}
+		else if (use_float)
+		{
+			ok = wide_floats() ? float_binary_tokens_64(op, &left, &right, &result, err_code)
+							   : float_binary_tokens(op, &left, &right, &result, err_code);
+		}
+		else
+		{
+			ok = big_integers()    ? big_integer_binary_tokens(op, &left, &right, &result, err_code)
+				 : wide_integers() ? integer_binary_tokens_64(op, &left, &right, &result, err_code)
+								   : integer_binary_tokens(op, &left, &right, &result, err_code);
+		}
+	}
+	else if (cur.type == TOKEN_UNARY_OPERATOR)
+	{
+		calc_opcode op = unary_opcode(cur.value);
+		if (use_float && !float_supported(op))
+		{
+			ok = fail_operation(err_code, 1);
+		}
+		else if (use_float)
+		{
+			ok = wide_floats() ? float_unary_tokens_64(op, &right, &result, err_code)
+							   : float_unary_tokens(op, &right, &result, err_code);
+		}
+		else
+		{
+			ok = big_integers()    ? big_integer_unary_tokens(op, &right, &result, err_code)
+				 : wide_integers() ? integer_unary_tokens_64(op, &right, &result, err_code)
+								   : integer_unary_tokens(op, &right, &result, err_code);
+		}
+	}
+	else
+	{
+		calc_opcode op = (calc_opcode)function_table[function].opcode;
+		ok = wide_floats() ? function_tokens_64(op, &right, &result, err_code)
+						   : function_tokens(op, &right, &result, err_code);
+	}
+
+	free_token(&right);
+	free_token(&left);
+	free_token(&cur);
+	if (ok)
+	{
+		push_stack(st, result);
+	}
+	return ok;
+}
+
+bool finish_calculation(stack* st, token* result_token, int* err_code)
+{
+	if (st->top != 1)
+	{
+		if (err_code)
+		{
+			*err_code = 2;
+		}
+		return false;
+	}
+	*result_token = pop_stack(st);
+	return true;
+}
+
+bool calculate_expression(queue* q, token* result_token, int* err_code)
+{
+	calc_core_reset_cost();
+	stack st;
+	if (!initialize_stack(&st, q->capacity))
+	{
+		if (err_code)
+		{
+			*err_code = 5;
+		}
+		return false;
+	}
+
+	token batch[QUEUE_BATCH];
+	size_t count;
+	size_t skip = 0;
+	while ((count = pop_queue_bulk(q, batch, QUEUE_BATCH)) != 0)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			if (skip)
+			{
+				skip--;
+				free_token(&batch[i]);
+				continue;
+			}
+			if (!(batch[i].type == TOKEN_BRANCH ? calculate_branch(&st, batch[i], &skip, err_code)
+												: calculate_token(&st, batch[i], err_code)))
+			{
+				while (++i < count)
+				{
+					free_token(&batch[i]);
+				}
+				delete_stack(&st);
+				return false;
+			}
+		}
+	}
+
+	bool ok = finish_calculation(&st, result_token, err_code);
+	delete_stack(&st);
+	return ok;
+}
+
+
+struct calc_context
+{
+	calc_allocator allocator;
+	calc_limits limits;
+	calc_widths widths;
+};
+
+struct calc_expression
+{
+	size_t length;
+	size_t constant_count;
+	size_t slot_count;
+	size_t max_depth;
+	unsigned int_bits;
+	unsigned float_bits;
+	const calc_instruction* code;
+	const calc_value* constants;
+	const uint32_t* slots;
+	const char* names;
+};
+
+#define CALC_LOCAL_STACK 32
+
+static void* default_allocate(void* user_data, size_t size)
+{
+	(void)user_data;
+	return malloc(size);
+}
+
+static void* default_reallocate(void* user_data, void* ptr, size_t size)
+{
+	(void)user_data;
+	return realloc(ptr, size);
+}
+
+static void default_release(void* user_data, void* ptr)
+{
+	(void)user_data;
+	free(ptr);
+}
+
+typedef struct
+{
+	const calc_allocator* allocator;
+	calc_core_budget* budget;
+} context_scope;
+
+static context_scope enter_context(const calc_context* context, calc_core_budget* budget)
+{
+	budget->limits = context->limits;
+	budget->cost = 0;
+	context_scope previous = { calc_core_use_allocator(&context->allocator), calc_core_use_budget(budget) };
+	return previous;
+}
+
+static void leave_context(context_scope previous)
+{
+	calc_core_use_allocator(previous.allocator);
+	calc_core_use_budget(previous.budget);
+}
+
+static bool is_binary_opcode(calc_opcode op)
+{
+	return op >= CALC_OP_ADD && op <= CALC_OP_OR;
+}
+
+static bool is_unary_opcode(calc_opcode op)
+{
+	return op >= CALC_OP_POS && op <= CALC_OP_NOT;
+}
+
+static bool value_is_float(const calc_value* v)
+{
+	return v->type == CALC_VALUE_FLOAT || v->type == CALC_VALUE_DOUBLE;
+}
+
+static double value_to_double(const calc_value* v)
+{
+	switch (v->type)
+	{
+	case CALC_VALUE_FLOAT:
+		return v->float_value;
+	case CALC_VALUE_DOUBLE:
+		return v->double_value;
+	case CALC_VALUE_INT64:
+		return (double)v->int64_value;
+	default:
+		return v->int_value;
+	}
+}
+
+static bool value_truth(const calc_value* v)
+{
+	return value_to_double(v) != 0;
+}
+
+static int64_t value_to_int64(const calc_value* v)
+{
+	switch (v->type)
+	{
+	case CALC_VALUE_INT64:
+		return v->int64_value;
+	case CALC_VALUE_FLOAT:
+		return (int64_t)v->float_value;
+	case CALC_VALUE_DOUBLE:
+		return (int64_t)v->double_value;
+	default:
+		return v->int_value;
+	}
+}
+
+static bool valid_width(unsigned bits)
+{
+	return bits == 0 || bits == 32 || bits == 64;
+}
+
+/* Tangent rows for forward-mode differentiation; a zero entry stays zero even under an infinite factor. */
+static double dual_scale(double factor, double tangent)
+{
+	return tangent == 0 ? 0 : factor * tangent;
+}
+
+static void dual_zero(double* tangents, size_t slot, size_t count)
+{
+	memset(tangents + slot * count, 0, count * sizeof(double));
+}
+
+static void dual_move(double* tangents, size_t to, size_t from, size_t count)
+{
+	if (to != from)
+	{
+		memcpy(tangents + to * count, tangents + from * count, count * sizeof(double));
+	}
+}
+
+/* Row of variable slot: column slot of the direction matrix, or the unit vector for a full gradient. */
+static void dual_seed(const calc_expression* expression, size_t slot, const double* directions, size_t count,
+					  double* tangents, size_t position)
+{
+	double* row = tangents + position * count;
+	for (size_t d = 0; d < count; d++)
+	{
+		row[d] = directions ? directions[d * expression->slot_count + slot] : (double)(d == slot);
+	}
+}
+
+static void dual_power(double x, double y, double r, double* ta, const double* tb, size_t count)
+{
+	double dx = y == 0 ? 0 : y * pow(x, y - 1);
+	double dy = x > 0 ? r * log(x) : x == 0 ? 0 : NAN;
+	for (size_t d = 0; d < count; d++)
+	{
+		ta[d] = dual_scale(dx, ta[d]) + dual_scale(dy, tb[d]);
+	}
+}
+
+static void dual_binary(calc_opcode op, double x, double y, double r, double* tangents, size_t slot, size_t count)
+{
+	double* ta = tangents + slot * count;
+	const double* tb = ta + count;
+	switch (op)
+	{
+	case CALC_OP_ADD:
+		for (size_t d = 0; d < count; d++)
+		{
+			ta[d] += tb[d];
+		}
+		break;
+	case CALC_OP_SUB:
+		for (size_t d = 0; d < count; d++)
+		{
+			ta[d] -= tb[d];
+		}
+		break;
+	case CALC_OP_MUL:
+		for (size_t d = 0; d < count; d++)
+		{
+			ta[d] = dual_scale(y, ta[d]) + dual_scale(x, tb[d]);
+		}
+		break;
+	case CALC_OP_DIV:
+		for (size_t d = 0; d < count; d++)
+		{
+			ta[d] = (ta[d] - dual_scale(r, tb[d])) / y;
+		}
+		break;
+	default:
+		dual_power(x, y, r, ta, tb, count);
+		break;
+	}
+}
+
+static void dual_function(calc_opcode op, double x, double r, double* tangents, size_t slot, size_t count)
+{
+	double factor;
+	switch (op)
+	{
+	case CALC_OP_NEG:
+		factor = -1;
+		break;
+	case CALC_OP_SQRT:
+		factor = 0.5 / r;
+		break;
+	case CALC_OP_LOG2:
+		factor = 1 / (x * log(2.0));
+		break;
+	case CALC_OP_SIN:
+		factor = cos(x);
+		break;
+	case CALC_OP_COS:
+		factor = -sin(x);
+		break;
+	case CALC_OP_TAN:
+		factor = 1 + r * r;
+		break;
+	default:
+		return;
+	}
+	double* row = tangents + slot * count;
+	for (size_t d = 0; d < count; d++)
+	{
+		row[d] = dual_scale(factor, row[d]);
+	}
+}
+
+/* Registry calls differentiate only the two-argument built-ins; plug-ins carry no derivative. */
+static bool dual_call(const function_entry* f, const double* args, double r, double* tangents, size_t slot,
+					  size_t count)
+{
+	double* ta = tangents + slot * count;
+	const double* tb = ta + count;
+	if (f->scalar == builtin_min || f->scalar == builtin_max)
+	{
+		bool first = isnan(args[1]) || (f->scalar == builtin_min ? args[0] <= args[1] : args[0] >= args[1]);
+		if (!first)
+		{
+			memcpy(ta, tb, count * sizeof(double));
+		}
+	}
+	else if (f->scalar == builtin_pow)
+	{
+		dual_power(args[0], args[1], r, ta, tb, count);
+	}
+	else if (f->scalar == builtin_atan2)
+	{
+		double norm = args[0] * args[0] + args[1] * args[1];
+		for (size_t d = 0; d < count; d++)
+		{
+			ta[d] = (dual_scale(args[1], ta[d]) - dual_scale(args[0], tb[d])) / norm;
+		}
+	}
+	else if (f->scalar == builtin_hypot)
+	{
+		for (size_t d = 0; d < count; d++)
+		{
+			ta[d] = (dual_scale(args[0], ta[d]) + dual_scale(args[1], tb[d])) / r;
+		}
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+/*
+ * One evaluator loop per width pair. PUSH copies constants already stored in the expression's widths;
+ * LOAD converts caller variables of any type. With count directions the loop also carries a tangent row
+ * of count doubles per stack slot (forward-mode dual numbers); integer values always have a zero row.
+ */
+#define CALC_DEFINE_EVALUATOR(name, differentiate, itype, ftype, itag, ftag, ifield, ffield, isuffix, fsuffix)         \
+	static int name(const calc_expression* expression, const calc_value* variables, calc_value* st,                    \
+					const double* directions, size_t count, double* tangents)                                          \
+	{                                                                                                                  \
+		int err_code = 0;                                                                                              \
+		size_t top = 0;                                                                                                \
+		for (size_t i = 0; i < expression->length && !err_code; i++)                                                   \
+		{                                                                                                              \
+			const calc_instruction* ins = &expression->code[i];                                                        \
+			calc_opcode op = (calc_opcode)ins->opcode;                                                                 \
+			if (op >= CALC_OP_AND_THEN)                                                                                \
+			{                                                                                                          \
+				if (ins->operand <= i || ins->operand > expression->length)                                            \
+				{                                                                                                      \
+					err_code = 2;                                                                                      \
+				}                                                                                                      \
+				else if (op == CALC_OP_ELSE || value_truth(&st[top - 1]) == (op == CALC_OP_OR_ELSE))                   \
+				{                                                                                                      \
+					if (differentiate)                                                                                 \
+					{                                                                                                  \
+						dual_zero(tangents, top, count);                                                               \
+					}                                                                                                  \
+					st[top].type = itag;                                                                               \
+					st[top++].ifield = 0;                                                                              \
+					i = ins->operand - 1;                                                                              \
+				}                                                                                                      \
+				continue;                                                                                              \
+			}                                                                                                          \
+			if (op != CALC_OP_PUSH && op != CALC_OP_LOAD && !charge_cost(1, &err_code))                                \
+			{                                                                                                          \
+				break;                                                                                                 \
+			}                                                                                                          \
+                                                                                                                       \
+			if (op == CALC_OP_PUSH)                                                                                    \
+			{                                                                                                          \
+				if (differentiate)                                                                                     \
+				{                                                                                                      \
+					dual_zero(tangents, top, count);                                                                   \
+				}                                                                                                      \
+				st[top++] = expression->constants[ins->operand];                                                       \
+			}                                                                                                          \
+			else if (op == CALC_OP_LOAD)                                                                               \
+			{                                                                                                          \
+				const calc_value* v = &variables[ins->operand];                                                        \
+				calc_value* a = &st[top++];                                                                            \
+				if (value_is_float(v))                                                                                 \
+				{                                                                                                      \
+					a->type = ftag;                                                                                    \
+					a->ffield = (ftype)value_to_double(v);                                                             \
+					if (differentiate)                                                                                 \
+					{                                                                                                  \
+						dual_seed(expression, ins->operand, directions, count, tangents, top - 1);                     \
+					}                                                                                                  \
+				}                                                                                                      \
+				else                                                                                                   \
+				{                                                                                                      \
+					a->type = itag;                                                                                    \
+					a->ifield = (itype)value_to_int64(v);                                                              \
+					if (differentiate)                                                                                 \
+					{                                                                                                  \
+						dual_zero(tangents, top - 1, count);                                                           \
+					}                                                                                                  \
+				}                                                                                                      \
+			}                                                                                                          \
+			else if (is_binary_opcode(op))                                                                             \
+			{                                                                                                          \
+				calc_value* a = &st[top - 2];                                                                          \
+				const calc_value* b = &st[top - 1];                                                                    \
+				top--;                                                                                                 \
+				if (a->type == ftag || b->type == ftag)                                                                \
+				{                                                                                                      \
+					ftype x = a->type == ftag ? a->ffield : (ftype)a->ifield;                                          \
+					ftype y = b->type == ftag ? b->ffield : (ftype)b->ifield;                                          \
+					if (!float_supported(op))                                                                          \
+					{                                                                                                  \
+						err_code = 1;                                                                                  \
+					}                                                                                                  \
+					else if (float_binary_operation##fsuffix(op, x, y, &a->ffield, &err_code))                         \
+					{                                                                                                  \
+						a->type = ftag;                                                                                \
+						if (differentiate)                                                                             \
+						{                                                                                              \
+							dual_binary(op, x, y, a->ffield, tangents, top - 1, count);                                \
+						}                                                                                              \
+					}                                                                                                  \
+				}                                                                                                      \
+				else                                                                                                   \
+				{                                                                                                      \
+					integer_binary_operation##isuffix(op, a->ifield, b->ifield, &a->ifield, &err_code);                \
+				}                                                                                                      \
+			}                                                                                                          \
+			else if (is_unary_opcode(op))                                                                              \
+			{                                                                                                          \
+				calc_value* a = &st[top - 1];                                                                          \
+				if (a->type != ftag)                                                                                   \
+				{                                                                                                      \
+					integer_unary_operation##isuffix(op, a->ifield, &a->ifield, &err_code);                            \
+				}                                                                                                      \
+				else if (!float_supported(op))                                                                         \
+				{                                                                                                      \
+					err_code = 1;                                                                                      \
+				}                                                                                                      \
+				else                                                                                                   \
+				{                                                                                                      \
+					ftype x = a->ffield;                                                                               \
+					float_unary_operation##fsuffix(op, x, &a->ffield, &err_code);                                      \
+					if (differentiate)                                                                                 \
+					{                                                                                                  \
+						dual_function(op, x, a->ffield, tangents, top - 1, count);                                     \
+					}                                                                                                  \
+				}                                                                                                      \
+			}                                                                                                          \
+			else if (is_condition_opcode(op))                                                                          \
+			{                                                                                                          \
+				calc_value* a = &st[top - 2];                                                                          \
+				const calc_value* b = &st[top - 1];                                                                    \
+				if (op == CALC_OP_SELECT)                                                                              \
+				{                                                                                                      \
+					size_t chosen = top - 1 - (size_t)value_truth(&st[top - 3]);                                       \
+					st[top - 3] = st[chosen];                                                                          \
+					if (differentiate)                                                                                 \
+					{                                                                                                  \
+						dual_move(tangents, top - 3, chosen, count);                                                   \
+					}                                                                                                  \
+					top -= 2;                                                                                          \
+					continue;                                                                                          \
+				}                                                                                                      \
+				bool truth;                                                                                            \
+				if (op == CALC_OP_LAND || op == CALC_OP_LOR)                                                           \
+				{                                                                                                      \
+					bool x = value_truth(a);                                                                           \
+					bool y = value_truth(b);                                                                           \
+					truth = op == CALC_OP_LAND ? (x & y) : (x | y);                                                    \
+				}                                                                                                      \
+				else if (a->type == ftag || b->type == ftag)                                                           \
+				{                                                                                                      \
+					ftype x = a->type == ftag ? a->ffield : (ftype)a->ifield;                                          \
+					ftype y = b->type == ftag ? b->ffield : (ftype)b->ifield;                                          \
+					truth = ordered_truth(op, (x > y) - (x < y), isnan(x) || isnan(y));                                \
+				}                                                                                                      \
+				else                                                                                                   \
+				{                                                                                                      \
+					truth = ordered_truth(op, (a->ifield > b->ifield) - (a->ifield < b->ifield), false);               \
+				}                                                                                                      \
+				a->type = itag;                                                                                        \
+				a->ifield = truth;                                                                                     \
+				if (differentiate)                                                                                     \
+				{                                                                                                      \
+					dual_zero(tangents, top - 2, count);                                                               \
+				}                                                                                                      \
+				top--;                                                                                                 \
+			}                                                                                                          \
+			else if (op == CALC_OP_CALL)                                                                               \
+			{                                                                                                          \
+				const function_entry* f = registered_function(ins->operand);                                           \
+				double args[CALC_FUNCTION_MAX_ARITY];                                                                  \
+				double r = 0;                                                                                          \
+				for (size_t k = 0; f && k < f->arity; k++)                                                             \
+				{                                                                                                      \
+					const calc_value* v = &st[top - f->arity + k];                                                     \
+					args[k] = v->type == ftag ? (double)v->ffield : (double)v->ifield;                                 \
+				}                                                                                                      \
+				err_code = f ? (int)f->scalar(args, &r) : 1;                                                           \
+				if (!err_code)                                                                                         \
+				{                                                                                                      \
+					top -= f->arity - 1;                                                                               \
+					st[top - 1].type = ftag;                                                                           \
+					st[top - 1].ffield = (ftype)r;                                                                     \
+					if (differentiate && !dual_call(f, args, st[top - 1].ffield, tangents, top - 1, count))            \
+					{                                                                                                  \
+						err_code = 1;                                                                                  \
+					}                                                                                                  \
+				}                                                                                                      \
+			}                                                                                                          \
+			else                                                                                                       \
+			{                                                                                                          \
+				calc_value* a = &st[top - 1];                                                                          \
+				ftype x = a->type == ftag ? a->ffield : (ftype)a->ifield;                                              \
+				if (function_operation##fsuffix(op, x, &a->ffield, &err_code))                                         \
+				{                                                                                                      \
+					a->type = ftag;                                                                                    \
+					if (differentiate)                                                                                 \
+					{                                                                                                  \
+						dual_function(op, x, a->ffield, tangents, top - 1, count);                                     \
+					}                                                                                                  \
+				}                                                                                                      \
+			}                                                                                                          \
+		}                                                                                                              \
+		return err_code;                                                                                               \
+	}
+
+CALC_DEFINE_EVALUATOR(evaluate_int32_float, false, int32_t, float, CALC_VALUE_INT, CALC_VALUE_FLOAT, int_value,
+					  float_value, , )
+CALC_DEFINE_EVALUATOR(evaluate_int64_float, false, int64_t, float, CALC_VALUE_INT64, CALC_VALUE_FLOAT, int64_value,
+					  float_value, _64, )
+CALC_DEFINE_EVALUATOR(evaluate_int32_double, false, int32_t, double, CALC_VALUE_INT, CALC_VALUE_DOUBLE, int_value,
+					  double_value, , _64)
+CALC_DEFINE_EVALUATOR(evaluate_int64_double, false, int64_t, double, CALC_VALUE_INT64, CALC_VALUE_DOUBLE, int64_value,
+					  double_value, _64, _64)
+CALC_DEFINE_EVALUATOR(differentiate_int32_float, true, int32_t, float, CALC_VALUE_INT, CALC_VALUE_FLOAT, int_value,
+					  float_value, , )
+CALC_DEFINE_EVALUATOR(differentiate_int64_float, true, int64_t, float, CALC_VALUE_INT64, CALC_VALUE_FLOAT,
+					  int64_value, float_value, _64, )
+CALC_DEFINE_EVALUATOR(differentiate_int32_double, true, int32_t, double, CALC_VALUE_INT, CALC_VALUE_DOUBLE,
+					  int_value, double_value, , _64)
+CALC_DEFINE_EVALUATOR(differentiate_int64_double, true, int64_t, double, CALC_VALUE_INT64, CALC_VALUE_DOUBLE,
+					  int64_value, double_value, _64, _64)
+
+typedef int (*calc_evaluator)(const calc_expression* expression, const calc_value* variables, calc_value* st,
+							  const double* directions, size_t count, double* tangents);
+
+static calc_evaluator select_evaluator(const calc_expression* expression, bool differentiate)
+{
+	static const calc_evaluator evaluators[2][2][2] = {
+		{ { evaluate_int32_float, evaluate_int32_double }, { evaluate_int64_float, evaluate_int64_double } },
+		{ { differentiate_int32_float, differentiate_int32_double },
+		  { differentiate_int64_float, differentiate_int64_double } }
+	};
+	return evaluators[differentiate][expression->int_bits == 64][expression->float_bits == 64];
+}
+
+/*
+ * Batch evaluation runs each instruction across CALC_BATCH_LANES points held as per-slot arrays of kinds,
+ * errors, integers and floats. Branch markers are ignored: both sides of &&, || and ?: are evaluated and
+ * the taken side supplies the value and error, so every point gets the result of the branching evaluator.
+ * Error-free all-float operands take plain loops the compiler vectorizes; other lanes go through the kernels.
+ */
+#define CALC_BATCH_LANES 64
+#define CALC_BATCH_SLOT_BYTES (CALC_BATCH_LANES * (sizeof(int64_t) + sizeof(double) + 2))
+#define BATCH_TRUTH(kinds, ints, floats, x) ((kinds)[x] ? (floats)[x] != 0 : (ints)[x] != 0)
+
+/* Stack values an instruction pops before pushing its result; a branch marker counts one and keeps the depth. */
+static size_t instruction_arity(const calc_instruction* ins)
+{
+	calc_opcode op = (calc_opcode)ins->opcode;
+	if (op == CALC_OP_PUSH || op == CALC_OP_LOAD)
+	{
+		return 0;
+	}
+	if (op == CALC_OP_CALL)
+	{
+		const function_entry* f = registered_function(ins->operand);
+		return f ? f->arity : 0;
+	}
+	if (is_binary_opcode(op) || is_condition_opcode(op))
+	{
+		return op == CALC_OP_SELECT ? 3 : 2;
+	}
+	return 1;
+}
+
+/*
+ * One instruction of a block with explicit slots: the result goes to target and the operands are read from
+ * sources. The expression evaluator takes the slots from the stack depth; a fused program assigns them.
+ */
+typedef struct
+{
+	uint8_t opcode;
+	uint8_t arity;
+	uint32_t operand;
+	uint32_t target;
+	uint32_t sources[CALC_FUNCTION_MAX_ARITY];
+} batch_step;
+
+typedef struct
+{
+	const calc_value* constants;
+	const calc_value* variables;
+	const calc_column* columns;
+	size_t slot_count;
+	size_t first;
+	size_t lanes;
+	size_t depth;
+	unsigned char* storage;
+} batch_block;
+
+typedef struct
+{
+	uint32_t step;
+	uint32_t slot;
+	uint32_t output;
+} program_store;
+
+struct calc_program
+{
+	size_t output_count;
+	size_t slot_count;
+	size_t step_count;
+	size_t depth;
+	size_t max_depth;
+	size_t max_slots;
+	unsigned int_bits;
+	unsigned float_bits;
+	const calc_expression* const* expressions;
+	const char* const* names;
+	const calc_value* constants;
+	const batch_step* steps;
+	const program_store* stores;
+	const uint32_t* slot_maps;
+};
+
+#define CALC_DEFINE_BATCH_EVALUATOR(name, itype, ftype, itag, ftag, ifield, ffield, isuffix, fsuffix)                  \
+	static bool name##_step(const batch_step* step, const batch_block* block)                                          \
+	{                                                                                                                  \
+		const size_t stride = CALC_BATCH_LANES;                                                                        \
+		const size_t lanes = block->lanes;                                                                             \
+		ftype* floats = (ftype*)block->storage;                                                                        \
+		itype* ints = (itype*)(floats + block->depth * stride);                                                        \
+		uint8_t* kinds = (uint8_t*)(ints + block->depth * stride);                                                     \
+		uint8_t* errors = kinds + block->depth * stride;                                                               \
+		calc_opcode op = (calc_opcode)step->opcode;                                                                    \
+		size_t t = step->target * stride;                                                                              \
+		if (step->arity && op != CALC_OP_SELECT && op != CALC_OP_CALL && step->sources[0] != step->target)             \
+		{                                                                                                              \
+			size_t a = step->sources[0] * stride;                                                                      \
+			memcpy(floats + t, floats + a, lanes * sizeof(ftype));                                                     \
+			memcpy(ints + t, ints + a, lanes * sizeof(itype));                                                         \
+			memcpy(kinds + t, kinds + a, lanes);                                                                       \
+			memcpy(errors + t, errors + a, lanes);                                                                     \
+		}                                                                                                              \
+                                                                                                                       \
+		if (op == CALC_OP_LOAD && block->columns)                                                                      \
+		{                                                                                                              \
+			const calc_column* column = &block->columns[step->operand];                                                \
+			memset(errors + t, 0, lanes);                                                                              \
+			memset(kinds + t, column->type == CALC_VALUE_FLOAT || column->type == CALC_VALUE_DOUBLE, lanes);           \
+			switch (column->type)                                                                                      \
+			{                                                                                                          \
+			case CALC_VALUE_INT:                                                                                       \
+				for (size_t l = 0; l < lanes; l++)                                                                     \
+				{                                                                                                      \
+					ints[t + l] = (itype)((const int32_t*)column->data)[block->first + l];                             \
+				}                                                                                                      \
+				break;                                                                                                 \
+			case CALC_VALUE_INT64:                                                                                     \
+				for (size_t l = 0; l < lanes; l++)                                                                     \
+				{                                                                                                      \
+					ints[t + l] = (itype)((const int64_t*)column->data)[block->first + l];                             \
+				}                                                                                                      \
+				break;                                                                                                 \
+			case CALC_VALUE_FLOAT:                                                                                     \
+				for (size_t l = 0; l < lanes; l++)                                                                     \
+				{                                                                                                      \
+					floats[t + l] = (ftype)((const float*)column->data)[block->first + l];                             \
+				}                                                                                                      \
+				break;                                                                                                 \
+			default:                                                                                                   \
+				for (size_t l = 0; l < lanes; l++)                                                                     \
+				{                                                                                                      \
+					floats[t + l] = (ftype)((const double*)column->data)[block->first + l];                            \
+				}                                                                                                      \
+				break;                                                                                                 \
+			}                                                                                                          \
+		}                                                                                                              \
+		else if (op == CALC_OP_LOAD)                                                                                   \
+		{                                                                                                              \
+			memset(errors + t, 0, lanes);                                                                              \
+			for (size_t l = 0; l < lanes; l++)                                                                         \
+			{                                                                                                          \
+				const calc_value* v = &block->variables[(block->first + l) * block->slot_count + step->operand];       \
+				kinds[t + l] = value_is_float(v);                                                                      \
+				if (kinds[t + l])                                                                                      \
+				{                                                                                                      \
+					floats[t + l] = (ftype)value_to_double(v);                                                         \
+				}                                                                                                      \
+				else                                                                                                   \
+				{                                                                                                      \
+					ints[t + l] = (itype)value_to_int64(v);                                                            \
+				}                                                                                                      \
+			}                                                                                                          \
+		}                                                                                                              \
+		else if (op == CALC_OP_PUSH)                                                                                   \
+		{                                                                                                              \
+			const calc_value* c = &block->constants[step->operand];                                                    \
+			memset(errors + t, 0, lanes);                                                                              \
+			memset(kinds + t, c->type == ftag, lanes);                                                                 \
+			if (c->type == ftag)                                                                                       \
+			{                                                                                                          \
+				for (size_t l = 0; l < lanes; l++)                                                                     \
+				{                                                                                                      \
+					floats[t + l] = c->ffield;                                                                         \
+				}                                                                                                      \
+			}                                                                                                          \
+			else                                                                                                       \
+			{                                                                                                          \
+				for (size_t l = 0; l < lanes; l++)                                                                     \
+				{                                                                                                      \
+					ints[t + l] = c->ifield;                                                                           \
+				}                                                                                                      \
+			}                                                                                                          \
+		}                                                                                                              \
+		else if (is_binary_opcode(op) || (is_condition_opcode(op) && op != CALC_OP_SELECT))                            \
+		{                                                                                                              \
+			size_t a = t;                                                                                              \
+			size_t b = step->sources[1] * stride;                                                                      \
+			uint8_t mixed = 0;                                                                                         \
+			bool zero = false;                                                                                         \
+			for (size_t l = 0; l < lanes; l++)                                                                         \
+			{                                                                                                          \
+				mixed |= (uint8_t)((kinds[a + l] & kinds[b + l]) ^ 1) | errors[a + l] | errors[b + l];                 \
+				zero |= floats[b + l] == 0;                                                                            \
+			}                                                                                                          \
+			if (!mixed && (op == CALC_OP_ADD || op == CALC_OP_SUB || op == CALC_OP_MUL ||                              \
+						   (op == CALC_OP_DIV && !zero)))                                                              \
+			{                                                                                                          \
+				ftype* x = floats + a;                                                                                 \
+				const ftype* y = floats + b;                                                                           \
+				switch (op)                                                                                            \
+				{                                                                                                      \
+				case CALC_OP_ADD:                                                                                      \
+					for (size_t l = 0; l < lanes; l++)                                                                 \
+					{                                                                                                  \
+						x[l] += y[l];                                                                                  \
+					}                                                                                                  \
+					break;                                                                                             \
+				case CALC_OP_SUB:                                                                                      \
+					for (size_t l = 0; l < lanes; l++)                                                                 \
+					{                                                                                                  \
+						x[l] -= y[l];                                                                                  \
+					}                                                                                                  \
+					break;                                                                                             \
+				case CALC_OP_MUL:                                                                                      \
+					for (size_t l = 0; l < lanes; l++)                                                                 \
+					{                                                                                                  \
+						x[l] *= y[l];                                                                                  \
+					}                                                                                                  \
+					break;                                                                                             \
+				default:                                                                                               \
+					for (size_t l = 0; l < lanes; l++)                                                                 \
+					{                                                                                                  \
+						x[l] /= y[l];                                                                                  \
+					}                                                                                                  \
+					break;                                                                                             \
+				}                                                                                                      \
+				return true;                                                                                           \
+			}                                                                                                          \
+			for (size_t x = a, y = b; x < a + lanes; x++, y++)                                                         \
+			{                                                                                                          \
+				int err_code = 0;                                                                                      \
+				if (errors[x])                                                                                         \
+				{                                                                                                      \
+					continue;                                                                                          \
+				}                                                                                                      \
+				if (op == CALC_OP_LAND || op == CALC_OP_LOR)                                                           \
+				{                                                                                                      \
+					bool truth = BATCH_TRUTH(kinds, ints, floats, x);                                                  \
+					if (truth != (op == CALC_OP_LOR))                                                                  \
+					{                                                                                                  \
+						errors[x] = errors[y];                                                                         \
+						truth = BATCH_TRUTH(kinds, ints, floats, y);                                                   \
+					}                                                                                                  \
+					kinds[x] = 0;                                                                                      \
+					ints[x] = truth;                                                                                   \
+					continue;                                                                                          \
+				}                                                                                                      \
+				if (errors[y])                                                                                         \
+				{                                                                                                      \
+					errors[x] = errors[y];                                                                             \
+					continue;                                                                                          \
+				}                                                                                                      \
+				if (kinds[x] || kinds[y])                                                                              \
+				{                                                                                                      \
+					ftype p = kinds[x] ? floats[x] : (ftype)ints[x];                                                   \
+					ftype q = kinds[y] ? floats[y] : (ftype)ints[y];                                                   \
+					if (is_condition_opcode(op))                                                                       \
+					{                                                                                                  \
+						kinds[x] = 0;                                                                                  \
+						ints[x] = ordered_truth(op, (p > q) - (p < q), isnan(p) || isnan(q));                          \
+					}                                                                                                  \
+					else if (!float_supported(op))                                                                     \
+					{                                                                                                  \
+						err_code = 1;                                                                                  \
+					}                                                                                                  \
+					else if (float_binary_operation##fsuffix(op, p, q, &floats[x], &err_code))                         \
+					{                                                                                                  \
+						kinds[x] = 1;                                                                                  \
+					}                                                                                                  \
+				}                                                                                                      \
+				else if (is_condition_opcode(op))                                                                      \
+				{                                                                                                      \
+					ints[x] = ordered_truth(op, (ints[x] > ints[y]) - (ints[x] < ints[y]), false);                     \
+				}                                                                                                      \
+				else                                                                                                   \
+				{                                                                                                      \
+					integer_binary_operation##isuffix(op, ints[x], ints[y], &ints[x], &err_code);                      \
+				}                                                                                                      \
+				errors[x] = (uint8_t)err_code;                                                                         \
+			}                                                                                                          \
+		}                                                                                                              \
+		else if (is_unary_opcode(op))                                                                                  \
+		{                                                                                                              \
+			uint8_t mixed = 0;                                                                                         \
+			for (size_t l = 0; l < lanes; l++)                                                                         \
+			{                                                                                                          \
+				mixed |= (uint8_t)(kinds[t + l] ^ 1) | errors[t + l];                                                  \
+			}                                                                                                          \
+			if (!mixed && (op == CALC_OP_NEG || op == CALC_OP_POS))                                                    \
+			{                                                                                                          \
+				for (size_t l = 0; op == CALC_OP_NEG && l < lanes; l++)                                                \
+				{                                                                                                      \
+					floats[t + l] = -floats[t + l];                                                                    \
+				}                                                                                                      \
+				return true;                                                                                           \
+			}                                                                                                          \
+			for (size_t x = t; x < t + lanes; x++)                                                                     \
+			{                                                                                                          \
+				int err_code = 0;                                                                                      \
+				if (errors[x])                                                                                         \
+				{                                                                                                      \
+					continue;                                                                                          \
+				}                                                                                                      \
+				if (!kinds[x])                                                                                         \
+				{                                                                                                      \
+					integer_unary_operation##isuffix(op, ints[x], &ints[x], &err_code);                                \
+				}                                                                                                      \
+				else if (!float_supported(op))                                                                         \
+				{                                                                                                      \
+					err_code = 1;                                                                                      \
+				}                                                                                                      \
+				else                                                                                                   \
+				{                                                                                                      \
+					float_unary_operation##fsuffix(op, floats[x], &floats[x], &err_code);                              \
+				}                                                                                                      \
+				errors[x] = (uint8_t)err_code;                                                                         \
+			}                                                                                                          \
+		}                                                                                                              \
+		else if (op == CALC_OP_SELECT)                                                                                 \
+		{                                                                                                              \
+			size_t c = step->sources[0] * stride;                                                                      \
+			size_t a = step->sources[1] * stride;                                                                      \
+			size_t b = step->sources[2] * stride;                                                                      \
+			for (size_t l = 0; l < lanes; l++)                                                                         \
+			{                                                                                                          \
+				size_t from = (BATCH_TRUTH(kinds, ints, floats, c + l) ? a : b) + l;                                   \
+				errors[t + l] = errors[c + l] ? errors[c + l] : errors[from];                                          \
+				kinds[t + l] = kinds[from];                                                                            \
+				ints[t + l] = ints[from];                                                                              \
+				floats[t + l] = floats[from];                                                                          \
+			}                                                                                                          \
+		}                                                                                                              \
+		else if (op == CALC_OP_CALL)                                                                                   \
+		{                                                                                                              \
+			const function_entry* f = registered_function(step->operand);                                              \
+			if (!f)                                                                                                    \
+			{                                                                                                          \
+				return false;                                                                                          \
+			}                                                                                                          \
+			uint8_t failed = 0;                                                                                        \
+			for (size_t k = 0; k < f->arity; k++)                                                                      \
+			{                                                                                                          \
+				for (size_t l = 0; l < lanes; l++)                                                                     \
+				{                                                                                                      \
+					failed |= errors[step->sources[k] * stride + l];                                                   \
+				}                                                                                                      \
+			}                                                                                                          \
+			if (f->vector && !failed)                                                                                  \
+			{                                                                                                          \
+				double columns[CALC_FUNCTION_MAX_ARITY][CALC_BATCH_LANES];                                             \
+				const double* args[CALC_FUNCTION_MAX_ARITY];                                                           \
+				double out[CALC_BATCH_LANES];                                                                          \
+				for (size_t k = 0; k < f->arity; k++)                                                                  \
+				{                                                                                                      \
+					size_t a = step->sources[k] * stride;                                                              \
+					for (size_t l = 0; l < lanes; l++)                                                                 \
+					{                                                                                                  \
+						columns[k][l] = kinds[a + l] ? (double)floats[a + l] : (double)ints[a + l];                    \
+					}                                                                                                  \
+					args[k] = columns[k];                                                                              \
+				}                                                                                                      \
+				if (f->vector(args, out, lanes) == CALC_OK)                                                            \
+				{                                                                                                      \
+					memset(kinds + t, 1, lanes);                                                                       \
+					memset(errors + t, 0, lanes);                                                                      \
+					for (size_t l = 0; l < lanes; l++)                                                                 \
+					{                                                                                                  \
+						floats[t + l] = (ftype)out[l];                                                                 \
+					}                                                                                                  \
+					return true;                                                                                       \
+				}                                                                                                      \
+			}                                                                                                          \
+			for (size_t l = 0; l < lanes; l++)                                                                         \
+			{                                                                                                          \
+				double args[CALC_FUNCTION_MAX_ARITY];                                                                  \
+				double r = 0;                                                                                          \
+				int err_code = 0;                                                                                      \
+				for (size_t k = 0; k < f->arity && !err_code; k++)                                                     \
+				{                                                                                                      \
+					size_t a = step->sources[k] * stride + l;                                                          \
+					err_code = errors[a];                                                                              \
+					args[k] = kinds[a] ? (double)floats[a] : (double)ints[a];                                          \
+				}                                                                                                      \
+				err_code = err_code ? err_code : (int)f->scalar(args, &r);                                             \
+				if (!err_code)                                                                                         \
+				{                                                                                                      \
+					kinds[t + l] = 1;                                                                                  \
+					floats[t + l] = (ftype)r;                                                                          \
+				}                                                                                                      \
+				errors[t + l] = (uint8_t)err_code;                                                                     \
+			}                                                                                                          \
+		}                                                                                                              \
+		else                                                                                                           \
+		{                                                                                                              \
+			for (size_t x = t; x < t + lanes; x++)                                                                     \
+			{                                                                                                          \
+				int err_code = 0;                                                                                      \
+				if (errors[x])                                                                                         \
+				{                                                                                                      \
+					continue;                                                                                          \
+				}                                                                                                      \
+				ftype p = kinds[x] ? floats[x] : (ftype)ints[x];                                                       \
+				if (function_operation##fsuffix(op, p, &floats[x], &err_code))                                         \
+				{                                                                                                      \
+					kinds[x] = 1;                                                                                      \
+				}                                                                                                      \
+				errors[x] = (uint8_t)err_code;                                                                         \
+			}                                                                                                          \
+		}                                                                                                              \
+		return true;                                                                                                   \
+	}                                                                                                                  \
+                                                                                                                       \
+	static void name##_store(const batch_block* block, size_t slot, calc_value* results, size_t stride,                \
+							 calc_status* statuses)                                                                    \
+	{                                                                                                                  \
+		const ftype* floats = (const ftype*)block->storage;                                                            \
+		const itype* ints = (const itype*)(floats + block->depth * CALC_BATCH_LANES);                                  \
+		const uint8_t* kinds = (const uint8_t*)(ints + block->depth * CALC_BATCH_LANES);                               \
+		const uint8_t* errors = kinds + block->depth * CALC_BATCH_LANES;                                               \
+		size_t x = slot * CALC_BATCH_LANES;                                                                            \
+		for (size_t l = 0; l < block->lanes; l++, x++)                                                                 \
+		{                                                                                                              \
+			statuses[l * stride] = (calc_status)errors[x];                                                             \
+			results[l * stride].type = kinds[x] ? ftag : itag;                                                         \
+			if (kinds[x])                                                                                              \
+			{                                                                                                          \
+				results[l * stride].ffield = floats[x];                                                                \
+			}                                                                                                          \
+			else                                                                                                       \
+			{                                                                                                          \
+				results[l * stride].ifield = ints[x];                                                                  \
+			}                                                                                                          \
+		}                                                                                                              \
+	}                                                                                                                  \
+                                                                                                                       \
+	static void name(const calc_expression* expression, const calc_value* variables, const calc_column* columns,       \
+					 size_t first, size_t lanes, unsigned char* storage, calc_value* results, calc_status* statuses)   \
+	{                                                                                                                  \
+		batch_block block = { expression->constants, variables, columns, expression->slot_count, first, lanes,         \
+							  expression->max_depth, storage };                                                        \
+		size_t top = 0;                                                                                                \
+		for (size_t i = 0; i < expression->length; i++)                                                                \
+		{                                                                                                              \
+			const calc_instruction* ins = &expression->code[i];                                                        \
+			if (ins->opcode >= CALC_OP_AND_THEN)                                                                       \
+			{                                                                                                          \
+				continue;                                                                                              \
+			}                                                                                                          \
+			batch_step step;                                                                                           \
+			step.opcode = ins->opcode;                                                                                 \
+			step.arity = (uint8_t)instruction_arity(ins);                                                              \
+			step.operand = ins->operand;                                                                               \
+			step.target = (uint32_t)(top - step.arity);                                                                \
+			for (size_t k = 0; k < step.arity; k++)                                                                    \
+			{                                                                                                          \
+				step.sources[k] = (uint32_t)(top - step.arity + k);                                                    \
+			}                                                                                                          \
+			top = step.target + 1;                                                                                     \
+			if (!name##_step(&step, &block))                                                                           \
+			{                                                                                                          \
+				for (size_t l = 0; l < lanes; l++)                                                                     \
+				{                                                                                                      \
+					statuses[l] = CALC_ERROR_UNSUPPORTED;                                                              \
+				}                                                                                                      \
+				return;                                                                                                \
+			}                                                                                                          \
+		}                                                                                                              \
+		name##_store(&block, 0, results, 1, statuses);                                                                 \
+	}                                                                                                                  \
+                                                                                                                       \
+	static void name##_program(const calc_program* program, const batch_block* block, calc_value* results,             \
+							   calc_status* statuses)                                                                  \
+	{                                                                                                                  \
+		size_t s = 0;                                                                                                  \
+		for (size_t i = 0; i < program->step_count; i++)                                                               \
+		{                                                                                                              \
+			name##_step(&program->steps[i], block);                                                                    \
+			for (; s < program->output_count && program->stores[s].step == i; s++)                                     \
+			{                                                                                                          \
+				name##_store(block, program->stores[s].slot, results + program->stores[s].output,                      \
+							 program->output_count, statuses + program->stores[s].output);                             \
+			}                                                                                                          \
+		}                                                                                                              \
+	}
+
+CALC_DEFINE_BATCH_EVALUATOR(batch_int32_float, int32_t, float, CALC_VALUE_INT, CALC_VALUE_FLOAT, int_value,
+							float_value, , )
+CALC_DEFINE_BATCH_EVALUATOR(batch_int64_float, int64_t, float, CALC_VALUE_INT64, CALC_VALUE_FLOAT, int64_value,
+							float_value, _64, )
+CALC_DEFINE_BATCH_EVALUATOR(batch_int32_double, int32_t, double, CALC_VALUE_INT, CALC_VALUE_DOUBLE, int_value,
+							double_value, , _64)
+CALC_DEFINE_BATCH_EVALUATOR(batch_int64_double, int64_t, double, CALC_VALUE_INT64, CALC_VALUE_DOUBLE, int64_value,
+							double_value, _64, _64)
+
+typedef void (*calc_batch_evaluator)(const calc_expression* expression, const calc_value* variables,
+									 const calc_column* columns, size_t first, size_t lanes, unsigned char* storage,
+									 calc_value* results, calc_status* statuses);
+
+static calc_batch_evaluator select_batch_evaluator(const calc_expression* expression)
+{
+	static const calc_batch_evaluator evaluators[2][2] = { { batch_int32_float, batch_int32_double },
+														   { batch_int64_float, batch_int64_double } };
+	return evaluators[expression->int_bits == 64][expression->float_bits == 64];
+}
+
+typedef void (*calc_program_evaluator)(const calc_program* program, const batch_block* block, calc_value* results,
+									   calc_status* statuses);
+
+static calc_program_evaluator select_program_evaluator(const calc_program* program)
+{
+	static const calc_program_evaluator evaluators[2][2] = {
+		{ batch_int32_float_program, batch_int32_double_program },
+		{ batch_int64_float_program, batch_int64_double_program }
+	};
+	return evaluators[program->int_bits == 64][program->float_bits == 64];
+}
+
+
+calc_status calc_context_create(const calc_allocator* allocator, calc_context** context)
+{
+	return calc_context_create_limited(allocator, NULL, context);
+}
+
+calc_status calc_context_create_limited(const calc_allocator* allocator, const calc_limits* limits,
+										calc_context** context)
+{
+	return calc_context_create_with_widths(allocator, limits, NULL, context);
+}
+
+calc_status calc_context_create_with_widths(const calc_allocator* allocator, const calc_limits* limits,
+											const calc_widths* widths, calc_context** context)
+{
+	if (!context)
+	{
+		return CALC_ERROR_INVALID_ARGUMENT;
+	}
+	*context = NULL;
+	if (widths && (!valid_width(widths->int_bits) || !valid_width(widths->float_bits)))
+	{
+		return CALC_ERROR_INVALID_ARGUMENT;
+	}
+
+	calc_allocator chosen = { default_allocate, default_reallocate, default_release, NULL };
+	if (allocator)
+	{
+		if (!allocator->allocate || !allocator->reallocate || !allocator->release)
+		{
+			return CALC_ERROR_INVALID_ARGUMENT;
+		}
+		chosen = *allocator;
+	}
+
+	calc_context* ctx = chosen.allocate(chosen.user_data, sizeof(calc_context));
+	if (!ctx)
+	{
+		return CALC_ERROR_NO_MEMORY;
+	}
+	ctx->allocator = chosen;
+	memset(&ctx->limits, 0, sizeof(ctx->limits));
+	if (limits)
+	{
+		ctx->limits = *limits;
+	}
+	ctx->widths.int_bits = widths && widths->int_bits == 64 ? 64 : 32;
+	ctx->widths.float_bits = widths && widths->float_bits == 64 ? 64 : 32;
+	*context = ctx;
+	return CALC_OK;
+}
+
+void calc_context_destroy(calc_context* context)
+{
+	if (!context)
+	{
+		return;
+	}
+	calc_allocator allocator = context->allocator;
+	allocator.release(allocator.user_data, context);
+}
+
+/*
+ * Each branch marker must skip exactly one operand: the code up to its target leaves one value above the
+ * marker's depth and never reaches below it, and markers nest. Operators with a missing operand can get
+ * past the shunting yard with a marker in the wrong place; the token evaluator then fails on the leftover
+ * stack, so compilation rejects them the same way.
+ */
+static calc_status check_branches(const calc_expression* expr)
+{
+	size_t markers = 0;
+	for (size_t i = 0; i < expr->length; i++)
+	{
+		markers += expr->code[i].opcode >= CALC_OP_AND_THEN;
+	}
+	if (!markers)
+	{
+		return CALC_OK;
+	}
+	size_t* open = calc_malloc(markers * 2 * sizeof(size_t));
+	if (!open)
+	{
+		return CALC_ERROR_NO_MEMORY;
+	}
+	size_t open_count = 0;
+	size_t depth = 0;
+	calc_status status = CALC_OK;
+	for (size_t i = 0; i < expr->length && status == CALC_OK; i++)
+	{
+		const calc_instruction* ins = &expr->code[i];
+		calc_opcode op = (calc_opcode)ins->opcode;
+		depth = depth + 1 - instruction_arity(ins);
+		if (open_count && depth <= open[2 * open_count - 2])
+		{
+			status = CALC_ERROR_SYNTAX;
+		}
+		while (status == CALC_OK && open_count && open[2 * open_count - 1] == i + 1)
+		{
+			status = depth == open[2 * open_count - 2] + 1 ? CALC_OK : CALC_ERROR_SYNTAX;
+			open_count--;
+		}
+		if (status == CALC_OK && op >= CALC_OP_AND_THEN)
+		{
+			if (ins->operand <= i + 1 || ins->operand > expr->length ||
+				(open_count && ins->operand > open[2 * open_count - 1]))
+			{
+				status = CALC_ERROR_SYNTAX;
+			}
+			open[2 * open_count] = depth;
+			open[2 * open_count + 1] = ins->operand;
+			open_count++;
+		}
+	}
+	calc_free(open);
+	return status == CALC_OK && open_count ? CALC_ERROR_SYNTAX : status;
+}
+
+/* Checks that a shunted stream leaves one value and that its branch markers nest, as calc_compile would. */
+bool check_token_stream(const token_stream* rpn, int* err_code)
+{
+	calc_instruction* code = calc_malloc((rpn->length ? rpn->length : 1) * sizeof(calc_instruction));
+	if (!code)
+	{
+		return fail_operation(err_code, 5);
+	}
+	size_t depth = 0;
+	bool valid = true;
+	for (size_t i = 0; i < rpn->length && valid; i++)
+	{
+		token_type kind = (token_type)rpn->kinds[i];
+		calc_instruction* ins = &code[i];
+		memset(ins, 0, sizeof(*ins));
+		if (kind == TOKEN_NUMBER || kind == TOKEN_FLOAT_NUMBER || kind == TOKEN_VARIABLE)
+		{
+			ins->opcode = kind == TOKEN_VARIABLE ? CALC_OP_LOAD : CALC_OP_PUSH;
+		}
+		else
+		{
+			ins->opcode = rpn->opcodes[i];
+			if (kind == TOKEN_FUNCTION)
+			{
+				ins->operand = rpn->values[i];
+			}
+			else if (kind == TOKEN_BRANCH)
+			{
+				ins->operand = (uint32_t)(i + 1 + rpn->values[i]);
+			}
+		}
+		size_t arity = instruction_arity(ins);
+		valid = ins->opcode != CALC_OP_NONE && depth >= arity;
+		depth = depth - arity + 1;
+	}
+	calc_expression view;
+	memset(&view, 0, sizeof(view));
+	view.code = code;
+	view.length = rpn->length;
+	calc_status status = valid && depth == 1 ? check_branches(&view) : CALC_ERROR_SYNTAX;
+	calc_free(code);
+	return status == CALC_OK || fail_operation(err_code, (int)status);
+}
+
+static calc_status build_expression(const token_stream* rpn, const calc_widths* widths, calc_expression** expression)
+{
+	size_t count = rpn->length;
+	size_t names_size = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (rpn->kinds[i] == TOKEN_VARIABLE)
+		{
+			names_size += strlen(token_stream_literal(rpn, i)) + 1;
+		}
+	}
+
+	size_t size = sizeof(calc_expression) + count * sizeof(calc_instruction) + count * sizeof(calc_value) +
+				  count * sizeof(uint32_t) + names_size;
+	calc_expression* expr = calc_malloc(size);
+	if (!expr)
+	{
+		return CALC_ERROR_NO_MEMORY;
+	}
+	calc_instruction* code = (calc_instruction*)(expr + 1);
+	calc_value* constants = (calc_value*)(code + count);
+	uint32_t* slots = (uint32_t*)(constants + count);
+	char* names = (char*)(slots + count);
+	expr->code = code;
+	expr->constants = constants;
+	expr->slots = slots;
+	expr->names = names;
+	expr->length = 0;
+	expr->constant_count = 0;
+	expr->slot_count = 0;
+	expr->max_depth = 0;
+	expr->int_bits = widths->int_bits;
+	expr->float_bits = widths->float_bits;
+
+	size_t names_used = 0;
+	size_t depth = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		token_type kind = (token_type)rpn->kinds[i];
+		calc_instruction* ins = &code[expr->length++];
+		memset(ins, 0, sizeof(*ins));
+		int err_code = 0;
+
+		if (kind == TOKEN_NUMBER || kind == TOKEN_FLOAT_NUMBER)
+		{
+			calc_value* c = &constants[expr->constant_count];
+			const char* literal = token_stream_literal(rpn, i);
+			memset(c, 0, sizeof(*c));
+			bool parsed = true;
+			if (kind == TOKEN_FLOAT_NUMBER && widths->float_bits == 64)
+			{
+				c->type = CALC_VALUE_DOUBLE;
+				c->double_value = strtod(literal, NULL);
+			}
+			else if (kind == TOKEN_FLOAT_NUMBER)
+			{
+				c->type = CALC_VALUE_FLOAT;
+				c->float_value = strtof(literal, NULL);
+			}
+			else if (widths->int_bits == 64)
+			{
+				c->type = CALC_VALUE_INT64;
+				parsed = parse_string_to_int64(literal, &c->int64_value, &err_code);
+			}
+			else
+			{
+				c->type = CALC_VALUE_INT;
+				parsed = parse_string_to_int(literal, &c->int_value, &err_code);
+			}
+			if (!parsed)
+			{
+				calc_free(expr);
+				return CALC_ERROR_UNSUPPORTED;
+			}
+			ins->opcode = CALC_OP_PUSH;
+			ins->operand = (uint32_t)expr->constant_count++;
+		}
+		else if (kind == TOKEN_VARIABLE)
+		{
+			const char* name = token_stream_literal(rpn, i);
+			size_t slot = 0;
+			while (slot < expr->slot_count && strcmp(names + slots[slot], name) != 0)
+			{
+				slot++;
+			}
+			if (slot == expr->slot_count)
+			{
+				slots[slot] = (uint32_t)names_used;
+				strcpy(names + names_used, name);
+				names_used += strlen(name) + 1;
+				expr->slot_count++;
+			}
+			ins->opcode = CALC_OP_LOAD;
+			ins->operand = (uint32_t)slot;
+		}
+		else
+		{
+			calc_opcode op = (calc_opcode)rpn->opcodes[i];
+			size_t arity = kind == TOKEN_OPERATOR   ? (op == CALC_OP_SELECT ? 3 : 2)
+						   : kind == TOKEN_FUNCTION ? function_table[rpn->values[i]].arity
+													: 1;
+			if (op == CALC_OP_NONE || depth < arity)
+			{
+				calc_free(expr);
+				return op == CALC_OP_NONE ? CALC_ERROR_UNSUPPORTED : CALC_ERROR_SYNTAX;
+			}
+			/* A branch marker leaves the depth unchanged; its operand is the absolute jump target. */
+			ins->opcode = (uint8_t)op;
+			if (op == CALC_OP_CALL)
+			{
+				ins->operand = rpn->values[i];
+			}
+			else if (kind == TOKEN_BRANCH)
+			{
+				ins->operand = (uint32_t)(i + 1 + rpn->values[i]);
+			}
+			depth -= arity;
+		}
+
+		depth++;
+		if (depth > expr->max_depth)
+		{
+			expr->max_depth = depth;
+		}
+	}
+
+	calc_status status = depth == 1 ? check_branches(expr) : CALC_ERROR_SYNTAX;
+	if (status != CALC_OK)
+	{
+		calc_free(expr);
+		return status;
+	}
+	*expression = expr;
+	return CALC_OK;
+}
+
+calc_status calc_compile(const calc_context* context, const char* text, calc_expression** expression)
+{
+	if (!context || !text || !expression)
+	{
+		return CALC_ERROR_INVALID_ARGUMENT;
+	}
+	*expression = NULL;
+	calc_core_budget budget;
+	context_scope previous = enter_context(context, &budget);
+
+	int err_code = 0;
+	calc_status status;
+	token_stream tokens;
+	token_stream rpn;
+	if (!initialize_token_stream(&tokens, 16))
+	{
+		leave_context(previous);
+		return CALC_ERROR_NO_MEMORY;
+	}
+	if (!tokenize_stream(text, &tokens, &err_code))
+	{
+		delete_token_stream(&tokens);
+		leave_context(previous);
+		return err_code ? (calc_status)err_code : CALC_ERROR_UNSUPPORTED;
+	}
+
+	bool shunted = shunt_token_stream(&tokens, &rpn, &err_code);
+	delete_token_stream(&tokens);
+	if (!shunted)
+	{
+		leave_context(previous);
+		return (calc_status)err_code;
+	}
+
+	status = build_expression(&rpn, &context->widths, expression);
+	delete_token_stream(&rpn);
+	leave_context(previous);
+	return status;
+}
+
+static calc_status evaluate_dual(const calc_context* context, const calc_expression* expression,
+								 const calc_value* variables, const double* directions, size_t count,
+								 calc_value* result, double* derivatives)
+{
+	if (!context || !expression || !result || (expression->slot_count && !variables) || (count && !derivatives))
+	{
+		return CALC_ERROR_INVALID_ARGUMENT;
+	}
+	if (context->limits.max_stack && expression->max_depth > context->limits.max_stack)
+	{
+		return CALC_ERROR_STACK_LIMIT;
+	}
+	if (count && expression->max_depth > SIZE_MAX / sizeof(double) / count)
+	{
+		return CALC_ERROR_NO_MEMORY;
+	}
+
+	calc_core_budget budget;
+	context_scope previous = enter_context(context, &budget);
+	calc_value local[CALC_LOCAL_STACK];
+	calc_value* st = local;
+	double* tangents = NULL;
+	if (expression->max_depth > CALC_LOCAL_STACK)
+	{
+		st = context->allocator.allocate(context->allocator.user_data, sizeof(calc_value) * expression->max_depth);
+	}
+	if (st && count)
+	{
+		tangents = context->allocator.allocate(context->allocator.user_data,
+											   sizeof(double) * expression->max_depth * count);
+	}
+	if (!st || (count && !tangents))
+	{
+		if (st && st != local)
+		{
+			context->allocator.release(context->allocator.user_data, st);
+		}
+		leave_context(previous);
+		return CALC_ERROR_NO_MEMORY;
+	}
+
+	int err_code = select_evaluator(expression, count != 0)(expression, variables, st, directions, count, tangents);
+
+	if (!err_code)
+	{
+		*result = st[0];
+		if (count)
+		{
+			memcpy(derivatives, tangents, count * sizeof(double));
+		}
+	}
+	if (tangents)
+	{
+		context->allocator.release(context->allocator.user_data, tangents);
+	}
+	if (st != local)
+	{
+		context->allocator.release(context->allocator.user_data, st);
+	}
+	leave_context(previous);
+	return (calc_status)err_code;
+}
+
+calc_status calc_evaluate_with(const calc_context* context, const calc_expression* expression,
+							   const calc_value* variables, calc_value* result)
+{
+	return evaluate_dual(context, expression, variables, NULL, 0, result, NULL);
+}
+
+calc_status calc_evaluate_gradient(const calc_context* context, const calc_expression* expression,
+								   const calc_value* variables, calc_value* result, double* gradient)
+{
+	return evaluate_dual(context, expression, variables, NULL, expression ? expression->slot_count : 0, result,
+						 gradient);
+}
+
+calc_status calc_evaluate_directional(const calc_context* context, const calc_expression* expression,
+									  const calc_value* variables, const double* directions, size_t direction_count,
+									  calc_value* result, double* derivatives)
+{
+	if (direction_count && !directions)
+	{
+		return CALC_ERROR_INVALID_ARGUMENT;
+	}
+	return evaluate_dual(context, expression, variables, directions, direction_count, result, derivatives);
+}
+
+static void column_value(const calc_column* column, size_t index, calc_value* value)
+{
+	value->type = column->type;
+	switch (column->type)
+	{
+	case CALC_VALUE_INT:
+		value->int_value = ((const int32_t*)column->data)[index];
+		break;
+	case CALC_VALUE_INT64:
+		value->int64_value = ((const int64_t*)column->data)[index];
+		break;
+	case CALC_VALUE_FLOAT:
+		value->float_value = ((const float*)column->data)[index];
+		break;
+	default:
+		value->double_value = ((const double*)column->data)[index];
+		break;
+	}
+}
+
+/* Points come from row-major variables or, when columns is set, from one typed array per slot. */
+static calc_status evaluate_blocks(const calc_context* context, const calc_expression* expression,
+								   const calc_value* variables, const calc_column* columns, size_t count,
+								   calc_value* results, calc_status* statuses)
+{
+	if (context->limits.max_stack && expression->max_depth > context->limits.max_stack)
+	{
+		return CALC_ERROR_STACK_LIMIT;
+	}
+	if (expression->max_depth > SIZE_MAX / CALC_BATCH_SLOT_BYTES ||
+		(columns && expression->slot_count > SIZE_MAX / sizeof(calc_value)))
+	{
+		return CALC_ERROR_NO_MEMORY;
+	}
+	/* The cost budget is per evaluation and charged in branch order, which only the scalar loop reproduces. */
+	if (context->limits.max_cost)
+	{
+		calc_value* row = NULL;
+		if (columns && expression->slot_count)
+		{
+			row = context->allocator.allocate(context->allocator.user_data, expression->slot_count * sizeof(*row));
+			if (!row)
+			{
+				return CALC_ERROR_NO_MEMORY;
+			}
+		}
+		for (size_t i = 0; i < count; i++)
+		{
+			const calc_value* point = row;
+			if (row)
+			{
+				for (size_t slot = 0; slot < expression->slot_count; slot++)
+				{
+					column_value(&columns[slot], i, &row[slot]);
+				}
+			}
+			else if (!columns && expression->slot_count)
+			{
+				point = variables + i * expression->slot_count;
+			}
+			statuses[i] = calc_evaluate_with(context, expression, point, &results[i]);
+		}
+		if (row)
+		{
+			context->allocator.release(context->allocator.user_data, row);
+		}
+		return CALC_OK;
+	}
+
+	calc_core_budget budget;
+	context_scope previous = enter_context(context, &budget);
+	size_t size = expression->max_depth * CALC_BATCH_SLOT_BYTES;
+	unsigned char* storage = context->allocator.allocate(context->allocator.user_data, size);
+	if (!storage)
+	{
+		leave_context(previous);
+		return CALC_ERROR_NO_MEMORY;
+	}
+	memset(storage, 0, size);
+	calc_batch_evaluator evaluate = select_batch_evaluator(expression);
+	for (size_t done = 0; done < count; done += CALC_BATCH_LANES)
+	{
+		size_t lanes = count - done < CALC_BATCH_LANES ? count - done : CALC_BATCH_LANES;
+		evaluate(expression, variables, columns, done, lanes, storage, results + done, statuses + done);
+	}
+	context->allocator.release(context->allocator.user_data, storage);
+	leave_context(previous);
+	return CALC_OK;
+}
+
+calc_status calc_evaluate_batch(const calc_context* context, const calc_expression* expression,
+								const calc_value* variables, size_t count, calc_value* results, calc_status* statuses)
+{
+	if (!context || !expression || (count && (!results || !statuses || (expression->slot_count && !variables))))
+	{
+		return CALC_ERROR_INVALID_ARGUMENT;
+	}
+	return evaluate_blocks(context, expression, variables, NULL, count, results, statuses);
+}
+
+calc_status calc_evaluate_columns(const calc_context* context, const calc_expression* expression,
+								  const calc_column* columns, size_t count, calc_value* results, calc_status* statuses)
+{
+	if (!context || !expression || (count && (!results || !statuses || (expression->slot_count && !columns))))
+	{
+		return CALC_ERROR_INVALID_ARGUMENT;
+	}
+	for (size_t slot = 0; count && slot < expression->slot_count; slot++)
+	{
+		if (!columns[slot].data || (unsigned)columns[slot].type > CALC_VALUE_DOUBLE)
+		{
+			return CALC_ERROR_INVALID_ARGUMENT;
+		}
+	}
+	return evaluate_blocks(context, expression, NULL, columns, count, results, statuses);
+}
+
+/*
+ * Fusing numbers the values of all expressions: a hash table over opcode, operand and operand numbers merges
+ * equal loads, constants and subexpressions into one step. Slots are then assigned by a scan over last uses,
+ * and each result is stored right after the step computing it, so the storage holds only live values.
+ */
+static uint64_t constant_bits(const calc_value* value)
+{
+	uint64_t bits = 0;
+	switch (value->type)
+	{
+	case CALC_VALUE_INT:
+		bits = (uint32_t)value->int_value;
+		break;
+	case CALC_VALUE_INT64:
+		bits = (uint64_t)value->int64_value;
+		break;
+	case CALC_VALUE_FLOAT:
+		memcpy(&bits, &value->float_value, sizeof(value->float_value));
+		break;
+	default:
+		memcpy(&bits, &value->double_value, sizeof(value->double_value));
+		break;
+	}
+	return bits;
+}
+
+/* PUSH steps are keyed by the constant itself, other steps by their operand. */
+static uint64_t step_hash(const batch_step* step, const calc_value* constant)
+{
+	uint64_t h = ((uint64_t)step->opcode << 8 | step->arity) * 0x9e3779b97f4a7c15ull;
+	h ^= constant ? constant_bits(constant) ^ (uint64_t)constant->type << 60 : step->operand;
+	for (size_t k = 0; k < step->arity; k++)
+	{
+		h = (h ^ h >> 29) * 0xff51afd7ed558ccdull;
+		h ^= step->sources[k];
+	}
+	h = (h ^ h >> 33) * 0xc4ceb9fe1a85ec53ull;
+	return h ^ h >> 33;
+}
+
+static bool same_step(const batch_step* step, const calc_value* constants, const batch_step* key,
+					  const calc_value* constant)
+{
+	if (step->opcode != key->opcode || step->arity != key->arity)
+	{
+		return false;
+	}
+	if (constant)
+	{
+		const calc_value* c = &constants[step->operand];
+		return c->type == constant->type && constant_bits(c) == constant_bits(constant);
+	}
+	return step->operand == key->operand && memcmp(step->sources, key->sources, step->arity * sizeof(uint32_t)) == 0;
+}
+
+static int compare_program_stores(const void* a, const void* b)
+{
+	const program_store* x = a;
+	const program_store* y = b;
+	if (x->step != y->step)
+	{
+		return x->step < y->step ? -1 : 1;
+	}
+	return x->output < y->output ? -1 : x->output > y->output;
+}
+
+calc_status calc_program_create(const calc_context* context, const calc_expression* const* expressions, size_t count,
+								calc_program** program)
+{
+	if (!context || !expressions || !count || !program)
+	{
+		return CALC_ERROR_INVALID_ARGUMENT;
+	}
+	*program = NULL;
+	size_t length = 0;
+	size_t slots = 0;
+	size_t max_depth = 0;
+	size_t max_slots = 0;
+	for (size_t e = 0; e < count; e++)
+	{
+		const calc_expression* expression = expressions[e];
+		if (!expression || expression->int_bits != expressions[0]->int_bits ||
+			expression->float_bits != expressions[0]->float_bits)
+		{
+			return CALC_ERROR_INVALID_ARGUMENT;
+		}
+		if (expression->length > UINT32_MAX / 4 - length || expression->slot_count > UINT32_MAX / 4 - slots)
+		{
+			return CALC_ERROR_NO_MEMORY;
+		}
+		length += expression->length;
+		slots += expression->slot_count;
+		max_depth = expression->max_depth > max_depth ? expression->max_depth : max_depth;
+		max_slots = expression->slot_count > max_slots ? expression->slot_count : max_slots;
+	}
+	if (count > UINT32_MAX / 4)
+	{
+		return CALC_ERROR_NO_MEMORY;
+	}
+
+	size_t buckets = 16;
+	while (buckets < 2 * length)
+	{
+		buckets *= 2;
+	}
+	size_t scratch_size = length * sizeof(calc_value) + slots * sizeof(const char*) + length * sizeof(batch_step) +
+						  (slots + buckets + 3 * length + count + max_depth) * sizeof(uint32_t);
+	unsigned char* scratch = context->allocator.allocate(context->allocator.user_data, scratch_size);
+	if (!scratch)
+	{
+		return CALC_ERROR_NO_MEMORY;
+	}
+	calc_value* constants = (calc_value*)scratch;
+	const char** names = (const char**)(constants + length);
+	batch_step* steps = (batch_step*)(names + slots);
+	uint32_t* slot_maps = (uint32_t*)(steps + length);
+	uint32_t* table = slot_maps + slots;
+	uint32_t* last_use = table + buckets;
+	uint32_t* step_slots = last_use + length;
+	uint32_t* free_slots = step_slots + length;
+	uint32_t* roots = free_slots + length;
+	uint32_t* operands = roots + count;
+	memset(table, 0, buckets * sizeof(uint32_t));
+
+	size_t step_count = 0;
+	size_t constant_count = 0;
+	size_t slot_count = 0;
+	size_t mapped = 0;
+	calc_status status = CALC_OK;
+	for (size_t e = 0; e < count && status == CALC_OK; e++)
+	{
+		const calc_expression* expression = expressions[e];
+		uint32_t* map = slot_maps + mapped;
+		mapped += expression->slot_count;
+		for (size_t s = 0; s < expression->slot_count; s++)
+		{
+			const char* name = expression->names + expression->slots[s];
+			size_t p = 0;
+			while (p < slot_count && strcmp(names[p], name) != 0)
+			{
+				p++;
+			}
+			if (p == slot_count)
+			{
+				names[slot_count++] = name;
+			}
+			map[s] = (uint32_t)p;
+		}
+
+		size_t top = 0;
+		for (size_t i = 0; i < expression->length; i++)
+		{
+			const calc_instruction* ins = &expression->code[i];
+			if (ins->opcode >= CALC_OP_AND_THEN)
+			{
+				continue;
+			}
+			if (ins->opcode == CALC_OP_CALL && !registered_function(ins->operand))
+			{
+				status = CALC_ERROR_UNSUPPORTED;
+				break;
+			}
+			batch_step key;
+			memset(&key, 0, sizeof(key));
+			key.opcode = ins->opcode;
+			key.arity = (uint8_t)instruction_arity(ins);
+			key.operand = ins->opcode == CALC_OP_LOAD ? map[ins->operand] : ins->operand;
+			const calc_value* constant = ins->opcode == CALC_OP_PUSH ? &expression->constants[ins->operand] : NULL;
+			top -= key.arity;
+			memcpy(key.sources, operands + top, key.arity * sizeof(uint32_t));
+			size_t b = step_hash(&key, constant) & (buckets - 1);
+			while (table[b] && !same_step(&steps[table[b] - 1], constants, &key, constant))
+			{
+				b = (b + 1) & (buckets - 1);
+			}
+			if (!table[b])
+			{
+				if (constant)
+				{
+					constants[constant_count] = *constant;
+					key.operand = (uint32_t)constant_count++;
+				}
+				steps[step_count++] = key;
+				table[b] = (uint32_t)step_count;
+			}
+			operands[top++] = table[b] - 1;
+		}
+		roots[e] = operands[0];
+	}
+
+	for (size_t n = 0; n < step_count; n++)
+	{
+		last_use[n] = (uint32_t)n;
+		for (size_t k = 0; k < steps[n].arity; k++)
+		{
+			last_use[steps[n].sources[k]] = (uint32_t)n;
+		}
+	}
+	size_t depth = 0;
+	size_t free_count = 0;
+	for (size_t n = 0; n < step_count && status == CALC_OK; n++)
+	{
+		batch_step* step = &steps[n];
+		uint32_t sources[CALC_FUNCTION_MAX_ARITY];
+		memcpy(sources, step->sources, step->arity * sizeof(uint32_t));
+		if (step->arity && last_use[sources[0]] == n)
+		{
+			step->target = step_slots[sources[0]];
+		}
+		else
+		{
+			step->target = free_count ? free_slots[--free_count] : (uint32_t)depth++;
+		}
+		for (size_t k = 0; k < step->arity; k++)
+		{
+			bool repeated = false;
+			for (size_t j = 0; j < k; j++)
+			{
+				repeated |= sources[j] == sources[k];
+			}
+			if (!repeated && last_use[sources[k]] == n && step_slots[sources[k]] != step->target)
+			{
+				free_slots[free_count++] = step_slots[sources[k]];
+			}
+			step->sources[k] = step_slots[sources[k]];
+		}
+		step_slots[n] = step->target;
+		if (last_use[n] == n)
+		{
+			free_slots[free_count++] = step->target;
+		}
+	}
+
+	size_t size = sizeof(calc_program) + constant_count * sizeof(calc_value) + count * sizeof(calc_expression*) +
+				  slot_count * sizeof(const char*) + step_count * sizeof(batch_step) + count * sizeof(program_store) +
+				  slots * sizeof(uint32_t);
+	calc_program* p = status == CALC_OK ? context->allocator.allocate(context->allocator.user_data, size) : NULL;
+	if (!p)
+	{
+		context->allocator.release(context->allocator.user_data, scratch);
+		return status == CALC_OK ? CALC_ERROR_NO_MEMORY : status;
+	}
+	calc_value* program_constants = (calc_value*)(p + 1);
+	const calc_expression** program_expressions = (const calc_expression**)(program_constants + constant_count);
+	const char** program_names = (const char**)(program_expressions + count);
+	batch_step* program_steps = (batch_step*)(program_names + slot_count);
+	program_store* stores = (program_store*)(program_steps + step_count);
+	uint32_t* program_maps = (uint32_t*)(stores + count);
+	memcpy(program_constants, constants, constant_count * sizeof(calc_value));
+	memcpy(program_expressions, expressions, count * sizeof(calc_expression*));
+	memcpy(program_names, names, slot_count * sizeof(const char*));
+	memcpy(program_steps, steps, step_count * sizeof(batch_step));
+	memcpy(program_maps, slot_maps, slots * sizeof(uint32_t));
+	for (size_t e = 0; e < count; e++)
+	{
+		stores[e].step = roots[e];
+		stores[e].slot = step_slots[roots[e]];
+		stores[e].output = (uint32_t)e;
+	}
+	qsort(stores, count, sizeof(program_store), compare_program_stores);
+	context->allocator.release(context->allocator.user_data, scratch);
+
+	p->output_count = count;
+	p->slot_count = slot_count;
+	p->step_count = step_count;
+	p->depth = depth;
+	p->max_depth = max_depth;
+	p->max_slots = max_slots;
+	p->int_bits = expressions[0]->int_bits;
+	p->float_bits = expressions[0]->float_bits;
+	p->expressions = program_expressions;
+	p->names = program_names;
+	p->constants = program_constants;
+	p->steps = program_steps;
+	p->stores = stores;
+	p->slot_maps = program_maps;
+	*program = p;
+	return CALC_OK;
+}
+
+void calc_program_free(const calc_context* context, calc_program* program)
+{
+	if (!context || !program)
+	{
+		return;
+	}
+	context->allocator.release(context->allocator.user_data, program);
+}
+
+size_t calc_program_variable_count(const calc_program* program)
+{
+	return program ? program->slot_count : 0;
+}
+
+const char* calc_program_variable_name(const calc_program* program, size_t slot)
+{
+	if (!program || slot >= program->slot_count)
+	{
+		return NULL;
+	}
+	return program->names[slot];
+}
+
+static calc_status evaluate_program(const calc_context* context, const calc_program* program,
+									const calc_value* variables, const calc_column* columns, size_t count,
+									calc_value* results, calc_status* statuses)
+{
+	if (context->limits.max_stack && program->max_depth > context->limits.max_stack)
+	{
+		return CALC_ERROR_STACK_LIMIT;
+	}
+	if (program->depth > SIZE_MAX / CALC_BATCH_SLOT_BYTES)
+	{
+		return CALC_ERROR_NO_MEMORY;
+	}
+	const size_t outputs = program->output_count;
+	/* As in evaluate_blocks, a cost limit needs the scalar evaluator: each expression gets its own row. */
+	if (context->limits.max_cost)
+	{
+		calc_value* row = NULL;
+		if (program->max_slots)
+		{
+			row = context->allocator.allocate(context->allocator.user_data, program->max_slots * sizeof(*row));
+			if (!row)
+			{
+				return CALC_ERROR_NO_MEMORY;
+			}
+		}
+		for (size_t i = 0; i < count; i++)
+		{
+			const uint32_t* map = program->slot_maps;
+			for (size_t e = 0; e < outputs; e++)
+			{
+				const calc_expression* expression = program->expressions[e];
+				for (size_t s = 0; s < expression->slot_count; s++)
+				{
+					if (columns)
+					{
+						column_value(&columns[map[s]], i, &row[s]);
+					}
+					else
+					{
+						row[s] = variables[i * program->slot_count + map[s]];
+					}
+				}
+				map += expression->slot_count;
+				statuses[i * outputs + e] = calc_evaluate_with(context, expression, row, &results[i * outputs + e]);
+			}
+		}
+		if (row)
+		{
+			context->allocator.release(context->allocator.user_data, row);
+		}
+		return CALC_OK;
+	}
+
+	calc_core_budget budget;
+	context_scope previous = enter_context(context, &budget);
+	size_t size = program->depth * CALC_BATCH_SLOT_BYTES;
+	unsigned char* storage = context->allocator.allocate(context->allocator.user_data, size);
+	if (!storage)
+	{
+		leave_context(previous);
+		return CALC_ERROR_NO_MEMORY;
+	}
+	memset(storage, 0, size);
+	calc_program_evaluator evaluate = select_program_evaluator(program);
+	for (size_t done = 0; done < count; done += CALC_BATCH_LANES)
+	{
+		size_t lanes = count - done < CALC_BATCH_LANES ? count - done : CALC_BATCH_LANES;
+		batch_block block = { program->constants, variables, columns, program->slot_count, done, lanes,
+							  program->depth, storage };
+		evaluate(program, &block, results + done * outputs, statuses + done * outputs);
+	}
+	context->allocator.release(context->allocator.user_data, storage);
+	leave_context(previous);
+	return CALC_OK;
+}
+
+calc_status calc_program_evaluate(const calc_context* context, const calc_program* program,
+								  const calc_value* variables, size_t count, calc_value* results, calc_status* statuses)
+{
+	if (!context || !program || (count && (!results || !statuses || (program->slot_count && !variables))))
+	{
+		return CALC_ERROR_INVALID_ARGUMENT;
+	}
+	return evaluate_program(context, program, variables, NULL, count, results, statuses);
+}
+
+calc_status calc_program_evaluate_columns(const calc_context* context, const calc_program* program,
+										  const calc_column* columns, size_t count, calc_value* results,
+										  calc_status* statuses)
+{
+	if (!context || !program || (count && (!results || !statuses || (program->slot_count && !columns))))
+	{
+		return CALC_ERROR_INVALID_ARGUMENT;
+	}
+	for (size_t slot = 0; count && slot < program->slot_count; slot++)
+	{
+		if (!columns[slot].data || (unsigned)columns[slot].type > CALC_VALUE_DOUBLE)
+		{
+			return CALC_ERROR_INVALID_ARGUMENT;
+		}
+	}
+	return evaluate_program(context, program, NULL, columns, count, results, statuses);
+}
+
+calc_status calc_evaluate(const calc_context* context, const calc_expression* expression, calc_value* result)
+{
+	return calc_evaluate_with(context, expression, NULL, result);
+}
+
+size_t calc_expression_variable_count(const calc_expression* expression)
+{
+	return expression ? expression->slot_count : 0;
+}
+
+const char* calc_expression_variable_name(const calc_expression* expression, size_t slot)
+{
+	if (!expression || slot >= expression->slot_count)
+	{
+		return NULL;
+	}
+	return expression->names + expression->slots[slot];
+}
+
+void calc_expression_free(const calc_context* context, calc_expression* expression)
+{
+	if (!context || !expression)
+	{
+		return;
+	}
+	context->allocator.release(context->allocator.user_data, expression);
+}
+
+calc_status calc_evaluate_text(const calc_context* context, const char* text, calc_value* result)
+{
+	calc_expression* expression = NULL;
+	calc_status status = calc_compile(context, text, &expression);
+	if (status != CALC_OK)
+	{
+		return status;
+	}
+	status = calc_evaluate(context, expression, result);
+	calc_expression_free(context, expression);
+	return status;
+}
+
+#define CALC_LIBRARY_MAGIC 0x004e4942434c4143ull
+#define CALC_LIBRARY_VERSION 2u
+
+typedef struct
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t expression_count;
+	uint64_t directory_offset;
+	uint64_t code_offset;
+	uint64_t constant_offset;
+	uint64_t slot_offset;
+	uint64_t name_offset;
+	uint64_t file_size;
+	uint64_t checksum;
+} calc_library_header;
+
+typedef struct
+{
+	uint32_t code_start;
+	uint32_t code_length;
+	uint32_t constant_start;
+	uint32_t constant_count;
+	uint32_t slot_start;
+	uint32_t slot_count;
+	uint32_t max_depth;
+	uint32_t status;
+	uint32_t int_bits;
+	uint32_t float_bits;
+} calc_library_entry;
+
+struct calc_library
+{
+	const unsigned char* base;
+	size_t size;
+	const calc_library_header* header;
+	const calc_library_entry* entries;
+	const calc_instruction* code;
+	const calc_value* constants;
+	const uint32_t* slots;
+	const char* names;
+	size_t names_size;
+	calc_status* statuses;
+};
+
+_Static_assert(sizeof(calc_value) == 16, "calc_value must match the on-disk constant layout");
+_Static_assert(sizeof(calc_instruction) == 8, "calc_instruction must match the on-disk code layout");
+_Static_assert(sizeof(calc_library_entry) == 40, "calc_library_entry must match the on-disk directory layout");
+
+static uint64_t checksum_bytes(const unsigned char* data, size_t length)
+{
+	uint64_t h = 0x9e3779b97f4a7c15ull ^ length;
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8)
+	{
+		uint64_t w;
+		memcpy(&w, data + i, sizeof(w));
+		h = (h ^ w) * 0xff51afd7ed558ccdull;
+		h ^= h >> 29;
+	}
+	for (; i < length; i++)
+	{
+		h = (h ^ data[i]) * 0x100000001b3ull;
+	}
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+static size_t align8(size_t n)
+{
+	return (n + 7) & ~(size_t)7;
+}
+
+calc_status calc_library_write(const calc_context* context, const char* path,
+							   const calc_expression* const* expressions, const calc_status* statuses, size_t count)
+{
+	if (!context || !path || (count && !expressions))
+	{
+		return CALC_ERROR_INVALID_ARGUMENT;
+	}
+
+	size_t code_count = 0;
+	size_t constant_count = 0;
+	size_t slot_count = 0;
+	size_t names_size = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		const calc_expression* e = expressions[i];
+		if (!e)
+		{
+			continue;
+		}
+		/* Plug-in indices depend on load order, so only built-in calls can be stored. */
+		for (size_t k = 0; k < e->length; k++)
+		{
+			if (e->code[k].opcode == CALC_OP_CALL && e->code[k].operand >= BUILTIN_FUNCTION_COUNT)
+			{
+				return CALC_ERROR_UNSUPPORTED;
+			}
+		}
+		code_count += e->length;
+		constant_count += e->constant_count;
+		slot_count += e->slot_count;
+		for (size_t s = 0; s < e->slot_count; s++)
+		{
+			names_size += strlen(e->names + e->slots[s]) + 1;
+		}
+	}
+	if (code_count > UINT32_MAX || constant_count > UINT32_MAX || slot_count > UINT32_MAX || names_size > UINT32_MAX)
+	{
+		return CALC_ERROR_INVALID_ARGUMENT;
+	}
+
+	calc_library_header header;
+	memset(&header, 0, sizeof(header));
+	header.magic = CALC_LIBRARY_MAGIC;
+	header.version = CALC_LIBRARY_VERSION;
+	header.header_size = sizeof(calc_library_header);
+	header.expression_count = count;
+	header.directory_offset = align8(sizeof(calc_library_header));
+	header.code_offset = header.directory_offset + count * sizeof(calc_library_entry);
+	header.constant_offset = header.code_offset + code_count * sizeof(calc_instruction);
+	header.slot_offset = header.constant_offset + constant_count * sizeof(calc_value);
+	header.name_offset = header.slot_offset + align8(slot_count * sizeof(uint32_t));
+	header.file_size = header.name_offset + align8(names_size);
+
+	unsigned char* image = context->allocator.allocate(context->allocator.user_data, header.file_size);
+	if (!image)
+	{
+		return CALC_ERROR_NO_MEMORY;
+	}
+	memset(image, 0, header.file_size);
+
+	calc_library_entry* entries = (calc_library_entry*)(image + header.directory_offset);
+	calc_instruction* code = (calc_instruction*)(image + header.code_offset);
+	calc_value* constants = (calc_value*)(image + header.constant_offset);
+	uint32_t* slots = (uint32_t*)(image + header.slot_offset);
+	char* names = (char*)(image + header.name_offset);
+	size_t code_used = 0;
+	size_t constant_used = 0;
+	size_t slot_used = 0;
+	size_t names_used = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const calc_expression* e = expressions[i];
+		calc_library_entry* entry = &entries[i];
+		if (!e)
+		{
+			entry->status = statuses && statuses[i] != CALC_OK ? (uint32_t)statuses[i] : CALC_ERROR_SYNTAX;
+			continue;
+		}
+		entry->code_start = (uint32_t)code_used;
+		entry->code_length = (uint32_t)e->length;
+		entry->constant_start = (uint32_t)constant_used;
+		entry->constant_count = (uint32_t)e->constant_count;
+		entry->slot_start = (uint32_t)slot_used;
+		entry->slot_count = (uint32_t)e->slot_count;
+		entry->max_depth = (uint32_t)e->max_depth;
+		entry->int_bits = e->int_bits;
+		entry->float_bits = e->float_bits;
+
+		memcpy(code + code_used, e->code, e->length * sizeof(calc_instruction));
+		memcpy(constants + constant_used, e->constants, e->constant_count * sizeof(calc_value));
+		for (size_t s = 0; s < e->slot_count; s++)
+		{
+			const char* name = e->names + e->slots[s];
+			size_t length = strlen(name) + 1;
+			slots[slot_used + s] = (uint32_t)names_used;
+			memcpy(names + names_used, name, length);
+			names_used += length;
+		}
+		code_used += e->length;
+		constant_used += e->constant_count;
+		slot_used += e->slot_count;
+	}
+
+	header.checksum =
+		checksum_bytes(image + header.directory_offset, (size_t)(header.file_size - header.directory_offset));
+	memcpy(image, &header, sizeof(header));
+
+	size_t tmp_length = strlen(path) + 5;
+	char* tmp_path = context->allocator.allocate(context->allocator.user_data, tmp_length);
+	calc_status status = CALC_ERROR_NO_MEMORY;
+	if (tmp_path)
+	{
+		snprintf(tmp_path, tmp_length, "%s.tmp", path);
+		FILE* out = fopen(tmp_path, "wb");
+		status = CALC_ERROR_INVALID_ARGUMENT;
+		if (out)
+		{
+			bool ok = fwrite(image, 1, header.file_size, out) == header.file_size;
+			ok = fflush(out) == 0 && fsync(fileno(out)) == 0 && ok;
+			ok = fclose(out) == 0 && ok;
+			ok = ok && rename(tmp_path, path) == 0;
+			if (ok)
+			{
+				status = CALC_OK;
+			}
+			else
+			{
+				unlink(tmp_path);
+			}
+		}
+		context->allocator.release(context->allocator.user_data, tmp_path);
+	}
+	context->allocator.release(context->allocator.user_data, image);
+	return status;
+}
+
+static bool library_section_fits(const calc_library_header* h, uint64_t offset, uint64_t count, uint64_t element)
+{
+	return offset % 8 == 0 && offset <= h->file_size && (h->file_size - offset) / element >= count;
+}
+
+/*
+ * Mapped code is run without further checks, so each entry is verified once at open the way the compiler builds
+ * it: known opcodes, constant, slot and built-in function indices in range, names terminated inside their
+ * section, a stack that never underflows or outgrows max_depth and well-nested branches.
+ */
+static calc_status verify_library_entry(const calc_library* library, size_t index)
+{
+	const calc_library_entry* e = &library->entries[index];
+	if (e->status != CALC_OK)
+	{
+		return e->status > CALC_ERROR_COST_LIMIT ? CALC_ERROR_SYNTAX : (calc_status)e->status;
+	}
+	const calc_library_header* h = library->header;
+	uint64_t code_total = (h->constant_offset - h->code_offset) / sizeof(calc_instruction);
+	uint64_t constant_total = (h->slot_offset - h->constant_offset) / sizeof(calc_value);
+	uint64_t slot_total = (h->name_offset - h->slot_offset) / sizeof(uint32_t);
+	if ((uint64_t)e->code_start + e->code_length > code_total ||
+		(uint64_t)e->constant_start + e->constant_count > constant_total ||
+		(uint64_t)e->slot_start + e->slot_count > slot_total || e->code_length == 0 || e->max_depth == 0 ||
+		e->max_depth > e->code_length || (e->int_bits != 32 && e->int_bits != 64) ||
+		(e->float_bits != 32 && e->float_bits != 64))
+	{
+		return CALC_ERROR_SYNTAX;
+	}
+
+	const calc_value* constants = library->constants + e->constant_start;
+	for (size_t c = 0; c < e->constant_count; c++)
+	{
+		if ((unsigned)constants[c].type > CALC_VALUE_DOUBLE)
+		{
+			return CALC_ERROR_SYNTAX;
+		}
+	}
+	const uint32_t* slots = library->slots + e->slot_start;
+	for (size_t slot = 0; slot < e->slot_count; slot++)
+	{
+		if (slots[slot] >= library->names_size ||
+			!memchr(library->names + slots[slot], '\0', library->names_size - slots[slot]))
+		{
+			return CALC_ERROR_SYNTAX;
+		}
+	}
+
+	calc_expression view;
+	view.length = e->code_length;
+	view.constant_count = e->constant_count;
+	view.slot_count = e->slot_count;
+	view.max_depth = e->max_depth;
+	view.code = library->code + e->code_start;
+	size_t depth = 0;
+	for (size_t i = 0; i < view.length; i++)
+	{
+		const calc_instruction* ins = &view.code[i];
+		calc_opcode op = (calc_opcode)ins->opcode;
+		if (op == CALC_OP_NONE || op > CALC_OP_ELSE || (op == CALC_OP_PUSH && ins->operand >= view.constant_count) ||
+			(op == CALC_OP_LOAD && ins->operand >= view.slot_count) ||
+			(op == CALC_OP_CALL && ins->operand >= BUILTIN_FUNCTION_COUNT))
+		{
+			return CALC_ERROR_SYNTAX;
+		}
+		size_t arity = instruction_arity(ins);
+		if (depth < arity || depth - arity + 1 > view.max_depth)
+		{
+			return CALC_ERROR_SYNTAX;
+		}
+		depth = depth - arity + 1;
+	}
+	return depth == 1 ? check_branches(&view) : CALC_ERROR_SYNTAX;
+}
+
+calc_status calc_library_open(const calc_context* context, const char* path, calc_library** library)
+{
+	if (!context || !path || !library)
+	{
+		return CALC_ERROR_INVALID_ARGUMENT;
+	}
+	*library = NULL;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return CALC_ERROR_INVALID_ARGUMENT;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(calc_library_header))
+	{
+		close(fd);
+		return CALC_ERROR_SYNTAX;
+	}
+	size_t size = (size_t)st.st_size;
+	void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		return CALC_ERROR_NO_MEMORY;
+	}
+
+	const calc_library_header* h = map;
+	uint64_t slot_count = (h->name_offset - h->slot_offset) / sizeof(uint32_t);
+	bool valid = h->magic == CALC_LIBRARY_MAGIC && h->version == CALC_LIBRARY_VERSION &&
+				 h->header_size == sizeof(calc_library_header) && h->file_size == size &&
+				 h->directory_offset >= sizeof(calc_library_header) &&
+				 library_section_fits(h, h->directory_offset, h->expression_count, sizeof(calc_library_entry)) &&
+				 h->code_offset >= h->directory_offset + h->expression_count * sizeof(calc_library_entry) &&
+				 h->constant_offset >= h->code_offset && h->slot_offset >= h->constant_offset &&
+				 h->name_offset >= h->slot_offset && h->file_size >= h->name_offset &&
+				 library_section_fits(h, h->code_offset, 0, 1) && library_section_fits(h, h->slot_offset, slot_count, 4) &&
+				 checksum_bytes((const unsigned char*)map + h->directory_offset, size - h->directory_offset) == h->checksum;
+	if (!valid)
+	{
+		munmap(map, size);
+		return CALC_ERROR_SYNTAX;
+	}
+
+	calc_library* lib = context->allocator.allocate(context->allocator.user_data, sizeof(calc_library));
+	if (!lib)
+	{
+		munmap(map, size);
+		return CALC_ERROR_NO_MEMORY;
+	}
+	lib->base = map;
+	lib->size = size;
+	lib->header = h;
+	lib->entries = (const calc_library_entry*)(lib->base + h->directory_offset);
+	lib->code = (const calc_instruction*)(lib->base + h->code_offset);
+	lib->constants = (const calc_value*)(lib->base + h->constant_offset);
+	lib->slots = (const uint32_t*)(lib->base + h->slot_offset);
+	lib->names = (const char*)(lib->base + h->name_offset);
+	lib->names_size = size - h->name_offset;
+	lib->statuses = context->allocator.allocate(context->allocator.user_data,
+												(h->expression_count ? h->expression_count : 1) * sizeof(calc_status));
+	if (!lib->statuses)
+	{
+		context->allocator.release(context->allocator.user_data, lib);
+		munmap(map, size);
+		return CALC_ERROR_NO_MEMORY;
+	}
+	for (size_t i = 0; i < h->expression_count; i++)
+	{
+		lib->statuses[i] = verify_library_entry(lib, i);
+	}
+	*library = lib;
+	return CALC_OK;
+}
+
+void calc_library_close(const calc_context* context, calc_library* library)
+{
+	if (!context || !library)
+	{
+		return;
+	}
+	munmap((void*)library->base, library->size);
+	context->allocator.release(context->allocator.user_data, library->statuses);
+	context->allocator.release(context->allocator.user_data, library);
+}
+
+size_t calc_library_count(const calc_library* library)
+{
+	return library ? (size_t)library->header->expression_count : 0;
+}
+
+static calc_status library_expression(const calc_library* library, size_t index, calc_expression* view)
+{
+	if (!library || index >= library->header->expression_count)
+	{
+		return CALC_ERROR_INVALID_ARGUMENT;
+	}
+	if (library->statuses[index] != CALC_OK)
+	{
+		return library->statuses[index];
+	}
+	const calc_library_entry* e = &library->entries[index];
+	view->length = e->code_length;
+	view->constant_count = e->constant_count;
+	view->slot_count = e->slot_count;
+	view->max_depth = e->max_depth;
+	view->int_bits = e->int_bits;
+	view->float_bits = e->float_bits;
+	view->code = library->code + e->code_start;
+	view->constants = library->constants + e->constant_start;
+	view->slots = library->slots + e->slot_start;
+	view->names = library->names;
+	return CALC_OK;
+}
+
+size_t calc_library_variable_count(const calc_library* library, size_t index)
+{
+	calc_expression view;
+	return library_expression(library, index, &view) == CALC_OK ? view.slot_count : 0;
+}
+
+const char* calc_library_variable_name(const calc_library* library, size_t index, size_t slot)
+{
+	calc_expression view;
+	if (library_expression(library, index, &view) != CALC_OK || slot >= view.slot_count ||
+		view.slots[slot] >= library->names_size)
+	{
+		return NULL;
+	}
+	return view.names + view.slots[slot];
+}
+
+calc_status calc_library_evaluate(const calc_context* context, const calc_library* library, size_t index,
+								  const calc_value* variables, calc_value* result)
+{
+	calc_expression view;
+	calc_status status = library_expression(library, index, &view);
+	if (status != CALC_OK)
+	{
+		return status;
+	}
+	return calc_evaluate_with(context, &view, variables, result);
+}
+
+const char* calc_status_string(calc_status status)
+{
+	switch (status)
+	{
+	case CALC_OK:
+		return "ok";
+	case CALC_ERROR_UNSUPPORTED:
+		return "unsupported token or operation";
+	case CALC_ERROR_SYNTAX:
+		return "malformed expression";
+	case CALC_ERROR_MATH:
+		return "math error";
+	case CALC_ERROR_INVALID_ARGUMENT:
+		return "invalid argument";
+	case CALC_ERROR_NO_MEMORY:
+		return "out of memory";
+	case CALC_ERROR_INPUT_LIMIT:
+		return "input size limit exceeded";
+	case CALC_ERROR_TOKEN_LIMIT:
+		return "token limit exceeded";
+	case CALC_ERROR_NESTING_LIMIT:
+		return "nesting limit exceeded";
+	case CALC_ERROR_STACK_LIMIT:
+		return "evaluation stack limit exceeded";
+	case CALC_ERROR_COST_LIMIT:
+		return "operation cost limit exceeded";
+	}
+	return "unknown error";
+}
+
+int calc_format_value(const calc_value* value, char* buffer, size_t size)
+{
+	switch (value->type)
+	{
+	case CALC_VALUE_FLOAT:
+		return snprintf(buffer, size, "%e", value->float_value);
+	case CALC_VALUE_DOUBLE:
+		return snprintf(buffer, size, "%.*e", DBL_DIG - 1, value->double_value);
+	case CALC_VALUE_INT64:
+		return snprintf(buffer, size, "%" PRId64, value->int64_value);
+	default:
+		return snprintf(buffer, size, "%d", value->int_value);
+	}
+}
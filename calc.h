@@ -0,0 +1,220 @@
+#ifndef CALC_H
+#define CALC_H
+
+/*
+ * Embeddable calculator library: tokenizer, shunting yard and evaluator of main.c.
+ *
+ *   make build/libcalc.a build/libcalc.so    (both compiled with -fvisibility=hidden; link -lm -ldl)
+ *   make test                                 (API tests against each library, command line tests)
+ *
+ * Every function except calc_register_function and calc_load_functions is reentrant; those two change the
+ * process-wide function registry and must finish before other threads compile or evaluate. A context is
+ * immutable after creation and may be shared between threads; a compiled expression is immutable and may
+ * be evaluated concurrently.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define CALC_API __attribute__((visibility("default")))
+#else
+#define CALC_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum
+{
+	CALC_OK = 0,
+	CALC_ERROR_UNSUPPORTED = 1,
+	CALC_ERROR_SYNTAX = 2,
+	CALC_ERROR_MATH = 3,
+	CALC_ERROR_INVALID_ARGUMENT = 4,
+	CALC_ERROR_NO_MEMORY = 5,
+	CALC_ERROR_INPUT_LIMIT = 6,
+	CALC_ERROR_TOKEN_LIMIT = 7,
+	CALC_ERROR_NESTING_LIMIT = 8,
+	CALC_ERROR_STACK_LIMIT = 9,
+	CALC_ERROR_COST_LIMIT = 10
+} calc_status;
+
+typedef enum
+{
+	CALC_VALUE_INT,
+	CALC_VALUE_FLOAT,
+	CALC_VALUE_INT64,
+	CALC_VALUE_DOUBLE
+} calc_value_type;
+
+typedef struct
+{
+	calc_value_type type;
+	union
+	{
+		int32_t int_value;
+		float float_value;
+		int64_t int64_value;
+		double double_value;
+	};
+} calc_value;
+
+typedef struct
+{
+	void* (*allocate)(void* user_data, size_t size);
+	void* (*reallocate)(void* user_data, void* ptr, size_t size);
+	void (*release)(void* user_data, void* ptr);
+	void* user_data;
+} calc_allocator;
+
+/*
+ * Per-context resource limits; zero leaves a limit off. Cost is one unit per operator or function plus
+ * the exponent bit length for integer powers; arbitrary-precision multiplications, divisions and powers are also
+ * charged one unit per pair of 9-digit limbs they multiply or divide.
+ */
+typedef struct
+{
+	size_t max_input_bytes;
+	size_t max_tokens;
+	size_t max_nesting;
+	size_t max_stack;
+	uint64_t max_cost;
+} calc_limits;
+
+/*
+ * Numeric widths of compiled expressions: 32 or 64 bits for integers and for floating point, zero meaning
+ * 32. Results and constants then use CALC_VALUE_INT64 and CALC_VALUE_DOUBLE; variables of any type are
+ * converted on load.
+ */
+typedef struct
+{
+	unsigned int_bits;
+	unsigned float_bits;
+} calc_widths;
+
+/*
+ * Process-wide function registry. sqrt, log2, sin, cos, tan, min, max, pow, atan2 and hypot are built in;
+ * arguments are separated by ',' and results are floating point. Names are a letter followed by letters
+ * or digits. Register functions before other threads compile or evaluate. A plug-in is a shared object
+ * exporting CALC_PLUGIN_SYMBOL as a calc_plugin_entry; the optional vector implementation receives one
+ * array per argument and is used by calc_apply_function.
+ */
+#define CALC_FUNCTION_MAX_ARITY 8
+#define CALC_FUNCTION_MAX_NAME 31
+#define CALC_PLUGIN_SYMBOL "calc_plugin_functions"
+
+typedef struct
+{
+	const char* name;
+	unsigned arity;
+	calc_status (*scalar)(const double* args, double* result);
+	calc_status (*vector)(const double* const* args, double* results, size_t count);
+} calc_function;
+
+typedef const calc_function* (*calc_plugin_entry)(size_t* count);
+
+typedef struct calc_context calc_context;
+typedef struct calc_expression calc_expression;
+typedef struct calc_library calc_library;
+typedef struct calc_program calc_program;
+
+CALC_API calc_status calc_context_create(const calc_allocator* allocator, calc_context** context);
+CALC_API calc_status calc_context_create_limited(const calc_allocator* allocator, const calc_limits* limits,
+												 calc_context** context);
+CALC_API calc_status calc_context_create_with_widths(const calc_allocator* allocator, const calc_limits* limits,
+													 const calc_widths* widths, calc_context** context);
+CALC_API void calc_context_destroy(calc_context* context);
+
+CALC_API calc_status calc_compile(const calc_context* context, const char* text, calc_expression** expression);
+CALC_API calc_status calc_evaluate(const calc_context* context, const calc_expression* expression,
+								   calc_value* result);
+CALC_API calc_status calc_evaluate_with(const calc_context* context, const calc_expression* expression,
+										const calc_value* variables, calc_value* result);
+CALC_API void calc_expression_free(const calc_context* context, calc_expression* expression);
+CALC_API size_t calc_expression_variable_count(const calc_expression* expression);
+CALC_API const char* calc_expression_variable_name(const calc_expression* expression, size_t slot);
+
+/*
+ * Forward-mode differentiation: one pass returns the value and its derivatives. The gradient has one entry
+ * per variable slot, with respect to floating-point variables; integer variables and integer results count
+ * as constants. calc_evaluate_directional takes direction_count rows of calc_expression_variable_count
+ * seeds and returns one directional derivative per row. Plug-in functions are not differentiable.
+ */
+CALC_API calc_status calc_evaluate_gradient(const calc_context* context, const calc_expression* expression,
+											const calc_value* variables, calc_value* result, double* gradient);
+CALC_API calc_status calc_evaluate_directional(const calc_context* context, const calc_expression* expression,
+											   const calc_value* variables, const double* directions,
+											   size_t direction_count, calc_value* result, double* derivatives);
+
+/*
+ * Batch evaluation of count points: variables holds one row of calc_expression_variable_count values per
+ * point, and each point gets its result and status as if passed to calc_evaluate_with. Points are evaluated
+ * in SIMD-friendly blocks; with a cost limit set they are evaluated one at a time instead.
+ */
+CALC_API calc_status calc_evaluate_batch(const calc_context* context, const calc_expression* expression,
+										 const calc_value* variables, size_t count, calc_value* results,
+										 calc_status* statuses);
+
+/* One typed array per variable slot for calc_evaluate_columns; the arrays are read in place. */
+typedef struct
+{
+	calc_value_type type;
+	const void* data;
+} calc_column;
+
+CALC_API calc_status calc_evaluate_columns(const calc_context* context, const calc_expression* expression,
+										   const calc_column* columns, size_t count, calc_value* results,
+										   calc_status* statuses);
+
+/*
+ * Fused evaluation of several expressions over the same points. calc_program_create merges them into one
+ * program whose variables are the union of theirs by name; equal loads, constants and subexpressions are
+ * evaluated once per block, and every block yields the results of all expressions before the next is loaded.
+ * Points are rows of calc_program_variable_count values or one column per slot; results and statuses get one
+ * row of count values per point, as calc_evaluate_batch would give for each expression. The expressions must
+ * share numeric widths and outlive the program.
+ */
+CALC_API calc_status calc_program_create(const calc_context* context, const calc_expression* const* expressions,
+										 size_t count, calc_program** program);
+CALC_API void calc_program_free(const calc_context* context, calc_program* program);
+CALC_API size_t calc_program_variable_count(const calc_program* program);
+CALC_API const char* calc_program_variable_name(const calc_program* program, size_t slot);
+CALC_API calc_status calc_program_evaluate(const calc_context* context, const calc_program* program,
+										   const calc_value* variables, size_t count, calc_value* results,
+										   calc_status* statuses);
+CALC_API calc_status calc_program_evaluate_columns(const calc_context* context, const calc_program* program,
+												   const calc_column* columns, size_t count, calc_value* results,
+												   calc_status* statuses);
+
+CALC_API calc_status calc_evaluate_text(const calc_context* context, const char* text, calc_value* result);
+
+/*
+ * Formula libraries: a versioned, checksummed image of compiled expressions (instruction array, constant
+ * pool, variable slot table, maximum stack depth, numeric widths) that calc_library_open maps with a single
+ * mmap and evaluates in place. NULL entries in calc_library_write are stored as failures with statuses[i].
+ */
+CALC_API calc_status calc_library_write(const calc_context* context, const char* path,
+										const calc_expression* const* expressions, const calc_status* statuses,
+										size_t count);
+CALC_API calc_status calc_library_open(const calc_context* context, const char* path, calc_library** library);
+CALC_API void calc_library_close(const calc_context* context, calc_library* library);
+CALC_API size_t calc_library_count(const calc_library* library);
+CALC_API size_t calc_library_variable_count(const calc_library* library, size_t index);
+CALC_API const char* calc_library_variable_name(const calc_library* library, size_t index, size_t slot);
+CALC_API calc_status calc_library_evaluate(const calc_context* context, const calc_library* library, size_t index,
+										   const calc_value* variables, calc_value* result);
+
+CALC_API calc_status calc_register_function(const calc_function* function);
+CALC_API calc_status calc_load_functions(const char* path);
+CALC_API calc_status calc_apply_function(const char* name, const double* const* args, double* results, size_t count);
+
+CALC_API const char* calc_status_string(calc_status status);
+CALC_API int calc_format_value(const calc_value* value, char* buffer, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
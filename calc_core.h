@@ -0,0 +1,228 @@
+#ifndef CALC_CORE_H
+#define CALC_CORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "calc.h"
+
+typedef enum
+{
+	TOKEN_NUMBER,
+	TOKEN_FLOAT_NUMBER,
+	TOKEN_OPERATOR,
+	TOKEN_UNARY_OPERATOR,
+	TOKEN_FUNCTION,
+	TOKEN_LPAREN,
+	TOKEN_RPAREN,
+	TOKEN_VARIABLE,
+	TOKEN_COMMA,
+	TOKEN_QUESTION,
+	TOKEN_COLON,
+	TOKEN_BRANCH,
+	TOKEN_NULL
+} token_type;
+
+typedef struct
+{
+	token_type type;
+	char* value;
+	int priority;
+} token;
+
+typedef struct
+{
+	token* data;
+	size_t top;
+	size_t capacity;
+} stack;
+
+/*
+ * Growable ring buffer. front and rear are free-running positions, capacity is a power of two and a
+ * position maps to slot position & (capacity - 1), so consumed slots are reused by later pushes.
+ */
+typedef struct
+{
+	token* data;
+	size_t front;
+	size_t rear;
+	size_t capacity;
+} queue;
+
+#define QUEUE_BATCH 32
+
+/*
+ * Token stream as parallel dense arrays: kind and opcode bytes plus a 32-bit value that is a literal pool
+ * offset for numbers and variables. Priorities are derived from (kind, opcode) instead of being stored.
+ */
+typedef struct
+{
+	uint8_t* kinds;
+	uint8_t* opcodes;
+	uint32_t* values;
+	size_t length;
+	size_t capacity;
+	char* literals;
+	size_t literals_length;
+	size_t literals_capacity;
+} token_stream;
+
+typedef enum
+{
+	CALC_OP_NONE,
+	CALC_OP_PUSH,
+	CALC_OP_LOAD,
+	CALC_OP_ADD,
+	CALC_OP_SUB,
+	CALC_OP_MUL,
+	CALC_OP_DIV,
+	CALC_OP_MOD,
+	CALC_OP_POW,
+	CALC_OP_SHL,
+	CALC_OP_SHR,
+	CALC_OP_AND,
+	CALC_OP_XOR,
+	CALC_OP_OR,
+	CALC_OP_POS,
+	CALC_OP_NEG,
+	CALC_OP_NOT,
+	CALC_OP_SQRT,
+	CALC_OP_LOG2,
+	CALC_OP_SIN,
+	CALC_OP_COS,
+	CALC_OP_TAN,
+	CALC_OP_CALL,
+	CALC_OP_LT,
+	CALC_OP_LE,
+	CALC_OP_GT,
+	CALC_OP_GE,
+	CALC_OP_EQ,
+	CALC_OP_NE,
+	CALC_OP_LAND,
+	CALC_OP_LOR,
+	CALC_OP_SELECT,
+	CALC_OP_AND_THEN,
+	CALC_OP_OR_ELSE,
+	CALC_OP_THEN,
+	CALC_OP_ELSE
+} calc_opcode;
+
+/*
+ * &&, || and ?: compile to branch markers placed after the operand that decides them: a AND_THEN b LAND,
+ * a OR_ELSE b LOR and c THEN a ELSE b SELECT. A taken branch pushes a placeholder 0 for the skipped
+ * operand and jumps over it; the strict LAND, LOR and SELECT then combine branch-free. Markers are
+ * TOKEN_BRANCH entries whose value is the number of tokens to skip.
+ */
+
+typedef struct
+{
+	uint8_t opcode;
+	uint8_t reserved[3];
+	uint32_t operand;
+} calc_instruction;
+
+typedef struct
+{
+	uint64_t allocations;
+	uint64_t reallocations;
+	uint64_t releases;
+	uint64_t token_allocations;
+	uint64_t stack_allocations;
+	uint64_t stack_reallocations;
+	uint64_t queue_allocations;
+	uint64_t queue_reallocations;
+	size_t peak_stack_capacity;
+	size_t peak_queue_capacity;
+} calc_core_stats;
+
+typedef struct
+{
+	calc_limits limits;
+	uint64_t cost;
+} calc_core_budget;
+
+/* int_bits value of calc_core_use_widths selecting arbitrary-precision integers in the token evaluator. */
+#define CALC_CORE_BIG_INTEGERS 0xffffffffu
+
+const calc_allocator* calc_core_use_allocator(const calc_allocator* allocator);
+calc_core_stats* calc_core_use_stats(calc_core_stats* stats);
+calc_core_budget* calc_core_use_budget(calc_core_budget* budget);
+const calc_widths* calc_core_use_widths(const calc_widths* widths);
+void calc_core_reset_cost(void);
+
+token make_token(token_type type, const char* text);
+void free_token(token* t);
+token copy_token(const token* t);
+
+bool is_digit_char(char c);
+bool is_letter_char(char c);
+bool is_valid_function(const char* func_name);
+
+bool initialize_stack(stack* s, size_t capacity);
+void delete_stack(stack* s);
+bool push_stack(stack* s, token input);
+token pop_stack(stack* s);
+token peek_stack(stack* s);
+bool is_empty_stack(stack* s);
+void clear_stack(stack* s);
+
+bool initialize_queue(queue* q, size_t capacity);
+void delete_queue(queue* q);
+bool reserve_queue(queue* q, size_t count);
+bool push_queue(queue* q, token input);
+bool push_queue_bulk(queue* q, const token* items, size_t count);
+token pop_queue(queue* q);
+size_t pop_queue_bulk(queue* q, token* items, size_t max);
+token* queue_at(const queue* q, size_t index);
+size_t queue_size(const queue* q);
+bool is_empty_queue(queue* q);
+
+bool is_right_assoc(const token* t);
+bool is_operator_token(const token* t);
+bool tokenizator(const char* math_expression, queue* res_queue, int* err_code);
+
+bool initialize_token_stream(token_stream* s, size_t capacity);
+void delete_token_stream(token_stream* s);
+bool reserve_token_stream(token_stream* s, size_t capacity);
+bool push_token_stream(token_stream* s, token_type kind, calc_opcode opcode, uint32_t value);
+bool push_token_literal(token_stream* s, token_type kind, const char* text, size_t length);
+const char* token_stream_literal(const token_stream* s, size_t index);
+int token_stream_priority(token_type kind, calc_opcode opcode);
+bool tokenize_stream(const char* math_expression, token_stream* tokens, int* err_code);
+bool shunt_token_stream(const token_stream* input, token_stream* output, int* err_code);
+bool check_token_stream(const token_stream* rpn, int* err_code);
+bool token_stream_to_queue(const token_stream* tokens, queue* res_queue, int* err_code);
+bool queue_to_token_stream(const queue* q, token_stream* tokens, int* err_code);
+
+bool safe_pow(int32_t a, int32_t b, int32_t* res);
+bool safe_pow_64(int64_t a, int64_t b, int64_t* res);
+calc_opcode binary_opcode(const char* op);
+calc_opcode unary_opcode(const char* op);
+calc_opcode function_opcode(const char* func_name);
+bool float_supported(calc_opcode op);
+bool integer_binary_operation(calc_opcode op, int32_t a, int32_t b, int32_t* res, int* err_code);
+bool integer_unary_operation(calc_opcode op, int32_t a, int32_t* res, int* err_code);
+bool float_binary_operation(calc_opcode op, float a, float b, float* res, int* err_code);
+bool float_unary_operation(calc_opcode op, float a, float* res, int* err_code);
+bool function_operation(calc_opcode op, float arg, float* res, int* err_code);
+bool integer_binary_operation_64(calc_opcode op, int64_t a, int64_t b, int64_t* res, int* err_code);
+bool integer_unary_operation_64(calc_opcode op, int64_t a, int64_t* res, int* err_code);
+bool float_binary_operation_64(calc_opcode op, double a, double b, double* res, int* err_code);
+bool float_unary_operation_64(calc_opcode op, double a, double* res, int* err_code);
+bool function_operation_64(calc_opcode op, double arg, double* res, int* err_code);
+
+bool binary_operators_operations(int32_t a, int32_t b, const char* op, int32_t* res, int* err_code);
+bool unary_operators_operations(int32_t a, const char* operation, int32_t* res, int* err_code);
+bool binary_operators_operations_float(float a, float b, const char* op, float* res, int* err_code);
+bool unary_operators_operations_float(float a, const char* operation, float* res, int* err_code);
+bool function_operations(const char* func_name, float arg, float* res, int* err_code);
+
+bool make_rpn_token(const char* text, token* result, int* err_code);
+queue shunting_yard_algorithm(queue input, int* err_code);
+bool calculate_token(stack* st, token cur, int* err_code);
+bool calculate_branch(stack* st, token cur, size_t* skip, int* err_code);
+bool finish_calculation(stack* st, token* result_token, int* err_code);
+bool calculate_expression(queue* q, token* result_token, int* err_code);
+
+#endif
@@ -0,0 +1,638 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shm_ring.h"
+
+#define SHM_WAIT_TIMEOUT_NS 100000000L
+
+static const char* default_expressions[] = {
+	"1 * 2 + 3",
+	"(17 + 4) * 3 - 8 / 2",
+	"2 ** 10 - 1",
+	"sqrt(2.0) * sin(0.5)",
+	"((1 << 12) | 255) ^ 77",
+	"-3 * (4 + ~5) % 7",
+};
+
+typedef struct
+{
+	const char* socket_path;
+	const char* expression;
+	size_t requests;
+	size_t window;
+	size_t index;
+	uint64_t* latencies;
+	size_t completed;
+	bool failed;
+} load_connection;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int connect_socket(const char* socket_path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Error: socket path is too long\n");
+		return -1;
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool write_all(int fd, const char* data, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		data += n;
+		length -= (size_t)n;
+	}
+	return true;
+}
+
+static void* copy_responses(void* arg)
+{
+	int fd = *(int*)arg;
+	char buffer[65536];
+	for (;;)
+	{
+		ssize_t n = read(fd, buffer, sizeof(buffer));
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			break;
+		}
+		fwrite(buffer, 1, (size_t)n, stdout);
+	}
+	fflush(stdout);
+	return NULL;
+}
+
+static int run_interactive(const char* socket_path)
+{
+	int fd = connect_socket(socket_path);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Error: Cannot connect to %s\n", socket_path);
+		return 5;
+	}
+
+	pthread_t reader;
+	if (pthread_create(&reader, NULL, copy_responses, &fd) != 0)
+	{
+		close(fd);
+		return 5;
+	}
+
+	char* line = NULL;
+	size_t capacity = 0;
+	ssize_t length;
+	int rc = 0;
+	while ((length = getline(&line, &capacity, stdin)) > 0)
+	{
+		if (line[length - 1] != '\n')
+		{
+			line[length++] = '\n';
+		}
+		if (!write_all(fd, line, (size_t)length))
+		{
+			fprintf(stderr, "Error: Connection closed by server\n");
+			rc = 5;
+			break;
+		}
+	}
+	free(line);
+
+	shutdown(fd, SHUT_WR);
+	pthread_join(reader, NULL);
+	close(fd);
+	return rc;
+}
+
+static const char* load_expression(load_connection* conn, size_t i)
+{
+	if (conn->expression)
+	{
+		return conn->expression;
+	}
+	size_t count = sizeof(default_expressions) / sizeof(default_expressions[0]);
+	return default_expressions[(conn->index + i) % count];
+}
+
+static bool send_load_request(load_connection* conn, int fd, size_t i, uint64_t* sent_at)
+{
+	char line[1024];
+	int length = snprintf(line, sizeof(line), "%s\n", load_expression(conn, i));
+	if (length < 0 || (size_t)length >= sizeof(line))
+	{
+		return false;
+	}
+	sent_at[i % conn->window] = now_ns();
+	return write_all(fd, line, (size_t)length);
+}
+
+static void* run_load_connection(void* arg)
+{
+	load_connection* conn = arg;
+	conn->failed = true;
+
+	int fd = connect_socket(conn->socket_path);
+	uint64_t* sent_at = calloc(conn->window, sizeof(uint64_t));
+	if (fd < 0 || !sent_at)
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		free(sent_at);
+		return NULL;
+	}
+
+	size_t sent = 0;
+	while (sent < conn->requests && sent < conn->window)
+	{
+		if (!send_load_request(conn, fd, sent, sent_at))
+		{
+			goto done;
+		}
+		sent++;
+	}
+
+	char buffer[65536];
+	while (conn->completed < conn->requests)
+	{
+		ssize_t n = read(fd, buffer, sizeof(buffer));
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			goto done;
+		}
+		for (ssize_t i = 0; i < n; i++)
+		{
+			if (buffer[i] != '\n')
+			{
+				continue;
+			}
+			conn->latencies[conn->completed] = now_ns() - sent_at[conn->completed % conn->window];
+			conn->completed++;
+			if (sent < conn->requests)
+			{
+				if (!send_load_request(conn, fd, sent, sent_at))
+				{
+					goto done;
+				}
+				sent++;
+			}
+		}
+	}
+	conn->failed = false;
+
+done:
+	free(sent_at);
+	close(fd);
+	return NULL;
+}
+
+static int compare_latencies(const void* a, const void* b)
+{
+	uint64_t la = *(const uint64_t*)a;
+	uint64_t lb = *(const uint64_t*)b;
+	return la < lb ? -1 : (la > lb ? 1 : 0);
+}
+
+static double percentile_us(const uint64_t* sorted, size_t count, double p)
+{
+	if (count == 0)
+	{
+		return 0.0;
+	}
+	size_t i = (size_t)(p * (double)(count - 1));
+	return (double)sorted[i] / 1000.0;
+}
+
+static int run_load(const char* socket_path, size_t connections, size_t requests, size_t window,
+					const char* expression)
+{
+	load_connection* conns = calloc(connections, sizeof(load_connection));
+	pthread_t* threads = calloc(connections, sizeof(pthread_t));
+	uint64_t* latencies = malloc(sizeof(uint64_t) * connections * requests);
+	if (!conns || !threads || !latencies)
+	{
+		fprintf(stderr, "Error: Cannot allocate load generator state\n");
+		free(conns);
+		free(threads);
+		free(latencies);
+		return 5;
+	}
+
+	uint64_t start = now_ns();
+	size_t started = 0;
+	for (size_t i = 0; i < connections; i++)
+	{
+		conns[i].socket_path = socket_path;
+		conns[i].expression = expression;
+		conns[i].requests = requests;
+		conns[i].window = window;
+		conns[i].index = i;
+		conns[i].latencies = latencies + i * requests;
+		if (pthread_create(&threads[i], NULL, run_load_connection, &conns[i]) != 0)
+		{
+			break;
+		}
+		started++;
+	}
+
+	size_t completed = 0;
+	size_t failed = 0;
+	for (size_t i = 0; i < started; i++)
+	{
+		pthread_join(threads[i], NULL);
+		memmove(latencies + completed, conns[i].latencies, sizeof(uint64_t) * conns[i].completed);
+		completed += conns[i].completed;
+		failed += conns[i].failed ? 1 : 0;
+	}
+	double elapsed = (double)(now_ns() - start) / 1e9;
+
+	qsort(latencies, completed, sizeof(uint64_t), compare_latencies);
+	printf("connections=%zu window=%zu requests=%zu failed_connections=%zu\n", started, window, completed, failed);
+	printf("elapsed_s=%.3f throughput_rps=%.0f\n", elapsed, elapsed > 0 ? (double)completed / elapsed : 0.0);
+	printf("latency_us p50=%.1f p90=%.1f p99=%.1f max=%.1f\n", percentile_us(latencies, completed, 0.50),
+		   percentile_us(latencies, completed, 0.90), percentile_us(latencies, completed, 0.99),
+		   percentile_us(latencies, completed, 1.0));
+
+	free(conns);
+	free(threads);
+	free(latencies);
+	return failed || started < connections ? 5 : 0;
+}
+
+/* The ring is single-producer, so *fd keeps the client lock until close_shm_ring; a second client is refused. */
+static shm_ring_region* open_shm_ring(const char* name, int* fd)
+{
+	*fd = shm_open(name, O_RDWR, 0);
+	if (*fd < 0)
+	{
+		fprintf(stderr, "Error: Cannot open shared memory object %s\n", name);
+		return NULL;
+	}
+	if (!shm_ring_try_lock(*fd, SHM_RING_CLIENT_LOCK))
+	{
+		fprintf(stderr, "Error: another client is attached to %s\n", name);
+		close(*fd);
+		return NULL;
+	}
+	shm_ring_region* ring = mmap(NULL, sizeof(shm_ring_region), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (ring == MAP_FAILED)
+	{
+		fprintf(stderr, "Error: Cannot map shared memory object %s\n", name);
+		close(*fd);
+		return NULL;
+	}
+	if (ring->magic != SHM_RING_MAGIC || ring->version != SHM_RING_VERSION || ring->slots != SHM_RING_SLOTS ||
+		atomic_load_explicit(&ring->state, memory_order_acquire) != SHM_RING_READY)
+	{
+		fprintf(stderr, "Error: %s is not a ready calculator ring\n", name);
+		munmap(ring, sizeof(shm_ring_region));
+		close(*fd);
+		return NULL;
+	}
+	return ring;
+}
+
+static void close_shm_ring(shm_ring_region* ring, int fd)
+{
+	munmap(ring, sizeof(shm_ring_region));
+	close(fd);
+}
+
+static bool submit_shm_expression(shm_ring_region* ring, uint32_t* tail, uint64_t tag, const char* text, size_t length)
+{
+	shm_ring_indices* sq = &ring->submissions;
+	for (;;)
+	{
+		uint32_t head = atomic_load_explicit(&sq->head, memory_order_acquire);
+		if (*tail - head < SHM_RING_SLOTS)
+		{
+			break;
+		}
+		if (!shm_ring_wait_change(&sq->head, &sq->producer_waiting, head, SHM_WAIT_TIMEOUT_NS) &&
+			atomic_load_explicit(&ring->state, memory_order_acquire) != SHM_RING_READY)
+		{
+			return false;
+		}
+	}
+
+	shm_submission* sqe = &ring->submission_slots[*tail % SHM_RING_SLOTS];
+	sqe->tag = tag;
+	sqe->length = (uint32_t)length;
+	memcpy(sqe->expression, text, length);
+	sqe->expression[length] = '\0';
+	(*tail)++;
+	shm_ring_publish(&sq->tail, &sq->consumer_waiting, *tail);
+	return true;
+}
+
+static bool reap_shm_completion(shm_ring_region* ring, uint32_t* head, shm_completion* out)
+{
+	shm_ring_indices* cq = &ring->completions;
+	for (;;)
+	{
+		uint32_t tail = atomic_load_explicit(&cq->tail, memory_order_acquire);
+		if (tail != *head)
+		{
+			break;
+		}
+		if (!shm_ring_wait_change(&cq->tail, &cq->consumer_waiting, tail, SHM_WAIT_TIMEOUT_NS) &&
+			atomic_load_explicit(&ring->state, memory_order_acquire) != SHM_RING_READY)
+		{
+			return false;
+		}
+	}
+
+	*out = ring->completion_slots[*head % SHM_RING_SLOTS];
+	(*head)++;
+	shm_ring_publish(&cq->head, &cq->producer_waiting, *head);
+	return true;
+}
+
+static void print_shm_completion(const shm_completion* cqe)
+{
+	if (cqe->err_code)
+	{
+		printf("error %d\n", cqe->err_code);
+	}
+	else if (cqe->type == SHM_RESULT_FLOAT)
+	{
+		float value;
+		memcpy(&value, &cqe->value, sizeof(value));
+		printf("%e\n", value);
+	}
+	else
+	{
+		printf("%d\n", cqe->value);
+	}
+}
+
+static int run_shm_interactive(const char* name)
+{
+	int fd;
+	shm_ring_region* ring = open_shm_ring(name, &fd);
+	if (!ring)
+	{
+		return 5;
+	}
+
+	uint32_t sq_tail = atomic_load_explicit(&ring->submissions.tail, memory_order_relaxed);
+	uint32_t cq_head = atomic_load_explicit(&ring->completions.head, memory_order_relaxed);
+	uint64_t submitted = 0;
+	uint64_t reaped = 0;
+	int rc = 0;
+
+	char* line = NULL;
+	size_t capacity = 0;
+	ssize_t length;
+	while (rc == 0 && (length = getline(&line, &capacity, stdin)) > 0)
+	{
+		while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+		{
+			line[--length] = '\0';
+		}
+		if (line[strspn(line, " \t")] == '\0')
+		{
+			continue;
+		}
+		if ((size_t)length >= SHM_RING_EXPRESSION_BYTES)
+		{
+			fprintf(stderr, "Error: expression longer than %u bytes\n", SHM_RING_EXPRESSION_BYTES - 1);
+			rc = 1;
+			break;
+		}
+		shm_completion cqe;
+		while (submitted - reaped >= SHM_RING_SLOTS)
+		{
+			if (!reap_shm_completion(ring, &cq_head, &cqe))
+			{
+				rc = 5;
+				break;
+			}
+			print_shm_completion(&cqe);
+			reaped++;
+		}
+		if (rc == 0 && !submit_shm_expression(ring, &sq_tail, submitted, line, (size_t)length))
+		{
+			rc = 5;
+		}
+		submitted++;
+	}
+	free(line);
+
+	while (rc == 0 && reaped < submitted)
+	{
+		shm_completion cqe;
+		if (!reap_shm_completion(ring, &cq_head, &cqe))
+		{
+			rc = 5;
+			break;
+		}
+		print_shm_completion(&cqe);
+		reaped++;
+	}
+	if (rc == 5)
+	{
+		fprintf(stderr, "Error: calculator ring %s was closed\n", name);
+	}
+
+	close_shm_ring(ring, fd);
+	return rc;
+}
+
+static int run_shm_load(const char* name, size_t requests, size_t window, const char* expression)
+{
+	int fd;
+	shm_ring_region* ring = open_shm_ring(name, &fd);
+	uint64_t* latencies = malloc(sizeof(uint64_t) * requests);
+	uint64_t* sent_at = calloc(window, sizeof(uint64_t));
+	if (!ring || !latencies || !sent_at || window > SHM_RING_SLOTS)
+	{
+		if (window > SHM_RING_SLOTS)
+		{
+			fprintf(stderr, "Error: window is larger than the ring (%u slots)\n", SHM_RING_SLOTS);
+		}
+		if (ring)
+		{
+			close_shm_ring(ring, fd);
+		}
+		free(latencies);
+		free(sent_at);
+		return 5;
+	}
+
+	uint32_t sq_tail = atomic_load_explicit(&ring->submissions.tail, memory_order_relaxed);
+	uint32_t cq_head = atomic_load_explicit(&ring->completions.head, memory_order_relaxed);
+	size_t count = sizeof(default_expressions) / sizeof(default_expressions[0]);
+	size_t submitted = 0;
+	size_t completed = 0;
+	size_t errors = 0;
+	bool failed = false;
+
+	uint64_t start = now_ns();
+	while (completed < requests)
+	{
+		while (submitted < requests && submitted - completed < window)
+		{
+			const char* text = expression ? expression : default_expressions[submitted % count];
+			sent_at[submitted % window] = now_ns();
+			if (!submit_shm_expression(ring, &sq_tail, submitted, text, strlen(text)))
+			{
+				failed = true;
+				break;
+			}
+			submitted++;
+		}
+		shm_completion cqe;
+		if (failed || !reap_shm_completion(ring, &cq_head, &cqe))
+		{
+			failed = true;
+			break;
+		}
+		latencies[completed] = now_ns() - sent_at[cqe.tag % window];
+		errors += cqe.err_code ? 1 : 0;
+		completed++;
+	}
+	double elapsed = (double)(now_ns() - start) / 1e9;
+
+	qsort(latencies, completed, sizeof(uint64_t), compare_latencies);
+	printf("shm=%s window=%zu requests=%zu errors=%zu\n", name, window, completed, errors);
+	printf("elapsed_s=%.3f throughput_rps=%.0f\n", elapsed, elapsed > 0 ? (double)completed / elapsed : 0.0);
+	printf("latency_us p50=%.1f p90=%.1f p99=%.1f max=%.1f\n", percentile_us(latencies, completed, 0.50),
+		   percentile_us(latencies, completed, 0.90), percentile_us(latencies, completed, 0.99),
+		   percentile_us(latencies, completed, 1.0));
+
+	close_shm_ring(ring, fd);
+	free(latencies);
+	free(sent_at);
+	return failed ? 5 : 0;
+}
+
+static bool parse_count(const char* str, size_t* result)
+{
+	char* endp = NULL;
+	unsigned long long value = strtoull(str, &endp, 10);
+	if (endp == str || *endp != '\0' || *str == '-' || value == 0)
+	{
+		return false;
+	}
+	*result = (size_t)value;
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		fprintf(stderr,
+				"Usage: %s socket_path\n"
+				"       %s socket_path --load [-c connections] [-n requests] [-w window] [-e expression]\n"
+				"       %s --shm name [--load [-n requests] [-w window] [-e expression]]\n",
+				argv[0], argv[0], argv[0]);
+		return 1;
+	}
+
+	bool shm = strcmp(argv[1], "--shm") == 0;
+	if (shm && argc < 3)
+	{
+		fprintf(stderr, "Error: missing shared memory name after --shm\n");
+		return 1;
+	}
+	const char* target = shm ? argv[2] : argv[1];
+
+	bool load = false;
+	size_t connections = 4;
+	size_t requests = 100000;
+	size_t window = 1;
+	const char* expression = NULL;
+
+	for (int i = shm ? 3 : 2; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--load") == 0)
+		{
+			load = true;
+		}
+		else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+		{
+			expression = argv[++i];
+		}
+		else if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "-w") == 0) &&
+				 i + 1 < argc)
+		{
+			size_t* count = argv[i][1] == 'c' ? &connections : (argv[i][1] == 'n' ? &requests : &window);
+			if (!parse_count(argv[i + 1], count))
+			{
+				fprintf(stderr, "Error: invalid count %s for %s\n", argv[i + 1], argv[i]);
+				return 1;
+			}
+			i++;
+		}
+		else
+		{
+			fprintf(stderr, "Error: unknown argument %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	if (shm)
+	{
+		return load ? run_shm_load(target, requests, window, expression) : run_shm_interactive(target);
+	}
+	if (load)
+	{
+		return run_load(target, connections, requests, window, expression);
+	}
+	return run_interactive(target);
+}
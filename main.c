@@ -1,1541 +1,5688 @@
-#include <limits.h>
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
+#include <inttypes.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "calc.h"
+#include "calc_core.h"
+#include "shm_ring.h"
+
+#define CALC_EVALUATOR_VERSION 1u
+
+#define RESULT_CACHE_MAGIC 0x48434c43u
+#define RESULT_CACHE_FORMAT_VERSION 1u
+#define RESULT_CACHE_DEFAULT_LIMIT ((size_t)64 * 1024 * 1024)
+#define RESULT_CACHE_FLUSH_RECORDS 4096
 
 typedef enum
 {
-	TOKEN_NUMBER,
-	TOKEN_FLOAT_NUMBER,
-	TOKEN_OPERATOR,
-	TOKEN_UNARY_OPERATOR,
-	TOKEN_FUNCTION,
-	TOKEN_LPAREN,
-	TOKEN_RPAREN,
-	TOKEN_NULL
-} token_type;
+	CACHE_RESULT_INT,
+	CACHE_RESULT_FLOAT
+} cache_result_type;
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t format_version;
+	uint32_t evaluator_version;
+	uint32_t record_size;
+} result_cache_header;
+
+typedef struct
+{
+	uint64_t key;
+	uint64_t check;
+	uint32_t length;
+	uint8_t type;
+	uint8_t reserved[3];
+	int32_t value;
+	uint32_t checksum;
+} result_cache_record;
 
 typedef struct
 {
-	token_type type;
-	char* value;
-	int priority;
-} token;
+	uint64_t key;
+	uint32_t position;
+	bool touched;
+} result_cache_slot;
+
+typedef struct
+{
+	char* path;
+	int fd;
+	size_t limit;
+	const result_cache_record* mapped;
+	size_t mapped_size;
+	size_t mapped_count;
+	result_cache_record* appended;
+	size_t appended_count;
+	size_t appended_capacity;
+	size_t flushed_count;
+	result_cache_slot* slots;
+	size_t slot_capacity;
+	size_t slot_count;
+} result_cache;
+
+void delete_result_cache(result_cache* c);
 
-token make_token(token_type type, const char* text)
+static uint64_t hash_bytes(const void* data, size_t length, uint64_t seed)
 {
-	token t;
-	t.type = type;
-	t.priority = -1;
-	if (text)
+	const unsigned char* bytes = data;
+	uint64_t h = seed ^ 0xcbf29ce484222325ull;
+	for (size_t i = 0; i < length; i++)
 	{
-		t.value = malloc(strlen(text) + 1);
-		if (t.value)
-		{
-			strcpy(t.value, text);
-		}
+		h ^= bytes[i];
+		h *= 0x100000001b3ull;
 	}
-	else
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+static uint32_t result_cache_record_checksum(const result_cache_record* r)
+{
+	return (uint32_t)hash_bytes(r, offsetof(result_cache_record, checksum), 0x5bd1e995u);
+}
+
+static void hash_expression(const char* text, size_t length, uint64_t* key, uint64_t* check)
+{
+	uint64_t version = CALC_EVALUATOR_VERSION;
+	*key = hash_bytes(text, length, hash_bytes(&version, sizeof(version), 0));
+	*check = hash_bytes(text, length, hash_bytes(&version, sizeof(version), 0x9e3779b97f4a7c15ull));
+	if (*key == 0)
 	{
-		t.value = NULL;
+		*key = 1;
 	}
+}
 
-	if (type == TOKEN_FUNCTION)
+static const result_cache_record* result_cache_record_at(const result_cache* c, uint32_t position)
+{
+	if (position < c->mapped_count)
 	{
-		t.priority = 0;
+		return &c->mapped[position];
 	}
-	if (type == TOKEN_UNARY_OPERATOR)
+	return &c->appended[position - c->mapped_count];
+}
+
+static bool grow_result_cache_slots(result_cache* c)
+{
+	size_t newcap = c->slot_capacity == 0 ? 1024 : c->slot_capacity * 2;
+	result_cache_slot* slots = calloc(newcap, sizeof(result_cache_slot));
+	if (!slots)
 	{
-		t.priority = 1;
+		return false;
 	}
-	else if (type == TOKEN_OPERATOR)
+	for (size_t i = 0; i < c->slot_capacity; i++)
 	{
-		if (t.value)
+		if (c->slots[i].key == 0)
 		{
-			if (strcmp(t.value, "**") == 0)
-			{
-				t.priority = 2;
-			}
-			else if (strcmp(t.value, "*") == 0 || strcmp(t.value, "/") == 0 || strcmp(t.value, "%") == 0)
-			{
-				t.priority = 3;
-			}
-			else if (strcmp(t.value, "+") == 0 || strcmp(t.value, "-") == 0)
-			{
-				t.priority = 4;
-			}
-			else if (strcmp(t.value, "<<") == 0 || strcmp(t.value, ">>") == 0)
-			{
-				t.priority = 5;
-			}
-			else if (strcmp(t.value, "&") == 0)
-			{
-				t.priority = 6;
-			}
-			else if (strcmp(t.value, "^") == 0)
-			{
-				t.priority = 7;
-			}
-			else if (strcmp(t.value, "|") == 0)
-			{
-				t.priority = 8;
-			}
-			else
-			{
-				t.priority = 100;
-			}
+			continue;
+		}
+		size_t j = (size_t)c->slots[i].key & (newcap - 1);
+		while (slots[j].key != 0)
+		{
+			j = (j + 1) & (newcap - 1);
 		}
+		slots[j] = c->slots[i];
 	}
-	return t;
+	free(c->slots);
+	c->slots = slots;
+	c->slot_capacity = newcap;
+	return true;
 }
 
-void free_token(token* t)
+static result_cache_slot* find_result_cache_slot(result_cache* c, uint64_t key, uint64_t check, uint32_t length)
 {
-	if (!t)
+	if (c->slot_capacity == 0)
 	{
-		return;
+		return NULL;
 	}
-	if (t->value)
+	size_t j = (size_t)key & (c->slot_capacity - 1);
+	while (c->slots[j].key != 0)
 	{
-		free(t->value);
-		t->value = NULL;
+		if (c->slots[j].key == key)
+		{
+			const result_cache_record* r = result_cache_record_at(c, c->slots[j].position);
+			if (r->check == check && r->length == length)
+			{
+				return &c->slots[j];
+			}
+		}
+		j = (j + 1) & (c->slot_capacity - 1);
 	}
-	t->type = TOKEN_NULL;
-	t->priority = 0;
+	return NULL;
 }
 
-token copy_token(const token* t)
+static bool index_result_cache_record(result_cache* c, uint32_t position)
 {
-	return make_token(t->type, t->value);
+	const result_cache_record* r = result_cache_record_at(c, position);
+	result_cache_slot* existing = find_result_cache_slot(c, r->key, r->check, r->length);
+	if (existing)
+	{
+		existing->position = position;
+		return true;
+	}
+	if ((c->slot_count + 1) * 2 > c->slot_capacity && !grow_result_cache_slots(c))
+	{
+		return false;
+	}
+	size_t j = (size_t)r->key & (c->slot_capacity - 1);
+	while (c->slots[j].key != 0)
+	{
+		j = (j + 1) & (c->slot_capacity - 1);
+	}
+	c->slots[j].key = r->key;
+	c->slots[j].position = position;
+	c->slots[j].touched = false;
+	c->slot_count++;
+	return true;
 }
 
-bool is_digit_char(char c)
+static bool reset_result_cache_file(int fd)
 {
-	return (c >= '0' && c <= '9');
+	result_cache_header header = { RESULT_CACHE_MAGIC, RESULT_CACHE_FORMAT_VERSION, CALC_EVALUATOR_VERSION,
+								   sizeof(result_cache_record) };
+	if (ftruncate(fd, 0) != 0 || pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+	{
+		return false;
+	}
+	return fsync(fd) == 0;
 }
 
-bool is_letter_char(char c)
+bool initialize_result_cache(result_cache* c, const char* path, size_t limit)
 {
-	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
-}
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+	c->limit = limit;
+	c->path = malloc(strlen(path) + 1);
+	if (!c->path)
+	{
+		return false;
+	}
+	strcpy(c->path, path);
 
-bool is_valid_function(const char* func_name)
-{
-	return strcmp(func_name, "sqrt") == 0 || strcmp(func_name, "log2") == 0 || strcmp(func_name, "sin") == 0 ||
-		   strcmp(func_name, "cos") == 0 || strcmp(func_name, "tan") == 0;
-}
+	c->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (c->fd < 0)
+	{
+		fprintf(stderr, "Error: Cannot open cache file %s\n", path);
+		free(c->path);
+		c->path = NULL;
+		return false;
+	}
 
-typedef struct
-{
-	token* data;
-	size_t top;
-	size_t capacity;
-} stack;
+	struct stat st;
+	if (fstat(c->fd, &st) != 0)
+	{
+		goto error;
+	}
 
-bool initialize_stack(stack* s, size_t capacity)
-{
-	s->data = malloc(sizeof(token) * capacity);
-	if (!s->data)
+	size_t size = (size_t)st.st_size;
+	result_cache_header header;
+	bool valid_header = size >= sizeof(header) && pread(c->fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+						header.magic == RESULT_CACHE_MAGIC && header.format_version == RESULT_CACHE_FORMAT_VERSION &&
+						header.evaluator_version == CALC_EVALUATOR_VERSION &&
+						header.record_size == sizeof(result_cache_record);
+	if (!valid_header)
 	{
-		fprintf(stderr, "Error: Stack allocation failed\n");
-		return false;
+		if (!reset_result_cache_file(c->fd))
+		{
+			goto error;
+		}
+		return true;
+	}
+
+	if (size > sizeof(header))
+	{
+		void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, c->fd, 0);
+		if (map == MAP_FAILED)
+		{
+			goto error;
+		}
+		c->mapped_size = size;
+		c->mapped = (const result_cache_record*)((const char*)map + sizeof(header));
+
+		size_t available = (size - sizeof(header)) / sizeof(result_cache_record);
+		size_t valid = 0;
+		while (valid < available && c->mapped[valid].checksum == result_cache_record_checksum(&c->mapped[valid]))
+		{
+			valid++;
+		}
+		c->mapped_count = valid;
+		for (size_t i = 0; i < valid; i++)
+		{
+			if (!index_result_cache_record(c, (uint32_t)i))
+			{
+				goto error;
+			}
+		}
+
+		size_t valid_end = sizeof(header) + valid * sizeof(result_cache_record);
+		if (valid_end != size && (ftruncate(c->fd, (off_t)valid_end) != 0 || fsync(c->fd) != 0))
+		{
+			goto error;
+		}
 	}
-	s->capacity = capacity;
-	s->top = 0;
 	return true;
+
+error:
+	fprintf(stderr, "Error: Cannot load cache file %s\n", path);
+	delete_result_cache(c);
+	return false;
 }
 
-void delete_stack(stack* s)
+bool lookup_result_cache(result_cache* c, const char* text, size_t length, token* result_token)
 {
-	if (!s || !s->data)
+	uint64_t key, check;
+	hash_expression(text, length, &key, &check);
+	result_cache_slot* slot = find_result_cache_slot(c, key, check, (uint32_t)length);
+	if (!slot)
 	{
-		return;
+		return false;
+	}
+	slot->touched = true;
+
+	const result_cache_record* r = result_cache_record_at(c, slot->position);
+	char buf[64];
+	if (r->type == CACHE_RESULT_FLOAT)
+	{
+		float value;
+		memcpy(&value, &r->value, sizeof(value));
+		snprintf(buf, sizeof(buf), "%e", value);
+		*result_token = make_token(TOKEN_FLOAT_NUMBER, buf);
 	}
-	for (size_t i = 0; i < s->top; i++)
+	else
 	{
-		free_token(&s->data[i]);
+		snprintf(buf, sizeof(buf), "%d", r->value);
+		*result_token = make_token(TOKEN_NUMBER, buf);
 	}
-	free(s->data);
-	s->data = NULL;
-	s->top = 0;
-	s->capacity = 0;
+	return result_token->value != NULL;
 }
 
-bool push_stack(stack* s, token input)
+static bool write_all(int fd, const void* data, size_t length)
 {
-	if (s->top >= s->capacity)
+	const char* p = data;
+	while (length > 0)
 	{
-		size_t newcap = s->capacity == 0 ? 8 : s->capacity * 2;
-		token* tmp = realloc(s->data, sizeof(token) * newcap);
-		if (!tmp)
+		ssize_t written = write(fd, p, length);
+		if (written < 0)
 		{
-			fprintf(stderr, "Error: StackOverflow\n");
+			if (errno == EINTR)
+			{
+				continue;
+			}
 			return false;
 		}
-		s->data = tmp;
-		s->capacity = newcap;
+		p += written;
+		length -= (size_t)written;
 	}
-	s->data[s->top++] = input;
 	return true;
 }
 
-token pop_stack(stack* s)
+static bool flush_result_cache(result_cache* c)
 {
-	if (s->top == 0)
+	if (c->fd < 0 || c->flushed_count == c->appended_count)
+	{
+		return true;
+	}
+	size_t pending = c->appended_count - c->flushed_count;
+	if (!write_all(c->fd, &c->appended[c->flushed_count], pending * sizeof(result_cache_record)))
 	{
-		return make_token(TOKEN_NULL, NULL);
+		return false;
 	}
-	s->top--;
-	return s->data[s->top];
+	c->flushed_count = c->appended_count;
+	return true;
 }
 
-token peek_stack(stack* s)
+bool store_result_cache(result_cache* c, const char* text, size_t length, const token* result_token)
 {
-	if (s->top == 0)
+	if (!result_token->value || c->mapped_count + c->appended_count >= UINT32_MAX)
 	{
-		return make_token(TOKEN_NULL, NULL);
+		return false;
 	}
-	return s->data[s->top - 1];
-}
 
-bool is_empty_stack(stack* s)
-{
-	return s->top == 0;
-}
+	result_cache_record r;
+	memset(&r, 0, sizeof(r));
+	hash_expression(text, length, &r.key, &r.check);
+	r.length = (uint32_t)length;
+	if (result_token->type == TOKEN_FLOAT_NUMBER)
+	{
+		float value = strtof(result_token->value, NULL);
+		r.type = CACHE_RESULT_FLOAT;
+		memcpy(&r.value, &value, sizeof(value));
+	}
+	else
+	{
+		r.type = CACHE_RESULT_INT;
+		r.value = (int32_t)strtol(result_token->value, NULL, 10);
+	}
+	r.checksum = result_cache_record_checksum(&r);
 
-typedef struct
-{
-	token* data;
-	size_t front;
-	size_t rear;
-	size_t capacity;
-} queue;
+	if (c->appended_count >= c->appended_capacity)
+	{
+		size_t newcap = c->appended_capacity == 0 ? 64 : c->appended_capacity * 2;
+		result_cache_record* tmp = realloc(c->appended, sizeof(result_cache_record) * newcap);
+		if (!tmp)
+		{
+			return false;
+		}
+		c->appended = tmp;
+		c->appended_capacity = newcap;
+	}
+	c->appended[c->appended_count++] = r;
 
-bool initialize_queue(queue* q, size_t capacity)
-{
-	q->data = malloc(sizeof(token) * capacity);
-	if (!q->data)
+	uint32_t position = (uint32_t)(c->mapped_count + c->appended_count - 1);
+	if (!index_result_cache_record(c, position))
 	{
-		fprintf(stderr, "Error: Queue allocation failed\n");
+		c->appended_count--;
 		return false;
 	}
-	q->capacity = capacity;
-	q->front = 0;
-	q->rear = 0;
+	result_cache_slot* slot = find_result_cache_slot(c, r.key, r.check, r.length);
+	if (slot)
+	{
+		slot->touched = true;
+	}
+
+	if (c->appended_count - c->flushed_count >= RESULT_CACHE_FLUSH_RECORDS)
+	{
+		return flush_result_cache(c);
+	}
 	return true;
 }
 
-void delete_queue(queue* q)
+static int compare_cache_positions_desc(const void* a, const void* b)
 {
-	if (!q || !q->data)
+	uint32_t pa = *(const uint32_t*)a;
+	uint32_t pb = *(const uint32_t*)b;
+	return pa < pb ? 1 : (pa > pb ? -1 : 0);
+}
+
+static bool compact_result_cache(result_cache* c)
+{
+	size_t budget = c->limit > sizeof(result_cache_header) ? (c->limit - sizeof(result_cache_header)) / 4 * 3 : 0;
+	size_t keep_max = budget / sizeof(result_cache_record);
+
+	uint32_t* order = malloc(sizeof(uint32_t) * (c->slot_count ? c->slot_count : 1));
+	if (!order)
 	{
-		return;
+		return false;
 	}
-	for (size_t i = 0; i < q->rear; i++)
+	size_t touched = 0;
+	size_t count = 0;
+	for (size_t i = 0; i < c->slot_capacity; i++)
 	{
-		if (q->data[i].value != NULL)
+		if (c->slots[i].key != 0 && c->slots[i].touched)
 		{
-			free_token(&q->data[i]);
+			order[count++] = c->slots[i].position;
 		}
 	}
-	free(q->data);
-	q->data = NULL;
-	q->front = q->rear = q->capacity = 0;
-}
+	touched = count;
+	for (size_t i = 0; i < c->slot_capacity; i++)
+	{
+		if (c->slots[i].key != 0 && !c->slots[i].touched)
+		{
+			order[count++] = c->slots[i].position;
+		}
+	}
+	qsort(order, touched, sizeof(uint32_t), compare_cache_positions_desc);
+	qsort(order + touched, count - touched, sizeof(uint32_t), compare_cache_positions_desc);
+	if (count > keep_max)
+	{
+		count = keep_max;
+	}
 
-bool push_queue(queue* q, token input)
-{
-	if (q->rear >= q->capacity)
+	size_t tmp_length = strlen(c->path) + 5;
+	char* tmp_path = malloc(tmp_length);
+	if (!tmp_path)
 	{
-		size_t newcap = q->capacity == 0 ? 8 : q->capacity * 2;
-		token* tmp = realloc(q->data, sizeof(token) * newcap);
-		if (!tmp)
+		free(order);
+		return false;
+	}
+	snprintf(tmp_path, tmp_length, "%s.tmp", c->path);
+
+	bool ok = false;
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0)
+	{
+		result_cache_header header = { RESULT_CACHE_MAGIC, RESULT_CACHE_FORMAT_VERSION, CALC_EVALUATOR_VERSION,
+									   sizeof(result_cache_record) };
+		ok = write_all(fd, &header, sizeof(header));
+		for (size_t i = count; ok && i > 0; i--)
 		{
-			fprintf(stderr, "Error: QueueOverflow\n");
-			return false;
+			ok = write_all(fd, result_cache_record_at(c, order[i - 1]), sizeof(result_cache_record));
+		}
+		ok = ok && fsync(fd) == 0;
+		ok = close(fd) == 0 && ok;
+		ok = ok && rename(tmp_path, c->path) == 0;
+		if (!ok)
+		{
+			unlink(tmp_path);
 		}
-		q->data = tmp;
-		q->capacity = newcap;
 	}
-	q->data[q->rear++] = input;
-	return true;
+
+	free(tmp_path);
+	free(order);
+	return ok;
 }
 
-token pop_queue(queue* q)
+void delete_result_cache(result_cache* c)
 {
-	if (q->front == q->rear)
+	if (!c)
 	{
-		return make_token(TOKEN_NULL, NULL);
+		return;
+	}
+	if (c->fd >= 0)
+	{
+		bool flushed = flush_result_cache(c) && fsync(c->fd) == 0;
+		size_t file_records = c->mapped_count + c->flushed_count;
+		size_t file_size = sizeof(result_cache_header) + file_records * sizeof(result_cache_record);
+		if (!flushed)
+		{
+			fprintf(stderr, "Error: Cannot write cache file %s\n", c->path);
+		}
+		else if (c->limit && (file_size > c->limit || file_records > c->slot_count * 2 + 1024))
+		{
+			if (!compact_result_cache(c))
+			{
+				fprintf(stderr, "Error: Cannot compact cache file %s\n", c->path);
+			}
+		}
+		close(c->fd);
+	}
+	if (c->mapped)
+	{
+		munmap((void*)((const char*)c->mapped - sizeof(result_cache_header)), c->mapped_size);
 	}
-	token res = q->data[q->front];
-	q->data[q->front].value = NULL;
-	q->front++;
-	return res;
+	free(c->appended);
+	free(c->slots);
+	free(c->path);
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
 }
 
-bool is_empty_queue(queue* q)
+#define SWEEP_MAX_AXES 8
+#define PLUGIN_MAX_PATHS 16
+#define BATCH_CHUNK_POINTS 16384
+#define BATCH_LINE_MAX 32
+#define CSV_CHUNK_BYTES ((size_t)1 << 20)
+#define REDUCE_MAX_BINS 65536
+
+/* One --sweep dimension; integer bounds and step give CALC_VALUE_INT64 points, anything else doubles. */
+typedef struct
 {
-	return q->front == q->rear;
-}
+	char* name;
+	bool integral;
+	int64_t int_start;
+	int64_t int_step;
+	double start;
+	double step;
+	size_t count;
+} sweep_axis;
 
-static queue make_empty_queue(void)
+typedef struct
 {
-	queue empty;
-	empty.data = NULL;
-	empty.front = empty.rear = empty.capacity = 0;
-	return empty;
-}
+	char* input_file_path;
+	char* output_file_path;
+	bool polish_notation;
+	bool line_mode;
+	char* cache_path;
+	size_t cache_limit;
+	char* socket_path;
+	size_t worker_count;
+	char* shm_name;
+	bool rpn_input;
+	bool compile_library;
+	bool library_input;
+	bool stats;
+	char* stats_path;
+	char* trace_path;
+	calc_limits limits;
+	calc_widths widths;
+	const char* plugin_paths[PLUGIN_MAX_PATHS];
+	size_t plugin_count;
+	sweep_axis sweeps[SWEEP_MAX_AXES];
+	size_t sweep_count;
+	char* csv_path;
+	char* columns_path;
+	bool binary_output;
+	bool column_output;
+	bool reduce;
+	size_t histogram_bins;
+	double histogram_start;
+	double histogram_stop;
+	bool definitions;
+	bool watch;
+	bool manifest;
+	bool input_directory;
+	size_t max_read_bytes;
+	size_t max_open_files;
+} console_options;
 
-static bool parse_string_to_int(const char* str, int32_t* result, int* err_code)
+static calc_widths numeric_widths = { 32, 32 };
+
+static bool parse_size_argument(const char* str, size_t* result)
 {
 	char* endp = NULL;
-	long value = strtol(str, &endp, 10);
-	if (endp == str || *endp != '\0' || value < INT_MIN || value > INT_MAX)
+	unsigned long long value = strtoull(str, &endp, 10);
+	if (endp == str || *str == '-')
+	{
+		return false;
+	}
+	if (*endp == 'K' || *endp == 'k')
+	{
+		value <<= 10;
+		endp++;
+	}
+	else if (*endp == 'M' || *endp == 'm')
+	{
+		value <<= 20;
+		endp++;
+	}
+	else if (*endp == 'G' || *endp == 'g')
+	{
+		value <<= 30;
+		endp++;
+	}
+	if (*endp != '\0')
 	{
-		if (err_code)
-		{
-			*err_code = 1;
-		}
 		return false;
 	}
-	*result = (int32_t)value;
+	*result = (size_t)value;
 	return true;
 }
 
-bool is_right_assoc(const token* t)
+/* start:stop:bins; the bins split [start, stop) evenly. */
+static bool parse_histogram_argument(const char* str, double* start, double* stop, size_t* bins)
 {
-	if (!t || !t->value)
+	char* endp = NULL;
+	*start = strtod(str, &endp);
+	if (endp == str || *endp != ':')
 	{
 		return false;
 	}
-	if (t->type == TOKEN_UNARY_OPERATOR)
+	const char* field = endp + 1;
+	*stop = strtod(field, &endp);
+	if (endp == field || *endp != ':')
 	{
-		return true;
+		return false;
 	}
-	return false;
-}
-
-bool is_operator_token(const token* t)
-{
-	return t && (t->type == TOKEN_OPERATOR || t->type == TOKEN_UNARY_OPERATOR);
+	return isfinite(*start) && isfinite(*stop) && *start < *stop && parse_size_argument(endp + 1, bins) &&
+		   *bins > 0 && *bins <= REDUCE_MAX_BINS;
 }
 
-bool tokenizator(char* math_expression, queue* res_queue, int* err_code)
+/* name=start:stop:step; stop is included when it lies on the grid, up to rounding for floating-point steps. */
+static bool parse_sweep_argument(char* str, sweep_axis* axis)
 {
-	size_t length = strlen(math_expression);
-	size_t index = 0;
-
-	token prev = make_token(TOKEN_NULL, NULL);
+	char* fields[3];
+	char* equals = strchr(str, '=');
+	if (!equals || equals == str)
+	{
+		return false;
+	}
+	*equals = '\0';
+	axis->name = str;
+	fields[0] = equals + 1;
+	for (int k = 1; k < 3; k++)
+	{
+		char* colon = strchr(fields[k - 1], ':');
+		if (!colon)
+		{
+			return false;
+		}
+		*colon = '\0';
+		fields[k] = colon + 1;
+	}
 
-	while (index < length)
+	int64_t ints[3];
+	double values[3];
+	axis->integral = true;
+	for (int k = 0; k < 3; k++)
 	{
-		if (math_expression[index] == ' ' || math_expression[index] == '\t' || math_expression[index] == '\n' ||
-			math_expression[index] == '\r')
+		char* endp = NULL;
+		errno = 0;
+		long long value = strtoll(fields[k], &endp, 10);
+		axis->integral = axis->integral && endp != fields[k] && *endp == '\0' && errno == 0;
+		ints[k] = (int64_t)value;
+		values[k] = strtod(fields[k], &endp);
+		if (endp == fields[k] || *endp != '\0' || !isfinite(values[k]))
 		{
-			index++;
-			continue;
+			return false;
 		}
+	}
+	if (values[2] == 0)
+	{
+		return false;
+	}
 
-		if (is_digit_char(math_expression[index]))
+	if (axis->integral)
+	{
+		int64_t span = 0;
+		if (__builtin_sub_overflow(ints[1], ints[0], &span) || (span != 0 && (span < 0) != (ints[2] < 0)) ||
+			(uint64_t)(span / ints[2]) >= SIZE_MAX)
 		{
-			size_t temp_index = index;
-			bool has_dot = false;
-			while (temp_index < length && (is_digit_char(math_expression[temp_index]) || math_expression[temp_index] == '.'))
-			{
-				if (math_expression[temp_index] == '.')
-				{
-					if (has_dot)
-					{
-						if (err_code)
-						{
-							*err_code = 2;
-						}
-						free_token(&prev);
-						return false;
-					}
-					has_dot = true;
-				}
-				temp_index++;
-			}
+			return false;
+		}
+		axis->int_start = ints[0];
+		axis->int_step = ints[2];
+		axis->count = (size_t)(span / ints[2]) + 1;
+		return true;
+	}
+	double steps = (values[1] - values[0]) / values[2];
+	if (!(steps > -1e-9) || steps >= (double)(SIZE_MAX / 2))
+	{
+		return false;
+	}
+	axis->start = values[0];
+	axis->step = values[2];
+	axis->count = (size_t)floor(steps + 1e-9) + 1;
+	return true;
+}
 
-			size_t buffer_size = temp_index - index + 1;
-			char* buffer = malloc(buffer_size);
-			if (!buffer)
-			{
-				if (err_code)
-				{
-					*err_code = 5;
-					free_token(&prev);
-					return false;
-				}
-			}
-			memcpy(buffer, math_expression + index, buffer_size - 1);
-			buffer[buffer_size - 1] = '\0';
+bool parse_console_data(int argc, char* argv[], console_options* options)
+{
+	if (argc < 3)
+	{
+		fprintf(stderr,
+				"Error: incorrect amount of arguments. Usage: %s -i input_file -o output_file [-p | --rpn-input] [--lines] "
+				"[--watch] [--cache cache_file] [--cache-limit bytes] [--stats | --stats-file stats_file]\n"
+				"       [--trace trace_file] [--max-input-bytes n] [--max-tokens n] [--max-nesting n] [--max-stack n]\n"
+				"       [--max-cost n] [--int-bits 32|64|big] [--float-bits 32|64] [--plugin shared_object]...\n"
+				"       %s -i formulas_file -o library_file --compile-library [--int-bits 32|64] [--float-bits 32|64]\n"
+				"       %s -i library_file -o output_file --library\n"
+				"       %s (-i input_directory -o output_directory | -i manifest_file --manifest) [-p] [--lines]\n"
+				"          [--workers count] [--max-read-bytes n] [--max-open-files n] [--int-bits 32|64|big]\n"
+				"          [--float-bits 32|64] [limits]\n"
+				"       %s -i formulas_file -o output_file (--sweep name=start:stop:step... | --csv data_file |\n"
+				"          --columns column_file) [--binary | --column-output |\n"
+				"          --reduce [--histogram start:stop:bins]] [--workers count] [--int-bits 32|64]\n"
+				"          [--float-bits 32|64] [limits]\n"
+				"       %s -i definitions_file -o output_file --definitions [--watch] [--workers count]\n"
+				"          [--int-bits 32|64] [--float-bits 32|64] [limits]\n"
+				"       %s --serve socket_path [--workers count] [--trace trace_file] [limits]\n"
+				"       %s --shm name [--trace trace_file] [limits]\n",
+				argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+		return false;
+	}
 
-			token temp_token = make_token(has_dot ? TOKEN_FLOAT_NUMBER : TOKEN_NUMBER, buffer);
-			free(buffer);
+	memset(options, 0, sizeof(*options));
+	options->cache_limit = RESULT_CACHE_DEFAULT_LIMIT;
+	options->widths.int_bits = 32;
+	options->widths.float_bits = 32;
 
-			if (!push_queue(res_queue, temp_token))
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-i") == 0)
+		{
+			if (i + 1 >= argc)
 			{
-				free_token(&temp_token);
-				free_token(&prev);
-				if (err_code)
-				{
-					*err_code = 5;
-				}
+				fprintf(stderr, "Error: missing input file name after -i\n");
 				return false;
 			}
-
-			index = temp_index;
-
-			free_token(&prev);
-			prev = copy_token(&temp_token);
-			continue;
+			options->input_file_path = argv[i + 1];
+			i++;
 		}
-
-		if (is_letter_char(math_expression[index]))
+		else if (strcmp(argv[i], "-o") == 0)
 		{
-			size_t temp_index = index;
-			while (temp_index < length && (is_letter_char(math_expression[temp_index]) || is_digit_char(math_expression[temp_index])))
-			{
-				temp_index++;
-			}
-
-			size_t buffer_size = temp_index - index + 1;
-			char* buffer = malloc(buffer_size);
-			if (!buffer)
+			if (i + 1 >= argc)
 			{
-				if (err_code)
-				{
-					*err_code = 5;
-					free_token(&prev);
-					return false;
-				}
+				fprintf(stderr, "Error: missing output file name after -o\n");
+				return false;
 			}
-			memcpy(buffer, math_expression + index, buffer_size - 1);
-			buffer[buffer_size - 1] = '\0';
-
-			if (!is_valid_function(buffer))
+			options->output_file_path = argv[i + 1];
+			i++;
+		}
+		else if (strcmp(argv[i], "-p") == 0)
+		{
+			options->polish_notation = true;
+		}
+		else if (strcmp(argv[i], "--lines") == 0)
+		{
+			options->line_mode = true;
+		}
+		else if (strcmp(argv[i], "--watch") == 0)
+		{
+			options->watch = true;
+		}
+		else if (strcmp(argv[i], "--manifest") == 0)
+		{
+			options->manifest = true;
+		}
+		else if (strcmp(argv[i], "--max-read-bytes") == 0 || strcmp(argv[i], "--max-open-files") == 0)
+		{
+			size_t* target =
+				strcmp(argv[i], "--max-read-bytes") == 0 ? &options->max_read_bytes : &options->max_open_files;
+			if (i + 1 >= argc || !parse_size_argument(argv[i + 1], target) || *target == 0)
 			{
-				free(buffer);
-				if (err_code)
-				{
-					*err_code = 1;
-				}
-				free_token(&prev);
+				fprintf(stderr, "Error: missing or invalid value after %s\n", argv[i]);
 				return false;
 			}
-
-			token temp_token = make_token(TOKEN_FUNCTION, buffer);
-			free(buffer);
-
-			if (!push_queue(res_queue, temp_token))
+			i++;
+		}
+		else if (strcmp(argv[i], "--rpn-input") == 0)
+		{
+			options->rpn_input = true;
+		}
+		else if (strcmp(argv[i], "--stats") == 0)
+		{
+			options->stats = true;
+		}
+		else if (strcmp(argv[i], "--stats-file") == 0)
+		{
+			if (i + 1 >= argc)
 			{
-				free_token(&temp_token);
-				free_token(&prev);
-				if (err_code)
-				{
-					*err_code = 5;
-				}
+				fprintf(stderr, "Error: missing stats file name after --stats-file\n");
 				return false;
 			}
-
-			index = temp_index;
-
-			free_token(&prev);
-			prev = copy_token(&temp_token);
-			continue;
+			options->stats = true;
+			options->stats_path = argv[i + 1];
+			i++;
 		}
-
-		if (math_expression[index] == '(')
+		else if (strcmp(argv[i], "--max-input-bytes") == 0 || strcmp(argv[i], "--max-tokens") == 0 ||
+				 strcmp(argv[i], "--max-nesting") == 0 || strcmp(argv[i], "--max-stack") == 0 ||
+				 strcmp(argv[i], "--max-cost") == 0)
 		{
-			token tmp = make_token(TOKEN_LPAREN, "(");
-			if (!push_queue(res_queue, tmp))
+			size_t value = 0;
+			if (i + 1 >= argc || !parse_size_argument(argv[i + 1], &value) || value == 0)
 			{
-				free_token(&tmp);
-				free_token(&prev);
-				if (err_code)
-				{
-					*err_code = 5;
-					return false;
-				}
+				fprintf(stderr, "Error: missing or invalid limit after %s\n", argv[i]);
+				return false;
 			}
-			free_token(&prev);
-			prev = copy_token(&tmp);
-			index++;
-			continue;
+			if (strcmp(argv[i], "--max-input-bytes") == 0)
+			{
+				options->limits.max_input_bytes = value;
+			}
+			else if (strcmp(argv[i], "--max-tokens") == 0)
+			{
+				options->limits.max_tokens = value;
+			}
+			else if (strcmp(argv[i], "--max-nesting") == 0)
+			{
+				options->limits.max_nesting = value;
+			}
+			else if (strcmp(argv[i], "--max-stack") == 0)
+			{
+				options->limits.max_stack = value;
+			}
+			else
+			{
+				options->limits.max_cost = value;
+			}
+			i++;
 		}
-
-		if (math_expression[index] == ')')
+		else if (strcmp(argv[i], "--int-bits") == 0 || strcmp(argv[i], "--float-bits") == 0)
 		{
-			token tmp = make_token(TOKEN_RPAREN, ")");
-			if (!push_queue(res_queue, tmp))
+			size_t bits = 0;
+			bool integers = strcmp(argv[i], "--int-bits") == 0;
+			if (integers && i + 1 < argc && strcmp(argv[i + 1], "big") == 0)
 			{
-				free_token(&tmp);
-				free_token(&prev);
-				if (err_code)
-				{
-					*err_code = 5;
-					return false;
-				}
+				bits = CALC_CORE_BIG_INTEGERS;
 			}
-			free_token(&prev);
-			prev = copy_token(&tmp);
-			index++;
-			continue;
+			else if (i + 1 >= argc || !parse_size_argument(argv[i + 1], &bits) || (bits != 32 && bits != 64))
+			{
+				fprintf(stderr, integers ? "Error: %s expects 32, 64 or big\n" : "Error: %s expects 32 or 64\n", argv[i]);
+				return false;
+			}
+			if (integers)
+			{
+				options->widths.int_bits = (unsigned)bits;
+			}
+			else
+			{
+				options->widths.float_bits = (unsigned)bits;
+			}
+			i++;
 		}
-
-		if (index + 1 < length)
+		else if (strcmp(argv[i], "--trace") == 0)
 		{
-			if (math_expression[index] == '*' && math_expression[index + 1] == '*')
+			if (i + 1 >= argc)
 			{
-				token tmp = make_token(TOKEN_OPERATOR, "**");
-				if (!push_queue(res_queue, tmp))
-				{
-					free_token(&tmp);
-					free_token(&prev);
-					if (err_code)
-					{
-						*err_code = 5;
-						return false;
-					}
-				}
-				free_token(&prev);
-				prev = copy_token(&tmp);
-				index += 2;
-				continue;
+				fprintf(stderr, "Error: missing trace file name after --trace\n");
+				return false;
 			}
-
-			if (math_expression[index] == '>' && math_expression[index + 1] == '>')
+			options->trace_path = argv[i + 1];
+			i++;
+		}
+		else if (strcmp(argv[i], "--plugin") == 0)
+		{
+			if (options->plugin_count == PLUGIN_MAX_PATHS)
 			{
-				token tmp = make_token(TOKEN_OPERATOR, ">>");
-				if (!push_queue(res_queue, tmp))
-				{
-					free_token(&tmp);
-					free_token(&prev);
-					if (err_code)
-					{
-						*err_code = 5;
-						return false;
-					}
-				}
-				free_token(&prev);
-				prev = copy_token(&tmp);
-				index += 2;
-				continue;
+				fprintf(stderr, "Error: at most %d --plugin shared objects are supported\n", PLUGIN_MAX_PATHS);
+				return false;
 			}
-
-			if (math_expression[index] == '<' && math_expression[index + 1] == '<')
+			if (i + 1 >= argc)
 			{
-				token tmp = make_token(TOKEN_OPERATOR, "<<");
-				if (!push_queue(res_queue, tmp))
-				{
-					free_token(&tmp);
-					free_token(&prev);
-					if (err_code)
-					{
-						*err_code = 5;
-						return false;
-					}
-				}
-				free_token(&prev);
-				prev = copy_token(&tmp);
-				index += 2;
-				continue;
+				fprintf(stderr, "Error: missing shared object after --plugin\n");
+				return false;
 			}
+			options->plugin_paths[options->plugin_count++] = argv[i + 1];
+			i++;
 		}
-
-		char ch = math_expression[index];
-		if (ch == '+' || ch == '-' || ch == '*' || ch == '/' || ch == '%' || ch == '&' || ch == '^' || ch == '|' || ch == '~')
+		else if (strcmp(argv[i], "--compile-library") == 0)
 		{
-			bool unary = false;
-
-			if ((ch == '+' || ch == '-' || ch == '~') &&
-				(prev.type == TOKEN_NULL || is_operator_token(&prev) || prev.type == TOKEN_UNARY_OPERATOR || prev.type == TOKEN_LPAREN))
+			options->compile_library = true;
+		}
+		else if (strcmp(argv[i], "--library") == 0)
+		{
+			options->library_input = true;
+		}
+		else if (strcmp(argv[i], "--cache") == 0)
+		{
+			if (i + 1 >= argc)
 			{
-				unary = true;
+				fprintf(stderr, "Error: missing cache file name after --cache\n");
+				return false;
 			}
-
-			char tmp_s[2] = { ch, '\0' };
-			token tmp = make_token(unary ? TOKEN_UNARY_OPERATOR : TOKEN_OPERATOR, tmp_s);
-
-			if (!push_queue(res_queue, tmp))
+			options->cache_path = argv[i + 1];
+			i++;
+		}
+		else if (strcmp(argv[i], "--cache-limit") == 0)
+		{
+			if (i + 1 >= argc || !parse_size_argument(argv[i + 1], &options->cache_limit))
 			{
-				free_token(&tmp);
-				free_token(&prev);
-				if (err_code)
-				{
-					*err_code = 5;
-					return false;
-				}
+				fprintf(stderr, "Error: missing or invalid size after --cache-limit\n");
+				return false;
 			}
-			free_token(&prev);
-			prev = copy_token(&tmp);
-
-			index++;
-			continue;
+			i++;
 		}
-
-		if (err_code)
+		else if (strcmp(argv[i], "--serve") == 0)
 		{
-			*err_code = 1;
+			if (i + 1 >= argc)
+			{
+				fprintf(stderr, "Error: missing socket path after --serve\n");
+				return false;
+			}
+			options->socket_path = argv[i + 1];
+			i++;
 		}
-		free_token(&prev);
-		return false;
-	}
-
-	free_token(&prev);
-	return true;
-}
-
-bool safe_pow(int a, int b, int* res)
-{
-	if (b < 0)
-	{
-		return false;
-	}
-	int64_t r = 1;
-	for (int i = 0; i < b; i++)
-	{
-		r = (int64_t)((int32_t)r * (int32_t)a);
-	}
-	*res = (int32_t)r;
-	return true;
-}
-
-bool binary_operators_operations(int32_t a, int32_t b, const char* op, int32_t* res, int* err_code)
-{
-	if (!op || !res)
-	{
-		if (err_code)
+		else if (strcmp(argv[i], "--shm") == 0)
 		{
-			*err_code = 5;
+			if (i + 1 >= argc)
+			{
+				fprintf(stderr, "Error: missing shared memory name after --shm\n");
+				return false;
+			}
+			options->shm_name = argv[i + 1];
+			i++;
 		}
-		return false;
-	}
-
-	if (strcmp(op, "+") == 0)
-	{
-		int64_t tmp = (int64_t)a + (int64_t)b;
-		*res = (int32_t)tmp;
-	}
-	else if (strcmp(op, "-") == 0)
-	{
-		int64_t tmp = (int64_t)a - (int64_t)b;
-		*res = (int32_t)tmp;
-	}
-	else if (strcmp(op, "*") == 0)
-	{
-		int64_t tmp = (int64_t)a * (int64_t)b;
-		*res = (int32_t)tmp;
-	}
-	else if (strcmp(op, "**") == 0)
-	{
-		if (!safe_pow(a, b, res))
+		else if (strcmp(argv[i], "--workers") == 0)
 		{
-			if (err_code)
+			if (i + 1 >= argc || !parse_size_argument(argv[i + 1], &options->worker_count) ||
+				options->worker_count == 0)
 			{
-				*err_code = 3;
+				fprintf(stderr, "Error: missing or invalid count after --workers\n");
+				return false;
 			}
-			return false;
+			i++;
 		}
-	}
-	else if (strcmp(op, "/") == 0)
-	{
-		if (b == 0 || (a == INT_MIN && b == -1))
+		else if (strcmp(argv[i], "--sweep") == 0)
 		{
-			if (err_code)
+			if (options->sweep_count == SWEEP_MAX_AXES)
+			{
+				fprintf(stderr, "Error: at most %d --sweep ranges are supported\n", SWEEP_MAX_AXES);
+				return false;
+			}
+			if (i + 1 >= argc || !parse_sweep_argument(argv[i + 1], &options->sweeps[options->sweep_count]))
 			{
-				*err_code = 3;
+				fprintf(stderr, "Error: missing or invalid range after --sweep\n");
+				return false;
 			}
-			return false;
+			options->sweep_count++;
+			i++;
 		}
-		*res = a / b;
-	}
-	else if (strcmp(op, "%") == 0)
-	{
-		if (b == 0)
+		else if (strcmp(argv[i], "--csv") == 0)
 		{
-			if (err_code)
+			if (i + 1 >= argc)
 			{
-				*err_code = 3;
+				fprintf(stderr, "Error: missing CSV file name after --csv\n");
+				return false;
 			}
-			return false;
+			options->csv_path = argv[i + 1];
+			i++;
 		}
-		*res = a % b;
-	}
-	else if (strcmp(op, "<<") == 0)
-	{
-		if (b < 0 || b >= 32)
+		else if (strcmp(argv[i], "--columns") == 0)
 		{
-			if (err_code)
+			if (i + 1 >= argc)
 			{
-				*err_code = 3;
+				fprintf(stderr, "Error: missing column file name after --columns\n");
+				return false;
 			}
-			return false;
+			options->columns_path = argv[i + 1];
+			i++;
 		}
-		*res = (int32_t)(a << b);
-	}
-	else if (strcmp(op, ">>") == 0)
-	{
-		if (b < 0 || b >= 32)
+		else if (strcmp(argv[i], "--binary") == 0)
 		{
-			if (err_code)
+			options->binary_output = true;
+		}
+		else if (strcmp(argv[i], "--column-output") == 0)
+		{
+			options->column_output = true;
+		}
+		else if (strcmp(argv[i], "--definitions") == 0)
+		{
+			options->definitions = true;
+		}
+		else if (strcmp(argv[i], "--reduce") == 0)
+		{
+			options->reduce = true;
+		}
+		else if (strcmp(argv[i], "--histogram") == 0)
+		{
+			if (i + 1 >= argc || !parse_histogram_argument(argv[i + 1], &options->histogram_start,
+														   &options->histogram_stop, &options->histogram_bins))
 			{
-				*err_code = 3;
+				fprintf(stderr, "Error: missing or invalid range after --histogram\n");
+				return false;
 			}
+			i++;
+		}
+		else
+		{
+			fprintf(stderr, "Error: unknown argument %s\n", argv[i]);
 			return false;
 		}
-		*res = (int32_t)(a >> b);
 	}
-	else if (strcmp(op, "&") == 0)
+
+	if (options->stats && (options->socket_path || options->shm_name || options->compile_library ||
+						   options->library_input))
 	{
-		*res = a & b;
+		fprintf(stderr, "Error: --stats is only available when evaluating an input file\n");
+		return false;
 	}
-	else if (strcmp(op, "^") == 0)
+
+	if (options->trace_path && (options->compile_library || options->library_input))
 	{
-		*res = a ^ b;
+		fprintf(stderr, "Error: --trace cannot be combined with --compile-library or --library\n");
+		return false;
 	}
-	else if (strcmp(op, "|") == 0)
+
+	if ((options->widths.int_bits != 32 || options->widths.float_bits != 32) &&
+		(options->shm_name || options->cache_path || options->library_input))
 	{
-		*res = a | b;
+		fprintf(stderr, "Error: --int-bits and --float-bits cannot be combined with --shm, --cache or --library\n");
+		return false;
 	}
-	else
+
+	if (options->plugin_count && options->cache_path)
 	{
-		if (err_code)
-		{
-			*err_code = 1;
-		}
+		fprintf(stderr, "Error: --plugin cannot be combined with --cache\n");
 		return false;
 	}
 
-	return true;
-}
-
-bool unary_operators_operations(int32_t a, const char* operation, int32_t* res, int* err_code)
-{
-	if (strcmp(operation, "~") == 0)
+	const calc_limits* limits = &options->limits;
+	if (options->cache_path &&
+		(limits->max_tokens || limits->max_nesting || limits->max_stack || limits->max_cost))
 	{
-		*res = ~a;
+		fprintf(stderr, "Error: --cache cannot be combined with --max-tokens, --max-nesting, --max-stack or "
+						"--max-cost\n");
+		return false;
 	}
-	else if (strcmp(operation, "+") == 0)
+
+	if (options->cache_path && options->rpn_input)
 	{
-		*res = +a;
+		fprintf(stderr, "Error: --cache cannot be combined with --rpn-input\n");
+		return false;
 	}
-	else if (strcmp(operation, "-") == 0)
+
+	if (options->widths.int_bits == CALC_CORE_BIG_INTEGERS && options->compile_library)
 	{
-		*res = -a;
+		fprintf(stderr, "Error: --int-bits big cannot be combined with --compile-library\n");
+		return false;
 	}
-	else
+
+	int batch_inputs = (options->sweep_count != 0) + (options->csv_path != NULL) + (options->columns_path != NULL);
+	if (options->binary_output && options->column_output)
 	{
-		if (err_code)
-		{
-			*err_code = 1;
-		}
+		fprintf(stderr, "Error: --binary cannot be combined with --column-output\n");
 		return false;
 	}
-	return true;
-}
 
-bool binary_operators_operations_float(float a, float b, const char* op, float* res, int* err_code)
-{
-	if (!op || !res)
+	if ((options->binary_output || options->column_output) && !batch_inputs)
 	{
-		if (err_code)
-		{
-			*err_code = 5;
-		}
+		fprintf(stderr, "Error: --binary and --column-output require --sweep, --csv or --columns\n");
 		return false;
 	}
 
-	if (strcmp(op, "+") == 0)
+	if (options->reduce && (!batch_inputs || options->binary_output || options->column_output))
 	{
-		*res = a + b;
+		fprintf(stderr, "Error: --reduce requires --sweep, --csv or --columns and cannot be combined with --binary "
+						"or --column-output\n");
+		return false;
 	}
-	else if (strcmp(op, "-") == 0)
+
+	if (options->histogram_bins && !options->reduce)
 	{
-		*res = a - b;
+		fprintf(stderr, "Error: --histogram requires --reduce\n");
+		return false;
 	}
-	else if (strcmp(op, "*") == 0)
+
+	if (batch_inputs && (batch_inputs > 1 || options->polish_notation || options->rpn_input || options->line_mode ||
+						 options->cache_path || options->compile_library || options->library_input || options->stats ||
+						 options->widths.int_bits == CALC_CORE_BIG_INTEGERS))
 	{
-		*res = a * b;
+		fprintf(stderr, "Error: --sweep, --csv and --columns cannot be combined with each other, -p, --rpn-input, "
+						"--lines, --cache, --stats, --compile-library, --library or --int-bits big\n");
+		return false;
 	}
-	else if (strcmp(op, "/") == 0)
+
+	if (options->definitions && (batch_inputs || options->polish_notation || options->rpn_input || options->line_mode ||
+								 options->cache_path || options->compile_library || options->library_input ||
+								 options->stats || options->widths.int_bits == CALC_CORE_BIG_INTEGERS))
 	{
-		if (b == 0.0f)
-		{
-			if (err_code)
-			{
-				*err_code = 3;
-			}
-			return false;
-		}
-		*res = a / b;
+		fprintf(stderr, "Error: --definitions cannot be combined with --sweep, --csv, --columns, -p, --rpn-input, "
+						"--lines, --cache, --stats, --compile-library, --library or --int-bits big\n");
+		return false;
 	}
-	else if (strcmp(op, "**") == 0)
+
+	if (options->watch && ((!options->line_mode && !options->definitions) || options->rpn_input || options->stats ||
+						   options->compile_library || options->library_input))
 	{
-		*res = powf(a, b);
+		fprintf(stderr, "Error: --watch requires --lines or --definitions and cannot be combined with --rpn-input, "
+						"--stats, --compile-library or --library\n");
+		return false;
 	}
-	else
+
+	if (options->socket_path || options->shm_name)
 	{
-		if (err_code)
-		{
-			*err_code = 1;
-		}
+		return true;
+	}
+
+	if (options->input_file_path == NULL)
+	{
+		fprintf(stderr, "Error: no input file provided\n");
+		return false;
+	}
+
+	struct stat input_stat;
+	options->input_directory = stat(options->input_file_path, &input_stat) == 0 && S_ISDIR(input_stat.st_mode);
+	bool file_batch = options->manifest || options->input_directory;
+	if (options->output_file_path == NULL && !options->manifest)
+	{
+		fprintf(stderr, "Error: no output file provided\n");
+		return false;
+	}
+
+	if ((options->max_read_bytes || options->max_open_files) && !file_batch)
+	{
+		fprintf(stderr, "Error: --max-read-bytes and --max-open-files require directory or manifest input\n");
+		return false;
+	}
+
+	if (file_batch && (options->rpn_input || options->cache_path || options->stats || options->watch ||
+					   options->definitions || options->compile_library || options->library_input || batch_inputs))
+	{
+		fprintf(stderr, "Error: directory and manifest input cannot be combined with --rpn-input, --cache, --stats, "
+						"--watch, --definitions, --compile-library, --library, --sweep, --csv or --columns\n");
+		return false;
+	}
+
+	if (options->rpn_input && options->polish_notation)
+	{
+		fprintf(stderr, "Error: --rpn-input cannot be combined with -p\n");
+		return false;
+	}
+
+	if ((options->compile_library || options->library_input) &&
+		(options->compile_library + options->library_input + options->rpn_input + options->polish_notation > 1))
+	{
+		fprintf(stderr, "Error: --compile-library and --library cannot be combined with -p, --rpn-input or each other\n");
 		return false;
 	}
 
 	return true;
 }
 
-bool unary_operators_operations_float(float a, const char* operation, float* res, int* err_code)
+typedef enum
+{
+	STATS_READ,
+	STATS_TOKENIZE,
+	STATS_SHUNTING_YARD,
+	STATS_EVALUATE,
+	STATS_OUTPUT,
+	STATS_REQUEST,
+	STATS_CHUNK,
+	STATS_DEFINITION,
+	STATS_STAGE_COUNT
+} stats_stage;
+
+static const char* stats_stage_names[STATS_STAGE_COUNT] = { "read", "tokenize", "shunting_yard", "evaluate",
+															"output", "request", "chunk", "definition" };
+static const char* stats_count_names[STATS_STAGE_COUNT] = { "tokens", "tokens", "tokens", "tokens",
+															"tokens", "expressions", "points", "dependencies" };
+
+typedef struct
+{
+	uint64_t started_ns;
+	uint64_t stage_ns[STATS_STAGE_COUNT];
+	uint64_t expressions;
+	uint64_t failed;
+	uint64_t cache_hits;
+	uint64_t input_tokens;
+	uint64_t rpn_tokens;
+	calc_core_stats core;
+} run_stats;
+
+static run_stats* active_run_stats = NULL;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+#define TRACE_BLOCK_EVENTS 4096
+
+typedef struct
+{
+	uint64_t start_ns;
+	uint64_t duration_ns;
+	uint64_t index;
+	uint32_t count;
+	uint32_t stage;
+} trace_event;
+
+typedef struct trace_block
+{
+	struct trace_block* next;
+	size_t count;
+	trace_event events[TRACE_BLOCK_EVENTS];
+} trace_block;
+
+typedef struct trace_thread
+{
+	struct trace_thread* next;
+	uint32_t tid;
+	bool overflowed;
+	trace_block* head;
+	trace_block* tail;
+} trace_thread;
+
+static bool trace_enabled = false;
+static uint64_t trace_origin_ns = 0;
+static _Atomic(trace_thread*) trace_threads = NULL;
+static _Atomic uint32_t trace_next_tid = 0;
+static _Thread_local trace_thread* current_trace_thread = NULL;
+static _Thread_local uint64_t current_trace_index = 0;
+
+static void trace_set_index(uint64_t index)
+{
+	current_trace_index = index;
+}
+
+static trace_thread* register_trace_thread(void)
 {
-	if (strcmp(operation, "+") == 0)
+	trace_thread* thread = calloc(1, sizeof(trace_thread));
+	if (!thread)
 	{
-		*res = +a;
+		return NULL;
 	}
-	else if (strcmp(operation, "-") == 0)
+	thread->tid = atomic_fetch_add_explicit(&trace_next_tid, 1, memory_order_relaxed);
+	trace_thread* head = atomic_load_explicit(&trace_threads, memory_order_relaxed);
+	do
+	{
+		thread->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&trace_threads, &head, thread, memory_order_release,
+													memory_order_relaxed));
+	return thread;
+}
+
+static void record_trace_event(stats_stage stage, uint64_t started, uint64_t finished, uint32_t count)
+{
+	trace_thread* thread = current_trace_thread;
+	if (!thread && !(thread = current_trace_thread = register_trace_thread()))
 	{
-		*res = -a;
+		return;
 	}
-	else
+	if (!thread->tail || thread->tail->count == TRACE_BLOCK_EVENTS)
 	{
-		if (err_code)
+		trace_block* block = malloc(sizeof(trace_block));
+		if (!block)
 		{
-			*err_code = 1;
+			thread->overflowed = true;
+			return;
 		}
-		return false;
+		block->next = NULL;
+		block->count = 0;
+		if (thread->tail)
+		{
+			thread->tail->next = block;
+		}
+		else
+		{
+			thread->head = block;
+		}
+		thread->tail = block;
 	}
-	return true;
+	trace_event* ev = &thread->tail->events[thread->tail->count++];
+	ev->start_ns = started;
+	ev->duration_ns = finished - started;
+	ev->index = current_trace_index;
+	ev->count = count;
+	ev->stage = stage;
+}
+
+static uint64_t stats_start(void)
+{
+	return active_run_stats || trace_enabled ? now_ns() : 0;
 }
 
-bool function_operations(const char* func_name, float arg, float* res, int* err_code)
+static void stats_stop(stats_stage stage, uint64_t started, size_t count)
 {
-	if (!func_name || !res)
+	if (!started)
 	{
-		if (err_code)
-		{
-			*err_code = 5;
-		}
-		return false;
+		return;
+	}
+	uint64_t finished = now_ns();
+	if (active_run_stats)
+	{
+		active_run_stats->stage_ns[stage] += finished - started;
+	}
+	if (trace_enabled)
+	{
+		record_trace_event(stage, started, finished, count > UINT32_MAX ? UINT32_MAX : (uint32_t)count);
 	}
+}
+
+static void start_trace(void)
+{
+	trace_origin_ns = now_ns();
+	trace_enabled = true;
+}
 
-	if (strcmp(func_name, "sqrt") == 0)
+static bool write_trace(const char* path)
+{
+	trace_enabled = false;
+	FILE* out = fopen(path, "w");
+	if (!out)
 	{
-		if (arg < 0.0f)
-		{
-			if (err_code)
-			{
-				*err_code = 3;
-			}
-			return false;
-		}
-		*res = sqrtf(arg);
+		fprintf(stderr, "Error: Cannot open trace file\n");
+	}
+
+	bool first = true;
+	if (out)
+	{
+		fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", out);
 	}
-	else if (strcmp(func_name, "log2") == 0)
+	trace_thread* thread = atomic_exchange_explicit(&trace_threads, NULL, memory_order_acquire);
+	while (thread)
 	{
-		if (arg <= 0.0f)
+		if (out)
 		{
-			if (err_code)
+			fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+					first ? "" : ",", thread->tid, thread->tid);
+			first = false;
+		}
+		if (out && thread->overflowed)
+		{
+			fprintf(stderr, "Error: trace buffer allocation failed, thread %u is incomplete\n", thread->tid);
+		}
+		trace_block* block = thread->head;
+		while (block)
+		{
+			for (size_t i = 0; out && i < block->count; i++)
 			{
-				*err_code = 3;
+				const trace_event* ev = &block->events[i];
+				fprintf(out,
+						",\n{\"name\":\"%s\",\"cat\":\"calc\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+						"\"dur\":%.3f,\"args\":{\"index\":%llu,\"%s\":%u}}",
+						stats_stage_names[ev->stage], thread->tid, (double)(ev->start_ns - trace_origin_ns) / 1000.0,
+						(double)ev->duration_ns / 1000.0, (unsigned long long)ev->index, stats_count_names[ev->stage],
+						ev->count);
 			}
-			return false;
+			trace_block* next = block->next;
+			free(block);
+			block = next;
 		}
-		*res = log2f(arg);
+		trace_thread* next = thread->next;
+		free(thread);
+		thread = next;
 	}
-	else if (strcmp(func_name, "sin") == 0)
+	current_trace_thread = NULL;
+	if (!out)
 	{
-		*res = sinf(arg);
+		return false;
 	}
-	else if (strcmp(func_name, "cos") == 0)
+	fputs("\n]}\n", out);
+	return fclose(out) == 0;
+}
+
+static void stats_count_expression(int err_code)
+{
+	if (active_run_stats)
 	{
-		*res = cosf(arg);
+		active_run_stats->expressions++;
+		active_run_stats->failed += err_code != 0;
 	}
-	else if (strcmp(func_name, "tan") == 0)
+}
+
+static void start_run_stats(run_stats* stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->started_ns = now_ns();
+	active_run_stats = stats;
+	calc_core_use_stats(&stats->core);
+}
+
+static bool write_run_stats(const run_stats* stats, const char* path)
+{
+	uint64_t total_ns = now_ns() - stats->started_ns;
+	calc_core_use_stats(NULL);
+	active_run_stats = NULL;
+
+	struct rusage usage;
+	long long peak_rss = -1;
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
 	{
-		*res = tanf(arg);
+#if defined(__APPLE__)
+		peak_rss = (long long)usage.ru_maxrss;
+#else
+		peak_rss = (long long)usage.ru_maxrss * 1024;
+#endif
 	}
-	else
+
+	FILE* out = path ? fopen(path, "w") : stderr;
+	if (!out)
 	{
-		if (err_code)
-		{
-			*err_code = 1;
-		}
+		fprintf(stderr, "Error: Cannot open stats file\n");
 		return false;
 	}
-	return true;
+	for (int i = 0; i < STATS_REQUEST; i++)
+	{
+		fprintf(out, "time_%s_seconds %.9f\n", stats_stage_names[i], (double)stats->stage_ns[i] / 1e9);
+	}
+	fprintf(out, "time_total_seconds %.9f\n", (double)total_ns / 1e9);
+	fprintf(out, "expressions %llu\n", (unsigned long long)stats->expressions);
+	fprintf(out, "failed %llu\n", (unsigned long long)stats->failed);
+	fprintf(out, "cache_hits %llu\n", (unsigned long long)stats->cache_hits);
+	fprintf(out, "input_tokens %llu\n", (unsigned long long)stats->input_tokens);
+	fprintf(out, "rpn_tokens %llu\n", (unsigned long long)stats->rpn_tokens);
+	fprintf(out, "make_token_mallocs %llu\n", (unsigned long long)stats->core.token_allocations);
+	fprintf(out, "stack_mallocs %llu\n", (unsigned long long)stats->core.stack_allocations);
+	fprintf(out, "push_stack_reallocs %llu\n", (unsigned long long)stats->core.stack_reallocations);
+	fprintf(out, "queue_mallocs %llu\n", (unsigned long long)stats->core.queue_allocations);
+	fprintf(out, "push_queue_reallocs %llu\n", (unsigned long long)stats->core.queue_reallocations);
+	fprintf(out, "mallocs %llu\n", (unsigned long long)stats->core.allocations);
+	fprintf(out, "reallocs %llu\n", (unsigned long long)stats->core.reallocations);
+	fprintf(out, "frees %llu\n", (unsigned long long)stats->core.releases);
+	fprintf(out, "peak_stack_capacity %zu\n", stats->core.peak_stack_capacity);
+	fprintf(out, "peak_queue_capacity %zu\n", stats->core.peak_queue_capacity);
+	fprintf(out, "peak_rss_bytes %lld\n", peak_rss);
+	return path ? fclose(out) == 0 : true;
 }
 
-queue shunting_yard_algorithm(queue input, int* err_code)
+bool parse_file_data(FILE* input_file, char** math_expression)
 {
-	queue output;
-	if (!initialize_queue(&output, input.capacity ? input.capacity : 16))
+	if (!input_file)
 	{
-		if (err_code)
-		{
-			*err_code = 5;
-		}
-		return make_empty_queue();
+		return false;
+	}
+	if (fseek(input_file, 0, SEEK_END) != 0)
+	{
+		return false;
+	}
+	long size = ftell(input_file);
+	if (size < 0)
+	{
+		return false;
 	}
+	rewind(input_file);
 
-	stack operator_stack;
-	if (!initialize_stack(&operator_stack, input.capacity ? input.capacity : 16))
+	*math_expression = malloc((size_t)size + 1);
+	if (*math_expression == NULL)
 	{
-		if (err_code)
-		{
-			*err_code = 5;
-		}
-		delete_queue(&output);
-		return make_empty_queue();
+		return false;
 	}
 
-	while (!is_empty_queue(&input))
+	size_t read = fread(*math_expression, 1, (size_t)size, input_file);
+	(*math_expression)[read] = '\0';
+
+	return true;
+}
+
+static const char* rpn_prefix(const token* t)
+{
+	return t->type == TOKEN_UNARY_OPERATOR && strcmp(t->value, "~") != 0 ? "u" : "";
+}
+
+void print_queue_to_file(queue* q, FILE* out)
+{
+	if (!q || !q->data)
 	{
-		token t = pop_queue(&input);
-		if (t.type == TOKEN_NUMBER || t.type == TOKEN_FLOAT_NUMBER)
-		{
-			token copy = copy_token(&t);
-			push_queue(&output, copy);
-			if (!is_empty_stack(&operator_stack))
-			{
-				token top = peek_stack(&operator_stack);
-				if (top.type == TOKEN_FUNCTION)
-				{
-					token func = pop_stack(&operator_stack);
-					token func_copy = copy_token(&func);
-					free_token(&func);
-					push_queue(&output, func_copy);
-				}
-			}
-		}
-		else if (t.type == TOKEN_OPERATOR)
-		{
-			while (!is_empty_stack(&operator_stack))
-			{
-				token top = peek_stack(&operator_stack);
-				if (top.type == TOKEN_LPAREN)
-				{
-					break;
-				}
-				if (is_operator_token(&top))
-				{
-					if (top.type == TOKEN_UNARY_OPERATOR)
-					{
-						token popped = pop_stack(&operator_stack);
-						token copy = copy_token(&popped);
-						free_token(&popped);
-						push_queue(&output, copy);
-						continue;
-					}
-					bool should_pop = false;
-					if (is_right_assoc(&t))
-					{
-						should_pop = (top.priority < t.priority);
-					}
-					else
-					{
-						if (top.priority < t.priority)
-						{
-							should_pop = true;
-						}
-						else if (top.priority == t.priority)
-						{
-							should_pop = !is_right_assoc(&top);
-						}
-						else
-						{
-							should_pop = false;
-						}
-					}
-					if (should_pop)
-					{
-						token popped = pop_stack(&operator_stack);
-						token copy = copy_token(&popped);
-						free_token(&popped);
-						push_queue(&output, copy);
-					}
-					else
-					{
-						break;
-					}
-				}
-				else
-				{
-					break;
-				}
-			}
-			token copy_op = copy_token(&t);
-			push_stack(&operator_stack, copy_op);
-		}
-		else if (t.type == TOKEN_LPAREN)
-		{
-			token copy = copy_token(&t);
-			push_stack(&operator_stack, copy);
-		}
-		else if (t.type == TOKEN_RPAREN)
-		{
-			bool found_lparen = false;
-			while (!is_empty_stack(&operator_stack))
-			{
-				token top = peek_stack(&operator_stack);
-				if (top.type == TOKEN_LPAREN)
-				{
-					found_lparen = true;
-					token lparen = pop_stack(&operator_stack);
-					free_token(&lparen);
-					break;
-				}
-				else
-				{
-					token popped = pop_stack(&operator_stack);
-					token copy = copy_token(&popped);
-					free_token(&popped);
-					push_queue(&output, copy);
-				}
-			}
-			if (!found_lparen)
-			{
-				if (err_code)
-				{
-					*err_code = 2;
-				}
-				delete_queue(&output);
-				delete_stack(&operator_stack);
-				return make_empty_queue();
-			}
-			if (!is_empty_stack(&operator_stack))
-			{
-				token top = peek_stack(&operator_stack);
-				if (top.type == TOKEN_FUNCTION)
-				{
-					token func = pop_stack(&operator_stack);
-					token copy = copy_token(&func);
-					free_token(&func);
-					push_queue(&output, copy);
-				}
-			}
-		}
-		else if (t.type == TOKEN_FUNCTION)
-		{
-			token copy = copy_token(&t);
-			push_stack(&operator_stack, copy);
-		}
-		else if (t.type == TOKEN_UNARY_OPERATOR)
-		{
-			token copy_unary = copy_token(&t);
-			push_stack(&operator_stack, copy_unary);
-		}
-		else
+		return;
+	}
+	uint64_t started = stats_start();
+	for (size_t i = 0; i < queue_size(q); i++)
+	{
+		const token* t = queue_at(q, i);
+		if (t->value)
 		{
-			if (err_code)
-			{
-				*err_code = 1;
-			}
-			delete_queue(&output);
-			delete_stack(&operator_stack);
-			return make_empty_queue();
+			fprintf(out, "%s%s\n", rpn_prefix(t), t->value);
 		}
 	}
+	stats_stop(STATS_OUTPUT, started, 0);
+}
 
-	while (!is_empty_stack(&operator_stack))
+void print_queue_to_line(queue* q, FILE* out)
+{
+	if (!q || !q->data)
 	{
-		token top = pop_stack(&operator_stack);
-		if (top.type == TOKEN_LPAREN || top.type == TOKEN_RPAREN)
+		return;
+	}
+	uint64_t started = stats_start();
+	bool first = true;
+	for (size_t i = 0; i < queue_size(q); i++)
+	{
+		const token* t = queue_at(q, i);
+		if (t->value)
 		{
-			free_token(&top);
-			if (err_code)
-			{
-				*err_code = 2;
-			}
-			delete_queue(&output);
-			delete_stack(&operator_stack);
-			return make_empty_queue();
+			fprintf(out, first ? "%s%s" : " %s%s", rpn_prefix(t), t->value);
+			first = false;
 		}
-		token copy = copy_token(&top);
-		free_token(&top);
-		push_queue(&output, copy);
 	}
+	stats_stop(STATS_OUTPUT, started, 0);
+}
 
-	bool has_operand = false;
-	for (size_t i = output.front; i < output.rear; i++)
+/* Integer literals pass through evaluation verbatim, so strip their leading zeros. */
+static const char* big_integer_digits(const char* value)
+{
+	while (value[0] == '0' && value[1] != '\0')
 	{
-		if (output.data[i].type == TOKEN_NUMBER || output.data[i].type == TOKEN_FLOAT_NUMBER)
-		{
-			has_operand = true;
-			break;
-		}
+		value++;
 	}
+	return value;
+}
 
-	if (!has_operand)
+int format_answer(const token* result_token, char* buffer, size_t size)
+{
+	if (result_token->type == TOKEN_FLOAT_NUMBER && numeric_widths.float_bits == 64)
 	{
-		if (err_code)
-		{
-			*err_code = 2;
-		}
-		delete_queue(&output);
-		delete_stack(&operator_stack);
-		return make_empty_queue();
+		return snprintf(buffer, size, "%.*e", DBL_DIG - 1, strtod(result_token->value, NULL));
+	}
+	if (result_token->type == TOKEN_FLOAT_NUMBER)
+	{
+		float float_value = strtof(result_token->value, NULL);
+		return snprintf(buffer, size, "%e", float_value);
 	}
+	if (numeric_widths.int_bits == CALC_CORE_BIG_INTEGERS)
+	{
+		return snprintf(buffer, size, "%s", big_integer_digits(result_token->value));
+	}
+	if (numeric_widths.int_bits == 64)
+	{
+		return snprintf(buffer, size, "%" PRId64, (int64_t)strtoll(result_token->value, NULL, 10));
+	}
+	return snprintf(buffer, size, "%d", atoi(result_token->value));
+}
 
-	delete_stack(&operator_stack);
-	return output;
+void print_answer_to_file(token* result_token, FILE* output_file)
+{
+	uint64_t started = stats_start();
+	if (result_token->type == TOKEN_NUMBER && numeric_widths.int_bits == CALC_CORE_BIG_INTEGERS)
+	{
+		fputs(big_integer_digits(result_token->value), output_file);
+		stats_stop(STATS_OUTPUT, started, 0);
+		return;
+	}
+	char buffer[64];
+	format_answer(result_token, buffer, sizeof(buffer));
+	fputs(buffer, output_file);
+	stats_stop(STATS_OUTPUT, started, 0);
 }
 
-bool calculate_expression(queue* q, token* result_token, int* err_code)
+/* check_structure rejects what evaluation would reject for its shape alone, for -p output that is not evaluated. */
+static bool compile_math_expression(char* math_expression, queue* shunted_expression, bool check_structure,
+									int* err_code, const char** error_message)
 {
-	stack st;
-	if (!initialize_stack(&st, q->capacity))
+	token_stream tokens;
+	if (!initialize_token_stream(&tokens, 100))
 	{
-		if (err_code)
+		*error_message = "Cannot initialize token stream";
+		*err_code = 5;
+		return false;
+	}
+	uint64_t started = stats_start();
+	bool tokenized = tokenize_stream(math_expression, &tokens, err_code);
+	stats_stop(STATS_TOKENIZE, started, tokens.length);
+	if (active_run_stats)
+	{
+		active_run_stats->input_tokens += tokens.length;
+	}
+	if (!tokenized)
+	{
+		*error_message = *err_code >= CALC_ERROR_INPUT_LIMIT ? calc_status_string((calc_status)*err_code)
+															: "Unsupported token";
+		delete_token_stream(&tokens);
+		if (!*err_code)
 		{
-			*err_code = 5;
+			*err_code = 1;
 		}
 		return false;
 	}
 
-	while (!is_empty_queue(q))
+	token_stream rpn;
+	started = stats_start();
+	bool shunted = shunt_token_stream(&tokens, &rpn, err_code);
+	delete_token_stream(&tokens);
+	if (shunted && check_structure && !check_token_stream(&rpn, err_code))
 	{
-		token cur = pop_queue(q);
-
-		if (cur.type == TOKEN_NUMBER || cur.type == TOKEN_FLOAT_NUMBER)
+		delete_token_stream(&rpn);
+		shunted = false;
+	}
+	else if (shunted)
+	{
+		if (!initialize_queue(shunted_expression, rpn.length))
 		{
-			token copy = copy_token(&cur);
-			push_stack(&st, copy);
-			continue;
+			*err_code = 5;
+			shunted = false;
 		}
-
-		if (cur.type == TOKEN_OPERATOR)
+		else if (!token_stream_to_queue(&rpn, shunted_expression, err_code))
 		{
-			if (st.top < 2)
-			{
-				if (err_code)
-				{
-					*err_code = 2;
-				}
-				goto error;
-			}
-
-			token right_token = pop_stack(&st);
-			token left_token = pop_stack(&st);
-
-			bool left_is_float = (left_token.type == TOKEN_FLOAT_NUMBER);
-			bool right_is_float = (right_token.type == TOKEN_FLOAT_NUMBER);
-			bool use_float = left_is_float || right_is_float;
+			delete_queue(shunted_expression);
+			shunted = false;
+		}
+		delete_token_stream(&rpn);
+	}
+	stats_stop(STATS_SHUNTING_YARD, started, shunted ? queue_size(shunted_expression) : 0);
+	if (active_run_stats && shunted)
+	{
+		active_run_stats->rpn_tokens += queue_size(shunted_expression);
+	}
+	if (!shunted)
+	{
+		*error_message = *err_code >= CALC_ERROR_INPUT_LIMIT ? calc_status_string((calc_status)*err_code)
+															: "Parse failed";
+		return false;
+	}
+	return true;
+}
+
+static bool evaluate_math_expression(char* math_expression, token* result_token, int* err_code,
+									 const char** error_message)
+{
+	queue shunted_expression;
+	if (!compile_math_expression(math_expression, &shunted_expression, false, err_code, error_message))
+	{
+		return false;
+	}
+	size_t rpn_tokens = queue_size(&shunted_expression);
+	uint64_t started = stats_start();
+	bool calculated = calculate_expression(&shunted_expression, result_token, err_code);
+	stats_stop(STATS_EVALUATE, started, rpn_tokens);
+	if (!calculated)
+	{
+		*error_message = *err_code >= CALC_ERROR_INPUT_LIMIT ? calc_status_string((calc_status)*err_code)
+															: "Evaluation failed";
+		delete_queue(&shunted_expression);
+		if (!*err_code)
+		{
+			*err_code = 3;
+		}
+		return false;
+	}
+	delete_queue(&shunted_expression);
+	return true;
+}
+
+/* The input limit is checked before the lookup: a cached result must not let a longer expression through. */
+static bool evaluate_cached_expression(char* math_expression, result_cache* cache, const calc_limits* limits,
+									   token* result_token, int* err_code, const char** error_message)
+{
+	size_t length = strlen(math_expression);
+	if (limits->max_input_bytes && length > limits->max_input_bytes)
+	{
+		*err_code = CALC_ERROR_INPUT_LIMIT;
+		*error_message = calc_status_string(CALC_ERROR_INPUT_LIMIT);
+		return false;
+	}
+	if (cache && lookup_result_cache(cache, math_expression, length, result_token))
+	{
+		if (active_run_stats)
+		{
+			active_run_stats->cache_hits++;
+		}
+		return true;
+	}
+	if (!evaluate_math_expression(math_expression, result_token, err_code, error_message))
+	{
+		return false;
+	}
+	if (cache && !store_result_cache(cache, math_expression, length, result_token))
+	{
+		fprintf(stderr, "Error: Cannot store result in cache\n");
+	}
+	return true;
+}
+
+/* skip carries the tokens a taken branch marker still has to pass over into the next line. */
+static bool feed_rpn_line(char* line, stack* st, size_t* tokens, size_t* skip, size_t max_tokens, int* err_code)
+{
+	char* save = NULL;
+	for (char* text = strtok_r(line, " \t\r\n", &save); text; text = strtok_r(NULL, " \t\r\n", &save))
+	{
+		if (max_tokens && *tokens >= max_tokens)
+		{
+			*err_code = CALC_ERROR_TOKEN_LIMIT;
+			return false;
+		}
+		token t;
+		if (!make_rpn_token(text, &t, err_code))
+		{
+			return false;
+		}
+		if (*skip)
+		{
+			(*skip)--;
+			free_token(&t);
+		}
+		else if (!(t.type == TOKEN_BRANCH ? calculate_branch(st, t, skip, err_code)
+										  : calculate_token(st, t, err_code)))
+		{
+			return false;
+		}
+		if (active_run_stats)
+		{
+			active_run_stats->input_tokens++;
+		}
+		(*tokens)++;
+	}
+	return true;
+}
+
+static int process_rpn_stream(FILE* input_file, FILE* output_file, bool line_mode, const calc_limits* limits)
+{
+	stack st;
+	if (!initialize_stack(&st, 16))
+	{
+		fprintf(stderr, "Error: Cannot initialize evaluation stack\n");
+		return 5;
+	}
+
+	char* line = NULL;
+	size_t capacity = 0;
+	size_t line_number = 0;
+	int first_error = 0;
+	int err_code = 0;
+	size_t tokens = 0;
+	size_t skip = 0;
+	size_t expression_bytes = 0;
+	ssize_t line_length;
+
+	calc_core_reset_cost();
+	uint64_t started = stats_start();
+	while ((line_length = getline(&line, &capacity, input_file)) != -1)
+	{
+		line_number++;
+		trace_set_index(line_number);
+		stats_stop(STATS_READ, started, 0);
+		started = stats_start();
+		size_t fed = tokens;
+		expression_bytes += (size_t)line_length;
+		if (!err_code && limits->max_input_bytes && expression_bytes > limits->max_input_bytes)
+		{
+			err_code = CALC_ERROR_INPUT_LIMIT;
+		}
+		if (!err_code && !feed_rpn_line(line, &st, &tokens, &skip, limits->max_tokens, &err_code) && !err_code)
+		{
+			err_code = 1;
+		}
+		if (!line_mode)
+		{
+			stats_stop(STATS_EVALUATE, started, tokens - fed);
+			if (err_code)
+			{
+				break;
+			}
+			started = stats_start();
+			continue;
+		}
+
+		if (!err_code && skip)
+		{
+			err_code = 2;
+		}
+		token res;
+		bool finished = !err_code && tokens && finish_calculation(&st, &res, &err_code);
+		stats_stop(STATS_EVALUATE, started, tokens);
+		if (finished)
+		{
+			print_answer_to_file(&res, output_file);
+			free_token(&res);
+		}
+		if (tokens || err_code)
+		{
+			stats_count_expression(err_code);
+		}
+		if (err_code)
+		{
+			fprintf(stderr, "Error: line %zu: %s\n", line_number,
+					err_code >= CALC_ERROR_INPUT_LIMIT ? calc_status_string((calc_status)err_code) : "Evaluation failed");
+			fprintf(output_file, "error %d", err_code);
+			if (!first_error)
+			{
+				first_error = err_code;
+			}
+		}
+		fputc('\n', output_file);
+		clear_stack(&st);
+		calc_core_reset_cost();
+		tokens = 0;
+		skip = 0;
+		expression_bytes = 0;
+		err_code = 0;
+		started = stats_start();
+	}
+
+	if (!line_mode)
+	{
+		if (!err_code && skip)
+		{
+			err_code = 2;
+		}
+		token res;
+		started = stats_start();
+		bool finished = !err_code && finish_calculation(&st, &res, &err_code);
+		stats_stop(STATS_EVALUATE, started, 0);
+		if (finished)
+		{
+			print_answer_to_file(&res, output_file);
+			free_token(&res);
+		}
+		stats_count_expression(err_code);
+		if (err_code)
+		{
+			fprintf(stderr, "Error: %s\n",
+					err_code >= CALC_ERROR_INPUT_LIMIT ? calc_status_string((calc_status)err_code) : "Evaluation failed");
+			first_error = err_code;
+		}
+	}
+
+	free(line);
+	delete_stack(&st);
+	return first_error;
+}
+
+/* The input file an error comes from, named in messages when several files are evaluated at once. */
+static _Thread_local const char* error_source = NULL;
+
+static void report_expression_error(size_t line_number, const char* message)
+{
+	if (error_source && line_number)
+	{
+		fprintf(stderr, "Error: %s: line %zu: %s\n", error_source, line_number, message);
+	}
+	else if (error_source)
+	{
+		fprintf(stderr, "Error: %s: %s\n", error_source, message);
+	}
+	else if (line_number)
+	{
+		fprintf(stderr, "Error: line %zu: %s\n", line_number, message);
+	}
+	else
+	{
+		fprintf(stderr, "Error: %s\n", message);
+	}
+}
+
+static int process_single_expression(char* expr, const console_options* options, result_cache* cache, FILE* output_file)
+{
+	int err_code = 0;
+	const char* error_message = NULL;
+	trace_set_index(1);
+
+	if (options->polish_notation)
+	{
+		queue shunted_expression;
+		bool compiled = compile_math_expression(expr, &shunted_expression, true, &err_code, &error_message);
+		stats_count_expression(err_code);
+		if (!compiled)
+		{
+			report_expression_error(0, error_message);
+			return err_code;
+		}
+		print_queue_to_file(&shunted_expression, output_file);
+		delete_queue(&shunted_expression);
+		return 0;
+	}
+
+	token res;
+	bool evaluated = evaluate_cached_expression(expr, cache, &options->limits, &res, &err_code, &error_message);
+	stats_count_expression(err_code);
+	if (!evaluated)
+	{
+		report_expression_error(0, error_message);
+		return err_code;
+	}
+	print_answer_to_file(&res, output_file);
+	free_token(&res);
+	return 0;
+}
+
+/* Writes the result of one --lines line, without its newline; blank lines write nothing. */
+static int process_expression_line(char* line, size_t line_number, const console_options* options,
+								   result_cache* cache, FILE* output_file)
+{
+	trace_set_index(line_number);
+
+	int err_code = 0;
+	const char* error_message = NULL;
+	bool blank = line[strspn(line, " \t")] == '\0';
+	if (!blank && options->polish_notation)
+	{
+		queue shunted_expression;
+		if (compile_math_expression(line, &shunted_expression, true, &err_code, &error_message))
+		{
+			print_queue_to_line(&shunted_expression, output_file);
+			delete_queue(&shunted_expression);
+		}
+	}
+	else if (!blank)
+	{
+		token res;
+		if (evaluate_cached_expression(line, cache, &options->limits, &res, &err_code, &error_message))
+		{
+			print_answer_to_file(&res, output_file);
+			free_token(&res);
+		}
+	}
+
+	if (!blank)
+	{
+		stats_count_expression(err_code);
+	}
+	if (err_code)
+	{
+		report_expression_error(line_number, error_message);
+		fprintf(output_file, "error %d", err_code);
+	}
+	return err_code;
+}
+
+/* Cuts the line starting at text in place, dropping a trailing '\r', and returns the start of the next one. */
+static char* cut_line(char* text)
+{
+	char* end = strchr(text, '\n');
+	char* next = end ? end + 1 : text + strlen(text);
+	if (end)
+	{
+		*end = '\0';
+	}
+	if (end > text && end[-1] == '\r')
+	{
+		end[-1] = '\0';
+	}
+	return next;
+}
+
+static int process_expression_lines(char* expr, const console_options* options, result_cache* cache, FILE* output_file)
+{
+	int first_error = 0;
+	size_t line_number = 0;
+	char* line = expr;
+
+	while (*line != '\0')
+	{
+		char* next = cut_line(line);
+		line_number++;
+		int err_code = process_expression_line(line, line_number, options, cache, output_file);
+		if (err_code && !first_error)
+		{
+			first_error = err_code;
+		}
+		fputc('\n', output_file);
+		line = next;
+	}
+	return first_error;
+}
+
+static int compile_expression_library(char* expr, const char* output_path, const calc_limits* limits)
+{
+	calc_context* context = NULL;
+	if (calc_context_create_with_widths(NULL, limits, &numeric_widths, &context) != CALC_OK)
+	{
+		fprintf(stderr, "Error: Cannot initialize calculator context\n");
+		return 5;
+	}
+
+	calc_expression** expressions = NULL;
+	calc_status* statuses = NULL;
+	size_t count = 0;
+	size_t capacity = 0;
+	size_t line_number = 0;
+	int err_code = 0;
+	int first_error = 0;
+	char* save = NULL;
+
+	for (char* line = strtok_r(expr, "\n", &save); line; line = strtok_r(NULL, "\n", &save))
+	{
+		size_t length = strlen(line);
+		if (length && line[length - 1] == '\r')
+		{
+			line[length - 1] = '\0';
+		}
+		line_number++;
+		if (line[strspn(line, " \t")] == '\0')
+		{
+			continue;
+		}
+		if (count == capacity)
+		{
+			size_t new_capacity = capacity ? capacity * 2 : 64;
+			calc_expression** new_expressions = realloc(expressions, new_capacity * sizeof(*expressions));
+			if (new_expressions)
+			{
+				expressions = new_expressions;
+			}
+			calc_status* new_statuses = realloc(statuses, new_capacity * sizeof(*statuses));
+			if (new_statuses)
+			{
+				statuses = new_statuses;
+			}
+			if (!new_expressions || !new_statuses)
+			{
+				fprintf(stderr, "Error: Cannot allocate formula library\n");
+				err_code = 5;
+				break;
+			}
+			capacity = new_capacity;
+		}
+		expressions[count] = NULL;
+		statuses[count] = calc_compile(context, line, &expressions[count]);
+		if (statuses[count] != CALC_OK)
+		{
+			fprintf(stderr, "Error: line %zu: %s\n", line_number, calc_status_string(statuses[count]));
+			first_error = first_error ? first_error : (int)statuses[count];
+		}
+		count++;
+	}
+
+	if (!err_code)
+	{
+		calc_status status =
+			calc_library_write(context, output_path, (const calc_expression* const*)expressions, statuses, count);
+		if (status != CALC_OK)
+		{
+			fprintf(stderr, "Error: Cannot write formula library: %s\n", calc_status_string(status));
+			err_code = 5;
+		}
+	}
+	if (!err_code)
+	{
+		err_code = first_error;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		calc_expression_free(context, expressions[i]);
+	}
+	free(expressions);
+	free(statuses);
+	calc_context_destroy(context);
+	return err_code;
+}
+
+static int evaluate_expression_library(const char* library_path, FILE* output_file, const calc_limits* limits)
+{
+	calc_context* context = NULL;
+	if (calc_context_create_limited(NULL, limits, &context) != CALC_OK)
+	{
+		fprintf(stderr, "Error: Cannot initialize calculator context\n");
+		return 5;
+	}
+
+	calc_library* library = NULL;
+	calc_status status = calc_library_open(context, library_path, &library);
+	if (status != CALC_OK)
+	{
+		fprintf(stderr, "Error: Cannot open formula library: %s\n", calc_status_string(status));
+		calc_context_destroy(context);
+		return 5;
+	}
+
+	int first_error = 0;
+	size_t count = calc_library_count(library);
+	for (size_t i = 0; i < count; i++)
+	{
+		calc_value value;
+		status = calc_library_evaluate(context, library, i, NULL, &value);
+		if (status == CALC_OK)
+		{
+			char buffer[64];
+			calc_format_value(&value, buffer, sizeof(buffer));
+			fputs(buffer, output_file);
+		}
+		else
+		{
+			fprintf(stderr, "Error: entry %zu: %s\n", i + 1, calc_status_string(status));
+			fprintf(output_file, "error %d", (int)status);
+			if (!first_error)
+			{
+				first_error = (int)status;
+			}
+		}
+		fputc('\n', output_file);
+	}
+
+	calc_library_close(context, library);
+	calc_context_destroy(context);
+	return first_error;
+}
+
+/*
+ * --definitions: one "name = expression" per line, where expressions refer to other definitions by name. Each
+ * definition is compiled once into a dependency graph; update_definitions diffs a new text against the graph by
+ * name and expression text and re-evaluates only changed definitions and their transitive dependents. Those are
+ * taken from a ready queue by a pool of workers, so independent branches of the graph run in parallel.
+ */
+typedef enum
+{
+	DEFINITION_OK,
+	DEFINITION_FAILED,
+	DEFINITION_UNDEFINED,
+	DEFINITION_CIRCULAR,
+	DEFINITION_DEPENDENCY
+} definition_failure;
+
+typedef struct
+{
+	char* name;
+	char* text;
+	size_t line;
+	calc_expression* expression;
+	calc_status compile_status;
+	size_t* dependencies;
+	calc_value* arguments;
+	size_t* dependents;
+	size_t dependent_count;
+	size_t pending;
+	bool dirty;
+	bool updated;
+	calc_value value;
+	calc_status status;
+	definition_failure failure;
+	size_t culprit;
+} definition;
+
+typedef struct
+{
+	calc_context* context;
+	definition* items;
+	size_t count;
+	size_t line_count;
+	size_t* table;
+	size_t table_size;
+	size_t worker_count;
+	size_t evaluated;
+} definition_graph;
+
+typedef struct
+{
+	definition_graph* graph;
+	size_t* ready;
+	size_t ready_count;
+	size_t active;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+} definition_schedule;
+
+/* Open addressing over definition indices plus one, zero marking an empty slot. */
+static size_t find_definition(const definition* items, const size_t* table, size_t table_size, const char* name)
+{
+	size_t mask = table_size - 1;
+	for (size_t slot = (size_t)hash_bytes(name, strlen(name), 0) & mask;; slot = (slot + 1) & mask)
+	{
+		if (table[slot] == 0 || strcmp(items[table[slot] - 1].name, name) == 0)
+		{
+			return table[slot] ? table[slot] - 1 : SIZE_MAX;
+		}
+	}
+}
+
+static void free_definition(const calc_context* context, definition* d)
+{
+	calc_expression_free(context, d->expression);
+	free(d->name);
+	free(d->text);
+	free(d->dependencies);
+	free(d->arguments);
+	free(d->dependents);
+}
+
+static void free_definition_items(const calc_context* context, definition* items, size_t count)
+{
+	for (size_t i = 0; items && i < count; i++)
+	{
+		free_definition(context, &items[i]);
+	}
+	free(items);
+}
+
+/* Splits "name = expression"; the expression is trimmed so that reformatting around it does not count as a change. */
+static bool split_definition(char* line, char** name, char** text)
+{
+	char* p = line + strspn(line, " \t");
+	*name = p;
+	if (!is_letter_char(*p))
+	{
+		return false;
+	}
+	while (is_letter_char(*p) || is_digit_char(*p))
+	{
+		p++;
+	}
+	char* name_end = p;
+	p += strspn(p, " \t");
+	if (*p != '=' || p[1] == '=')
+	{
+		return false;
+	}
+	*name_end = '\0';
+	p++;
+	*text = p + strspn(p, " \t");
+	size_t length = strlen(*text);
+	while (length && ((*text)[length - 1] == ' ' || (*text)[length - 1] == '\t'))
+	{
+		(*text)[--length] = '\0';
+	}
+	return true;
+}
+
+static int parse_definitions(char* text, definition** parsed, size_t* count, size_t* line_count, size_t** table,
+							 size_t* table_size)
+{
+	size_t lines = 1;
+	for (const char* p = text; *p; p++)
+	{
+		lines += *p == '\n';
+	}
+	size_t length = strlen(text);
+	size_t last_line = length == 0 || text[length - 1] == '\n' ? lines - 1 : lines;
+	size_t size = 16;
+	while (size < lines * 2)
+	{
+		size *= 2;
+	}
+	definition* items = calloc(lines, sizeof(definition));
+	size_t* slots = calloc(size, sizeof(size_t));
+	if (!items || !slots)
+	{
+		fprintf(stderr, "Error: Cannot allocate definition graph\n");
+		free(items);
+		free(slots);
+		return 5;
+	}
+
+	int err_code = 0;
+	size_t n = 0;
+	char* line = text;
+	size_t line_number = 0;
+	while (line && !err_code)
+	{
+		line_number++;
+		char* newline = strchr(line, '\n');
+		if (newline)
+		{
+			*newline = '\0';
+		}
+		size_t line_length = strlen(line);
+		if (line_length && line[line_length - 1] == '\r')
+		{
+			line[line_length - 1] = '\0';
+		}
+		char* name = NULL;
+		char* expression = NULL;
+		if (line[strspn(line, " \t")] == '\0')
+		{
+			line = newline ? newline + 1 : NULL;
+			continue;
+		}
+		if (!split_definition(line, &name, &expression))
+		{
+			fprintf(stderr, "Error: line %zu: expected name = expression\n", line_number);
+			err_code = CALC_ERROR_SYNTAX;
+		}
+		else if (is_valid_function(name))
+		{
+			fprintf(stderr, "Error: line %zu: %s is a function name\n", line_number, name);
+			err_code = CALC_ERROR_SYNTAX;
+		}
+		else if (find_definition(items, slots, size, name) != SIZE_MAX)
+		{
+			fprintf(stderr, "Error: line %zu: %s is already defined\n", line_number, name);
+			err_code = CALC_ERROR_SYNTAX;
+		}
+		else if (!(items[n].name = strdup(name)) || !(items[n].text = strdup(expression)))
+		{
+			fprintf(stderr, "Error: Cannot allocate definition graph\n");
+			err_code = 5;
+			n++;
+		}
+		else
+		{
+			size_t slot = (size_t)hash_bytes(name, strlen(name), 0) & (size - 1);
+			while (slots[slot])
+			{
+				slot = (slot + 1) & (size - 1);
+			}
+			slots[slot] = ++n;
+			items[n - 1].line = line_number;
+		}
+		line = newline ? newline + 1 : NULL;
+	}
+	if (err_code)
+	{
+		free_definition_items(NULL, items, n);
+		free(slots);
+		return err_code;
+	}
+	*parsed = items;
+	*count = n;
+	*line_count = last_line;
+	*table = slots;
+	*table_size = size;
+	return 0;
+}
+
+static void evaluate_definition(const definition_graph* graph, size_t index)
+{
+	definition* d = &graph->items[index];
+	d->dirty = false;
+	d->updated = true;
+	d->failure = DEFINITION_FAILED;
+	d->status = d->compile_status;
+	if (!d->expression)
+	{
+		return;
+	}
+	size_t slots = calc_expression_variable_count(d->expression);
+	for (size_t s = 0; s < slots; s++)
+	{
+		const definition* dependency = d->dependencies[s] == SIZE_MAX ? NULL : &graph->items[d->dependencies[s]];
+		if (!dependency || dependency->status != CALC_OK)
+		{
+			d->failure = dependency ? DEFINITION_DEPENDENCY : DEFINITION_UNDEFINED;
+			d->culprit = s;
+			d->status = dependency ? dependency->status : CALC_ERROR_SYNTAX;
+			return;
+		}
+		d->arguments[s] = dependency->value;
+	}
+	d->status = calc_evaluate_with(graph->context, d->expression, d->arguments, &d->value);
+	d->failure = d->status == CALC_OK ? DEFINITION_OK : DEFINITION_FAILED;
+}
+
+static void* run_definition_worker(void* arg)
+{
+	definition_schedule* schedule = arg;
+	definition* items = schedule->graph->items;
+	pthread_mutex_lock(&schedule->lock);
+	for (;;)
+	{
+		while (schedule->ready_count == 0 && schedule->active > 0)
+		{
+			pthread_cond_wait(&schedule->wake, &schedule->lock);
+		}
+		if (schedule->ready_count == 0)
+		{
+			break;
+		}
+		size_t index = schedule->ready[--schedule->ready_count];
+		schedule->active++;
+		pthread_mutex_unlock(&schedule->lock);
+
+		uint64_t started = stats_start();
+		evaluate_definition(schedule->graph, index);
+		trace_set_index(items[index].line);
+		stats_stop(STATS_DEFINITION, started,
+				   items[index].expression ? calc_expression_variable_count(items[index].expression) : 0);
+
+		pthread_mutex_lock(&schedule->lock);
+		schedule->active--;
+		schedule->graph->evaluated++;
+		for (size_t k = 0; k < items[index].dependent_count; k++)
+		{
+			size_t dependent = items[index].dependents[k];
+			if (--items[dependent].pending == 0)
+			{
+				schedule->ready[schedule->ready_count++] = dependent;
+			}
+		}
+		pthread_cond_broadcast(&schedule->wake);
+	}
+	pthread_mutex_unlock(&schedule->lock);
+	return NULL;
+}
+
+/* Links every definition to the ones it names and back; unresolved names leave SIZE_MAX and force a re-evaluation. */
+static bool link_definitions(definition_graph* graph)
+{
+	definition* items = graph->items;
+	for (size_t i = 0; i < graph->count; i++)
+	{
+		size_t slots = items[i].expression ? calc_expression_variable_count(items[i].expression) : 0;
+		if (slots && !items[i].dependencies)
+		{
+			items[i].dependencies = malloc(slots * sizeof(size_t));
+			items[i].arguments = malloc(slots * sizeof(calc_value));
+			if (!items[i].dependencies || !items[i].arguments)
+			{
+				return false;
+			}
+		}
+		for (size_t s = 0; s < slots; s++)
+		{
+			const char* name = calc_expression_variable_name(items[i].expression, s);
+			size_t dependency = find_definition(items, graph->table, graph->table_size, name);
+			items[i].dependencies[s] = dependency;
+			if (dependency == SIZE_MAX)
+			{
+				items[i].dirty = true;
+			}
+			else
+			{
+				items[dependency].dependent_count++;
+			}
+		}
+	}
+	for (size_t i = 0; i < graph->count; i++)
+	{
+		if (items[i].dependent_count && !(items[i].dependents = malloc(items[i].dependent_count * sizeof(size_t))))
+		{
+			return false;
+		}
+		items[i].dependent_count = 0;
+	}
+	for (size_t i = 0; i < graph->count; i++)
+	{
+		size_t slots = items[i].expression ? calc_expression_variable_count(items[i].expression) : 0;
+		for (size_t s = 0; s < slots; s++)
+		{
+			if (items[i].dependencies[s] != SIZE_MAX)
+			{
+				definition* dependency = &items[items[i].dependencies[s]];
+				dependency->dependents[dependency->dependent_count++] = i;
+			}
+		}
+	}
+	return true;
+}
+
+/* Evaluates the dirty definitions whose dirty dependencies all complete; definitions on a cycle stay dirty. */
+static bool run_definition_schedule(definition_graph* graph)
+{
+	definition* items = graph->items;
+	definition_schedule schedule;
+	memset(&schedule, 0, sizeof(schedule));
+	schedule.graph = graph;
+	schedule.ready = malloc((graph->count ? graph->count : 1) * sizeof(size_t));
+	if (!schedule.ready)
+	{
+		return false;
+	}
+	size_t dirty = 0;
+	for (size_t i = 0; i < graph->count; i++)
+	{
+		dirty += items[i].dirty;
+		for (size_t k = 0; items[i].dirty && k < items[i].dependent_count; k++)
+		{
+			items[items[i].dependents[k]].pending++;
+		}
+	}
+	for (size_t i = 0; i < graph->count; i++)
+	{
+		if (items[i].dirty && items[i].pending == 0)
+		{
+			schedule.ready[schedule.ready_count++] = i;
+		}
+	}
+
+	size_t workers = graph->worker_count < dirty ? graph->worker_count : dirty;
+	pthread_t* threads = workers > 1 ? malloc((workers - 1) * sizeof(pthread_t)) : NULL;
+	size_t started = 0;
+	pthread_mutex_init(&schedule.lock, NULL);
+	pthread_cond_init(&schedule.wake, NULL);
+	while (threads && started + 1 < workers &&
+		   pthread_create(&threads[started], NULL, run_definition_worker, &schedule) == 0)
+	{
+		started++;
+	}
+	run_definition_worker(&schedule);
+	for (size_t w = 0; w < started; w++)
+	{
+		pthread_join(threads[w], NULL);
+	}
+	pthread_mutex_destroy(&schedule.lock);
+	pthread_cond_destroy(&schedule.wake);
+	free(threads);
+	free(schedule.ready);
+	for (size_t i = 0; i < graph->count; i++)
+	{
+		items[i].pending = 0;
+	}
+	return true;
+}
+
+/*
+ * Tarjan's strongly connected components over the definitions a schedule left dirty. Members of a component with
+ * more than one definition, or with a self reference, are circular; the others only depend on a cycle and are
+ * evaluated by the next schedule, which reports the failed dependency.
+ */
+static bool mark_circular_definitions(definition_graph* graph)
+{
+	definition* items = graph->items;
+	size_t count = graph->count;
+	size_t* buffer = malloc((count ? count : 1) * 6 * sizeof(size_t));
+	if (!buffer)
+	{
+		return false;
+	}
+	size_t* order = buffer;
+	size_t* low = order + count;
+	size_t* position = low + count;
+	size_t* components = position + count;
+	size_t* frames = components + count;
+	size_t* next = frames + count;
+	size_t visited = 0;
+	size_t top = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		order[i] = SIZE_MAX;
+		position[i] = SIZE_MAX;
+	}
+	for (size_t root = 0; root < count; root++)
+	{
+		if (!items[root].dirty || order[root] != SIZE_MAX)
+		{
+			continue;
+		}
+		size_t depth = 0;
+		order[root] = low[root] = visited++;
+		position[root] = top;
+		components[top++] = root;
+		frames[depth++] = root;
+		next[root] = 0;
+		while (depth)
+		{
+			size_t v = frames[depth - 1];
+			if (next[v] < items[v].dependent_count)
+			{
+				size_t w = items[v].dependents[next[v]++];
+				if (items[w].dirty && order[w] == SIZE_MAX)
+				{
+					order[w] = low[w] = visited++;
+					position[w] = top;
+					components[top++] = w;
+					frames[depth++] = w;
+					next[w] = 0;
+				}
+				else if (items[w].dirty && position[w] != SIZE_MAX)
+				{
+					low[v] = order[w] < low[v] ? order[w] : low[v];
+				}
+				continue;
+			}
+			depth--;
+			if (depth)
+			{
+				size_t u = frames[depth - 1];
+				low[u] = low[v] < low[u] ? low[v] : low[u];
+			}
+			if (low[v] != order[v])
+			{
+				continue;
+			}
+			size_t start = position[v];
+			bool cyclic = top - start > 1;
+			for (size_t k = 0; !cyclic && k < items[v].dependent_count; k++)
+			{
+				cyclic = items[v].dependents[k] == v;
+			}
+			for (size_t k = start; k < top; k++)
+			{
+				definition* d = &items[components[k]];
+				position[components[k]] = SIZE_MAX;
+				if (cyclic)
+				{
+					d->dirty = false;
+					d->updated = true;
+					d->status = CALC_ERROR_SYNTAX;
+					d->failure = DEFINITION_CIRCULAR;
+				}
+			}
+			top = start;
+		}
+	}
+	free(buffer);
+	return true;
+}
+
+static void schedule_definitions(definition_graph* graph)
+{
+	definition* items = graph->items;
+	size_t* pending = malloc((graph->count ? graph->count : 1) * sizeof(size_t));
+	bool propagated = pending != NULL;
+	size_t top = 0;
+	for (size_t i = 0; pending && i < graph->count; i++)
+	{
+		if (items[i].dirty)
+		{
+			pending[top++] = i;
+		}
+	}
+	while (pending && top > 0)
+	{
+		const definition* d = &items[pending[--top]];
+		for (size_t k = 0; k < d->dependent_count; k++)
+		{
+			if (!items[d->dependents[k]].dirty)
+			{
+				items[d->dependents[k]].dirty = true;
+				pending[top++] = d->dependents[k];
+			}
+		}
+	}
+	free(pending);
+
+	graph->evaluated = 0;
+	bool scheduled = propagated && run_definition_schedule(graph);
+	bool cycles = false;
+	for (size_t i = 0; i < graph->count; i++)
+	{
+		cycles |= items[i].dirty;
+	}
+	if (scheduled && cycles)
+	{
+		scheduled = mark_circular_definitions(graph) && run_definition_schedule(graph);
+	}
+	for (size_t i = 0; i < graph->count; i++)
+	{
+		if (items[i].dirty)
+		{
+			items[i].dirty = false;
+			items[i].updated = true;
+			items[i].status = CALC_ERROR_NO_MEMORY;
+			items[i].failure = DEFINITION_FAILED;
+		}
+	}
+}
+
+static int update_definitions(definition_graph* graph, char* text)
+{
+	definition* items = NULL;
+	size_t count = 0;
+	size_t line_count = 0;
+	size_t* table = NULL;
+	size_t table_size = 0;
+	int err_code = parse_definitions(text, &items, &count, &line_count, &table, &table_size);
+	if (err_code)
+	{
+		return err_code;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		size_t old = graph->items ? find_definition(graph->items, graph->table, graph->table_size, items[i].name)
+								  : SIZE_MAX;
+		definition* previous = old == SIZE_MAX ? NULL : &graph->items[old];
+		if (previous && strcmp(previous->text, items[i].text) == 0)
+		{
+			items[i].expression = previous->expression;
+			items[i].compile_status = previous->compile_status;
+			items[i].dependencies = previous->dependencies;
+			items[i].arguments = previous->arguments;
+			items[i].value = previous->value;
+			items[i].status = previous->status;
+			items[i].failure = previous->failure;
+			items[i].culprit = previous->culprit;
+			previous->expression = NULL;
+			previous->dependencies = NULL;
+			previous->arguments = NULL;
+			continue;
+		}
+		items[i].dirty = true;
+		items[i].compile_status = calc_compile(graph->context, items[i].text, &items[i].expression);
+	}
+
+	free_definition_items(graph->context, graph->items, graph->count);
+	free(graph->table);
+	graph->items = items;
+	graph->count = count;
+	graph->line_count = line_count;
+	graph->table = table;
+	graph->table_size = table_size;
+	if (!link_definitions(graph))
+	{
+		fprintf(stderr, "Error: Cannot allocate definition graph\n");
+		return 5;
+	}
+	schedule_definitions(graph);
+	return 0;
+}
+
+static void report_definition_error(const definition_graph* graph, const definition* d)
+{
+	switch (d->failure)
+	{
+	case DEFINITION_UNDEFINED:
+		fprintf(stderr, "Error: line %zu: undefined name %s\n", d->line,
+				calc_expression_variable_name(d->expression, d->culprit));
+		break;
+	case DEFINITION_CIRCULAR:
+		fprintf(stderr, "Error: line %zu: circular definition of %s\n", d->line, d->name);
+		break;
+	case DEFINITION_DEPENDENCY:
+		fprintf(stderr, "Error: line %zu: %s depends on failed definition %s\n", d->line, d->name,
+				graph->items[d->dependencies[d->culprit]].name);
+		break;
+	default:
+		fprintf(stderr, "Error: line %zu: %s\n", d->line, calc_status_string(d->status));
+		break;
+	}
+}
+
+/*
+ * One output line per input line, as with --lines: "name = value", "name = error N" or blank. Errors are
+ * reported on stderr for the definitions evaluated by the last update only.
+ */
+static int write_definitions(const definition_graph* graph, FILE* output_file)
+{
+	int first_error = 0;
+	size_t line = 1;
+	for (size_t i = 0; i < graph->count; i++, line++)
+	{
+		const definition* d = &graph->items[i];
+		for (; line < d->line; line++)
+		{
+			fputc('\n', output_file);
+		}
+		fprintf(output_file, "%s = ", d->name);
+		if (d->status == CALC_OK)
+		{
+			char buffer[64];
+			calc_format_value(&d->value, buffer, sizeof(buffer));
+			fputs(buffer, output_file);
+		}
+		else
+		{
+			if (d->updated)
+			{
+				report_definition_error(graph, d);
+			}
+			fprintf(output_file, "error %d", (int)d->status);
+			if (!first_error)
+			{
+				first_error = (int)d->status;
+			}
+		}
+		fputc('\n', output_file);
+	}
+	for (; line <= graph->line_count; line++)
+	{
+		fputc('\n', output_file);
+	}
+	return first_error;
+}
+
+static int create_definition_graph(definition_graph* graph, const console_options* options)
+{
+	memset(graph, 0, sizeof(*graph));
+	graph->worker_count = options->worker_count;
+	if (graph->worker_count == 0)
+	{
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		graph->worker_count = online > 0 ? (size_t)online : 1;
+	}
+	if (calc_context_create_with_widths(NULL, &options->limits, &options->widths, &graph->context) != CALC_OK)
+	{
+		fprintf(stderr, "Error: Cannot initialize calculator context\n");
+		return 5;
+	}
+	return 0;
+}
+
+static void free_definition_graph(definition_graph* graph)
+{
+	free_definition_items(graph->context, graph->items, graph->count);
+	free(graph->table);
+	calc_context_destroy(graph->context);
+}
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop_signal(int signo)
+{
+	(void)signo;
+	stop_requested = 1;
+}
+
+/*
+ * --watch keeps -o in step with -i. Every line of the last version is remembered by its expression hash with
+ * its output bytes; after an inotify event the new version reuses the output of every line it still contains,
+ * evaluates only added or modified lines, and patches only the byte ranges of the output file that differ.
+ * The directory is watched rather than the file so that editors replacing the file on save are seen too.
+ */
+#define WATCH_EVENT_BUFFER 4096
+#define WATCH_MERGE_GAP 64
+
+typedef struct
+{
+	uint64_t key;
+	uint64_t check;
+	size_t offset;
+	size_t length;
+	int err_code;
+} watch_line;
+
+typedef struct
+{
+	watch_line* lines;
+	size_t count;
+	size_t* table;
+	size_t table_size;
+	char* output;
+	size_t output_length;
+} watch_state;
+
+static void free_watch_state(watch_state* state)
+{
+	free(state->lines);
+	free(state->table);
+	free(state->output);
+	memset(state, 0, sizeof(*state));
+}
+
+static const watch_line* find_watch_line(const watch_state* state, uint64_t key, uint64_t check)
+{
+	if (!state->table_size)
+	{
+		return NULL;
+	}
+	size_t mask = state->table_size - 1;
+	for (size_t slot = (size_t)key & mask;; slot = (slot + 1) & mask)
+	{
+		const watch_line* line = state->table[slot] ? &state->lines[state->table[slot] - 1] : NULL;
+		if (!line || (line->key == key && line->check == check))
+		{
+			return line;
+		}
+	}
+	return NULL;
+}
+
+static bool index_watch_lines(watch_state* state)
+{
+	state->table_size = 16;
+	while (state->table_size < state->count * 2)
+	{
+		state->table_size *= 2;
+	}
+	state->table = calloc(state->table_size, sizeof(size_t));
+	if (!state->table)
+	{
+		return false;
+	}
+	for (size_t i = 0; i < state->count; i++)
+	{
+		if (find_watch_line(state, state->lines[i].key, state->lines[i].check))
+		{
+			continue;
+		}
+		size_t slot = (size_t)state->lines[i].key & (state->table_size - 1);
+		while (state->table[slot])
+		{
+			slot = (slot + 1) & (state->table_size - 1);
+		}
+		state->table[slot] = i + 1;
+	}
+	return true;
+}
+
+/* Builds the output of text line by line, copying the bytes of lines the previous version already had. */
+static int render_watch_lines(char* text, const console_options* options, result_cache* cache,
+							  const watch_state* previous, watch_state* next, int* first_error)
+{
+	memset(next, 0, sizeof(*next));
+	size_t lines = 1;
+	for (const char* p = text; *p; p++)
+	{
+		lines += *p == '\n';
+	}
+	next->lines = malloc(lines * sizeof(watch_line));
+	FILE* stream = next->lines ? open_memstream(&next->output, &next->output_length) : NULL;
+	if (!stream)
+	{
+		fprintf(stderr, "Error: Cannot allocate output buffer\n");
+		free_watch_state(next);
+		return 5;
+	}
+
+	*first_error = 0;
+	char* line = text;
+	while (*line != '\0')
+	{
+		char* following = cut_line(line);
+		watch_line* current = &next->lines[next->count++];
+		hash_expression(line, strlen(line), &current->key, &current->check);
+		const watch_line* known = find_watch_line(previous, current->key, current->check);
+		current->offset = (size_t)ftello(stream);
+		if (known)
+		{
+			fwrite(previous->output + known->offset, 1, known->length, stream);
+			current->err_code = known->err_code;
+		}
+		else
+		{
+			current->err_code = process_expression_line(line, next->count, options, cache, stream);
+			fputc('\n', stream);
+		}
+		current->length = (size_t)ftello(stream) - current->offset;
+		if (current->err_code && !*first_error)
+		{
+			*first_error = current->err_code;
+		}
+		line = following;
+	}
+	if (fclose(stream) != 0 || !index_watch_lines(next))
+	{
+		fprintf(stderr, "Error: Cannot allocate output buffer\n");
+		free_watch_state(next);
+		return 5;
+	}
+	return 0;
+}
+
+static int render_watch_definitions(char* text, definition_graph* graph, watch_state* next, int* first_error)
+{
+	memset(next, 0, sizeof(*next));
+	int err_code = update_definitions(graph, text);
+	if (err_code)
+	{
+		return err_code;
+	}
+	FILE* stream = open_memstream(&next->output, &next->output_length);
+	if (!stream)
+	{
+		fprintf(stderr, "Error: Cannot allocate output buffer\n");
+		return 5;
+	}
+	*first_error = write_definitions(graph, stream);
+	if (fclose(stream) != 0)
+	{
+		fprintf(stderr, "Error: Cannot allocate output buffer\n");
+		free_watch_state(next);
+		return 5;
+	}
+	return 0;
+}
+
+static bool write_at(int fd, const char* data, size_t length, size_t offset)
+{
+	while (length)
+	{
+		ssize_t n = pwrite(fd, data, length, (off_t)offset);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			return false;
+		}
+		data += n;
+		length -= (size_t)n;
+		offset += (size_t)n;
+	}
+	return true;
+}
+
+/*
+ * Patches the output file from old to data. With an unchanged length only the differing runs are written, runs
+ * closer than WATCH_MERGE_GAP being merged; otherwise everything from the first difference is rewritten.
+ */
+static bool rewrite_watch_output(int fd, const char* old, size_t old_length, const char* data, size_t length)
+{
+	size_t start = 0;
+	while (start < length && start < old_length && old[start] == data[start])
+	{
+		start++;
+	}
+	if (length != old_length)
+	{
+		return write_at(fd, data + start, length - start, start) && ftruncate(fd, (off_t)length) == 0;
+	}
+	while (start < length)
+	{
+		size_t end = start + 1;
+		for (size_t same = 0; end < length && same < WATCH_MERGE_GAP; end++)
+		{
+			same = old[end] == data[end] ? same + 1 : 0;
+		}
+		while (end > start && old[end - 1] == data[end - 1])
+		{
+			end--;
+		}
+		if (!write_at(fd, data + start, end - start, start))
+		{
+			return false;
+		}
+		start = end;
+		while (start < length && old[start] == data[start])
+		{
+			start++;
+		}
+	}
+	return true;
+}
+
+static int render_watch_input(const console_options* options, result_cache* cache, definition_graph* graph,
+							  const watch_state* previous, watch_state* next, int* first_error)
+{
+	FILE* input_file = fopen(options->input_file_path, "r");
+	char* text = NULL;
+	if (!input_file || !parse_file_data(input_file, &text))
+	{
+		fprintf(stderr, "Error: Cannot read input file\n");
+		if (input_file)
+		{
+			fclose(input_file);
+		}
+		return 5;
+	}
+	fclose(input_file);
+	int err_code = options->definitions ? render_watch_definitions(text, graph, next, first_error)
+										: render_watch_lines(text, options, cache, previous, next, first_error);
+	free(text);
+	return err_code;
+}
+
+#if defined(__linux__)
+
+static bool watched_file_changed(int watch_fd, const char* name)
+{
+	char buffer[WATCH_EVENT_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+	ssize_t n;
+	while ((n = read(watch_fd, buffer, sizeof(buffer))) > 0)
+	{
+		for (char* p = buffer; p < buffer + n;)
+		{
+			const struct inotify_event* event = (const struct inotify_event*)p;
+			changed |= event->len && strcmp(event->name, name) == 0;
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+	return changed;
+}
+
+static int watch_input_file(const console_options* options)
+{
+	const char* path = options->input_file_path;
+	const char* slash = strrchr(path, '/');
+	char* directory = slash ? strndup(path, slash == path ? 1 : (size_t)(slash - path)) : strdup(".");
+	const char* name = slash ? slash + 1 : path;
+	int watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (!directory || watch_fd < 0 || inotify_add_watch(watch_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		fprintf(stderr, "Error: Cannot watch input file\n");
+		free(directory);
+		if (watch_fd >= 0)
+		{
+			close(watch_fd);
+		}
+		return 5;
+	}
+	free(directory);
+
+	result_cache cache;
+	result_cache* cache_ptr = NULL;
+	definition_graph graph;
+	memset(&graph, 0, sizeof(graph));
+	int err_code = options->definitions ? create_definition_graph(&graph, options) : 0;
+	if (!err_code && options->cache_path && !options->polish_notation)
+	{
+		err_code = initialize_result_cache(&cache, options->cache_path, options->cache_limit) ? 0 : 5;
+		cache_ptr = err_code ? NULL : &cache;
+	}
+	int output_fd = err_code ? -1 : open(options->output_file_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (!err_code && output_fd < 0)
+	{
+		fprintf(stderr, "Error: Cannot open output file\n");
+		err_code = 5;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_stop_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	watch_state current;
+	memset(&current, 0, sizeof(current));
+	bool changed = true;
+	int first_error = 0;
+	while (!err_code && !stop_requested)
+	{
+		watch_state next;
+		if (changed && render_watch_input(options, cache_ptr, &graph, &current, &next, &first_error) == 0)
+		{
+			if (!rewrite_watch_output(output_fd, current.output, current.output_length, next.output,
+									  next.output_length))
+			{
+				fprintf(stderr, "Error: Cannot write output file\n");
+				err_code = 5;
+			}
+			free_watch_state(&current);
+			current = next;
+		}
+		struct pollfd pfd = { watch_fd, POLLIN, 0 };
+		if (!err_code && poll(&pfd, 1, -1) < 0 && errno != EINTR)
+		{
+			fprintf(stderr, "Error: Cannot watch input file\n");
+			err_code = 5;
+		}
+		changed = !err_code && (pfd.revents & POLLIN) && watched_file_changed(watch_fd, name);
+	}
+
+	free_watch_state(&current);
+	if (output_fd >= 0 && close(output_fd) != 0 && !err_code)
+	{
+		err_code = 5;
+	}
+	if (cache_ptr)
+	{
+		delete_result_cache(cache_ptr);
+	}
+	if (options->definitions)
+	{
+		free_definition_graph(&graph);
+	}
+	close(watch_fd);
+	return err_code ? err_code : first_error;
+}
+
+#else
+
+static int watch_input_file(const console_options* options)
+{
+	(void)options;
+	fprintf(stderr, "Error: --watch requires inotify and is only available on Linux\n");
+	return 1;
+}
+
+#endif
+
+/*
+ * Directory and manifest input: every regular, non-hidden file of an -i directory is evaluated into the file of
+ * the same name in the -o directory, or every "input<TAB>output" line of a --manifest names one pair. Files are
+ * taken by a pool of workers, each evaluated as a single -i/-o run would be. A worker reserves the size of its
+ * input against --max-read-bytes and one descriptor against --max-open-files before opening it; a file larger
+ * than the byte cap waits until it can be read alone. Results are written to a hidden temporary file next to
+ * the output and renamed over it, so readers never see a partial output.
+ */
+#define FILE_BATCH_DEFAULT_READ_BYTES ((size_t)64 << 20)
+
+typedef struct
+{
+	char* input_path;
+	char* output_path;
+	int err_code;
+} file_job;
+
+typedef struct
+{
+	const console_options* options;
+	file_job* jobs;
+	size_t count;
+	size_t next;
+	size_t max_read_bytes;
+	size_t read_bytes;
+	size_t max_open_files;
+	size_t open_files;
+	mode_t file_mode;
+	pthread_mutex_t lock;
+	pthread_cond_t released;
+} file_pool;
+
+static void acquire_file_budget(file_pool* pool, size_t bytes)
+{
+	pthread_mutex_lock(&pool->lock);
+	while ((pool->read_bytes && pool->read_bytes + bytes > pool->max_read_bytes) ||
+		   pool->open_files >= pool->max_open_files)
+	{
+		pthread_cond_wait(&pool->released, &pool->lock);
+	}
+	pool->read_bytes += bytes;
+	pool->open_files++;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void release_file_budget(file_pool* pool, size_t bytes)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->read_bytes -= bytes;
+	pool->open_files--;
+	pthread_cond_broadcast(&pool->released);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static int read_file_job(const file_pool* pool, const file_job* job, uint64_t size, char** text)
+{
+	if (!pool->options->line_mode && pool->options->limits.max_input_bytes &&
+		size > pool->options->limits.max_input_bytes)
+	{
+		fprintf(stderr, "Error: %s: %s\n", job->input_path, calc_status_string(CALC_ERROR_INPUT_LIMIT));
+		return CALC_ERROR_INPUT_LIMIT;
+	}
+	FILE* input_file = fopen(job->input_path, "r");
+	bool read = input_file && parse_file_data(input_file, text);
+	if (input_file)
+	{
+		fclose(input_file);
+	}
+	if (!read)
+	{
+		fprintf(stderr, "Error: %s: Cannot read input file\n", job->input_path);
+		return 5;
+	}
+	return 0;
+}
+
+/* Evaluates text into a temporary file beside the output and renames it into place. */
+static int write_file_job(const file_pool* pool, const file_job* job, char* text)
+{
+	const char* slash = strrchr(job->output_path, '/');
+	size_t directory = slash ? (size_t)(slash - job->output_path) + 1 : 0;
+	size_t length = strlen(job->output_path) + 9;
+	char* temporary = malloc(length);
+	int fd = -1;
+	if (temporary)
+	{
+		snprintf(temporary, length, "%.*s.%s.XXXXXX", (int)directory, job->output_path, job->output_path + directory);
+		fd = mkstemp(temporary);
+	}
+	FILE* output_file = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if (!output_file)
+	{
+		fprintf(stderr, "Error: %s: Cannot open output file\n", job->output_path);
+		if (fd >= 0)
+		{
+			close(fd);
+			unlink(temporary);
+		}
+		free(temporary);
+		return 5;
+	}
+
+	int err_code = pool->options->line_mode ? process_expression_lines(text, pool->options, NULL, output_file)
+											: process_single_expression(text, pool->options, NULL, output_file);
+	bool written = fchmod(fd, pool->file_mode) == 0;
+	written = fclose(output_file) == 0 && written;
+	if (!written || rename(temporary, job->output_path) != 0)
+	{
+		fprintf(stderr, "Error: %s: Cannot write output file\n", job->output_path);
+		unlink(temporary);
+		err_code = 5;
+	}
+	free(temporary);
+	return err_code;
+}
+
+/* Workers evaluate with their own budget and the run's widths; the main thread gets its own back on return. */
+static void* run_file_worker(void* arg)
+{
+	file_pool* pool = arg;
+	calc_core_budget budget = { pool->options->limits, 0 };
+	calc_core_budget* previous_budget = calc_core_use_budget(&budget);
+	const calc_widths* previous_widths = calc_core_use_widths(&numeric_widths);
+	for (;;)
+	{
+		pthread_mutex_lock(&pool->lock);
+		size_t index = pool->next < pool->count ? pool->next++ : SIZE_MAX;
+		pthread_mutex_unlock(&pool->lock);
+		if (index == SIZE_MAX)
+		{
+			break;
+		}
+
+		file_job* job = &pool->jobs[index];
+		struct stat input_stat;
+		if (stat(job->input_path, &input_stat) != 0)
+		{
+			fprintf(stderr, "Error: %s: Cannot open input file\n", job->input_path);
+			job->err_code = 5;
+			continue;
+		}
+		uint64_t size = (uint64_t)input_stat.st_size;
+		size_t bytes = size < pool->max_read_bytes ? (size_t)size : pool->max_read_bytes;
+		acquire_file_budget(pool, bytes);
+		error_source = job->input_path;
+		char* text = NULL;
+		job->err_code = read_file_job(pool, job, size, &text);
+		if (!job->err_code)
+		{
+			job->err_code = write_file_job(pool, job, text);
+		}
+		error_source = NULL;
+		free(text);
+		release_file_budget(pool, bytes);
+	}
+	calc_core_use_budget(previous_budget);
+	calc_core_use_widths(previous_widths);
+	return NULL;
+}
+
+static bool add_file_job(file_job** jobs, size_t* count, size_t* capacity, char* input_path, char* output_path)
+{
+	if (*count == *capacity)
+	{
+		size_t grown = *capacity ? *capacity * 2 : 64;
+		file_job* resized = realloc(*jobs, grown * sizeof(file_job));
+		if (!resized)
+		{
+			free(input_path);
+			free(output_path);
+			return false;
+		}
+		*jobs = resized;
+		*capacity = grown;
+	}
+	if (!input_path || !output_path)
+	{
+		free(input_path);
+		free(output_path);
+		return false;
+	}
+	(*jobs)[*count].input_path = input_path;
+	(*jobs)[*count].output_path = output_path;
+	(*jobs)[*count].err_code = 0;
+	(*count)++;
+	return true;
+}
+
+static char* join_path(const char* directory, const char* name)
+{
+	size_t length = strlen(directory) + strlen(name) + 2;
+	char* path = malloc(length);
+	if (path)
+	{
+		snprintf(path, length, "%s/%s", directory, name);
+	}
+	return path;
+}
+
+static int compare_file_jobs(const void* a, const void* b)
+{
+	return strcmp(((const file_job*)a)->input_path, ((const file_job*)b)->input_path);
+}
+
+static int list_directory_jobs(const console_options* options, file_job** jobs, size_t* count)
+{
+	struct stat input_stat;
+	struct stat output_stat;
+	if (mkdir(options->output_file_path, 0777) != 0 && errno != EEXIST)
+	{
+		fprintf(stderr, "Error: Cannot create output directory\n");
+		return 5;
+	}
+	if (stat(options->input_file_path, &input_stat) != 0 || stat(options->output_file_path, &output_stat) != 0 ||
+		!S_ISDIR(output_stat.st_mode))
+	{
+		fprintf(stderr, "Error: Cannot open output directory\n");
+		return 5;
+	}
+	if (input_stat.st_dev == output_stat.st_dev && input_stat.st_ino == output_stat.st_ino)
+	{
+		fprintf(stderr, "Error: input and output directories must differ\n");
+		return 1;
+	}
+	DIR* directory = opendir(options->input_file_path);
+	if (!directory)
+	{
+		fprintf(stderr, "Error: Cannot open input directory\n");
+		return 5;
+	}
+	size_t capacity = 0;
+	int err_code = 0;
+	for (struct dirent* entry = readdir(directory); entry && !err_code; entry = readdir(directory))
+	{
+		if (entry->d_name[0] == '.')
+		{
+			continue;
+		}
+		char* input_path = join_path(options->input_file_path, entry->d_name);
+		struct stat entry_stat;
+		if (input_path && (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) &&
+			stat(input_path, &entry_stat) == 0 && S_ISREG(entry_stat.st_mode))
+		{
+			entry->d_type = DT_REG;
+		}
+		if (input_path && entry->d_type != DT_REG)
+		{
+			free(input_path);
+			continue;
+		}
+		if (!add_file_job(jobs, count, &capacity, input_path, join_path(options->output_file_path, entry->d_name)))
+		{
+			fprintf(stderr, "Error: Cannot allocate file list\n");
+			err_code = 5;
+		}
+	}
+	closedir(directory);
+	if (!err_code)
+	{
+		qsort(*jobs, *count, sizeof(file_job), compare_file_jobs);
+	}
+	return err_code;
+}
+
+static int read_manifest_jobs(const console_options* options, file_job** jobs, size_t* count)
+{
+	FILE* manifest = fopen(options->input_file_path, "r");
+	char* text = NULL;
+	bool read = manifest && parse_file_data(manifest, &text);
+	if (manifest)
+	{
+		fclose(manifest);
+	}
+	if (!read)
+	{
+		fprintf(stderr, "Error: Cannot read manifest file\n");
+		return 5;
+	}
+	size_t capacity = 0;
+	size_t line_number = 0;
+	int err_code = 0;
+	for (char* line = text; *line != '\0' && !err_code;)
+	{
+		char* next = cut_line(line);
+		line_number++;
+		char* tab = strchr(line, '\t');
+		if (line[strspn(line, " \t")] == '\0')
+		{
+			line = next;
+			continue;
+		}
+		if (!tab || tab == line || tab[1] == '\0' || strchr(tab + 1, '\t'))
+		{
+			fprintf(stderr, "Error: line %zu: expected input and output paths separated by a tab\n", line_number);
+			err_code = CALC_ERROR_SYNTAX;
+		}
+		else if (!add_file_job(jobs, count, &capacity, strndup(line, (size_t)(tab - line)), strdup(tab + 1)))
+		{
+			fprintf(stderr, "Error: Cannot allocate file list\n");
+			err_code = 5;
+		}
+		line = next;
+	}
+	free(text);
+	return err_code;
+}
+
+static int process_input_files(const console_options* options)
+{
+	file_pool pool;
+	memset(&pool, 0, sizeof(pool));
+	pool.options = options;
+	int err_code = options->manifest ? read_manifest_jobs(options, &pool.jobs, &pool.count)
+									 : list_directory_jobs(options, &pool.jobs, &pool.count);
+
+	size_t workers = options->worker_count;
+	if (workers == 0)
+	{
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = online > 0 ? (size_t)online : 1;
+	}
+	struct rlimit files;
+	pool.max_read_bytes = options->max_read_bytes ? options->max_read_bytes : FILE_BATCH_DEFAULT_READ_BYTES;
+	pool.max_open_files = options->max_open_files;
+	if (!pool.max_open_files)
+	{
+		pool.max_open_files = getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur != RLIM_INFINITY &&
+									  files.rlim_cur / 2 < workers
+								  ? (size_t)(files.rlim_cur / 2)
+								  : workers;
+	}
+	mode_t mask = umask(0);
+	umask(mask);
+	pool.file_mode = 0666 & ~mask;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.released, NULL);
+
+	workers = workers < pool.count ? workers : pool.count;
+	pthread_t* threads = !err_code && workers > 1 ? malloc((workers - 1) * sizeof(pthread_t)) : NULL;
+	size_t started = 0;
+	while (threads && started + 1 < workers && pthread_create(&threads[started], NULL, run_file_worker, &pool) == 0)
+	{
+		started++;
+	}
+	if (!err_code)
+	{
+		run_file_worker(&pool);
+	}
+	for (size_t w = 0; w < started; w++)
+	{
+		pthread_join(threads[w], NULL);
+	}
+	free(threads);
+	pthread_mutex_destroy(&pool.lock);
+	pthread_cond_destroy(&pool.released);
+
+	size_t failed = 0;
+	for (size_t i = 0; i < pool.count; i++)
+	{
+		failed += pool.jobs[i].err_code != 0;
+		if (!err_code)
+		{
+			err_code = pool.jobs[i].err_code;
+		}
+		free(pool.jobs[i].input_path);
+		free(pool.jobs[i].output_path);
+	}
+	if (failed)
+	{
+		fprintf(stderr, "Error: %zu of %zu files failed\n", failed, pool.count);
+	}
+	free(pool.jobs);
+	return err_code;
+}
+
+/*
+ * Column files: a header, one entry per column, then one array per column in host (little-endian) order at
+ * an offset aligned to its element size. Types are calc_value_type codes: int32, float32, int64, float64.
+ * --columns maps a file and evaluates its arrays in place; --column-output writes one float64 column per
+ * formula, "result" or result1, result2 and so on, with NaN for failed rows.
+ */
+#define COLUMN_FILE_MAGIC 0x534c4f434c4143ull
+#define COLUMN_FILE_VERSION 1u
+#define COLUMN_NAME_SIZE 32
+#define COLUMN_OUTPUT_ALIGN 128
+
+typedef struct
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t column_count;
+	uint64_t row_count;
+} column_file_header;
+
+typedef struct
+{
+	char name[COLUMN_NAME_SIZE];
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t offset;
+} column_file_entry;
+
+static size_t column_type_size(calc_value_type type)
+{
+	return type == CALC_VALUE_INT || type == CALC_VALUE_FLOAT ? 4 : 8;
+}
+
+/*
+ * Sweep, CSV and column modes compile every formula line once and fuse them into one calc_program, evaluated in
+ * blocks with calc_program_evaluate or calc_program_evaluate_columns. A sweep walks the grid of its --sweep
+ * ranges, the last range varying fastest; CSV and column files bind named columns to variables. Workers take
+ * consecutive chunks (grid points, rows or whole lines) and format one value per formula and row; chunks are
+ * written in order after each round.
+ */
+typedef struct
+{
+	calc_context* context;
+	calc_expression** expressions;
+	size_t count;
+	calc_program* program;
+} batch_formulas;
+
+/*
+ * --reduce replaces the rows of output with aggregates per formula. Each worker accumulates its chunk into
+ * partials that are merged in chunk order, so the totals do not depend on the worker count. Sums are compensated;
+ * NaN results are counted apart and left out of the other aggregates.
+ */
+#define BATCH_STATUS_COUNT (CALC_ERROR_COST_LIMIT + 1)
+
+typedef struct
+{
+	uint64_t count;
+	uint64_t nan;
+	uint64_t errors[BATCH_STATUS_COUNT];
+	uint64_t below;
+	uint64_t above;
+	double sum;
+	double compensation;
+	double min;
+	double max;
+} batch_reduction;
+
+typedef struct
+{
+	const calc_context* context;
+	const calc_program* program;
+	size_t output_count;
+	size_t chunk_points;
+	size_t slot_count;
+	const sweep_axis* axes;
+	size_t axis_count;
+	size_t* slot_axes;
+	size_t column_count;
+	size_t* column_slots;
+	const bool* reads;
+	const calc_column* columns;
+	bool binary;
+	FILE** column_files;
+	bool reduce;
+	size_t bins;
+	double bin_start;
+	double bin_stop;
+} batch_job;
+
+typedef struct
+{
+	const batch_job* job;
+	pthread_t thread;
+	bool threaded;
+	trace_thread* trace;
+	size_t chunk;
+	size_t begin;
+	size_t end;
+	const char* text;
+	size_t text_length;
+	calc_column* window;
+	calc_value* variables;
+	calc_value* results;
+	calc_status* statuses;
+	calc_status* row_errors;
+	calc_status* slot_errors;
+	char* output;
+	size_t output_length;
+	size_t output_capacity;
+	batch_reduction* reductions;
+	uint64_t* histogram;
+	size_t count;
+	size_t failed;
+	size_t first_failed;
+	size_t first_failed_output;
+	calc_status first_error;
+	calc_status status;
+} batch_worker;
+
+static void sweep_axis_point(const sweep_axis* axis, size_t index, calc_value* value)
+{
+	if (axis->integral)
+	{
+		value->type = CALC_VALUE_INT64;
+		value->int64_value = axis->int_start + (int64_t)index * axis->int_step;
+	}
+	else
+	{
+		value->type = CALC_VALUE_DOUBLE;
+		value->double_value = axis->start + (double)index * axis->step;
+	}
+}
+
+static double batch_result_double(const calc_value* value)
+{
+	switch (value->type)
+	{
+	case CALC_VALUE_FLOAT:
+		return value->float_value;
+	case CALC_VALUE_DOUBLE:
+		return value->double_value;
+	case CALC_VALUE_INT64:
+		return (double)value->int64_value;
+	default:
+		return value->int_value;
+	}
+}
+
+/*
+ * CSV scanning finds ',' and '\n' 64 bytes at a time: each block becomes a bit mask of delimiter positions
+ * (SSE2 compares where available) and fields are cut between consecutive set bits. A ',' between double quotes
+ * belongs to the field; a '\n' always ends the row, closing any quote left open.
+ */
+typedef struct
+{
+	const char* text;
+	size_t length;
+	size_t block;
+	uint64_t mask;
+	bool quoted;
+} csv_scanner;
+
+static uint64_t csv_block_mask(const char* p, size_t n, bool* quoted)
+{
+	uint64_t mask = 0;
+	uint64_t quotes = 0;
+	size_t i = 0;
+#if defined(__SSE2__)
+	const __m128i comma = _mm_set1_epi8(',');
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i quote = _mm_set1_epi8('"');
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i bytes = _mm_loadu_si128((const __m128i*)(p + i));
+		__m128i hits = _mm_or_si128(_mm_cmpeq_epi8(bytes, comma), _mm_cmpeq_epi8(bytes, newline));
+		mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(hits) << i;
+		quotes |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, quote)) << i;
+	}
+#endif
+	for (; i < n; i++)
+	{
+		mask |= (uint64_t)(p[i] == ',' || p[i] == '\n') << i;
+		quotes |= (uint64_t)(p[i] == '"') << i;
+	}
+	if (!quotes && !*quoted)
+	{
+		return mask;
+	}
+
+	/* Blocks with quotes are rare in numeric data and are cut byte by byte. */
+	mask = 0;
+	for (i = 0; i < n; i++)
+	{
+		if (p[i] == '"')
+		{
+			*quoted = !*quoted;
+		}
+		else if (p[i] == '\n' || (p[i] == ',' && !*quoted))
+		{
+			*quoted = *quoted && p[i] != '\n';
+			mask |= (uint64_t)1 << i;
+		}
+	}
+	return mask;
+}
+
+static void start_csv_scanner(csv_scanner* s, const char* text, size_t length)
+{
+	s->text = text;
+	s->length = length;
+	s->block = 0;
+	s->quoted = false;
+	s->mask = csv_block_mask(text, length < 64 ? length : 64, &s->quoted);
+}
+
+/* Offset of the next delimiter, or the length when none is left. */
+static size_t next_csv_delimiter(csv_scanner* s)
+{
+	while (!s->mask)
+	{
+		s->block += 64;
+		if (s->block >= s->length)
+		{
+			return s->length;
+		}
+		size_t n = s->length - s->block;
+		s->mask = csv_block_mask(s->text + s->block, n < 64 ? n : 64, &s->quoted);
+	}
+	size_t offset = s->block + (size_t)__builtin_ctzll(s->mask);
+	s->mask &= s->mask - 1;
+	return offset;
+}
+
+static void trim_csv_field(const char** field, size_t* length)
+{
+	while (*length && ((*field)[*length - 1] == '\r' || (*field)[*length - 1] == ' ' || (*field)[*length - 1] == '\t'))
+	{
+		(*length)--;
+	}
+	while (*length && (**field == ' ' || **field == '\t'))
+	{
+		(*field)++;
+		(*length)--;
+	}
+}
+
+/* Trims a field and drops one pair of enclosing double quotes, for header names and data alike. */
+static void unquote_csv_field(const char** field, size_t* length)
+{
+	trim_csv_field(field, length);
+	if (*length >= 2 && (*field)[0] == '"' && (*field)[*length - 1] == '"')
+	{
+		(*field)++;
+		*length -= 2;
+	}
+}
+
+/* Integer fields become CALC_VALUE_INT64 and other numbers CALC_VALUE_DOUBLE, as for --sweep ranges. */
+static bool parse_csv_number(const char* field, size_t length, calc_value* value)
+{
+	char buffer[64];
+	unquote_csv_field(&field, &length);
+	trim_csv_field(&field, &length);
+	if (length == 0 || length >= sizeof(buffer))
+	{
+		return false;
+	}
+	size_t i = field[0] == '-' || field[0] == '+';
+	uint64_t magnitude = 0;
+	bool digits = i < length;
+	for (size_t k = i; k < length && digits; k++)
+	{
+		digits = field[k] >= '0' && field[k] <= '9' && !__builtin_mul_overflow(magnitude, 10, &magnitude) &&
+				 !__builtin_add_overflow(magnitude, (uint64_t)(field[k] - '0'), &magnitude);
+	}
+	if (digits && magnitude <= (uint64_t)INT64_MAX + (field[0] == '-'))
+	{
+		value->type = CALC_VALUE_INT64;
+		value->int64_value = field[0] == '-' ? (int64_t)(0 - magnitude) : (int64_t)magnitude;
+		return true;
+	}
+	memcpy(buffer, field, length);
+	buffer[length] = '\0';
+	char* endp = NULL;
+	value->type = CALC_VALUE_DOUBLE;
+	value->double_value = strtod(buffer, &endp);
+	return endp == buffer + length;
+}
+
+/*
+ * Parses one line into row and returns the offset after it; blank lines leave *blank set and no row. Each slot
+ * whose field is missing or not a number gets an error in slot_errors, and *error holds the last of them.
+ */
+static size_t parse_csv_row(const batch_job* job, csv_scanner* s, size_t start, calc_value* row,
+							calc_status* slot_errors, calc_status* error, bool* blank)
+{
+	size_t column = 0;
+	size_t delimiter;
+	memset(row, 0, job->slot_count * sizeof(calc_value));
+	for (size_t slot = 0; slot < job->slot_count; slot++)
+	{
+		slot_errors[slot] = CALC_ERROR_SYNTAX;
+	}
+	*error = CALC_OK;
+	do
+	{
+		delimiter = next_csv_delimiter(s);
+		const char* field = s->text + start;
+		size_t length = delimiter - start;
+		if (column == 0)
+		{
+			const char* first = field;
+			size_t first_length = length;
+			trim_csv_field(&first, &first_length);
+			*blank = first_length == 0 && (delimiter == s->length || s->text[delimiter] == '\n');
+		}
+		size_t slot = column < job->column_count ? job->column_slots[column] : SIZE_MAX;
+		if (slot != SIZE_MAX && parse_csv_number(field, length, &row[slot]))
+		{
+			slot_errors[slot] = CALC_OK;
+		}
+		column++;
+		start = delimiter + 1;
+	} while (delimiter < s->length && s->text[delimiter] != '\n');
+	for (size_t slot = 0; slot < job->slot_count; slot++)
+	{
+		if (slot_errors[slot] != CALC_OK)
+		{
+			*error = slot_errors[slot];
+		}
+	}
+	return start;
+}
+
+/* Neumaier summation: the compensation collects the low-order bits lost by each addition. */
+static void add_compensated(double* sum, double* compensation, double value)
+{
+	double t = *sum + value;
+	*compensation += fabs(*sum) >= fabs(value) ? (*sum - t) + value : (value - t) + *sum;
+	*sum = t;
+}
+
+static void reduce_batch_value(const batch_job* job, batch_reduction* r, uint64_t* histogram, calc_status status,
+							   const calc_value* result)
+{
+	if (status != CALC_OK)
+	{
+		r->errors[(unsigned)status < BATCH_STATUS_COUNT ? status : CALC_ERROR_UNSUPPORTED]++;
+		return;
+	}
+	double value = batch_result_double(result);
+	if (isnan(value))
+	{
+		r->nan++;
+		return;
+	}
+	r->min = r->count == 0 || value < r->min ? value : r->min;
+	r->max = r->count == 0 || value > r->max ? value : r->max;
+	r->count++;
+	add_compensated(&r->sum, &r->compensation, value);
+	if (!job->bins)
+	{
+		return;
+	}
+	if (value < job->bin_start)
+	{
+		r->below++;
+	}
+	else if (value >= job->bin_stop)
+	{
+		r->above++;
+	}
+	else
+	{
+		size_t bin = (size_t)((value - job->bin_start) / (job->bin_stop - job->bin_start) * (double)job->bins);
+		histogram[bin < job->bins ? bin : job->bins - 1]++;
+	}
+}
+
+static void merge_batch_reduction(const batch_job* job, batch_reduction* into, uint64_t* into_histogram,
+								  const batch_reduction* from, const uint64_t* from_histogram)
+{
+	if (from->count)
+	{
+		into->min = into->count == 0 || from->min < into->min ? from->min : into->min;
+		into->max = into->count == 0 || from->max > into->max ? from->max : into->max;
+	}
+	into->count += from->count;
+	into->nan += from->nan;
+	for (size_t s = 0; s < BATCH_STATUS_COUNT; s++)
+	{
+		into->errors[s] += from->errors[s];
+	}
+	into->below += from->below;
+	into->above += from->above;
+	add_compensated(&into->sum, &into->compensation, from->sum);
+	into->compensation += from->compensation;
+	for (size_t b = 0; b < job->bins; b++)
+	{
+		into_histogram[b] += from_histogram[b];
+	}
+}
+
+/* One "name value" line per aggregate, as in the --stats report; several formulas get a result<N>_ prefix. */
+static bool write_batch_reduction(FILE* output_file, const batch_job* job, const batch_reduction* totals,
+								  const uint64_t* histogram, size_t rows)
+{
+	fprintf(output_file, "rows %zu\n", rows);
+	for (size_t o = 0; o < job->output_count; o++)
+	{
+		const batch_reduction* r = &totals[o];
+		char prefix[32] = "";
+		if (job->output_count > 1)
+		{
+			snprintf(prefix, sizeof(prefix), "result%zu_", o + 1);
+		}
+		uint64_t errors = 0;
+		for (size_t s = 0; s < BATCH_STATUS_COUNT; s++)
+		{
+			errors += r->errors[s];
+		}
+		double sum = isfinite(r->sum) ? r->sum + r->compensation : r->sum;
+		fprintf(output_file, "%scount %llu\n", prefix, (unsigned long long)r->count);
+		fprintf(output_file, "%snan %llu\n", prefix, (unsigned long long)r->nan);
+		fprintf(output_file, "%serrors %llu\n", prefix, (unsigned long long)errors);
+		for (size_t s = 0; s < BATCH_STATUS_COUNT; s++)
+		{
+			if (r->errors[s])
+			{
+				fprintf(output_file, "%serror_%zu %llu\n", prefix, s, (unsigned long long)r->errors[s]);
+			}
+		}
+		fprintf(output_file, "%ssum %.17g\n", prefix, sum);
+		fprintf(output_file, "%smean %.17g\n", prefix, r->count ? sum / (double)r->count : NAN);
+		fprintf(output_file, "%smin %.17g\n", prefix, r->count ? r->min : NAN);
+		fprintf(output_file, "%smax %.17g\n", prefix, r->count ? r->max : NAN);
+		if (job->bins)
+		{
+			fprintf(output_file, "%shistogram_below %llu\n", prefix, (unsigned long long)r->below);
+			for (size_t b = 0; b < job->bins; b++)
+			{
+				fprintf(output_file, "%shistogram_%zu %llu\n", prefix, b,
+						(unsigned long long)histogram[o * job->bins + b]);
+			}
+			fprintf(output_file, "%shistogram_above %llu\n", prefix, (unsigned long long)r->above);
+		}
+	}
+	return !ferror(output_file);
+}
+
+/* A row with an unreadable or missing field fails only the formulas that load that field's slot. */
+static calc_status batch_input_status(const batch_worker* worker, size_t point, size_t output)
+{
+	const batch_job* job = worker->job;
+	if (worker->row_errors[point] == CALC_OK)
+	{
+		return CALC_OK;
+	}
+	const calc_status* slot_errors = worker->slot_errors + point * job->slot_count;
+	const bool* reads = job->reads + output * job->slot_count;
+	for (size_t slot = 0; slot < job->slot_count; slot++)
+	{
+		if (reads[slot] && slot_errors[slot] != CALC_OK)
+		{
+			return slot_errors[slot];
+		}
+	}
+	return CALC_OK;
+}
+
+static bool finish_batch_block(batch_worker* worker, size_t count)
+{
+	const batch_job* job = worker->job;
+	const size_t outputs = job->output_count;
+	worker->status = job->columns ? calc_program_evaluate_columns(job->context, job->program, worker->window, count,
+																  worker->results, worker->statuses)
+								  : calc_program_evaluate(job->context, job->program, worker->variables, count,
+														  worker->results, worker->statuses);
+	size_t needed = worker->output_length + count * outputs * (job->binary ? sizeof(double) : BATCH_LINE_MAX);
+	if (worker->status == CALC_OK && !job->reduce && needed > worker->output_capacity)
+	{
+		size_t capacity = worker->output_capacity * 2 > needed ? worker->output_capacity * 2 : needed;
+		char* output = realloc(worker->output, capacity);
+		if (!output)
+		{
+			worker->status = CALC_ERROR_NO_MEMORY;
+		}
+		else
+		{
+			worker->output = output;
+			worker->output_capacity = capacity;
+		}
+	}
+	if (worker->status != CALC_OK)
+	{
+		return false;
+	}
+
+	for (size_t p = 0; p < count; p++)
+	{
+		bool failed = false;
+		for (size_t o = 0; o < outputs; o++)
+		{
+			const calc_value* result = &worker->results[p * outputs + o];
+			calc_status input_status = batch_input_status(worker, p, o);
+			calc_status status = input_status != CALC_OK ? input_status : worker->statuses[p * outputs + o];
+			if (status != CALC_OK && !failed)
+			{
+				failed = true;
+				if (worker->failed++ == 0)
+				{
+					worker->first_failed = worker->count + p;
+					worker->first_failed_output = o;
+					worker->first_error = status;
+				}
+			}
+			if (job->reduce)
+			{
+				reduce_batch_value(job, &worker->reductions[o], worker->histogram + o * job->bins, status, result);
+				continue;
+			}
+			if (job->binary)
+			{
+				double value = status == CALC_OK ? batch_result_double(result) : NAN;
+				memcpy(worker->output + worker->output_length, &value, sizeof(value));
+				worker->output_length += sizeof(value);
+				continue;
+			}
+			char* field = worker->output + worker->output_length;
+			int length = status == CALC_OK ? calc_format_value(result, field, BATCH_LINE_MAX)
+										   : snprintf(field, BATCH_LINE_MAX, "error %d", (int)status);
+			worker->output_length += (size_t)length < BATCH_LINE_MAX - 1 ? (size_t)length : BATCH_LINE_MAX - 1;
+			worker->output[worker->output_length++] = o + 1 < outputs ? ',' : '\n';
+		}
+	}
+	worker->count += count;
+	return true;
+}
+
+static void fill_sweep_rows(batch_worker* worker)
+{
+	const batch_job* job = worker->job;
+	size_t index[SWEEP_MAX_AXES];
+	size_t rest = worker->begin;
+	for (size_t a = job->axis_count; a-- > 0;)
+	{
+		index[a] = rest % job->axes[a].count;
+		rest /= job->axes[a].count;
+	}
+	for (size_t p = 0; p < worker->end - worker->begin; p++)
+	{
+		calc_value* row = worker->variables + p * job->slot_count;
+		for (size_t s = 0; s < job->slot_count; s++)
+		{
+			size_t a = job->slot_axes[s];
+			sweep_axis_point(&job->axes[a], index[a], &row[s]);
+		}
+		for (size_t a = job->axis_count; a-- > 0 && ++index[a] == job->axes[a].count;)
+		{
+			index[a] = 0;
+		}
+	}
+	memset(worker->row_errors, 0, (worker->end - worker->begin) * sizeof(calc_status));
+}
+
+/* Each worker slot keeps one trace lane across rounds; a chunk is traced as one span with its point count. */
+static void* run_batch_worker(void* arg)
+{
+	batch_worker* worker = arg;
+	const batch_job* job = worker->job;
+	trace_thread* previous_trace = current_trace_thread;
+	current_trace_thread = worker->trace;
+	uint64_t started = stats_start();
+	worker->output_length = 0;
+	worker->count = 0;
+	worker->failed = 0;
+	if (job->reduce)
+	{
+		memset(worker->reductions, 0, job->output_count * sizeof(batch_reduction));
+		memset(worker->histogram, 0, job->output_count * job->bins * sizeof(uint64_t));
+	}
+	if (job->axes || job->columns)
+	{
+		for (size_t s = 0; job->columns && s < job->slot_count; s++)
+		{
+			worker->window[s].type = job->columns[s].type;
+			worker->window[s].data =
+				(const char*)job->columns[s].data + worker->begin * column_type_size(job->columns[s].type);
+		}
+		if (job->axes)
+		{
+			fill_sweep_rows(worker);
+		}
+		else
+		{
+			memset(worker->row_errors, 0, (worker->end - worker->begin) * sizeof(calc_status));
+		}
+		finish_batch_block(worker, worker->end - worker->begin);
+	}
+	else
+	{
+		csv_scanner scanner;
+		start_csv_scanner(&scanner, worker->text, worker->text_length);
+		size_t start = 0;
+		bool ok = true;
+		while (ok && start < worker->text_length)
+		{
+			size_t rows = 0;
+			while (rows < job->chunk_points && start < worker->text_length)
+			{
+				bool blank = false;
+				start = parse_csv_row(job, &scanner, start, worker->variables + rows * job->slot_count,
+									  worker->slot_errors + rows * job->slot_count, &worker->row_errors[rows], &blank);
+				rows += !blank;
+			}
+			ok = finish_batch_block(worker, rows);
+		}
+	}
+	trace_set_index(worker->chunk);
+	stats_stop(STATS_CHUNK, started, worker->count);
+	worker->trace = current_trace_thread;
+	current_trace_thread = previous_trace;
+	return NULL;
+}
+
+/* Column output sends each formula's values to its own file; the chunk holds rows of output_count doubles. */
+static bool write_column_chunk(const batch_job* job, const batch_worker* worker, double* column)
+{
+	size_t rows = worker->output_length / sizeof(double) / job->output_count;
+	for (size_t o = 0; o < job->output_count; o++)
+	{
+		for (size_t first = 0; first < rows; first += BATCH_CHUNK_POINTS)
+		{
+			size_t n = rows - first < BATCH_CHUNK_POINTS ? rows - first : BATCH_CHUNK_POINTS;
+			for (size_t r = 0; r < n; r++)
+			{
+				memcpy(&column[r], worker->output + ((first + r) * job->output_count + o) * sizeof(double),
+					   sizeof(double));
+			}
+			if (fwrite(column, sizeof(double), n, job->column_files[o]) != n)
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/* Runs the job over total grid points or column rows, or over the CSV lines in text when text is set. */
+static int run_batch_job(const batch_job* job, size_t total, const char* text, size_t text_length,
+						 size_t worker_count, FILE* output_file, size_t* rows)
+{
+	if (worker_count == 0)
+	{
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		worker_count = online > 0 ? (size_t)online : 1;
+	}
+	batch_worker* workers = calloc(worker_count, sizeof(batch_worker));
+	double* column = job->column_files ? malloc(BATCH_CHUNK_POINTS * sizeof(double)) : NULL;
+	batch_reduction* totals = job->reduce ? calloc(job->output_count, sizeof(batch_reduction)) : NULL;
+	uint64_t* histogram = job->reduce ? calloc(job->output_count * job->bins + 1, sizeof(uint64_t)) : NULL;
+	int err_code = workers && (column || !job->column_files) && (!job->reduce || (totals && histogram)) ? 0 : 5;
+	for (size_t w = 0; workers && w < worker_count && !err_code; w++)
+	{
+		workers[w].job = job;
+		workers[w].variables =
+			malloc(job->chunk_points * (job->slot_count ? job->slot_count : 1) * sizeof(calc_value));
+		workers[w].results = malloc(job->chunk_points * job->output_count * sizeof(calc_value));
+		workers[w].statuses = malloc(job->chunk_points * job->output_count * sizeof(calc_status));
+		workers[w].row_errors = malloc(job->chunk_points * sizeof(calc_status));
+		workers[w].slot_errors =
+			job->reads ? malloc(job->chunk_points * (job->slot_count ? job->slot_count : 1) * sizeof(calc_status))
+					   : NULL;
+		workers[w].window = malloc((job->slot_count ? job->slot_count : 1) * sizeof(calc_column));
+		if (job->reduce)
+		{
+			workers[w].reductions = malloc(job->output_count * sizeof(batch_reduction));
+			workers[w].histogram = malloc((job->output_count * job->bins + 1) * sizeof(uint64_t));
+		}
+		if (!workers[w].variables || !workers[w].results || !workers[w].statuses || !workers[w].row_errors ||
+			(job->reads && !workers[w].slot_errors) || !workers[w].window ||
+			(job->reduce && (!workers[w].reductions || !workers[w].histogram)))
+		{
+			err_code = 5;
+		}
+	}
+	if (err_code)
+	{
+		fprintf(stderr, "Error: Cannot allocate evaluation buffers\n");
+	}
+
+	const char* unit = job->axes ? "point" : "row";
+	size_t done = 0;
+	size_t failed = 0;
+	size_t first_failed = 0;
+	size_t first_failed_output = 0;
+	calc_status first_error = CALC_OK;
+	size_t next = 0;
+	size_t chunks = 0;
+	size_t limit = text ? text_length : total;
+	while (next < limit && !err_code)
+	{
+		size_t started = 0;
+		for (; started < worker_count && next < limit; started++)
+		{
+			batch_worker* worker = &workers[started];
+			worker->chunk = ++chunks;
+			worker->begin = next;
+			if (!text)
+			{
+				next = limit - next > job->chunk_points ? next + job->chunk_points : limit;
+			}
+			else
+			{
+				const char* newline = limit - next > CSV_CHUNK_BYTES
+										  ? memchr(text + next + CSV_CHUNK_BYTES, '\n', limit - next - CSV_CHUNK_BYTES)
+										  : NULL;
+				next = newline ? (size_t)(newline - text) + 1 : limit;
+				worker->text = text + worker->begin;
+				worker->text_length = next - worker->begin;
+			}
+			worker->end = next;
+			worker->threaded = worker_count > 1 &&
+							   pthread_create(&worker->thread, NULL, run_batch_worker, worker) == 0;
+			if (!worker->threaded)
+			{
+				run_batch_worker(worker);
+			}
+		}
+		for (size_t w = 0; w < started; w++)
+		{
+			if (workers[w].threaded)
+			{
+				pthread_join(workers[w].thread, NULL);
+			}
+			if (workers[w].status != CALC_OK)
+			{
+				fprintf(stderr, "Error: %s\n", calc_status_string(workers[w].status));
+				err_code = err_code ? err_code : (int)workers[w].status;
+				continue;
+			}
+			if (workers[w].failed && !failed)
+			{
+				first_failed = done + workers[w].first_failed;
+				first_failed_output = workers[w].first_failed_output;
+				first_error = workers[w].first_error;
+			}
+			failed += workers[w].failed;
+			done += workers[w].count;
+			for (size_t o = 0; job->reduce && o < job->output_count; o++)
+			{
+				merge_batch_reduction(job, &totals[o], histogram + o * job->bins, &workers[w].reductions[o],
+									  workers[w].histogram + o * job->bins);
+			}
+			bool written = job->reduce || (job->column_files ? write_column_chunk(job, &workers[w], column)
+															 : fwrite(workers[w].output, 1, workers[w].output_length,
+																	  output_file) == workers[w].output_length);
+			if (!err_code && !written)
+			{
+				fprintf(stderr, "Error: Cannot write output file\n");
+				err_code = 5;
+			}
+		}
+	}
+	if (!err_code && job->reduce && !write_batch_reduction(output_file, job, totals, histogram, done))
+	{
+		fprintf(stderr, "Error: Cannot write output file\n");
+		err_code = 5;
+	}
+	if (!err_code && failed)
+	{
+		if (job->output_count > 1)
+		{
+			fprintf(stderr, "Error: %s %zu: formula %zu: %s\n", unit, first_failed + 1, first_failed_output + 1,
+					calc_status_string(first_error));
+		}
+		else
+		{
+			fprintf(stderr, "Error: %s %zu: %s\n", unit, first_failed + 1, calc_status_string(first_error));
+		}
+		fprintf(stderr, "Error: %zu of %zu %ss failed\n", failed, done, unit);
+		err_code = (int)first_error;
+	}
+
+	for (size_t w = 0; workers && w < worker_count; w++)
+	{
+		free(workers[w].variables);
+		free(workers[w].results);
+		free(workers[w].statuses);
+		free(workers[w].row_errors);
+		free(workers[w].slot_errors);
+		free(workers[w].window);
+		free(workers[w].output);
+		free(workers[w].reductions);
+		free(workers[w].histogram);
+	}
+	free(workers);
+	free(column);
+	free(totals);
+	free(histogram);
+	*rows = done;
+	return err_code;
+}
+
+/* Every non-blank line of text is a formula; all of them are fused into one program over the same rows. */
+static int compile_batch_formulas(char* text, const console_options* options, batch_formulas* formulas)
+{
+	memset(formulas, 0, sizeof(*formulas));
+	if (calc_context_create_with_widths(NULL, &options->limits, &options->widths, &formulas->context) != CALC_OK)
+	{
+		fprintf(stderr, "Error: Cannot initialize calculator context\n");
+		return 5;
+	}
+	size_t lines = 1;
+	for (const char* p = text; *p; p++)
+	{
+		lines += *p == '\n';
+	}
+	formulas->expressions = calloc(lines, sizeof(calc_expression*));
+	if (!formulas->expressions)
+	{
+		fprintf(stderr, "Error: Cannot allocate evaluation buffers\n");
+		return 5;
+	}
+
+	int err_code = 0;
+	char* line = text;
+	for (size_t line_number = 1; line && !err_code; line_number++)
+	{
+		char* newline = strchr(line, '\n');
+		if (newline)
+		{
+			*newline = '\0';
+		}
+		size_t length = strlen(line);
+		if (length && line[length - 1] == '\r')
+		{
+			line[length - 1] = '\0';
+		}
+		if (line[strspn(line, " \t")] != '\0')
+		{
+			calc_status status = calc_compile(formulas->context, line, &formulas->expressions[formulas->count]);
+			if (status != CALC_OK)
+			{
+				fprintf(stderr, "Error: line %zu: %s\n", line_number, calc_status_string(status));
+				err_code = (int)status;
+			}
+			else
+			{
+				formulas->count++;
+			}
+		}
+		line = newline ? newline + 1 : NULL;
+	}
+	if (!err_code && formulas->count == 0)
+	{
+		fprintf(stderr, "Error: input file has no formulas\n");
+		err_code = CALC_ERROR_SYNTAX;
+	}
+	if (!err_code)
+	{
+		const calc_expression* const* expressions = (const calc_expression* const*)formulas->expressions;
+		calc_status status = calc_program_create(formulas->context, expressions, formulas->count, &formulas->program);
+		if (status != CALC_OK)
+		{
+			fprintf(stderr, "Error: %s\n", calc_status_string(status));
+			err_code = (int)status;
+		}
+	}
+	return err_code;
+}
+
+static void free_batch_formulas(batch_formulas* formulas)
+{
+	calc_program_free(formulas->context, formulas->program);
+	for (size_t i = 0; formulas->expressions && i < formulas->count; i++)
+	{
+		calc_expression_free(formulas->context, formulas->expressions[i]);
+	}
+	free(formulas->expressions);
+	calc_context_destroy(formulas->context);
+}
+
+/* Chunks hold whole blocks of 64 rows and about BATCH_CHUNK_POINTS results whatever the formula count. */
+static void start_batch_job(batch_job* job, const batch_formulas* formulas, FILE** column_files,
+							const console_options* options)
+{
+	size_t chunk = BATCH_CHUNK_POINTS / formulas->count;
+	memset(job, 0, sizeof(*job));
+	job->context = formulas->context;
+	job->program = formulas->program;
+	job->output_count = formulas->count;
+	job->chunk_points = chunk > 64 ? chunk & ~(size_t)63 : 64;
+	job->slot_count = calc_program_variable_count(formulas->program);
+	job->binary = options->binary_output || options->column_output;
+	job->column_files = column_files;
+	job->reduce = options->reduce;
+	job->bins = options->histogram_bins;
+	job->bin_start = options->histogram_start;
+	job->bin_stop = options->histogram_stop;
+}
+
+static int evaluate_sweep(const batch_formulas* formulas, FILE* output_file, FILE** column_files,
+						  const console_options* options, size_t* rows)
+{
+	batch_job job;
+	start_batch_job(&job, formulas, column_files, options);
+	job.axes = options->sweeps;
+	job.axis_count = options->sweep_count;
+	int err_code = 0;
+	job.slot_axes = malloc((job.slot_count ? job.slot_count : 1) * sizeof(size_t));
+	if (!job.slot_axes)
+	{
+		fprintf(stderr, "Error: Cannot allocate evaluation buffers\n");
+		err_code = 5;
+	}
+	for (size_t s = 0; s < job.slot_count && !err_code; s++)
+	{
+		const char* name = calc_program_variable_name(job.program, s);
+		size_t a = 0;
+		while (a < job.axis_count && strcmp(job.axes[a].name, name) != 0)
+		{
+			a++;
+		}
+		if (a == job.axis_count)
+		{
+			fprintf(stderr, "Error: variable %s has no --sweep range\n", name);
+			err_code = CALC_ERROR_INVALID_ARGUMENT;
+		}
+		job.slot_axes[s] = a;
+	}
+	size_t total = 1;
+	for (size_t a = 0; a < job.axis_count && !err_code; a++)
+	{
+		if (__builtin_mul_overflow(total, job.axes[a].count, &total))
+		{
+			fprintf(stderr, "Error: sweep has too many points\n");
+			err_code = CALC_ERROR_INVALID_ARGUMENT;
+		}
+	}
+	if (!err_code)
+	{
+		err_code = run_batch_job(&job, total, NULL, 0, options->worker_count, output_file, rows);
+	}
+
+	free(job.slot_axes);
+	return err_code;
+}
+
+static const char* map_input_file(const char* path, size_t* size)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		fprintf(stderr, "Error: Cannot read %s\n", path);
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		return NULL;
+	}
+	*size = (size_t)st.st_size;
+	const char* data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		fprintf(stderr, "Error: Cannot map %s\n", path);
+		return NULL;
+	}
+	madvise((void*)data, *size, MADV_SEQUENTIAL);
+	return data;
+}
 
-			bool supports_float =
-				(cur.value && (strcmp(cur.value, "+") == 0 || strcmp(cur.value, "-") == 0 || strcmp(cur.value, "*") == 0 ||
-							   strcmp(cur.value, "/") == 0 || strcmp(cur.value, "**") == 0));
+/* The header row names the columns; every formula variable must name one, other columns are ignored. */
+static int evaluate_csv(const batch_formulas* formulas, FILE* output_file, FILE** column_files,
+						const console_options* options, size_t* rows)
+{
+	size_t size = 0;
+	const char* text = map_input_file(options->csv_path, &size);
+	if (!text)
+	{
+		return 5;
+	}
+
+	batch_job job;
+	start_batch_job(&job, formulas, column_files, options);
+	int err_code = 0;
+
+	const char* newline = memchr(text, '\n', size);
+	size_t header_length = newline ? (size_t)(newline - text) : size;
+	for (size_t i = 0; i < header_length; i++)
+	{
+		job.column_count += text[i] == ',';
+	}
+	job.column_count++;
+	job.column_slots = malloc(job.column_count * sizeof(size_t));
+	bool* bound = calloc(job.slot_count ? job.slot_count : 1, sizeof(bool));
+	bool* reads = calloc(job.output_count * (job.slot_count ? job.slot_count : 1), sizeof(bool));
+	if (!job.column_slots || !bound || !reads)
+	{
+		fprintf(stderr, "Error: Cannot allocate evaluation buffers\n");
+		err_code = 5;
+	}
 
-			if (use_float && !supports_float)
+	csv_scanner scanner;
+	start_csv_scanner(&scanner, text, header_length);
+	size_t start = 0;
+	for (size_t column = 0; column < job.column_count && !err_code; column++)
+	{
+		size_t delimiter = next_csv_delimiter(&scanner);
+		const char* name = text + start;
+		size_t length = delimiter - start;
+		unquote_csv_field(&name, &length);
+		job.column_slots[column] = SIZE_MAX;
+		for (size_t s = 0; s < job.slot_count; s++)
+		{
+			const char* variable = calc_program_variable_name(job.program, s);
+			if (!bound[s] && strlen(variable) == length && memcmp(variable, name, length) == 0)
 			{
-				free_token(&right_token);
-				free_token(&left_token);
-				if (err_code)
-				{
-					*err_code = 1;
-				}
-				goto error;
+				job.column_slots[column] = s;
+				bound[s] = true;
+				break;
 			}
-
-			if (use_float)
+		}
+		start = delimiter + 1;
+	}
+	for (size_t s = 0; s < job.slot_count && !err_code; s++)
+	{
+		if (!bound[s])
+		{
+			fprintf(stderr, "Error: variable %s is not a column of %s\n", calc_program_variable_name(job.program, s),
+					options->csv_path);
+			err_code = CALC_ERROR_INVALID_ARGUMENT;
+		}
+	}
+	for (size_t o = 0; o < job.output_count && !err_code; o++)
+	{
+		for (size_t v = 0; v < calc_expression_variable_count(formulas->expressions[o]); v++)
+		{
+			const char* variable = calc_expression_variable_name(formulas->expressions[o], v);
+			for (size_t s = 0; s < job.slot_count; s++)
 			{
-				float left_float, right_float;
-				if (left_is_float)
-				{
-					left_float = strtof(left_token.value, NULL);
-				}
-				else
-				{
-					long left_value = strtol(left_token.value, NULL, 10);
-					left_float = (float)left_value;
-				}
-				if (right_is_float)
-				{
-					right_float = strtof(right_token.value, NULL);
-				}
-				else
+				if (strcmp(variable, calc_program_variable_name(job.program, s)) == 0)
 				{
-					long right_value = strtol(right_token.value, NULL, 10);
-					right_float = (float)right_value;
+					reads[o * job.slot_count + s] = true;
 				}
+			}
+		}
+	}
+	job.reads = reads;
+	if (!err_code && newline)
+	{
+		size_t offset = header_length + 1;
+		err_code = run_batch_job(&job, 0, text + offset, size - offset, options->worker_count, output_file, rows);
+	}
 
-				free_token(&right_token);
-				free_token(&left_token);
+	free(bound);
+	free(reads);
+	free(job.column_slots);
+	munmap((void*)text, size);
+	return err_code;
+}
 
-				float result;
-				if (!binary_operators_operations_float(left_float, right_float, cur.value, &result, err_code))
-				{
-					goto error;
-				}
+static int evaluate_column_file(const batch_formulas* formulas, FILE* output_file, FILE** column_files,
+								const console_options* options, size_t* rows)
+{
+	size_t size = 0;
+	const char* data = map_input_file(options->columns_path, &size);
+	if (!data)
+	{
+		return 5;
+	}
+	const column_file_header* header = (const column_file_header*)data;
+	const column_file_entry* entries = (const column_file_entry*)(header + 1);
+	bool valid = size >= sizeof(*header) && header->magic == COLUMN_FILE_MAGIC &&
+				 header->version == COLUMN_FILE_VERSION &&
+				 header->column_count <= (size - sizeof(*header)) / sizeof(*entries);
+	for (uint32_t c = 0; valid && c < header->column_count; c++)
+	{
+		const column_file_entry* e = &entries[c];
+		valid = e->type <= CALC_VALUE_DOUBLE && memchr(e->name, '\0', sizeof(e->name)) != NULL &&
+				e->offset % column_type_size((calc_value_type)e->type) == 0 && e->offset <= size &&
+				header->row_count <= (size - e->offset) / column_type_size((calc_value_type)e->type);
+	}
+	if (!valid)
+	{
+		fprintf(stderr, "Error: %s is not a valid column file\n", options->columns_path);
+		munmap((void*)data, size);
+		return 5;
+	}
 
-				char buf[64];
-				snprintf(buf, sizeof(buf), "%e", result);
-				push_stack(&st, make_token(TOKEN_FLOAT_NUMBER, buf));
-			}
-			else
-			{
-				int32_t right_int, left_int;
-				if (!parse_string_to_int(right_token.value, &right_int, err_code))
-				{
-					free_token(&right_token);
-					free_token(&left_token);
-					goto error;
-				}
-				if (!parse_string_to_int(left_token.value, &left_int, err_code))
-				{
-					free_token(&right_token);
-					free_token(&left_token);
-					goto error;
-				}
+	batch_job job;
+	start_batch_job(&job, formulas, column_files, options);
+	int err_code = 0;
+	calc_column* columns = malloc((job.slot_count ? job.slot_count : 1) * sizeof(calc_column));
+	if (!columns)
+	{
+		fprintf(stderr, "Error: Cannot allocate evaluation buffers\n");
+		err_code = 5;
+	}
+	for (size_t s = 0; s < job.slot_count && !err_code; s++)
+	{
+		const char* name = calc_program_variable_name(job.program, s);
+		uint32_t c = 0;
+		while (c < header->column_count && strcmp(entries[c].name, name) != 0)
+		{
+			c++;
+		}
+		if (c == header->column_count)
+		{
+			fprintf(stderr, "Error: variable %s is not a column of %s\n", name, options->columns_path);
+			err_code = CALC_ERROR_INVALID_ARGUMENT;
+			break;
+		}
+		columns[s].type = (calc_value_type)entries[c].type;
+		columns[s].data = data + entries[c].offset;
+	}
+	job.columns = columns;
+	if (!err_code && header->row_count > SIZE_MAX)
+	{
+		fprintf(stderr, "Error: %s has too many rows\n", options->columns_path);
+		err_code = 5;
+	}
+	if (!err_code)
+	{
+		err_code =
+			run_batch_job(&job, (size_t)header->row_count, NULL, 0, options->worker_count, output_file, rows);
+	}
 
-				free_token(&right_token);
-				free_token(&left_token);
+	free(columns);
+	munmap((void*)data, size);
+	return err_code;
+}
 
-				int32_t result;
-				if (!binary_operators_operations(left_int, right_int, cur.value, &result, err_code))
-				{
-					goto error;
-				}
+static size_t column_output_offset(size_t columns)
+{
+	size_t size = sizeof(column_file_header) + columns * sizeof(column_file_entry);
+	return (size + COLUMN_OUTPUT_ALIGN - 1) / COLUMN_OUTPUT_ALIGN * COLUMN_OUTPUT_ALIGN;
+}
 
-				char buf[32];
-				snprintf(buf, sizeof(buf), "%d", result);
-				push_stack(&st, make_token(TOKEN_NUMBER, buf));
-			}
+/*
+ * The header is written first with no rows and rewritten with the final count once the columns are complete.
+ * One formula gives a "result" column, several give result1, result2 and so on.
+ */
+static bool write_column_output_header(FILE* output_file, size_t rows, size_t columns)
+{
+	size_t offset = column_output_offset(columns);
+	unsigned char* buffer = calloc(1, offset);
+	if (!buffer)
+	{
+		return false;
+	}
+	column_file_header header = { COLUMN_FILE_MAGIC, COLUMN_FILE_VERSION, (uint32_t)columns, rows };
+	memcpy(buffer, &header, sizeof(header));
+	for (size_t c = 0; c < columns; c++)
+	{
+		column_file_entry entry;
+		memset(&entry, 0, sizeof(entry));
+		snprintf(entry.name, sizeof(entry.name), columns == 1 ? "result" : "result%zu", c + 1);
+		entry.type = CALC_VALUE_DOUBLE;
+		entry.offset = offset + c * rows * sizeof(double);
+		memcpy(buffer + sizeof(header) + c * sizeof(entry), &entry, sizeof(entry));
+	}
+	bool written = fseek(output_file, 0, SEEK_SET) == 0 && fwrite(buffer, 1, offset, output_file) == offset;
+	free(buffer);
+	return written;
+}
+
+/*
+ * Column output writes the first column straight to the output file and spools the others to temporary files,
+ * appended once the row count is known. The file is completed even when rows failed.
+ */
+static int evaluate_batch_input(const batch_formulas* formulas, FILE* output_file, const console_options* options)
+{
+	FILE** column_files = NULL;
+	int err_code = 0;
+	if (options->column_output)
+	{
+		column_files = calloc(formulas->count, sizeof(FILE*));
+		if (!column_files)
+		{
+			fprintf(stderr, "Error: Cannot allocate evaluation buffers\n");
+			return 5;
 		}
-		else if (cur.type == TOKEN_UNARY_OPERATOR)
+		column_files[0] = output_file;
+		for (size_t c = 1; c < formulas->count && !err_code; c++)
 		{
-			if (st.top < 1)
+			if (!(column_files[c] = tmpfile()))
 			{
-				if (err_code)
-				{
-					*err_code = 2;
-				}
-				goto error;
+				fprintf(stderr, "Error: Cannot create temporary file\n");
+				err_code = 5;
 			}
+		}
+		if (!err_code && !write_column_output_header(output_file, 0, formulas->count))
+		{
+			fprintf(stderr, "Error: Cannot write output file\n");
+			err_code = 5;
+		}
+	}
 
-			token operand_token = pop_stack(&st);
-			bool operand_is_float = (operand_token.type == TOKEN_FLOAT_NUMBER);
-			bool is_unary_plus_minus = (cur.value && (strcmp(cur.value, "+") == 0 || strcmp(cur.value, "-") == 0));
-			bool is_unary_tilde = (cur.value && strcmp(cur.value, "~") == 0);
+	size_t rows = 0;
+	if (!err_code && options->csv_path)
+	{
+		err_code = evaluate_csv(formulas, output_file, column_files, options, &rows);
+	}
+	else if (!err_code && options->columns_path)
+	{
+		err_code = evaluate_column_file(formulas, output_file, column_files, options, &rows);
+	}
+	else if (!err_code)
+	{
+		err_code = evaluate_sweep(formulas, output_file, column_files, options, &rows);
+	}
 
-			if (operand_is_float && is_unary_tilde)
-			{
-				free_token(&operand_token);
-				if (err_code)
-				{
-					*err_code = 1;
-				}
-				goto error;
-			}
+	bool written = true;
+	for (size_t c = 1; column_files && c < formulas->count; c++)
+	{
+		char buffer[65536];
+		size_t length;
+		written = written && column_files[c] && fseek(column_files[c], 0, SEEK_SET) == 0;
+		while (written && (length = fread(buffer, 1, sizeof(buffer), column_files[c])) > 0)
+		{
+			written = fwrite(buffer, 1, length, output_file) == length;
+		}
+		if (column_files[c])
+		{
+			fclose(column_files[c]);
+		}
+	}
+	if (column_files && (!written || !write_column_output_header(output_file, rows, formulas->count)) && !err_code)
+	{
+		fprintf(stderr, "Error: Cannot write output file\n");
+		err_code = 5;
+	}
+	free(column_files);
+	return err_code;
+}
 
-			if (operand_is_float && is_unary_plus_minus)
-			{
-				float operand_float = strtof(operand_token.value, NULL);
-				free_token(&operand_token);
+#define SHM_WAIT_TIMEOUT_NS 100000000L
 
-				float result;
-				if (!unary_operators_operations_float(operand_float, cur.value, &result, err_code))
-				{
-					goto error;
-				}
+static void fill_shm_completion(shm_completion* cqe, shm_submission* sqe)
+{
+	memset(cqe, 0, sizeof(*cqe));
+	cqe->tag = sqe->tag;
+	if (sqe->length >= SHM_RING_EXPRESSION_BYTES || sqe->expression[sqe->length] != '\0')
+	{
+		cqe->err_code = 1;
+		return;
+	}
 
-				char buf[64];
-				snprintf(buf, sizeof(buf), "%e", result);
-				push_stack(&st, make_token(TOKEN_FLOAT_NUMBER, buf));
-			}
-			else
-			{
-				int32_t operand_int;
-				if (!parse_string_to_int(operand_token.value, &operand_int, err_code))
-				{
-					free_token(&operand_token);
-					goto error;
-				}
-				free_token(&operand_token);
+	int err_code = 0;
+	const char* error_message = NULL;
+	token res;
+	trace_set_index(sqe->tag);
+	if (!evaluate_math_expression(sqe->expression, &res, &err_code, &error_message))
+	{
+		cqe->err_code = err_code;
+		return;
+	}
+	if (res.type == TOKEN_FLOAT_NUMBER)
+	{
+		float value = strtof(res.value, NULL);
+		cqe->type = SHM_RESULT_FLOAT;
+		memcpy(&cqe->value, &value, sizeof(value));
+	}
+	else
+	{
+		cqe->type = SHM_RESULT_INT;
+		cqe->value = (int32_t)strtol(res.value, NULL, 10);
+	}
+	free_token(&res);
+}
 
-				int32_t result;
-				if (!unary_operators_operations(operand_int, cur.value, &result, err_code))
-				{
-					goto error;
-				}
+/*
+ * A running server holds the server lock of its object. An existing object whose server lock is free was left
+ * by a server that died, and is replaced; one that is locked belongs to a live server and is left alone.
+ */
+static int create_shm_object(const char* name)
+{
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 && errno == EEXIST)
+	{
+		int stale = shm_open(name, O_RDWR, 0);
+		if (stale >= 0 && !shm_ring_try_lock(stale, SHM_RING_SERVER_LOCK))
+		{
+			fprintf(stderr, "Error: shared memory object %s is in use by another server\n", name);
+			close(stale);
+			return -1;
+		}
+		if (stale >= 0)
+		{
+			shm_unlink(name);
+			close(stale);
+			fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		}
+	}
+	if (fd >= 0 && !shm_ring_try_lock(fd, SHM_RING_SERVER_LOCK))
+	{
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0)
+	{
+		fprintf(stderr, "Error: Cannot create shared memory object %s\n", name);
+	}
+	return fd;
+}
 
-				char buf[32];
-				snprintf(buf, sizeof(buf), "%d", result);
-				push_stack(&st, make_token(TOKEN_NUMBER, buf));
-			}
+int run_shm_server(const char* name)
+{
+	int fd = create_shm_object(name);
+	if (fd < 0)
+	{
+		return 5;
+	}
+	if (ftruncate(fd, sizeof(shm_ring_region)) != 0)
+	{
+		fprintf(stderr, "Error: Cannot size shared memory object %s\n", name);
+		close(fd);
+		shm_unlink(name);
+		return 5;
+	}
+	shm_ring_region* ring = mmap(NULL, sizeof(shm_ring_region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED)
+	{
+		fprintf(stderr, "Error: Cannot map shared memory object %s\n", name);
+		close(fd);
+		shm_unlink(name);
+		return 5;
+	}
+
+	ring->magic = SHM_RING_MAGIC;
+	ring->version = SHM_RING_VERSION;
+	ring->slots = SHM_RING_SLOTS;
+	ring->expression_bytes = SHM_RING_EXPRESSION_BYTES;
+	atomic_store_explicit(&ring->state, SHM_RING_READY, memory_order_release);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_stop_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	shm_ring_indices* sq = &ring->submissions;
+	shm_ring_indices* cq = &ring->completions;
+	uint32_t head = atomic_load_explicit(&sq->head, memory_order_relaxed);
+	uint32_t cq_tail = atomic_load_explicit(&cq->tail, memory_order_relaxed);
+
+	while (!stop_requested)
+	{
+		uint32_t tail = atomic_load_explicit(&sq->tail, memory_order_acquire);
+		if (tail == head)
+		{
+			shm_ring_wait_change(&sq->tail, &sq->consumer_waiting, head, SHM_WAIT_TIMEOUT_NS);
+			continue;
 		}
-		else if (cur.type == TOKEN_FUNCTION)
+
+		while (head != tail && !stop_requested)
 		{
-			if (st.top < 1)
+			uint32_t cq_head = atomic_load_explicit(&cq->head, memory_order_acquire);
+			if (cq_tail - cq_head >= SHM_RING_SLOTS)
 			{
-				if (err_code)
-				{
-					*err_code = 2;
-				}
-				goto error;
+				shm_ring_publish(&cq->tail, &cq->consumer_waiting, cq_tail);
+				shm_ring_wait_change(&cq->head, &cq->producer_waiting, cq_head, SHM_WAIT_TIMEOUT_NS);
+				continue;
 			}
+			fill_shm_completion(&ring->completion_slots[cq_tail % SHM_RING_SLOTS],
+								&ring->submission_slots[head % SHM_RING_SLOTS]);
+			cq_tail++;
+			head++;
+		}
+		shm_ring_publish(&cq->tail, &cq->consumer_waiting, cq_tail);
+		shm_ring_publish(&sq->head, &sq->producer_waiting, head);
+	}
 
-			token arg_token = pop_stack(&st);
-			float arg_float;
-			if (arg_token.type == TOKEN_FLOAT_NUMBER)
-			{
-				arg_float = strtof(arg_token.value, NULL);
-			}
-			else
+	atomic_store_explicit(&ring->state, SHM_RING_CLOSED, memory_order_release);
+	shm_ring_wake(&cq->tail);
+	shm_ring_wake(&sq->head);
+	munmap(ring, sizeof(shm_ring_region));
+	shm_unlink(name);
+	close(fd);
+	return 0;
+}
+
+#if defined(__linux__)
+
+#define SERVER_MAX_EVENTS 64
+#define SERVER_READ_CHUNK 65536
+#define SERVER_MAX_LINE ((size_t)1 << 20)
+#define SERVER_WRITE_TIMEOUT_MS 5000
+
+typedef struct server_connection
+{
+	int fd;
+	char* buffer;
+	size_t length;
+	size_t capacity;
+	struct server_connection* next_job;
+	struct server_connection* previous;
+	struct server_connection* next;
+} server_connection;
+
+typedef struct
+{
+	int epoll_fd;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	server_connection* jobs_head;
+	server_connection* jobs_tail;
+	server_connection* connections;
+	bool stopping;
+	_Atomic uint64_t expressions;
+	calc_limits limits;
+} server_state;
+
+typedef struct
+{
+	server_state* server;
+	pthread_t thread;
+	char* output;
+	size_t output_length;
+	size_t output_capacity;
+} server_worker;
+
+static void delete_server_connection(server_connection* conn)
+{
+	close(conn->fd);
+	free(conn->buffer);
+	free(conn);
+}
+
+/* Every open connection stays on server->connections, idle or not, so that shutdown can close all of them. */
+static void add_server_connection(server_state* server, server_connection* conn)
+{
+	pthread_mutex_lock(&server->lock);
+	conn->next = server->connections;
+	if (conn->next)
+	{
+		conn->next->previous = conn;
+	}
+	server->connections = conn;
+	pthread_mutex_unlock(&server->lock);
+}
+
+static void remove_server_connection(server_state* server, server_connection* conn)
+{
+	pthread_mutex_lock(&server->lock);
+	if (conn->previous)
+	{
+		conn->previous->next = conn->next;
+	}
+	else
+	{
+		server->connections = conn->next;
+	}
+	if (conn->next)
+	{
+		conn->next->previous = conn->previous;
+	}
+	pthread_mutex_unlock(&server->lock);
+	delete_server_connection(conn);
+}
+
+static void push_server_job(server_state* server, server_connection* conn)
+{
+	pthread_mutex_lock(&server->lock);
+	conn->next_job = NULL;
+	if (server->jobs_tail)
+	{
+		server->jobs_tail->next_job = conn;
+	}
+	else
+	{
+		server->jobs_head = conn;
+	}
+	server->jobs_tail = conn;
+	pthread_cond_signal(&server->ready);
+	pthread_mutex_unlock(&server->lock);
+}
+
+static server_connection* pop_server_job(server_state* server)
+{
+	pthread_mutex_lock(&server->lock);
+	while (!server->jobs_head && !server->stopping)
+	{
+		pthread_cond_wait(&server->ready, &server->lock);
+	}
+	server_connection* conn = server->jobs_head;
+	if (conn)
+	{
+		server->jobs_head = conn->next_job;
+		if (!server->jobs_head)
+		{
+			server->jobs_tail = NULL;
+		}
+	}
+	pthread_mutex_unlock(&server->lock);
+	return conn;
+}
+
+static bool append_worker_output(server_worker* worker, const char* text, size_t length)
+{
+	if (worker->output_length + length > worker->output_capacity)
+	{
+		size_t newcap = worker->output_capacity == 0 ? 4096 : worker->output_capacity;
+		while (newcap < worker->output_length + length)
+		{
+			newcap *= 2;
+		}
+		char* tmp = realloc(worker->output, newcap);
+		if (!tmp)
+		{
+			return false;
+		}
+		worker->output = tmp;
+		worker->output_capacity = newcap;
+	}
+	memcpy(worker->output + worker->output_length, text, length);
+	worker->output_length += length;
+	return true;
+}
+
+static bool evaluate_server_line(server_worker* worker, char* line)
+{
+	char buf[96];
+	int length = 0;
+	if (line[strspn(line, " \t\r")] != '\0')
+	{
+		int err_code = 0;
+		const char* error_message = NULL;
+		token res;
+		if (trace_enabled)
+		{
+			trace_set_index(atomic_fetch_add_explicit(&worker->server->expressions, 1, memory_order_relaxed) + 1);
+		}
+		bool evaluated = evaluate_math_expression(line, &res, &err_code, &error_message);
+		if (evaluated && res.type == TOKEN_NUMBER && numeric_widths.int_bits == CALC_CORE_BIG_INTEGERS)
+		{
+			const char* digits = big_integer_digits(res.value);
+			bool ok = append_worker_output(worker, digits, strlen(digits)) && append_worker_output(worker, "\n", 1);
+			free_token(&res);
+			return ok;
+		}
+		if (evaluated)
+		{
+			length = format_answer(&res, buf, sizeof(buf));
+			free_token(&res);
+		}
+		else
+		{
+			length = snprintf(buf, sizeof(buf), "error %d", err_code);
+		}
+	}
+	buf[length++] = '\n';
+	return append_worker_output(worker, buf, (size_t)length);
+}
+
+static bool send_worker_output(server_worker* worker, int fd)
+{
+	size_t sent = 0;
+	while (sent < worker->output_length)
+	{
+		ssize_t n = send(fd, worker->output + sent, worker->output_length - sent, MSG_NOSIGNAL);
+		if (n > 0)
+		{
+			sent += (size_t)n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			struct pollfd pfd = { fd, POLLOUT, 0 };
+			if (poll(&pfd, 1, SERVER_WRITE_TIMEOUT_MS) > 0)
 			{
-				long arg_value = strtol(arg_token.value, NULL, 10);
-				arg_float = (float)arg_value;
+				continue;
 			}
-			free_token(&arg_token);
+		}
+		return false;
+	}
+	worker->output_length = 0;
+	return true;
+}
 
-			float result;
-			if (!function_operations(cur.value, arg_float, &result, err_code))
+static bool serve_connection(server_worker* worker, server_connection* conn)
+{
+	uint64_t request_started = stats_start();
+	size_t request_lines = 0;
+	bool eof = false;
+	for (;;)
+	{
+		if (conn->capacity - conn->length < SERVER_READ_CHUNK)
+		{
+			size_t newcap = conn->capacity == 0 ? SERVER_READ_CHUNK * 2 : conn->capacity * 2;
+			char* tmp = realloc(conn->buffer, newcap);
+			if (!tmp)
 			{
-				goto error;
+				return false;
 			}
-
-			char buf[64];
-			snprintf(buf, sizeof(buf), "%e", result);
-			push_stack(&st, make_token(TOKEN_FLOAT_NUMBER, buf));
+			conn->buffer = tmp;
+			conn->capacity = newcap;
 		}
-		else
+		ssize_t n = read(conn->fd, conn->buffer + conn->length, conn->capacity - conn->length - 1);
+		if (n > 0)
 		{
-			if (err_code)
+			conn->length += (size_t)n;
+			if (conn->length > SERVER_MAX_LINE)
 			{
-				*err_code = 1;
+				/* Evaluate what is buffered first; the level-triggered rearm below resumes reading. */
+				break;
 			}
-			goto error;
+			continue;
+		}
+		if (n == 0)
+		{
+			eof = true;
+			break;
+		}
+		if (errno == EINTR)
+		{
+			continue;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			break;
 		}
+		return false;
 	}
 
-	if (st.top != 1)
+	trace_set_index((uint64_t)conn->fd);
+	stats_stop(STATS_READ, request_started, 0);
+	size_t start = 0;
+	for (size_t i = 0; i < conn->length; i++)
 	{
-		if (err_code)
+		if (conn->buffer[i] != '\n')
 		{
-			*err_code = 2;
+			continue;
 		}
-		goto error;
+		conn->buffer[i] = '\0';
+		if (!evaluate_server_line(worker, conn->buffer + start))
+		{
+			return false;
+		}
+		request_lines++;
+		start = i + 1;
 	}
+	memmove(conn->buffer, conn->buffer + start, conn->length - start);
+	conn->length -= start;
 
-	*result_token = pop_stack(&st);
-	delete_stack(&st);
-	return true;
+	if (eof && conn->length > 0)
+	{
+		conn->buffer[conn->length] = '\0';
+		conn->length = 0;
+		if (!evaluate_server_line(worker, conn->buffer))
+		{
+			return false;
+		}
+		request_lines++;
+	}
+	uint64_t send_started = stats_start();
+	bool sent = send_worker_output(worker, conn->fd);
+	trace_set_index((uint64_t)conn->fd);
+	stats_stop(STATS_OUTPUT, send_started, 0);
+	stats_stop(STATS_REQUEST, request_started, request_lines);
+	if (!sent || eof || conn->length > SERVER_MAX_LINE)
+	{
+		return false;
+	}
 
-error:
-	delete_stack(&st);
-	return false;
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	ev.data.ptr = conn;
+	return epoll_ctl(worker->server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == 0;
 }
 
-bool parse_console_data(int argc, char* argv[], char** input_file_path, char** output_file_path, bool* polish_notation)
+static void* run_server_worker(void* arg)
 {
-	if (argc < 5 || argc > 6)
+	server_worker* worker = arg;
+	calc_core_budget budget = { worker->server->limits, 0 };
+	calc_core_use_budget(&budget);
+	calc_core_use_widths(&numeric_widths);
+	server_connection* conn;
+	while ((conn = pop_server_job(worker->server)) != NULL)
 	{
-		fprintf(stderr, "Error: incorrect amount of arguments. Usage: %s -i input_file -o output_file [-p]\n", argv[0]);
-		return false;
+		worker->output_length = 0;
+		if (!serve_connection(worker, conn))
+		{
+			remove_server_connection(worker->server, conn);
+		}
 	}
+	return NULL;
+}
 
-	*input_file_path = NULL;
-	*output_file_path = NULL;
-	*polish_notation = false;
-
-	for (int i = 1; i < argc; i++)
+static bool accept_server_connections(server_state* server, int listen_fd)
+{
+	for (;;)
 	{
-		if (strcmp(argv[i], "-i") == 0)
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
 		{
-			if (i + 1 >= argc)
+			if (errno == EINTR)
 			{
-				fprintf(stderr, "Error: missing input file name after -i\n");
-				return false;
+				continue;
 			}
-			*input_file_path = argv[i + 1];
-			i++;
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EMFILE ||
+				   errno == ENFILE;
 		}
-		else if (strcmp(argv[i], "-o") == 0)
+
+		server_connection* conn = calloc(1, sizeof(server_connection));
+		if (!conn)
 		{
-			if (i + 1 >= argc)
-			{
-				fprintf(stderr, "Error: missing output file name after -o\n");
-				return false;
-			}
-			*output_file_path = argv[i + 1];
-			i++;
+			close(fd);
+			continue;
 		}
-		else if (strcmp(argv[i], "-p") == 0)
+		conn->fd = fd;
+		add_server_connection(server, conn);
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+		ev.data.ptr = conn;
+		if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
 		{
-			*polish_notation = true;
+			remove_server_connection(server, conn);
 		}
-		else
+	}
+}
+
+/*
+ * An existing path is replaced only when it is a socket that refuses connections, left by a server that
+ * exited without removing it; anything else, or a socket a live server still accepts on, is left alone.
+ */
+static bool claim_socket_path(const struct sockaddr_un* addr)
+{
+	struct stat st;
+	if (lstat(addr->sun_path, &st) != 0)
+	{
+		if (errno == ENOENT)
 		{
-			fprintf(stderr, "Error: unknown argument %s\n", argv[i]);
-			return false;
+			return true;
 		}
+		fprintf(stderr, "Error: Cannot inspect %s\n", addr->sun_path);
+		return false;
 	}
-
-	if (*input_file_path == NULL)
+	if (!S_ISSOCK(st.st_mode))
 	{
-		fprintf(stderr, "Error: no input file provided\n");
+		fprintf(stderr, "Error: %s exists and is not a socket\n", addr->sun_path);
 		return false;
 	}
-
-	if (*output_file_path == NULL)
+	int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	bool stale = probe >= 0 && connect(probe, (const struct sockaddr*)addr, sizeof(*addr)) != 0 &&
+				 errno == ECONNREFUSED;
+	if (probe >= 0)
 	{
-		fprintf(stderr, "Error: no output file provided\n");
+		close(probe);
+	}
+	if (!stale)
+	{
+		fprintf(stderr, "Error: %s is in use by another server\n", addr->sun_path);
 		return false;
 	}
-
-	return true;
+	return unlink(addr->sun_path) == 0 || errno == ENOENT;
 }
 
-bool parse_file_data(FILE* input_file, char** math_expression)
+int run_server(const char* socket_path, size_t worker_count, const calc_limits* limits)
 {
-	if (!input_file)
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
 	{
-		return false;
+		fprintf(stderr, "Error: socket path is too long\n");
+		return 1;
 	}
-	if (fseek(input_file, 0, SEEK_END) != 0)
+	strcpy(addr.sun_path, socket_path);
+
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0)
 	{
-		return false;
+		fprintf(stderr, "Error: Cannot create socket\n");
+		return 5;
 	}
-	long size = ftell(input_file);
-	if (size < 0)
+	if (!claim_socket_path(&addr))
 	{
-		return false;
+		close(listen_fd);
+		return 5;
 	}
-	rewind(input_file);
-
-	*math_expression = malloc((size_t)size + 1);
-	if (*math_expression == NULL)
+	if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listen_fd, SOMAXCONN) != 0)
 	{
-		return false;
+		fprintf(stderr, "Error: Cannot listen on %s\n", socket_path);
+		close(listen_fd);
+		return 5;
 	}
 
-	size_t read = fread(*math_expression, 1, (size_t)size, input_file);
-	(*math_expression)[read] = '\0';
+	server_state server;
+	memset(&server, 0, sizeof(server));
+	server.limits = *limits;
+	server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event listen_ev;
+	listen_ev.events = EPOLLIN;
+	listen_ev.data.ptr = NULL;
+	if (server.epoll_fd < 0 || epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_ev) != 0)
+	{
+		fprintf(stderr, "Error: Cannot initialize event loop\n");
+		if (server.epoll_fd >= 0)
+		{
+			close(server.epoll_fd);
+		}
+		close(listen_fd);
+		unlink(socket_path);
+		return 5;
+	}
+	pthread_mutex_init(&server.lock, NULL);
+	pthread_cond_init(&server.ready, NULL);
 
-	return true;
-}
+	server_worker* workers = calloc(worker_count, sizeof(server_worker));
+	size_t started = 0;
+	if (workers)
+	{
+		while (started < worker_count)
+		{
+			workers[started].server = &server;
+			if (pthread_create(&workers[started].thread, NULL, run_server_worker, &workers[started]) != 0)
+			{
+				break;
+			}
+			started++;
+		}
+	}
 
-void print_queue_to_file(queue* q, FILE* out)
-{
-	if (!q || !q->data)
+	int rc = 0;
+	if (started == 0)
 	{
-		return;
+		fprintf(stderr, "Error: Cannot start worker threads\n");
+		rc = 5;
 	}
-	for (size_t i = q->front; i < q->rear; i++)
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_stop_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	struct epoll_event events[SERVER_MAX_EVENTS];
+	while (rc == 0 && !stop_requested)
 	{
-		if (q->data[i].value)
+		int n = epoll_wait(server.epoll_fd, events, SERVER_MAX_EVENTS, -1);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			fprintf(stderr, "Error: Event loop failed\n");
+			rc = 5;
+			break;
+		}
+		for (int i = 0; i < n; i++)
 		{
-			fprintf(out, "%s\n", q->data[i].value);
+			if (events[i].data.ptr == NULL)
+			{
+				if (!accept_server_connections(&server, listen_fd))
+				{
+					fprintf(stderr, "Error: Cannot accept connection\n");
+				}
+			}
+			else
+			{
+				push_server_job(&server, events[i].data.ptr);
+			}
 		}
 	}
-}
 
-void print_answer_to_file(token* result_token, FILE* output_file)
-{
-	if (result_token->type == TOKEN_FLOAT_NUMBER)
+	pthread_mutex_lock(&server.lock);
+	server.stopping = true;
+	pthread_cond_broadcast(&server.ready);
+	pthread_mutex_unlock(&server.lock);
+	for (size_t i = 0; i < started; i++)
 	{
-		float float_value = strtof(result_token->value, NULL);
-		fprintf(output_file, "%e", float_value);
+		pthread_join(workers[i].thread, NULL);
+		free(workers[i].output);
 	}
-	else
+	while (server.connections)
+	{
+		remove_server_connection(&server, server.connections);
+	}
+
+	free(workers);
+	pthread_cond_destroy(&server.ready);
+	pthread_mutex_destroy(&server.lock);
+	close(server.epoll_fd);
+	close(listen_fd);
+	unlink(socket_path);
+	return rc;
+}
+
+#else
+
+int run_server(const char* socket_path, size_t worker_count, const calc_limits* limits)
+{
+	(void)socket_path;
+	(void)worker_count;
+	(void)limits;
+	fprintf(stderr, "Error: server mode requires epoll and is only available on Linux\n");
+	return 1;
+}
+
+#endif
+
+static int finish_trace(const console_options* options, int err_code)
+{
+	if (options->trace_path && !write_trace(options->trace_path) && !err_code)
 	{
-		fprintf(output_file, "%d", atoi(result_token->value));
+		return 5;
 	}
+	return err_code;
 }
 
 int main(int argc, char* argv[])
 {
-	char* input_file_path = NULL;
-	char* output_file_path = NULL;
-	bool polish_notation = false;
-
-	if (!parse_console_data(argc, argv, &input_file_path, &output_file_path, &polish_notation))
+	console_options options;
+	if (!parse_console_data(argc, argv, &options))
 	{
 		return 1;
 	}
 
-	FILE* input_file = fopen(input_file_path, "r");
+	/* Plug-ins are loaded only once every option is known to be valid. */
+	for (size_t i = 0; i < options.plugin_count; i++)
+	{
+		calc_status status = calc_load_functions(options.plugin_paths[i]);
+		if (status != CALC_OK)
+		{
+			fprintf(stderr, "Error: cannot load functions from %s: %s\n", options.plugin_paths[i],
+					calc_status_string(status));
+			return 1;
+		}
+	}
+
+	if (options.trace_path)
+	{
+		start_trace();
+	}
+
+	calc_core_budget budget = { options.limits, 0 };
+	calc_core_use_budget(&budget);
+	numeric_widths = options.widths;
+	calc_core_use_widths(&numeric_widths);
+
+	if (options.socket_path)
+	{
+		size_t workers = options.worker_count;
+		if (workers == 0)
+		{
+			long online = sysconf(_SC_NPROCESSORS_ONLN);
+			workers = online > 0 ? (size_t)online : 1;
+		}
+		int err_code = run_server(options.socket_path, workers, &options.limits);
+		return finish_trace(&options, err_code);
+	}
+
+	if (options.shm_name)
+	{
+		return finish_trace(&options, run_shm_server(options.shm_name));
+	}
+
+	if (options.library_input)
+	{
+		FILE* output_file = fopen(options.output_file_path, "w");
+		if (!output_file)
+		{
+			fprintf(stderr, "Error: Cannot open output file\n");
+			return 5;
+		}
+		int err_code = evaluate_expression_library(options.input_file_path, output_file, &options.limits);
+		fclose(output_file);
+		return err_code;
+	}
+
+	if (options.manifest || options.input_directory)
+	{
+		return finish_trace(&options, process_input_files(&options));
+	}
+
+	FILE* input_file = fopen(options.input_file_path, "r");
 	if (!input_file)
 	{
 		fprintf(stderr, "Error: Cannot open input file\n");
 		return 5;
 	}
 
-	FILE* output_file = fopen(output_file_path, "w");
-	if (!output_file)
+	if (options.compile_library)
 	{
-		fprintf(stderr, "Error: Cannot open output file\n");
+		char* formulas = NULL;
+		int err_code = 5;
+		if (parse_file_data(input_file, &formulas))
+		{
+			err_code = compile_expression_library(formulas, options.output_file_path, &options.limits);
+		}
+		else
+		{
+			fprintf(stderr, "Error: Cannot read input file\n");
+		}
 		fclose(input_file);
-		return 5;
+		free(formulas);
+		return err_code;
 	}
 
-	char* expr = NULL;
-	if (!parse_file_data(input_file, &expr))
+	if (options.watch)
 	{
-		fprintf(stderr, "Error: Cannot read input file\n");
 		fclose(input_file);
-		return 5;
+		return finish_trace(&options, watch_input_file(&options));
 	}
 
-	int err_code = 0;
+	if (options.definitions)
+	{
+		char* text = NULL;
+		definition_graph graph;
+		int err_code = create_definition_graph(&graph, &options);
+		FILE* output_file = NULL;
+		if (!err_code && !parse_file_data(input_file, &text))
+		{
+			fprintf(stderr, "Error: Cannot read input file\n");
+			err_code = 5;
+		}
+		if (!err_code)
+		{
+			err_code = update_definitions(&graph, text);
+		}
+		if (!err_code && !(output_file = fopen(options.output_file_path, "w")))
+		{
+			fprintf(stderr, "Error: Cannot open output file\n");
+			err_code = 5;
+		}
+		else if (!err_code)
+		{
+			err_code = write_definitions(&graph, output_file);
+			if (fclose(output_file) != 0 && !err_code)
+			{
+				err_code = 5;
+			}
+		}
+		free_definition_graph(&graph);
+		fclose(input_file);
+		free(text);
+		return finish_trace(&options, err_code);
+	}
 
-	queue tokenized_expression;
-	if (!initialize_queue(&tokenized_expression, 100))
+	if (options.sweep_count || options.csv_path || options.columns_path)
 	{
-		fprintf(stderr, "Error: Cannot initialize tokenized expression queue\n");
+		char* text = NULL;
+		int err_code = 5;
+		batch_formulas formulas;
+		memset(&formulas, 0, sizeof(formulas));
+		FILE* output_file = NULL;
+		if (!parse_file_data(input_file, &text))
+		{
+			fprintf(stderr, "Error: Cannot read input file\n");
+		}
+		else
+		{
+			err_code = compile_batch_formulas(text, &options, &formulas);
+		}
+		if (!err_code && !(output_file = fopen(options.output_file_path, "wb")))
+		{
+			fprintf(stderr, "Error: Cannot open output file\n");
+			err_code = 5;
+		}
+		else if (!err_code)
+		{
+			err_code = evaluate_batch_input(&formulas, output_file, &options);
+			if (fclose(output_file) != 0 && !err_code)
+			{
+				err_code = 5;
+			}
+		}
+		free_batch_formulas(&formulas);
 		fclose(input_file);
-		free(expr);
-		return 5;
+		free(text);
+		return finish_trace(&options, err_code);
 	}
-	if (!tokenizator(expr, &tokenized_expression, &err_code))
+
+	FILE* output_file = fopen(options.output_file_path, "w");
+	if (!output_file)
 	{
-		fprintf(stderr, "Error: Unsupported token\n");
-		delete_queue(&tokenized_expression);
+		fprintf(stderr, "Error: Cannot open output file\n");
 		fclose(input_file);
-		free(expr);
-		return err_code ? err_code : 1;
+		return 5;
 	}
 
-	queue shunted_expression = shunting_yard_algorithm(tokenized_expression, &err_code);
+	run_stats stats;
+	if (options.stats)
+	{
+		start_run_stats(&stats);
+	}
 
-	delete_queue(&tokenized_expression);
-	if (err_code)
+	if (options.rpn_input)
 	{
-		fprintf(stderr, "Error: Parse failed\n");
-		delete_queue(&shunted_expression);
+		int err_code = process_rpn_stream(input_file, output_file, options.line_mode, &options.limits);
 		fclose(input_file);
+		uint64_t started = stats_start();
 		fclose(output_file);
-		free(expr);
-		return err_code;
+		stats_stop(STATS_OUTPUT, started, 0);
+		if (options.stats && !write_run_stats(&stats, options.stats_path) && !err_code)
+		{
+			err_code = 5;
+		}
+		return finish_trace(&options, err_code);
 	}
 
-	if (polish_notation)
+	struct stat input_stat;
+	if (!options.line_mode && options.limits.max_input_bytes && fstat(fileno(input_file), &input_stat) == 0 &&
+		(uint64_t)input_stat.st_size > options.limits.max_input_bytes)
 	{
-		print_queue_to_file(&shunted_expression, output_file);
-		delete_queue(&shunted_expression);
+		fprintf(stderr, "Error: %s\n", calc_status_string(CALC_ERROR_INPUT_LIMIT));
+		fclose(input_file);
+		fclose(output_file);
+		return finish_trace(&options, CALC_ERROR_INPUT_LIMIT);
 	}
-	else
+
+	char* expr = NULL;
+	uint64_t started = stats_start();
+	bool read = parse_file_data(input_file, &expr);
+	stats_stop(STATS_READ, started, 0);
+	if (!read)
 	{
-		token res;
-		if (!calculate_expression(&shunted_expression, &res, &err_code))
+		fprintf(stderr, "Error: Cannot read input file\n");
+		fclose(input_file);
+		fclose(output_file);
+		return 5;
+	}
+
+	result_cache cache;
+	result_cache* cache_ptr = NULL;
+	if (options.cache_path && !options.polish_notation)
+	{
+		if (!initialize_result_cache(&cache, options.cache_path, options.cache_limit))
 		{
-			fprintf(stderr, "Error: Evaluation failed\n");
-			delete_queue(&shunted_expression);
 			fclose(input_file);
 			fclose(output_file);
 			free(expr);
-			return err_code ? err_code : 3;
+			return 5;
 		}
-		print_answer_to_file(&res, output_file);
-		free_token(&res);
-		delete_queue(&shunted_expression);
+		cache_ptr = &cache;
+	}
+
+	int err_code = options.line_mode ? process_expression_lines(expr, &options, cache_ptr, output_file)
+									 : process_single_expression(expr, &options, cache_ptr, output_file);
+
+	if (cache_ptr)
+	{
+		delete_result_cache(cache_ptr);
 	}
 	fclose(input_file);
+	started = stats_start();
 	fclose(output_file);
+	stats_stop(STATS_OUTPUT, started, 0);
 	free(expr);
-	return 0;
+	if (options.stats && !write_run_stats(&stats, options.stats_path) && !err_code)
+	{
+		err_code = 5;
+	}
+	return finish_trace(&options, err_code);
 }
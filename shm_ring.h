@@ -0,0 +1,144 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#define SHM_RING_MAGIC 0x53484d52u
+#define SHM_RING_VERSION 1u
+#define SHM_RING_SLOTS 1024u
+#define SHM_RING_EXPRESSION_BYTES 240u
+#define SHM_RING_SPIN_LIMIT 256
+
+/*
+ * Each ring has one producer and one consumer on either side. The server holds a write lock on byte
+ * SHM_RING_SERVER_LOCK of the object while it runs, and the one attached client holds SHM_RING_CLIENT_LOCK;
+ * the kernel drops both when their holder exits, so a lock that can be taken marks a side nobody uses.
+ */
+#define SHM_RING_SERVER_LOCK 0
+#define SHM_RING_CLIENT_LOCK 1
+
+typedef enum
+{
+	SHM_RING_STARTING,
+	SHM_RING_READY,
+	SHM_RING_CLOSED
+} shm_ring_state;
+
+typedef enum
+{
+	SHM_RESULT_INT,
+	SHM_RESULT_FLOAT
+} shm_result_type;
+
+typedef struct
+{
+	uint64_t tag;
+	uint32_t length;
+	uint32_t reserved;
+	char expression[SHM_RING_EXPRESSION_BYTES];
+} shm_submission;
+
+typedef struct
+{
+	uint64_t tag;
+	int32_t err_code;
+	uint8_t type;
+	uint8_t reserved[3];
+	int32_t value;
+	uint32_t padding;
+} shm_completion;
+
+typedef struct
+{
+	_Alignas(64) _Atomic uint32_t head;
+	_Alignas(64) _Atomic uint32_t tail;
+	_Alignas(64) _Atomic uint32_t consumer_waiting;
+	_Atomic uint32_t producer_waiting;
+} shm_ring_indices;
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t expression_bytes;
+	_Atomic uint32_t state;
+	shm_ring_indices submissions;
+	shm_ring_indices completions;
+	shm_submission submission_slots[SHM_RING_SLOTS];
+	shm_completion completion_slots[SHM_RING_SLOTS];
+} shm_ring_region;
+
+static inline bool shm_ring_try_lock(int fd, off_t byte)
+{
+	struct flock lock;
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = byte;
+	lock.l_len = 1;
+	return fcntl(fd, F_SETLK, &lock) == 0;
+}
+
+static inline void shm_ring_wake(_Atomic uint32_t* word)
+{
+#if defined(__linux__)
+	syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE, 1, NULL, NULL, 0);
+#else
+	(void)word;
+#endif
+}
+
+static inline void shm_ring_sleep(_Atomic uint32_t* word, uint32_t expected, long timeout_ns)
+{
+#if defined(__linux__)
+	struct timespec ts = { timeout_ns / 1000000000L, timeout_ns % 1000000000L };
+	syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT, expected, &ts, NULL, 0);
+#else
+	(void)word;
+	(void)expected;
+	struct timespec ts = { 0, timeout_ns < 50000L ? timeout_ns : 50000L };
+	nanosleep(&ts, NULL);
+#endif
+}
+
+static inline bool shm_ring_wait_change(_Atomic uint32_t* word, _Atomic uint32_t* waiting, uint32_t current,
+										long timeout_ns)
+{
+	for (int i = 0; i < SHM_RING_SPIN_LIMIT; i++)
+	{
+		if (atomic_load_explicit(word, memory_order_acquire) != current)
+		{
+			return true;
+		}
+	}
+	atomic_store_explicit(waiting, 1, memory_order_seq_cst);
+	if (atomic_load_explicit(word, memory_order_seq_cst) == current)
+	{
+		shm_ring_sleep(word, current, timeout_ns);
+	}
+	atomic_store_explicit(waiting, 0, memory_order_relaxed);
+	return atomic_load_explicit(word, memory_order_acquire) != current;
+}
+
+static inline void shm_ring_publish(_Atomic uint32_t* word, _Atomic uint32_t* waiting, uint32_t value)
+{
+	atomic_store_explicit(word, value, memory_order_seq_cst);
+	if (atomic_load_explicit(waiting, memory_order_seq_cst))
+	{
+		shm_ring_wake(word);
+	}
+}
+
+#endif
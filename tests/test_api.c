@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+
+/*
+ * Behaviour tests of the public calc.h API; linked once against libcalc.a and once against libcalc.so.
+ * Prints one line per failed check and exits non-zero when any check failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "calc.h"
+
+static int failures = 0;
+
+#define CHECK(condition)                                                                                            \
+	do                                                                                                              \
+	{                                                                                                               \
+		if (!(condition))                                                                                           \
+		{                                                                                                           \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);                           \
+			failures++;                                                                                             \
+		}                                                                                                           \
+	} while (0)
+
+static double as_double(const calc_value* value)
+{
+	switch (value->type)
+	{
+	case CALC_VALUE_INT:
+		return value->int_value;
+	case CALC_VALUE_FLOAT:
+		return value->float_value;
+	case CALC_VALUE_INT64:
+		return (double)value->int64_value;
+	default:
+		return value->double_value;
+	}
+}
+
+static calc_value make_double(double d)
+{
+	calc_value value;
+	value.type = CALC_VALUE_DOUBLE;
+	value.double_value = d;
+	return value;
+}
+
+static void test_text(void)
+{
+	calc_context* context = NULL;
+	CHECK(calc_context_create(NULL, &context) == CALC_OK);
+	calc_value result;
+	CHECK(calc_evaluate_text(context, "1 + 2 * 3", &result) == CALC_OK);
+	CHECK(result.type == CALC_VALUE_INT && result.int_value == 7);
+	CHECK(calc_evaluate_text(context, "7 / 2.0", &result) == CALC_OK && as_double(&result) == 3.5);
+	CHECK(calc_evaluate_text(context, "0 && 1 / 0", &result) == CALC_OK && as_double(&result) == 0);
+	CHECK(calc_evaluate_text(context, "1 ? 5 : 1 / 0", &result) == CALC_OK && as_double(&result) == 5);
+	CHECK(calc_evaluate_text(context, "1 / 0", &result) == CALC_ERROR_MATH);
+	CHECK(calc_evaluate_text(context, "(1 + 2", &result) == CALC_ERROR_SYNTAX);
+	CHECK(calc_evaluate_text(context, "? 1 : 2", &result) == CALC_ERROR_SYNTAX);
+	CHECK(calc_evaluate_text(NULL, "1", &result) == CALC_ERROR_INVALID_ARGUMENT);
+	calc_context_destroy(context);
+}
+
+static void test_limits_and_widths(void)
+{
+	calc_limits limits;
+	memset(&limits, 0, sizeof(limits));
+	limits.max_tokens = 3;
+	calc_context* context = NULL;
+	CHECK(calc_context_create_limited(NULL, &limits, &context) == CALC_OK);
+	calc_value result;
+	CHECK(calc_evaluate_text(context, "1 + 2", &result) == CALC_OK);
+	CHECK(calc_evaluate_text(context, "1 + 2 + 3", &result) == CALC_ERROR_TOKEN_LIMIT);
+	calc_context_destroy(context);
+
+	calc_widths widths = { 64, 64 };
+	memset(&limits, 0, sizeof(limits));
+	CHECK(calc_context_create_with_widths(NULL, &limits, &widths, &context) == CALC_OK);
+	CHECK(calc_evaluate_text(context, "2 ** 40", &result) == CALC_OK);
+	CHECK(result.type == CALC_VALUE_INT64 && result.int64_value == 1099511627776ll);
+	calc_context_destroy(context);
+}
+
+static void test_variables_and_batch(void)
+{
+	calc_context* context = NULL;
+	CHECK(calc_context_create(NULL, &context) == CALC_OK);
+	calc_expression* expression = NULL;
+	CHECK(calc_compile(context, "x * y + 1", &expression) == CALC_OK);
+	CHECK(calc_expression_variable_count(expression) == 2);
+	CHECK(strcmp(calc_expression_variable_name(expression, 0), "x") == 0);
+	CHECK(strcmp(calc_expression_variable_name(expression, 1), "y") == 0);
+
+	enum
+	{
+		POINTS = 300
+	};
+	calc_value rows[POINTS * 2];
+	double xs[POINTS];
+	double ys[POINTS];
+	for (size_t p = 0; p < POINTS; p++)
+	{
+		xs[p] = (double)p * 0.5;
+		ys[p] = 3.0 - (double)p;
+		rows[2 * p] = make_double(xs[p]);
+		rows[2 * p + 1] = make_double(ys[p]);
+	}
+	calc_value results[POINTS];
+	calc_status statuses[POINTS];
+	CHECK(calc_evaluate_batch(context, expression, rows, POINTS, results, statuses) == CALC_OK);
+	for (size_t p = 0; p < POINTS; p++)
+	{
+		calc_value single;
+		CHECK(calc_evaluate_with(context, expression, &rows[2 * p], &single) == CALC_OK);
+		CHECK(statuses[p] == CALC_OK && as_double(&results[p]) == as_double(&single));
+		CHECK(as_double(&single) == xs[p] * ys[p] + 1);
+	}
+
+	calc_column columns[2] = { { CALC_VALUE_DOUBLE, xs }, { CALC_VALUE_DOUBLE, ys } };
+	CHECK(calc_evaluate_columns(context, expression, columns, POINTS, results, statuses) == CALC_OK);
+	for (size_t p = 0; p < POINTS; p++)
+	{
+		CHECK(statuses[p] == CALC_OK && as_double(&results[p]) == xs[p] * ys[p] + 1);
+	}
+	calc_expression_free(context, expression);
+	calc_context_destroy(context);
+}
+
+static void test_program(void)
+{
+	calc_context* context = NULL;
+	CHECK(calc_context_create(NULL, &context) == CALC_OK);
+	const char* texts[] = { "x + y", "x * y", "y - x", "sqrt(x)" };
+	enum
+	{
+		FORMULAS = 4,
+		POINTS = 150
+	};
+	calc_expression* expressions[FORMULAS];
+	for (size_t f = 0; f < FORMULAS; f++)
+	{
+		CHECK(calc_compile(context, texts[f], &expressions[f]) == CALC_OK);
+	}
+	calc_program* program = NULL;
+	CHECK(calc_program_create(context, (const calc_expression* const*)expressions, FORMULAS, &program) == CALC_OK);
+	CHECK(calc_program_variable_count(program) == 2);
+
+	double xs[POINTS];
+	double ys[POINTS];
+	calc_value rows[POINTS * 2];
+	for (size_t p = 0; p < POINTS; p++)
+	{
+		xs[p] = (double)p - 20.0;
+		ys[p] = (double)p * 0.25;
+		for (size_t s = 0; s < 2; s++)
+		{
+			double v = strcmp(calc_program_variable_name(program, s), "x") == 0 ? xs[p] : ys[p];
+			rows[2 * p + s] = make_double(v);
+		}
+	}
+	calc_value results[POINTS * FORMULAS];
+	calc_status statuses[POINTS * FORMULAS];
+	CHECK(calc_program_evaluate(context, program, rows, POINTS, results, statuses) == CALC_OK);
+	for (size_t p = 0; p < POINTS; p++)
+	{
+		for (size_t f = 0; f < FORMULAS; f++)
+		{
+			calc_value variables[2];
+			for (size_t s = 0; s < calc_expression_variable_count(expressions[f]); s++)
+			{
+				double v = strcmp(calc_expression_variable_name(expressions[f], s), "x") == 0 ? xs[p] : ys[p];
+				variables[s] = make_double(v);
+			}
+			calc_value single;
+			calc_status status = calc_evaluate_with(context, expressions[f], variables, &single);
+			CHECK(statuses[p * FORMULAS + f] == status);
+			CHECK(status != CALC_OK || as_double(&results[p * FORMULAS + f]) == as_double(&single));
+		}
+	}
+
+	calc_value column_results[POINTS * FORMULAS];
+	calc_status column_statuses[POINTS * FORMULAS];
+	calc_column columns[2];
+	for (size_t s = 0; s < 2; s++)
+	{
+		columns[s].type = CALC_VALUE_DOUBLE;
+		columns[s].data = strcmp(calc_program_variable_name(program, s), "x") == 0 ? xs : ys;
+	}
+	CHECK(calc_program_evaluate_columns(context, program, columns, POINTS, column_results, column_statuses) == CALC_OK);
+	for (size_t i = 0; i < POINTS * FORMULAS; i++)
+	{
+		CHECK(column_statuses[i] == statuses[i]);
+		CHECK(statuses[i] != CALC_OK || as_double(&column_results[i]) == as_double(&results[i]));
+	}
+	calc_program_free(context, program);
+	for (size_t f = 0; f < FORMULAS; f++)
+	{
+		calc_expression_free(context, expressions[f]);
+	}
+	calc_context_destroy(context);
+}
+
+static void test_library(void)
+{
+	calc_context* context = NULL;
+	CHECK(calc_context_create(NULL, &context) == CALC_OK);
+	char path[] = "/tmp/calc_test_XXXXXX";
+	int fd = mkstemp(path);
+	CHECK(fd >= 0);
+	close(fd);
+
+	calc_expression* expressions[3] = { NULL, NULL, NULL };
+	calc_status statuses[3] = { CALC_OK, CALC_ERROR_SYNTAX, CALC_OK };
+	CHECK(calc_compile(context, "rate * 12 + 1", &expressions[0]) == CALC_OK);
+	CHECK(calc_compile(context, "a > 0 && 10 / a > 1 ? 1 : 2", &expressions[2]) == CALC_OK);
+	CHECK(calc_library_write(context, path, (const calc_expression* const*)expressions, statuses, 3) == CALC_OK);
+
+	calc_library* library = NULL;
+	CHECK(calc_library_open(context, path, &library) == CALC_OK);
+	if (library)
+	{
+		CHECK(calc_library_count(library) == 3);
+		CHECK(calc_library_variable_count(library, 0) == 1);
+		CHECK(strcmp(calc_library_variable_name(library, 0, 0), "rate") == 0);
+		calc_value variable;
+		variable.type = CALC_VALUE_INT;
+		variable.int_value = 2;
+		calc_value result;
+		CHECK(calc_library_evaluate(context, library, 0, &variable, &result) == CALC_OK && as_double(&result) == 25);
+		CHECK(calc_library_evaluate(context, library, 1, NULL, &result) == CALC_ERROR_SYNTAX);
+		variable.int_value = 0;
+		CHECK(calc_library_evaluate(context, library, 2, &variable, &result) == CALC_OK && as_double(&result) == 2);
+		CHECK(calc_library_evaluate(context, library, 3, NULL, &result) == CALC_ERROR_INVALID_ARGUMENT);
+		calc_library_close(context, library);
+	}
+
+	FILE* f = fopen(path, "r+b");
+	CHECK(f != NULL);
+	if (f)
+	{
+		fseek(f, -1, SEEK_END);
+		int c = fgetc(f);
+		fseek(f, -1, SEEK_END);
+		fputc(c ^ 0x5a, f);
+		fclose(f);
+	}
+	CHECK(calc_library_open(context, path, &library) == CALC_ERROR_SYNTAX);
+	unlink(path);
+
+	calc_expression_free(context, expressions[0]);
+	calc_expression_free(context, expressions[2]);
+	calc_context_destroy(context);
+}
+
+int main(void)
+{
+	test_text();
+	test_limits_and_widths();
+	test_variables_and_batch();
+	test_program();
+	test_library();
+	if (failures)
+	{
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf("test_api: ok\n");
+	return 0;
+}
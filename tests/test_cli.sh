@@ -0,0 +1,89 @@
+#!/bin/sh
+# Behaviour tests of the calc command line: CSV input, column files, sweeps and .calcbin libraries.
+# Usage: tests/test_cli.sh path/to/calc
+
+calc=${1:?usage: $0 path/to/calc}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failures=0
+
+# expect name status file: compares file with the expected text on stdin and the exit status of the last run
+expect()
+{
+	if [ "$status" -ne "$2" ]; then
+		echo "$1: exit status $status, expected $2" >&2
+		failures=$((failures + 1))
+	fi
+	if ! diff -u - "$3" >&2; then
+		echo "$1: unexpected output" >&2
+		failures=$((failures + 1))
+	fi
+}
+
+run()
+{
+	"$calc" "$@" 2>"$work/stderr"
+	status=$?
+}
+
+printf 'x + y\nx / y\n' >"$work/f.txt"
+printf 'x,"y"\n1,2\n3,0\n4,bad\n5,5\n"6", "2"\n"7,5",1\n' >"$work/d.csv"
+run -i "$work/f.txt" -o "$work/o.txt" --csv "$work/d.csv"
+expect csv 3 "$work/o.txt" <<'EOF'
+3,0
+3,error 3
+error 2,error 2
+10,1
+8,3
+error 2,error 2
+EOF
+
+printf 'x * 2\ny - 1\n' >"$work/g.txt"
+printf 'x,y\n1,2\n2,bad\n3,4\n' >"$work/e.csv"
+run -i "$work/g.txt" -o "$work/c.bin" --csv "$work/e.csv" --column-output
+printf 'result1 + result2\nresult1 * 10\n' >"$work/h.txt"
+run -i "$work/h.txt" -o "$work/h.out" --columns "$work/c.bin"
+expect columns 0 "$work/h.out" <<'EOF'
+3.000000e+00,2.000000e+01
+nan,4.000000e+01
+9.000000e+00,6.000000e+01
+EOF
+
+run -i "$work/f.txt" -o "$work/s.txt" --sweep x=1:3:1 --sweep y=1:2:1
+expect sweep 0 "$work/s.txt" <<'EOF'
+2,1
+3,0
+3,2
+4,1
+4,3
+5,1
+EOF
+
+printf '0 && 1 / 0\n1 ? 2 : 1 / 0\n? 1 : 2\n' >"$work/b.txt"
+run -i "$work/b.txt" -o "$work/b.rpn" -p --lines
+expect polish 2 "$work/b.rpn" <<'EOF'
+0 &&3 1 0 / &&
+1 ?2 2 :3 1 0 / ?:
+error 2
+EOF
+head -n 2 "$work/b.rpn" >"$work/b2.rpn"
+run -i "$work/b2.rpn" -o "$work/b.out" --rpn-input --lines
+expect rpn-input 0 "$work/b.out" <<'EOF'
+0
+2
+EOF
+
+printf '1+2\n(\n2*3.5\n' >"$work/lib.txt"
+run -i "$work/lib.txt" -o "$work/lib.calcbin" --compile-library
+run -i "$work/lib.calcbin" -o "$work/lib.out" --library
+expect library 2 "$work/lib.out" <<'EOF'
+3
+error 2
+7.000000e+00
+EOF
+
+if [ "$failures" -ne 0 ]; then
+	echo "$failures checks failed" >&2
+	exit 1
+fi
+echo "test_cli: ok"